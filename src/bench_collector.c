@@ -0,0 +1,411 @@
+/*
+ * Workload slowdown: signal handler vs collector thread.
+ *
+ * Every thread of the workload samples itself and the records are fed
+ * to the same aggregator in both modes:
+ *
+ *   signal     the tools' usual setup. One PERF_SIGNAL per sample
+ *              delivered to the sampled thread, the handler drains the
+ *              ring and re-arms with PERF_EVENT_IOC_REFRESH.
+ *   collector  free-running counters with a wakeup watermark, the rings
+ *              are drained by a perf_collector thread.
+ *
+ * and the run time of each workload is compared with an unprofiled run.
+ *
+ * Usage: bench_collector [-f freq] [-b pages] [-r runs] [-n size]
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <omp.h>
+
+#include <linux/perf_event.h>
+
+#include "perf_ring.h"
+#include "perf_collector.h"
+#include "matrix_multiply.h"
+
+#define PERF_SIGNAL (SIGRTMIN+4)
+
+enum mode_e {
+	MODE_NONE = 0,
+	MODE_SIGNAL,
+	MODE_COLLECTOR,
+	MODE_NR
+};
+
+static const char *mode_names[MODE_NR] = {"none", "signal", "collector"};
+
+struct event_data_s {
+	int			 fd;
+	pid_t			 tid;
+	struct perf_ring_s	 ring;
+	uint64_t		 samples;
+	uint64_t		 ip_sum;	/* keeps the parse from being optimized out */
+};
+
+static struct event_data_s *events;
+static int num_events;
+
+static struct perf_sample_layout_s sample_layout;
+static struct perf_event_attr event_attr;
+static struct perf_collector_s collector;
+
+/* the rings of the last run, summed by stop_profiling() */
+static struct perf_ring_stats_s run_stats;
+
+static uint64_t sample_freq = 10000;
+static int buffer_pages = 8;
+static int num_runs = 3;
+static int gemm_size = 512;
+
+static double *A, *B, *C;
+
+static long
+perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
+		int cpu, int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, hw_event, pid, cpu,
+			group_fd, flags);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* the aggregator, same code for both modes */
+static void
+aggregate(const struct perf_event_header *ehdr, void *arg)
+{
+	struct event_data_s *event = arg;
+	struct perf_sample_s sample;
+
+	if (ehdr->type != PERF_RECORD_SAMPLE)
+		return;
+
+	if (perf_sample_parse(&sample_layout, ehdr, &sample) == 0) {
+		event->samples++;
+		event->ip_sum += sample.v[PERF_SF_IP];
+	}
+}
+
+static void
+event_handler(int signum, siginfo_t *info, void *uc)
+{
+	int i;
+
+	if (info->si_code != POLL_HUP)
+		return;
+
+	for(i=0; i<num_events; i++) {
+		if (events[i].fd == info->si_fd)
+			break;
+	}
+	if (i == num_events)
+		return;
+
+	perf_ring_drain(&events[i].ring, aggregate, &events[i]);
+	ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
+}
+
+/*
+ * Pick the event once: cycles if the PMU is usable, otherwise the
+ * cpu-clock software event so the comparison still runs in VMs.
+ */
+static int
+setup_attr(void)
+{
+	memset(&event_attr, 0, sizeof(event_attr));
+	event_attr.size		  = sizeof(event_attr);
+	event_attr.type		  = PERF_TYPE_HARDWARE;
+	event_attr.config	  = PERF_COUNT_HW_CPU_CYCLES;
+	event_attr.freq		  = 1;
+	event_attr.sample_freq	  = sample_freq;
+	event_attr.sample_type	  = PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+				    PERF_SAMPLE_TIME | PERF_SAMPLE_PERIOD;
+	event_attr.disabled	  = 1;
+	event_attr.exclude_kernel = 1;
+	event_attr.exclude_hv	  = 1;
+
+	int fd = perf_event_open(&event_attr, 0, -1, -1, 0);
+	if (fd < 0) {
+		event_attr.type   = PERF_TYPE_SOFTWARE;
+		event_attr.config = PERF_COUNT_SW_CPU_CLOCK;
+		fd = perf_event_open(&event_attr, 0, -1, -1, 0);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "perf_event_open: %s\n", strerror(errno));
+		return -1;
+	}
+	close(fd);
+
+	printf("event: %s, %"PRIu64" samples/sec per thread\n",
+	       event_attr.type == PERF_TYPE_HARDWARE ? "cycles" : "cpu-clock",
+	       sample_freq);
+
+	return perf_sample_layout_init(&sample_layout, &event_attr);
+}
+
+/* Called by each workload thread for itself */
+static int
+open_event(struct event_data_s *event, enum mode_e mode)
+{
+	struct perf_event_attr attr = event_attr;
+	struct f_owner_ex owner;
+
+	memset(event, 0, sizeof(*event));
+	event->tid = syscall(SYS_gettid);
+
+	if (mode == MODE_COLLECTOR)
+		perf_ring_watermark(&attr, buffer_pages);
+
+	event->fd = perf_event_open(&attr, 0, -1, -1, 0);
+	if (event->fd < 0) {
+		fprintf(stderr, "perf_event_open: %s\n", strerror(errno));
+		return -1;
+	}
+	if (perf_ring_open(&event->ring, event->fd, buffer_pages))
+		return -1;
+
+	if (mode != MODE_SIGNAL)
+		return 0;
+
+	/* signal the sampled thread itself, not whichever the kernel picks */
+	owner.type = F_OWNER_TID;
+	owner.pid  = event->tid;
+	if (fcntl(event->fd, F_SETFL, fcntl(event->fd, F_GETFL, 0) | O_ASYNC) ||
+	    fcntl(event->fd, F_SETSIG, PERF_SIGNAL) ||
+	    fcntl(event->fd, F_SETOWN_EX, &owner)) {
+		fprintf(stderr, "cannot set notification: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+start_profiling(enum mode_e mode)
+{
+	int ret = 0;
+
+	if (mode == MODE_NONE)
+		return 0;
+
+	/* one event per OpenMP thread, opened by the thread on itself */
+	#pragma omp parallel num_threads(num_events) reduction(+:ret)
+	{
+		ret += open_event(&events[omp_get_thread_num()], mode);
+	}
+	if (ret)
+		return -1;
+
+	if (mode == MODE_COLLECTOR) {
+		perf_collector_init(&collector);
+		for(int i=0; i<num_events; i++)
+			perf_collector_add(&collector, events[i].fd, &events[i].ring,
+					   aggregate, &events[i]);
+		perf_collector_start(&collector);
+	}
+
+	for(int i=0; i<num_events; i++) {
+		if (mode == MODE_SIGNAL)
+			ret += ioctl(events[i].fd, PERF_EVENT_IOC_REFRESH, 1);
+		else
+			ret += ioctl(events[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	return ret;
+}
+
+/* returns the number of samples aggregated */
+static uint64_t
+stop_profiling(enum mode_e mode)
+{
+	uint64_t samples = 0;
+	sigset_t sig;
+
+	memset(&run_stats, 0, sizeof(run_stats));
+	if (mode == MODE_NONE)
+		return 0;
+
+	sigemptyset(&sig);
+	sigaddset(&sig, PERF_SIGNAL);
+	sigprocmask(SIG_BLOCK, &sig, NULL);
+
+	for(int i=0; i<num_events; i++)
+		ioctl(events[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	if (mode == MODE_COLLECTOR) {
+		perf_collector_stop(&collector);
+		perf_collector_fini(&collector);
+	}
+
+	for(int i=0; i<num_events; i++) {
+		int fd = events[i].fd;
+
+		/* a late signal on another thread must not find the ring */
+		events[i].fd = -1;
+		perf_ring_drain(&events[i].ring, aggregate, &events[i]);
+		samples += events[i].samples;
+		perf_ring_stats_add(&run_stats, &events[i].ring.stats);
+		perf_ring_close(&events[i].ring);
+		close(fd);
+	}
+
+	sigprocmask(SIG_UNBLOCK, &sig, NULL);
+	return samples;
+}
+
+static void
+run_gemm_omp(void)
+{
+	gemm_omp(A, B, C, gemm_size);
+}
+
+static void
+run_naive(void)
+{
+	naive_matrix_multiply(1);
+}
+
+struct result_s {
+	double   time;
+	uint64_t samples;
+	uint64_t collector_ns;
+	uint64_t lost;
+	uint64_t throttled;
+};
+
+static void
+bench(const char *name, void (*workload)(void))
+{
+	struct result_s res[MODE_NR];
+
+	printf("\n%s\n", name);
+
+	for(int mode=0; mode<MODE_NR; mode++) {
+		res[mode].time = 0;
+
+		for(int run=0; run<num_runs; run++) {
+			if (start_profiling(mode)) {
+				fprintf(stderr, "%s: cannot start profiling\n", mode_names[mode]);
+				exit(1);
+			}
+
+			double start = now();
+			workload();
+			double elapsed = now() - start;
+
+			uint64_t samples = stop_profiling(mode);
+
+			/* best of the runs */
+			if (run == 0 || elapsed < res[mode].time) {
+				res[mode].time	       = elapsed;
+				res[mode].samples      = samples;
+				res[mode].collector_ns = mode == MODE_COLLECTOR ? collector.cpu_ns : 0;
+				res[mode].lost	       = run_stats.lost;
+				res[mode].throttled    = run_stats.throttled;
+			}
+		}
+
+		printf("  %-10s %8.3f s", mode_names[mode], res[mode].time);
+		if (mode != MODE_NONE)
+			printf("  %+7.2f%%  %10"PRIu64" samples",
+			       (res[mode].time - res[MODE_NONE].time) * 100.0 / res[MODE_NONE].time,
+			       res[mode].samples);
+		if (mode == MODE_COLLECTOR)
+			printf("  collector cpu %.3f ms", res[mode].collector_ns * 1e-6);
+		if (res[mode].lost || res[mode].throttled)
+			printf("  %"PRIu64" lost, %"PRIu64" throttled",
+			       res[mode].lost, res[mode].throttled);
+		printf("\n");
+	}
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f freq] [-b pages] [-r runs] [-n size]\n"
+			"  -f  sampling frequency per thread (default 10000)\n"
+			"  -b  ring buffer size in pages, power of 2 (default 8)\n"
+			"  -r  runs per mode, the fastest is kept (default 3)\n"
+			"  -n  gemm_omp matrix size (default 512)\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sigaction act;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:b:r:n:")) != -1) {
+		switch (opt) {
+		case 'f':
+			sample_freq = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			buffer_pages = atoi(optarg);
+			if (buffer_pages <= 0 || (buffer_pages & (buffer_pages - 1)))
+				usage(argv[0]);
+			break;
+		case 'r':
+			num_runs = atoi(optarg);
+			break;
+		case 'n':
+			gemm_size = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (sample_freq == 0 || num_runs <= 0 || gemm_size <= 0)
+		usage(argv[0]);
+
+	if (setup_attr())
+		exit(1);
+
+	memset(&act, 0, sizeof(act));
+	act.sa_sigaction = event_handler;
+	act.sa_flags     = SA_SIGINFO | SA_RESTART;
+	sigaction(PERF_SIGNAL, &act, 0);
+
+	num_events = omp_get_max_threads();
+	events = calloc(num_events, sizeof(*events));
+
+	size_t nn = (size_t) gemm_size * gemm_size;
+	A = malloc(sizeof(double) * nn);
+	B = malloc(sizeof(double) * nn);
+	C = malloc(sizeof(double) * nn);
+	for(size_t i=0; i<nn; i++) {
+		A[i] = (double) rand() / RAND_MAX;
+		B[i] = (double) rand() / RAND_MAX;
+	}
+
+	printf("%d threads, %d pages per ring, best of %d runs\n",
+	       num_events, buffer_pages, num_runs);
+
+	bench("gemm_omp", run_gemm_omp);
+	bench("naive_matrix_multiply", run_naive);
+
+	free(A);
+	free(B);
+	free(C);
+	free(events);
+	return 0;
+}
@@ -0,0 +1,441 @@
+/*
+ * IBS op decoding without IBS: records of known content are generated,
+ * decoded by perf_ibs, checked field by field against what was encoded,
+ * and the decoding is timed.
+ *
+ * Every generated op gets an IP out of -i of them, each IP with its own
+ * mix of data sources, and a DC miss latency drawn around the one of its
+ * source, so the report has something to show. With -z the data sources
+ * use the encoding of the cpus before Zen 4. The records go through the
+ * same fixture layout as the files, -w keeps them in one. With -r the
+ * records come from a fixture instead, e.g. from pe_ibsop -o, and are
+ * only decoded, timed and reported: there is nothing to check them
+ * against.
+ *
+ * The time is split in the three steps of the decoding: gathering the
+ * registers of a record into the batch, perf_ibs_decode() of the batch
+ * and perf_ibs_profile_add(), in ns per record over -p passes.
+ *
+ * Usage: bench_ibs [-n records] [-i ips] [-p passes] [-z] [-w fixture] [-r fixture]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "perf_ibs.h"
+
+#define RAW_SIZE	(sizeof(uint32_t) + PERF_IBS_OP_REGS * sizeof(uint64_t))
+#define RECORD_SIZE	(sizeof(uint32_t) + RAW_SIZE)
+#define MAX_ERRORS	10
+#define FIXTURE_HEADER	16	/* magic and count */
+
+/* what an op was generated with, as perf_ibs_decode() should find it */
+struct op_s {
+	uint64_t	ip;
+	uint64_t	addr;
+	uint16_t	flags;
+	uint16_t	miss_lat;
+	uint16_t	tlb_lat;
+	uint16_t	tag_to_ret;
+	uint8_t		width;
+	uint8_t		src;
+};
+
+/* DataSrc of a source in both encodings, 0 if it has none */
+static const struct {
+	uint8_t		zen4;
+	uint8_t		old;
+	uint16_t	lat;		/* typical miss latency */
+} sources[PERF_IBS_SRC_NR] = {
+	[PERF_IBS_SRC_L2]		= {  0, 0,   14 },
+	[PERF_IBS_SRC_L3]		= {  1, 2,   50 },
+	[PERF_IBS_SRC_NEAR_CACHE]	= {  2, 0,  120 },
+	[PERF_IBS_SRC_FAR_CACHE]	= {  5, 4,  250 },
+	[PERF_IBS_SRC_DRAM]		= {  3, 3,  300 },
+	[PERF_IBS_SRC_REMOTE_DRAM]	= {  3, 3,  550 },
+	[PERF_IBS_SRC_PMEM]		= {  6, 0,  900 },
+	[PERF_IBS_SRC_IO]		= {  7, 7, 2000 },
+	[PERF_IBS_SRC_EXT_MEM]		= {  8, 0,  700 },
+	[PERF_IBS_SRC_PEER_MEM]		= { 12, 0, 1500 },
+	[PERF_IBS_SRC_UNKNOWN]		= {  0, 0,  400 },
+};
+
+static struct perf_ibs_batch_s batch;
+static uint64_t seed = 0x2545f4914f6cdd1dull;
+static int old_encoding;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64, the same records on every run */
+static uint64_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static int
+has_source(int src)
+{
+	if (src == PERF_IBS_SRC_L2)
+		return 1;
+	return old_encoding ? sources[src].old != 0 : sources[src].zen4 != 0;
+}
+
+/* an op of IP number ip: the low IPs mostly hit, the high ones go further */
+static void
+generate(struct op_s *op, int ip, int nips)
+{
+	uint64_t r = rnd();
+	int kind = r % 100;
+
+	memset(op, 0, sizeof(*op));
+	op->ip	       = 0x400000 + ip * 0x40;
+	op->tag_to_ret = (r >> 8) & 0x3ff;
+
+	if (kind < 1)
+		return;				/* not valid */
+	op->flags = PERF_IBS_VALID;
+
+	if (kind < 20) {
+		op->src = PERF_IBS_SRC_NONE;
+		if (kind < 5)
+			op->flags |= PERF_IBS_BRANCH | (r & (1 << 20) ? PERF_IBS_MISPREDICT : 0);
+		return;
+	}
+
+	op->flags |= kind < 70 ? PERF_IBS_LOAD : PERF_IBS_STORE;
+	op->flags |= PERF_IBS_LIN_ADDR | PERF_IBS_PHYS_ADDR;
+	op->addr   = 0x7f0000000000ull + ((r >> 16) & 0xfffffc0);
+	op->width  = 1 + (r >> 40) % 5;
+	if (((r >> 24) & 0x3f) == 0)
+		op->flags |= PERF_IBS_LOCKED;
+	if (((r >> 30) & 0x1f) < 2) {
+		op->flags  |= PERF_IBS_L1TLB_MISS | ((r >> 35) & 1 ? PERF_IBS_L2TLB_MISS : 0);
+		op->tlb_lat = 20 + (r >> 44) % 100;
+	}
+
+	/* how far the IP goes, and where */
+	int depth = (int)((rnd() % 1000) * (ip + 1) / nips);
+	if (depth < 600) {
+		op->src = PERF_IBS_SRC_L1;
+		return;
+	}
+	op->flags |= PERF_IBS_DC_MISS;
+	if (depth < 800) {
+		op->src = PERF_IBS_SRC_L2;
+	} else if (depth > 990) {
+		op->src = PERF_IBS_SRC_UNKNOWN;
+		op->flags |= PERF_IBS_L2_MISS;
+	} else {
+		op->src = PERF_IBS_SRC_L3 + (depth - 800) % (PERF_IBS_SRC_PEER_MEM - PERF_IBS_SRC_L3 + 1);
+		if (!has_source(op->src))
+			op->src = PERF_IBS_SRC_DRAM;
+		op->flags |= PERF_IBS_L2_MISS;
+		if (op->src == PERF_IBS_SRC_REMOTE_DRAM || op->src == PERF_IBS_SRC_FAR_CACHE)
+			op->flags |= PERF_IBS_REMOTE;
+	}
+	if (op->flags & PERF_IBS_LOAD) {
+		uint32_t lat = sources[op->src].lat;
+		op->miss_lat = lat / 2 + rnd() % lat;
+	}
+}
+
+/* the raw record of the op, as the kernel lays it out */
+static void
+encode(unsigned char *raw, const struct op_s *op, int invalid_rip)
+{
+	uint32_t caps = 0x3ff | (old_encoding ? 0 : PERF_IBS_CAPS_ZEN4);
+	uint64_t regs[PERF_IBS_OP_REGS] = { 0 };
+	uint16_t f = op->flags;
+	uint8_t ds = 0;
+
+	if (op->src > PERF_IBS_SRC_L2 && op->src < PERF_IBS_SRC_UNKNOWN)
+		ds = old_encoding ? sources[op->src].old : sources[op->src].zen4;
+
+	regs[0] = 0x1000 | 1ull << 17 | (f & PERF_IBS_VALID || invalid_rip ? 1ull << 18 : 0);
+	regs[1] = op->ip;
+	regs[2] = (uint64_t) op->tag_to_ret << 16 | (op->tag_to_ret / 2)
+		| (uint64_t) (invalid_rip != 0) << 38
+		| (uint64_t) ((f & PERF_IBS_BRANCH) != 0) << 37
+		| (uint64_t) ((f & PERF_IBS_MISPREDICT) != 0) << 36;
+	regs[3] = (ds & 7) | (uint64_t) (ds >> 3) << 6 | (uint64_t) ((f & PERF_IBS_REMOTE) != 0) << 4;
+	regs[4] = (uint64_t) ((f & PERF_IBS_LOAD) != 0)
+		| (uint64_t) ((f & PERF_IBS_STORE) != 0) << 1
+		| (uint64_t) ((f & PERF_IBS_L1TLB_MISS) != 0) << 2
+		| (uint64_t) ((f & PERF_IBS_L2TLB_MISS) != 0) << 3
+		| (uint64_t) ((f & PERF_IBS_DC_MISS) != 0) << 7
+		| (uint64_t) ((f & PERF_IBS_UNCACHED) != 0) << 14
+		| (uint64_t) ((f & PERF_IBS_LOCKED) != 0) << 15
+		| (uint64_t) ((f & PERF_IBS_LIN_ADDR) != 0) << 17
+		| (uint64_t) ((f & PERF_IBS_PHYS_ADDR) != 0) << 18
+		| (uint64_t) ((f & PERF_IBS_L2_MISS) != 0) << 20
+		| (uint64_t) op->width << 22
+		| (uint64_t) op->miss_lat << 32
+		| (uint64_t) op->tlb_lat << 48;
+	regs[5] = op->addr;
+	regs[6] = op->addr & 0xffffffffffull;
+
+	memcpy(raw, &caps, sizeof(caps));
+	memcpy(raw + sizeof(caps), regs, sizeof(regs));
+}
+
+/* an in memory fixture of n records, with the ops they hold in ops[] */
+static unsigned char *
+make_fixture(size_t n, int nips, struct op_s *ops, size_t *len)
+{
+	unsigned char *buf = malloc(FIXTURE_HEADER + n * RECORD_SIZE), *p = buf + FIXTURE_HEADER;
+	uint32_t size = RAW_SIZE;
+	uint64_t count = n;
+
+	if (buf == NULL)
+		return NULL;
+	memcpy(buf, "IBSOPFX1", 8);
+	memcpy(buf + 8, &count, sizeof(count));
+
+	for (size_t i = 0; i < n; i++) {
+		int ip = rnd() % nips;
+
+		generate(&ops[i], ip, nips);
+		memcpy(p, &size, sizeof(size));
+		/* an invalid op either has no IbsOpVal, or an invalid rip */
+		encode(p + sizeof(size), &ops[i], !(ops[i].flags & PERF_IBS_VALID) && (i & 1));
+		p += RECORD_SIZE;
+	}
+	*len = p - buf;
+	return buf;
+}
+
+static int
+check_op(const struct perf_ibs_batch_s *b, size_t i, const struct op_s *op, size_t index)
+{
+	int ok = b->flags[i] == op->flags && b->rip[i] == op->ip && b->src[i] == op->src
+	      && b->width[i] == op->width && b->tag_to_ret[i] == op->tag_to_ret
+	      && b->lin_addr[i] == op->addr;
+
+	/* the latencies only mean something for a valid op */
+	if (op->flags & PERF_IBS_VALID)
+		ok = ok && b->miss_lat[i] == op->miss_lat && b->tlb_lat[i] == op->tlb_lat;
+	if (!ok) {
+		fprintf(stderr, "record %zu: flags %#x/%#x src %s/%s lat %u/%u tlb %u/%u width %u/%u\n",
+			index, b->flags[i], op->flags, perf_ibs_src_names[b->src[i]],
+			perf_ibs_src_names[op->src], b->miss_lat[i], op->miss_lat,
+			b->tlb_lat[i], op->tlb_lat, b->width[i], op->width);
+	}
+	return ok;
+}
+
+/* the totals of the profile against the ones of the generated ops */
+static int
+check_totals(const struct perf_ibs_profile_s *p, const struct op_s *ops, size_t n)
+{
+	struct perf_ibs_ip_s t = { 0 };
+	uint64_t invalid = 0;
+	int errors = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		const struct op_s *op = &ops[i];
+
+		if (!(op->flags & PERF_IBS_VALID)) {
+			invalid++;
+			continue;
+		}
+		t.ops++;
+		t.src[op->src]++;
+		t.loads  += (op->flags & PERF_IBS_LOAD) != 0;
+		t.stores += (op->flags & PERF_IBS_STORE) != 0;
+		if ((op->flags & PERF_IBS_LOAD) && (op->flags & PERF_IBS_DC_MISS)) {
+			t.misses++;
+			t.lat_sum += op->miss_lat;
+		}
+	}
+
+	errors += p->invalid != invalid || p->total.ops != t.ops || p->total.loads != t.loads;
+	errors += p->total.stores != t.stores || p->total.misses != t.misses;
+	errors += p->total.lat_sum != t.lat_sum;
+	errors += memcmp(p->total.src, t.src, sizeof(t.src)) != 0;
+	if (errors) {
+		fprintf(stderr, "totals: ops %"PRIu64"/%"PRIu64" loads %"PRIu64"/%"PRIu64" misses "
+			"%"PRIu64"/%"PRIu64" latency %"PRIu64"/%"PRIu64" invalid %"PRIu64"/%"PRIu64"\n",
+			p->total.ops, t.ops, p->total.loads, t.loads, p->total.misses, t.misses,
+			p->total.lat_sum, t.lat_sum, p->invalid, invalid);
+	}
+	return errors == 0;
+}
+
+/*
+ * Decode every record of the fixture into p, checking the ops against
+ * ops[] when there is one. Returns the number of bad records, -1 if
+ * the fixture is cut short. times[] gets the ns of the three steps.
+ */
+static long
+decode(struct perf_ibs_fixture_s *f, struct perf_ibs_profile_s *p, const struct op_s *ops,
+       uint64_t times[3])
+{
+	struct perf_ibs_batch_s *b = &batch;
+	const void *raw;
+	uint32_t size;
+	size_t index = 0;
+	long errors = 0;
+	int ret;
+
+	b->n		 = 0;
+	b->short_records = 0;
+	f->pos		 = FIXTURE_HEADER;
+	for (;;) {
+		uint64_t t0 = now_ns();
+		while ((ret = perf_ibs_fixture_next(f, &raw, &size)) == 1) {
+			if (perf_ibs_batch_add(b, raw, size) == 1)
+				break;
+		}
+		uint64_t t1 = now_ns();
+		perf_ibs_decode(b);
+		uint64_t t2 = now_ns();
+
+		for (size_t i = 0; ops && i < b->n; i++, index++) {
+			if (!check_op(b, i, &ops[index], index) && ++errors >= MAX_ERRORS)
+				ops = NULL;
+		}
+		uint64_t t3 = now_ns();
+		perf_ibs_profile_add(p, b);
+		uint64_t t4 = now_ns();
+
+		times[0] += t1 - t0;
+		times[1] += t2 - t1;
+		times[2] += t4 - t3;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+	}
+	return errors;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct perf_ibs_fixture_s f = { 0 };
+	struct perf_ibs_profile_s p;
+	struct op_s *ops = NULL;
+	const char *in = NULL, *out = NULL;
+	unsigned char *image = NULL;
+	size_t n = 1000000;
+	int nips = 64, passes = 5, c;
+
+	while ((c = getopt(argc, argv, "n:i:p:zw:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			nips = atoi(optarg);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 'z':
+			old_encoding = 1;
+			break;
+		case 'w':
+			out = optarg;
+			break;
+		case 'r':
+			in = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n records] [-i ips] [-p passes] [-z] "
+					"[-w fixture] [-r fixture]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n == 0 || nips <= 0 || passes <= 0) {
+		fprintf(stderr, "records, ips and passes must be positive\n");
+		return 1;
+	}
+
+	if (in) {
+		if (perf_ibs_fixture_open(&f, in))
+			return 1;
+		printf("%s: %"PRIu64" records\n", in, f.count);
+	} else {
+		ops   = malloc(n * sizeof(*ops));
+		image = ops ? make_fixture(n, nips, ops, &f.len) : NULL;
+		if (image == NULL) {
+			fprintf(stderr, "cannot allocate %zu records\n", n);
+			return 1;
+		}
+		f.map	= image;
+		f.count = n;
+		printf("%zu records on %d ips, %s encoding\n", n, nips,
+		       old_encoding ? "pre Zen 4" : "Zen 4");
+	}
+
+	if (out) {
+		FILE *file = fopen(out, "w");
+
+		if (file == NULL || fwrite(f.map, f.len, 1, file) != 1 || fclose(file) != 0) {
+			fprintf(stderr, "cannot write %s\n", out);
+			return 1;
+		}
+		printf("written to %s\n", out);
+	}
+
+	/* one pass checked and reported, then the timed ones */
+	uint64_t times[3] = { 0 };
+	if (perf_ibs_profile_init(&p, 1 << 14))
+		return 1;
+	long errors = decode(&f, &p, ops, times);
+	if (errors < 0)
+		return 1;
+	if (batch.short_records)
+		printf("%"PRIu64" records too short for an op\n", batch.short_records);
+	if (ops) {
+		int totals = check_totals(&p, ops, n);
+		printf("check: %ld bad records%s, totals %s\n", errors,
+		       errors >= MAX_ERRORS ? " (stopped)" : "", totals ? "match" : "differ");
+		errors += !totals;
+	}
+
+	memset(times, 0, sizeof(times));
+	uint64_t records = 0;
+	for (int i = 0; i < passes; i++) {
+		struct perf_ibs_profile_s q;
+
+		if (perf_ibs_profile_init(&q, 1 << 14))
+			return 1;
+		decode(&f, &q, NULL, times);
+		records += q.records;
+		perf_ibs_profile_fini(&q);
+	}
+	if (records) {
+		uint64_t total = times[0] + times[1] + times[2];
+		printf("%"PRIu64" records in %.3f s, %.1f M records/s: gather %.2f, decode %.2f, "
+		       "profile %.2f ns per record\n", records, total * 1e-9,
+		       total ? records * 1e3 / total : 0.0, (double) times[0] / records,
+		       (double) times[1] / records, (double) times[2] / records);
+	}
+
+	perf_ibs_report(&p, stdout, 10, NULL, NULL);
+	perf_ibs_profile_fini(&p);
+
+	if (in)
+		perf_ibs_fixture_close(&f);
+	free(image);
+	free(ops);
+	return errors != 0;
+}
@@ -0,0 +1,319 @@
+/*
+ * Throughput and accuracy of the per-thread IP histogram.
+ *
+ * Every thread adds -n samples drawn out of -k keys with a Zipf-like
+ * skew, the first keys far more often than the last ones, so the tables
+ * fill up and evict the way they do on a real profile. A key is an IP,
+ * an event out of -e, and with -p a data page. The draws are made
+ * before the clock starts, only perf_iphist_add() is timed.
+ *
+ * The tables are then checked against the exact counts of every thread:
+ * a key in a table is counted at most its error above its true count,
+ * and never under it. The recall is how many of the 100 hottest keys
+ * made it to the tables. With -l a thread keeps taking reports while the
+ * others add, as a live top view would.
+ *
+ * Usage: bench_iphist [-n samples] [-k keys] [-b buckets] [-t threads] [-e events] [-p] [-l]
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "perf_iphist.h"
+
+#define IP_BASE		0x400000ull
+#define ADDR_BASE	0x7f0000000000ull
+#define PAGES		4096
+#define HOTTEST		100
+#define MAX_ERRORS	10
+
+struct thread_s {
+	pthread_t	 tid;
+	uint64_t	 seed;
+	uint32_t	*draws;
+	uint64_t	*exact;		/* per key */
+	uint64_t	 ns;
+	struct perf_iphist_table_s *table;
+};
+
+static struct perf_iphist_s hist;
+static pthread_barrier_t barrier;
+static size_t nsamples = 10000000;
+static uint32_t nkeys = 100000;
+static int nevents = 4;
+static volatile int adding;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64, the same draws on every run */
+static uint64_t
+rnd(uint64_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+static inline uint64_t
+key_ip(uint32_t k)
+{
+	return IP_BASE + k * 16ull;
+}
+
+static inline unsigned int
+key_event(uint32_t k)
+{
+	return k % nevents;
+}
+
+static inline uint64_t
+key_addr(uint32_t k)
+{
+	return ADDR_BASE + ((k * 2654435761u) % PAGES) * 4096ull;
+}
+
+/* log-uniform draws: key i comes about 1/(i+1) as often as key 0 */
+static void
+draw(struct thread_s *t)
+{
+	double lk = log(nkeys + 1.0);
+
+	for (size_t i = 0; i < nsamples; i++) {
+		double u = (rnd(&t->seed) >> 11) * (1.0 / 9007199254740992.0);
+		uint32_t k = (uint32_t) exp(u * lk) - 1;
+
+		if (k >= nkeys)
+			k = nkeys - 1;
+		t->draws[i] = k;
+		t->exact[k]++;
+	}
+}
+
+static void *
+add_thread(void *arg)
+{
+	struct thread_s *t = arg;
+	uint64_t start;
+
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	for (size_t i = 0; i < nsamples; i++) {
+		uint32_t k = t->draws[i];
+
+		perf_iphist_add(&hist, key_event(k), key_ip(k), key_addr(k), 1);
+	}
+	t->ns = now_ns() - start;
+
+	/* the table this thread claimed, for the check */
+	for (int i = 0; i < hist.max_threads; i++) {
+		if (hist.tables[i].tid == gettid())
+			t->table = &hist.tables[i];
+	}
+	return NULL;
+}
+
+static void *
+report_thread(void *arg)
+{
+	FILE *null = fopen("/dev/null", "w");
+	long *reports = arg;
+
+	while (null && adding) {
+		perf_iphist_report(&hist, null, 20, NULL, 0, NULL, NULL);
+		(*reports)++;
+	}
+	if (null)
+		fclose(null);
+	return NULL;
+}
+
+/* the key of a slot, -1 if it is none of ours */
+static long
+slot_key(const struct perf_iphist_slot_s *s)
+{
+	uint64_t k = (s->ip - IP_BASE) / 16;
+
+	if (s->ip < IP_BASE || k >= nkeys || key_ip(k) != s->ip ||
+	    s->key >> 52 != key_event(k))
+		return -1;
+	if (hist.by_page && (s->key & ((1ull << 52) - 1)) != key_addr(k) >> 12)
+		return -1;
+	return k;
+}
+
+/* Space-Saving bounds of every slot of the table, and where the keys are */
+static long
+check_table(const struct thread_s *t, uint8_t *present)
+{
+	long errors = 0;
+
+	for (size_t i = 0; i < hist.buckets * PERF_IPHIST_WAYS; i++) {
+		const struct perf_iphist_slot_s *s = &t->table->slots[i];
+		long k;
+
+		if (s->count == 0)
+			continue;
+		k = slot_key(s);
+		if (k < 0 || s->count - s->error > t->exact[k] || t->exact[k] > s->count) {
+			if (errors++ < MAX_ERRORS)
+				fprintf(stderr, "slot %zu: key %ld count %"PRIu64" error %"PRIu64
+					" exact %"PRIu64"\n", i, k, s->count, s->error,
+					k < 0 ? 0 : t->exact[k]);
+			continue;
+		}
+		present[k] = 1;
+	}
+	return errors;
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t buckets = 4096;
+	int nthreads = 1, by_page = 0, live = 0, c;
+
+	while ((c = getopt(argc, argv, "n:k:b:t:e:pl")) != -1) {
+		switch (c) {
+		case 'n':
+			nsamples = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			nkeys = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			buckets = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'e':
+			nevents = atoi(optarg);
+			break;
+		case 'p':
+			by_page = 1;
+			break;
+		case 'l':
+			live = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n samples] [-k keys] [-b buckets] [-t threads] "
+					"[-e events] [-p] [-l]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nsamples == 0 || nkeys == 0 || nthreads <= 0 || nevents <= 0 ||
+	    nevents > PERF_IPHIST_EVENTS) {
+		fprintf(stderr, "samples, keys, threads and events must be positive, "
+				"at most %d events\n", PERF_IPHIST_EVENTS);
+		return 1;
+	}
+	if (perf_iphist_init(&hist, buckets, nthreads, by_page))
+		return 1;
+
+	struct thread_s *threads = calloc(nthreads, sizeof(*threads));
+	for (int i = 0; i < nthreads; i++) {
+		struct thread_s *t = &threads[i];
+
+		t->seed  = 0x2545f4914f6cdd1dull + i * 0x9e3779b97f4a7c15ull;
+		t->draws = malloc(nsamples * sizeof(*t->draws));
+		t->exact = calloc(nkeys, sizeof(*t->exact));
+		if (t->draws == NULL || t->exact == NULL) {
+			fprintf(stderr, "cannot allocate %zu samples\n", nsamples);
+			return 1;
+		}
+		draw(t);
+	}
+	printf("%d threads, %zu samples each on %u keys of %d events%s, %zu slots per thread\n",
+	       nthreads, nsamples, nkeys, nevents, by_page ? " and pages" : "",
+	       buckets * PERF_IPHIST_WAYS);
+
+	pthread_t reporter;
+	long reports = 0;
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	adding = 1;
+	if (live)
+		pthread_create(&reporter, NULL, report_thread, &reports);
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&threads[i].tid, NULL, add_thread, &threads[i]);
+	pthread_barrier_wait(&barrier);
+
+	uint64_t slowest = 0;
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		printf("  thread %d: %.1f M samples/s, %.2f ns per sample\n", i,
+		       nsamples * 1e3 / threads[i].ns, (double) threads[i].ns / nsamples);
+		if (threads[i].ns > slowest)
+			slowest = threads[i].ns;
+	}
+	adding = 0;
+	if (live) {
+		pthread_join(reporter, NULL);
+		printf("  %ld live reports while adding\n", reports);
+	}
+	printf("all threads: %.1f M samples/s\n", nthreads * nsamples * 1e3 / slowest);
+
+	/* the bounds of every slot, then the recall of the hottest keys */
+	uint8_t *present = calloc(nkeys, 1);
+	uint64_t *exact = calloc(nkeys, sizeof(*exact));
+	uint32_t *order = malloc(nkeys * sizeof(*order));
+	long errors = 0;
+
+	for (int i = 0; i < nthreads; i++) {
+		if (threads[i].table == NULL) {
+			fprintf(stderr, "thread %d: no table\n", i);
+			errors++;
+			continue;
+		}
+		errors += check_table(&threads[i], present);
+		for (uint32_t k = 0; k < nkeys; k++)
+			exact[k] += threads[i].exact[k];
+	}
+
+	/* the draws favour the low keys, but not exactly in order */
+	int hot = nkeys < HOTTEST ? nkeys : HOTTEST, found = 0;
+	for (uint32_t k = 0; k < nkeys; k++)
+		order[k] = k;
+	for (int i = 0; i < hot; i++) {
+		for (uint32_t k = i + 1; k < nkeys; k++) {
+			if (exact[order[k]] > exact[order[i]]) {
+				uint32_t x = order[i];
+
+				order[i] = order[k];
+				order[k] = x;
+			}
+		}
+		found += present[order[i]];
+	}
+	printf("check: %ld bad slots%s, %d of the %d hottest keys in the tables\n", errors,
+	       errors > MAX_ERRORS ? " (not all shown)" : "", found, hot);
+
+	perf_iphist_report(&hist, stdout, 5, NULL, 0, NULL, NULL);
+	perf_iphist_fini(&hist);
+
+	for (int i = 0; i < nthreads; i++) {
+		free(threads[i].draws);
+		free(threads[i].exact);
+	}
+	free(threads);
+	free(present);
+	free(exact);
+	free(order);
+	return errors != 0;
+}
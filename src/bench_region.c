@@ -0,0 +1,121 @@
+/*
+ * Cost of a perf_region_begin()/perf_region_end() pair, with the rdpmc
+ * path and with the PERF_FORMAT_GROUP read() fallback, and the counts
+ * of a small instrumented loop measured both ways.
+ *
+ * Usage: bench_region [-e events] [-n iterations] [-w work]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "perf_region.h"
+
+enum { REGION_EMPTY, REGION_LOOP };
+
+static volatile double sink;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+work(int n)
+{
+	double s = 0;
+
+	for (int i = 0; i < n; i++)
+		s += i * 0.5;
+	sink = s;
+}
+
+static int
+bench(const char *name, const char *events, int flags, int iterations, int n)
+{
+	uint64_t start, empty, loop;
+
+	if (perf_region_open(events, flags))
+		return -1;
+
+	struct perf_region_thread_s *t = perf_region_self();
+	printf("%s: %s\n", name, t->rdpmc ? "rdpmc" : "read()");
+
+	start = now_ns();
+	for (int i = 0; i < iterations; i++) {
+		perf_region_begin(REGION_EMPTY);
+		perf_region_end(REGION_EMPTY);
+	}
+	empty = now_ns() - start;
+
+	start = now_ns();
+	for (int i = 0; i < iterations; i++) {
+		perf_region_begin(REGION_LOOP);
+		work(n);
+		perf_region_end(REGION_LOOP);
+	}
+	loop = now_ns() - start;
+
+	printf("  begin+end: %8.1f ns, with the loop: %8.1f ns\n",
+	       (double) empty / iterations, (double) loop / iterations);
+	printf("  %lu reads, %lu with read()\n\n", t->reads, t->fallbacks);
+
+	perf_region_close();
+	return 0;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-e events] [-n iterations] [-w work]\n"
+			"  -e  comma separated events (default cycles,instructions)\n"
+			"  -n  regions per run (default 1000000)\n"
+			"  -w  loop iterations in the instrumented region (default 100)\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *events = "cycles,instructions";
+	int iterations = 1000000, n = 100;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:n:w:")) != -1) {
+		switch (opt) {
+		case 'e':
+			events = optarg;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'w':
+			n = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (iterations <= 0 || n < 0)
+		usage(argv[0]);
+
+	perf_region_name(REGION_EMPTY, "empty");
+	perf_region_name(REGION_LOOP, "loop");
+
+	if (bench("userspace", events, 0, iterations, n) ||
+	    bench("syscall", events, PERF_REGION_NO_RDPMC, iterations, n))
+		return 1;
+
+	/* both runs together */
+	perf_region_report(stdout);
+	return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Signal handler latency per record: decoding in the handler vs copying
+ * into a perf_spsc queue.
+ *
+ * The handler is fed from a fake perf ring in memory, refilled with
+ * PERF_RECORD_SAMPLE records between calls, so the numbers do not
+ * depend on the PMU or on signal delivery. Two handlers are timed:
+ *
+ *   decode   what the tools do today: parse every sample, look the
+ *            address up in a linear table of allocations and fprintf()
+ *            it (to /dev/null)
+ *   spsc     perf_spsc_push_ring() into a queue drained by an
+ *            aggregation thread that does the decoding and the lookups
+ *
+ * Between two calls the "workload" spins for a while, as the sampled
+ * thread would between two overflows, which gives the aggregation
+ * thread time to keep up. The handler latency is reported in ns per
+ * record, mean and percentiles of the calls.
+ *
+ * Usage: bench_spsc [-n calls] [-r records per call] [-a allocations] [-g gap ns]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include "perf_ring.h"
+#include "perf_spsc.h"
+
+#define RING_PAGES	8
+#define SPSC_SIZE	(1 << 20)
+
+struct alloc_s {
+	uint64_t start;
+	uint64_t end;
+	uint64_t samples;
+};
+
+static struct perf_ring_s ring;
+static void *ring_base;
+static struct perf_event_attr attr;
+static struct perf_sample_layout_s layout;
+
+static struct alloc_s *allocs;
+static int num_allocs = 64;
+
+static FILE *devnull;
+
+static struct perf_spsc_s queue;
+static struct perf_spsc_notify_s notify;
+static int stop;
+static uint64_t decoded;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Append n samples to the fake ring, as the kernel would. Every record
+ * is 64 bytes: header, ip, pid/tid, time, addr, cpu, period and one
+ * padding word from PERF_SAMPLE_ID.
+ */
+static void
+fill_ring(int n)
+{
+	struct perf_event_mmap_page *hdr = ring.hdr;
+	uint64_t head = hdr->data_head;
+
+	for (int i = 0; i < n; i++) {
+		uint64_t *rec = (uint64_t *)(ring.data + (head & ring.mask));
+		struct perf_event_header *ehdr = (void *)rec;
+		uint64_t r = rand();
+
+		ehdr->type = PERF_RECORD_SAMPLE;
+		ehdr->misc = PERF_RECORD_MISC_USER;
+		ehdr->size = 64;
+		rec[1] = 0x400000 + (r & 0xffff);			/* ip */
+		rec[2] = ((uint64_t)1234 << 32) | 1234;			/* pid, tid */
+		rec[3] = head;						/* time */
+		rec[4] = allocs[r % num_allocs].start + (r & 0xff);	/* addr */
+		rec[5] = 42;						/* id */
+		rec[6] = 0;						/* cpu */
+		rec[7] = 4000;						/* period */
+		head += 64;
+	}
+	__atomic_store_n(&hdr->data_head, head, __ATOMIC_RELEASE);
+}
+
+/* the decoding and aggregation the handlers do today */
+static void
+decode(const struct perf_event_header *ehdr, void *arg)
+{
+	struct perf_sample_s sample;
+
+	if (ehdr->type != PERF_RECORD_SAMPLE)
+		return;
+	if (perf_sample_parse(&layout, ehdr, &sample))
+		return;
+
+	uint64_t addr = sample.v[PERF_SF_ADDR];
+	for (int i = 0; i < num_allocs; i++) {
+		if (addr >= allocs[i].start && addr < allocs[i].end)
+			allocs[i].samples++;
+	}
+	perf_sample_fprint(devnull, &layout, &sample);
+	decoded++;
+}
+
+static void
+handler_decode(void)
+{
+	perf_ring_drain(&ring, decode, NULL);
+}
+
+static void
+handler_spsc(void)
+{
+	perf_spsc_push_ring(&queue, &ring);
+}
+
+static void *
+aggregation_thread(void *arg)
+{
+	struct perf_spsc_s *q = &queue;
+
+	for (;;) {
+		int done = __atomic_load_n(&stop, __ATOMIC_ACQUIRE);
+
+		if (perf_spsc_drain(q, decode, NULL) == 0) {
+			if (done)
+				break;
+			perf_spsc_wait(&notify, &q, 1, 1);
+		}
+	}
+	return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench(const char *name, void (*handler)(void), int calls, int records, uint64_t gap)
+{
+	uint64_t *lat = malloc(calls * sizeof(uint64_t));
+	uint64_t total = 0;
+
+	for (int i = 0; i < calls; i++) {
+		fill_ring(records);
+
+		uint64_t start = now_ns();
+		handler();
+		uint64_t end = now_ns();
+
+		lat[i]	= end - start;
+		total  += lat[i];
+
+		/* the workload, until the next overflow */
+		while (now_ns() - end < gap)
+			;
+	}
+
+	qsort(lat, calls, sizeof(uint64_t), cmp_u64);
+
+	printf("%-8s ns/record: mean %8.1f  p50 %8.1f  p99 %8.1f  max %10.1f\n", name,
+	       (double) total / ((uint64_t) calls * records),
+	       (double) lat[calls / 2] / records,
+	       (double) lat[calls - 1 - calls / 100] / records,
+	       (double) lat[calls - 1] / records);
+	free(lat);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n calls] [-r records] [-a allocations] [-g gap]\n"
+			"  -n  handler calls (default 100000)\n"
+			"  -r  records per call (default 1)\n"
+			"  -a  allocations in the lookup table (default 64)\n"
+			"  -g  ns of workload between two calls (default 10000)\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int calls = 100000, records = 1;
+	uint64_t gap = 10000;
+	pthread_t thread;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:a:g:")) != -1) {
+		switch (opt) {
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		case 'r':
+			records = atoi(optarg);
+			break;
+		case 'a':
+			num_allocs = atoi(optarg);
+			break;
+		case 'g':
+			gap = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (calls <= 0 || records <= 0 || num_allocs <= 0 ||
+	    records * 64 > RING_PAGES * 4096)
+		usage(argv[0]);
+
+	devnull = fopen("/dev/null", "w");
+
+	allocs = calloc(num_allocs, sizeof(*allocs));
+	for (int i = 0; i < num_allocs; i++) {
+		allocs[i].start = 0x10000000ull + i * 0x100000ull;
+		allocs[i].end	= allocs[i].start + 0x80000;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+			   PERF_SAMPLE_ADDR | PERF_SAMPLE_ID | PERF_SAMPLE_CPU |
+			   PERF_SAMPLE_PERIOD;
+	perf_sample_layout_init(&layout, &attr);
+
+	size_t pagesize = perf_ring_pagesize();
+	if (posix_memalign(&ring_base, pagesize, (RING_PAGES + 1) * pagesize))
+		exit(1);
+	memset(ring_base, 0, (RING_PAGES + 1) * pagesize);
+	perf_ring_init(&ring, ring_base, RING_PAGES);
+
+	printf("%d calls, %d records per call, %d allocations, %"PRIu64" ns apart\n\n",
+	       calls, records, num_allocs, gap);
+
+	bench("decode", handler_decode, calls, records, gap);
+
+	perf_spsc_notify_init(&notify);
+	if (perf_spsc_init(&queue, SPSC_SIZE, &notify))
+		exit(1);
+	pthread_create(&thread, NULL, aggregation_thread, NULL);
+
+	decoded = 0;
+	bench("spsc", handler_spsc, calls, records, gap);
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	perf_spsc_wake(&notify);
+	pthread_join(thread, NULL);
+
+	printf("\nspsc: %"PRIu64" pushed, %"PRIu64" dropped, %"PRIu64" decoded\n",
+	       queue.pushed, queue.dropped, decoded);
+
+	perf_spsc_fini(&queue);
+	perf_spsc_notify_fini(&notify);
+	free(ring_base);
+	return 0;
+}
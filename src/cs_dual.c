@@ -20,14 +20,15 @@
 
 #include <sched.h>
 #include "matrix_multiply.h"
+#include "perf_ring.h"
 
 #define TMSG(fd,...) do { if (!quiet) fprintf(fd, __VA_ARGS__); } while(0);
 
 struct perf_event_attr event_attr[2];
 /* Size of buffer data (must be power of 2 */
 int buffer_pages = 1;
-void *event_buf[] = {NULL, NULL};
-size_t event_pgmsk;
+struct perf_ring_s event_ring[2];
+struct perf_sample_layout_s event_layout[2];
 
 int quiet = 1;
 int fd[2];
@@ -45,282 +46,6 @@ long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 }
 
 
-/*
- * event_buf already has the mmap'ed address for perf buffer,
- * So, go ahead and read the data.
- *
- * The payload data (event data) starts after the first page of control
- * information.
- */
-static int read_from_perf_buffer(int index, void *buf, size_t sz)
-{
-	struct perf_event_mmap_page *header = event_buf[index];
-	size_t pgmsk = event_pgmsk;
-	void *data;
-	unsigned long tail;
-	size_t avail_sz, min, c;
-
-	/*
-	 * data points to beginning of buffer payload
-	 */
-	data = ((void *)header) + sysconf(_SC_PAGESIZE);
-
-	/*
-	 * position of tail within the buffer payload.
-	 */
-	tail = header->data_tail & pgmsk;
-
-	/*
-	 * Size of available data.
-	 */
-	avail_sz = header->data_head - header->data_tail;
-	if (sz > avail_sz) {
-		TMSG(stderr, "Needed size is more than available size\n");
-		return -1;
-	}
-
-	/*
-	 * c = size till the end of buffer
-	 *
-	 * buffer size is a power of two.
-	 */
-	c = pgmsk + 1 - tail;
-
-	/*
-	 * min with requested size.
-	 */
-	min = c < sz ? c : sz;
-
-	/* copy beginning */
-	memcpy(buf, data + tail, min);
-
-	/* copy wrapped around leftover */
-	if (sz > min)
-		memcpy(buf + min, data, sz - min);
-
-	/* header->data_tail should reflect the last read data */
-	header->data_tail += sz;
-
-	return 0;
-}
-
-
-static int read_from_perf_buffer_64(int index, void *buf)
-{
-	return read_from_perf_buffer(index, buf, sizeof(uint64_t));
-}
-
-
-/*
- * Not the data we need? Skip the data.
- */
-static void skip_perf_data(int index, size_t sz)
-{
-	struct perf_event_mmap_page *hdr = event_buf[index];
-
-	if ((hdr->data_tail + sz) > hdr->data_head)
-		sz = hdr->data_head - hdr->data_tail;
-
-	hdr->data_tail += sz;
-}
-
-static int is_more_perf_data(int index)
-{
-	struct perf_event_mmap_page *hdr = event_buf[index];
-
-	if (hdr->data_tail < hdr->data_head)
-		return 1;
-
-	return 0;
-}
-
-
-/*
- * The below parser is a stripped down version of perf source. To keep it
- * simple, it only looks for PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_CALLCHAIN,
- * PERF_SAMPLE_IP, PERF_SAMPLE_RAW and PERF_SAMPLE_TIME.
- * More parsers can be added if needed.
- */
-static int parse_perf_sample(int index, struct perf_event_header *ehdr)
-{
-	size_t sz;
-	uint64_t type, fmt, val64;
-	uint64_t time_enabled, time_running;
-	const char *str;
-	int ret;
-	uint64_t value;
-	uint64_t id;
-	struct { uint32_t pid, tid; } pid;
-
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = event_attr[index].sample_type;
-	fmt = event_attr[index].read_format;
-
-	TMSG(stderr, "CONTEXT SWITCH: SW_EVENT\n");
-	TMSG(stderr, "  ");
-
-	if (type & PERF_SAMPLE_IDENTIFIER) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read IP");
-			return -1;
-		}
-		TMSG(stderr, "ID :%"PRIu64" ", val64);
-		sz -= sizeof(val64);
-	}
-
-	/*
-	 * the sample_type information is laid down
-	 * based on the PERF_RECORD_SAMPLE format specified
-	 * in the perf_event.h header file.
-	 * That order is different from the enum perf_event_sample_format.
-	 */
-	if (type & PERF_SAMPLE_IP) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read IP");
-			return -1;
-		}
-
-		/*
-		 * MISC_EXACT_IP indicates that kernel is returning
-		 * th  IIP of an instruction which caused the event, i.e.,
-		 * no skid
-		 */
-		TMSG(stderr, "IIP:%#016"PRIx64"  ", val64);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(index, &pid, sizeof(pid));
-		if (ret) {
-			TMSG(stderr, "cannot read PID");
-			return -1;
-		}
-
-		TMSG(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
-
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read time");
-			return -1;
-		}
-
-		TMSG(stderr, "TIME:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(index, &cpu, sizeof(cpu));
-		if (ret) {
-			TMSG(stderr, "cannot read cpu");
-			return -1;
-		}
-		TMSG(stderr, "CPU:%u  ", cpu.cpu);
-		sz -= sizeof(cpu);
-	}
-
-	if (type & PERF_SAMPLE_PERIOD) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read period");
-			return -1;
-		}
-		TMSG(stderr, "PERIOD:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_CALLCHAIN) {
-		uint64_t nr, ip;
-
-		ret = read_from_perf_buffer_64(index, &nr);
-		if (ret) {
-			TMSG(stderr, "cannot read callchain nr");
-			return -1;
-		}
-		sz -= sizeof(nr);
-
-		TMSG(stderr, "\n  CALLCHAIN :\n");
-		while(nr--) {
-			ret = read_from_perf_buffer_64(index, &ip);
-			if (ret) {
-				TMSG(stderr, "cannot read ip");
-				return -1;
-			}
-
-			sz -= sizeof(ip);
-
-			TMSG(stderr, "\t0x%"PRIx64"\n", ip);
-		}
-	}
-
-	return 0;
-}
-
-static int parse_perf_switch(int index, struct perf_event_header *ehdr)
-{
-	size_t sz;
-	uint64_t type, fmt, val64;
-	int ret;
-	struct { uint32_t pid, tid; } pid;
-
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = event_attr[index].sample_type;
-	fmt = event_attr[index].read_format;
-
-	if (ehdr->misc == PERF_RECORD_MISC_SWITCH_OUT) {
-		TMSG(stderr, "CONTEXT SWITCH: OUT\n");
-	} else {
-		TMSG(stderr, "CONTEXT SWITCH: IN\n");
-	}
-
-	TMSG(stderr, "  ");
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(index, &pid, sizeof(pid));
-		if (ret) {
-			TMSG(stderr, "cannot read PID");
-			return -1;
-		}
-
-		TMSG(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
-
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read time");
-			return -1;
-		}
-
-		TMSG(stderr, "TIME:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(index, &cpu, sizeof(cpu));
-		if (ret) {
-			TMSG(stderr, "cannot read cpu");
-			return -1;
-		}
-		TMSG(stderr, "CPU:%u\n", cpu.cpu);
-		sz -= sizeof(cpu);
-	}
-
-	return 0;
-}
-
 static void sigio_handler(int n, siginfo_t *info, void *uc)
 {
 	static int num_samples = 0;
@@ -350,35 +75,35 @@ static void sigio_handler(int n, siginfo_t *info, void *uc)
 
 	TMSG(stderr, "%d. FD %d, SIGIO: %d\n", index, fd[index], num_samples++);
 
-	struct perf_event_header ehdr;
+	const struct perf_event_header *ehdr;
+	struct perf_sample_s sample;
 	int ret;
 
-	for(i=0; i<2; i++)
-	{
-again:
-
-	ret = read_from_perf_buffer(i, &ehdr, sizeof(ehdr));
-	if (ret) {
-		continue;
-	}
-
-	samples[i]++;
-
-	if (ehdr.type != PERF_RECORD_SAMPLE && ehdr.type != PERF_RECORD_SWITCH) {
-		/* Not the sample we are looking for */
-		fprintf(stderr, "skipping record type %d\n", ehdr.type);
-		skip_perf_data(index, ehdr.size);
-	}
-
-	if (ehdr.type == PERF_RECORD_SAMPLE) {
-		ret = parse_perf_sample(i, &ehdr);
-
-	} else if (ehdr.type == PERF_RECORD_SWITCH) {
-		ret = parse_perf_switch(i, &ehdr);
-	}
+	for(i=0; i<2; i++) {
+		perf_ring_begin(&event_ring[i]);
+		while ((ehdr = perf_ring_next(&event_ring[i])) != NULL) {
+			samples[i]++;
+
+			if (ehdr->type == PERF_RECORD_SAMPLE) {
+				TMSG(stderr, "CONTEXT SWITCH: SW_EVENT\n");
+				ret = perf_sample_parse(&event_layout[i], ehdr, &sample);
+			} else if (ehdr->type == PERF_RECORD_SWITCH) {
+				if (ehdr->misc & PERF_RECORD_MISC_SWITCH_OUT) {
+					TMSG(stderr, "CONTEXT SWITCH: OUT\n");
+				} else {
+					TMSG(stderr, "CONTEXT SWITCH: IN\n");
+				}
+				ret = perf_sample_parse_id(&event_layout[i], ehdr, &sample);
+			} else {
+				/* Not the sample we are looking for */
+				fprintf(stderr, "skipping record type %d\n", ehdr->type);
+				continue;
+			}
 
-	if (is_more_perf_data(i))
-		goto again;
+			if (ret == 0 && !quiet)
+				perf_sample_fprint(stderr, &event_layout[i], &sample);
+		}
+		perf_ring_end(&event_ring[i]);
 	}
 
 	ret = ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
@@ -506,16 +231,9 @@ setup_perf(int index, unsigned int type, unsigned int config)
 		return -1;
 	}
 
-	size_t pagesize = sysconf(_SC_PAGESIZE);
-	void *buf = mmap(NULL, (buffer_pages + 1) * pagesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd[index], 0);
-	if (buf == MAP_FAILED) {
-		fprintf(stderr, "Can't mmap buffer\n");
+	if (perf_ring_open(&event_ring[index], fd[index], buffer_pages))
 		return -1;
-	}
-	event_buf[index]    = buf;
-
-	size_t pgmsk = (buffer_pages * pagesize) - 1;
-	event_pgmsk  = pgmsk;
+	perf_sample_layout_init(&event_layout[index], &event_attr[index]);
 
 	return 0;
 }
@@ -557,6 +275,8 @@ setup_notification(int index)
 int
 disable_counter(int index)
 {
+	char name[16];
+
 	/* Disable the event counter */
 	int ret = ioctl(fd[index], PERF_EVENT_IOC_DISABLE, 1);
 	if (ret == -1) {
@@ -565,6 +285,9 @@ disable_counter(int index)
 	}
 
 	close(fd[index]);
+	snprintf(name, sizeof(name), "ring %d", index);
+	perf_ring_report(stdout, name, &event_ring[index].stats);
+	perf_ring_close(&event_ring[index]);
 	return 0;
 }
 int main(int argc, char *argv[])
@@ -19,6 +19,19 @@
 #include <asm/unistd.h>
 
 #include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/resource.h>
+
+#include "perf_ring.h"
+#include "perf_collector.h"
+#include "perf_region.h"
+#include "perf_adapt.h"
+#include "perf_numa.h"
+#include "perf_iphist.h"
+#include "perf_symtab.h"
 
 #define TMSG(fd,...) do { if (!quiet) fprintf(fd, __VA_ARGS__); } while(0);
 
@@ -39,7 +52,11 @@ struct event_counter_s {
 struct event_data_s {
 	unsigned int samples;
 	int fd;
-	void *event_buff;
+	struct perf_ring_s ring;
+	struct perf_sample_layout_s layout;
+	uint64_t periods;		/* sum of PERF_SAMPLE_PERIOD */
+	int adaptive;
+	struct perf_adapt_s adapt;
 };
 
 struct event_counter_s events_period[] = {
@@ -87,304 +104,165 @@ struct perf_event_attr *event_attr;
 
 /* Size of buffer data (must be power of 2 */
 int buffer_pages = 1;
-size_t event_pgmsk;
-
-int quiet = 1;
-
-
-static long
-perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
-		int cpu, int group_fd, unsigned long flags)
-{
-	int ret;
-
-	ret = syscall(__NR_perf_event_open, hw_event, pid, cpu,
-			group_fd, flags);
-	return ret;
-}
-
 
 /*
- * event_buf already has the mmap'ed address for perf buffer,
- * So, go ahead and read the data.
+ * Drain mode: let the counters run freely and drain the rings from the
+ * collector thread, woken up once per half buffer instead of one
+ * SIGIO + IOC_REFRESH per sample.
  *
- * The payload data (event data) starts after the first page of control
- * information.
+ * This can't be done with SIGIO: once O_ASYNC is set the kernel queues
+ * a signal on every overflow, whatever the wakeup_watermark is.
  */
-static int
-read_from_perf_buffer(int index, void *buf, size_t sz)
-{
-	struct perf_event_mmap_page *header = event_data[index].event_buff;
-	size_t pgmsk = event_pgmsk;
-	void *data;
-	unsigned long tail;
-	size_t avail_sz, min, c;
-
-	if (header == NULL) return -1;
-
-	/*
-	 * data points to beginning of buffer payload
-	 */
-	data = ((void *)header) + sysconf(_SC_PAGESIZE);
-
-	/*
-	 * position of tail within the buffer payload.
-	 */
-	tail = header->data_tail & pgmsk;
-
-	/*
-	 * Size of available data.
-	 */
-	avail_sz = header->data_head - header->data_tail;
-	if (sz > avail_sz) {
-		TMSG(stderr, "Needed size is more than available size\n");
-		return -1;
-	}
-
-	/*
-	 * c = size till the end of buffer
-	 *
-	 * buffer size is a power of two.
-	 */
-	c = pgmsk + 1 - tail;
-
-	/*
-	 * min with requested size.
-	 */
-	min = c < sz ? c : sz;
-
-	/* copy beginning */
-	memcpy(buf, data + tail, min);
-
-	/* copy wrapped around leftover */
-	if (sz > min)
-		memcpy(buf + min, data, sz - min);
-
-	/* header->data_tail should reflect the last read data */
-	header->data_tail += sz;
-
-	return 0;
-}
-
-
-static int
-read_from_perf_buffer_64(int index, void *buf)
-{
-	return read_from_perf_buffer(index, buf, sizeof(uint64_t));
-}
-
+int watermark = 0;
+struct perf_collector_s collector;
 
 /*
- * Not the data we need? Skip the data.
+ * System-wide mode (-a): every event is opened once per CPU with
+ * pid == -1, whatever runs there. The events of a CPU share the ring of
+ * the first one through PERF_EVENT_IOC_SET_OUTPUT and are told apart
+ * with PERF_SAMPLE_IDENTIFIER. Each NUMA node gets its own collector
+ * thread, bound to the node, so a ring is only touched by the CPU that
+ * writes it and a reader on the same node.
  */
-static void
-skip_perf_data(int index, size_t sz)
-{
-	struct perf_event_mmap_page *hdr = event_data[index].event_buff;
-
-	if ((hdr->data_tail + sz) > hdr->data_head)
-		sz = hdr->data_head - hdr->data_tail;
-
-	hdr->data_tail += sz;
-}
-
-static int
-is_more_perf_data(int index)
-{
-	struct perf_event_mmap_page *hdr = event_data[index].event_buff;
-
-	if (hdr->data_tail < hdr->data_head)
-		return 1;
+int system_wide = 0;
+
+struct cpu_data_s {
+	int cpu;
+	int node;
+	int *fd;		/* per event, -1 if it couldn't be opened */
+	uint64_t *id;		/* PERF_EVENT_IOC_ID of each event */
+	unsigned int *samples;	/* per event */
+	unsigned int num_events;
+	struct perf_ring_s ring;
+};
 
-	return 0;
-}
+struct perf_sample_layout_s cpu_layout;
 
+int quiet = 1;
 
 /*
- * The below parser is a stripped down version of perf source. To keep it
- * simple, it only looks for PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_CALLCHAIN,
- * PERF_SAMPLE_IP, PERF_SAMPLE_RAW and PERF_SAMPLE_TIME.
- * More parsers can be added if needed.
+ * Adaptive period (-o): the period-based events share an overhead
+ * budget, a percentage of the run, and a controller thread moves their
+ * sample_period every ADAPT_MS to stay within it. The frequency-based
+ * ones are left alone, the kernel already adapts their period. Either
+ * way the events are estimated by the sum of the sample periods, not
+ * the number of samples.
  */
-static int parse_perf_sample(int index, struct perf_event_header *ehdr)
-{
-	size_t sz;
-	uint64_t type, fmt, val64;
-	uint64_t time_enabled, time_running;
-	const char *str;
-	int ret;
-	uint64_t value;
-	uint64_t id;
-	struct { uint32_t pid, tid; } pid;
-
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = event_attr[index].sample_type;
-	fmt = event_attr[index].read_format;
-
-	TMSG(stderr, "CONTEXT SWITCH: SW_EVENT\n");
-	TMSG(stderr, "  ");
-
-	if (type & PERF_SAMPLE_IDENTIFIER) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read IP");
-			return -1;
-		}
-		TMSG(stderr, "ID :%"PRIu64" ", val64);
-		sz -= sizeof(val64);
-	}
-
-	/*
-	 * the sample_type information is laid down
-	 * based on the PERF_RECORD_SAMPLE format specified
-	 * in the perf_event.h header file.
-	 * That order is different from the enum perf_event_sample_format.
-	 */
-	if (type & PERF_SAMPLE_IP) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read IP");
-			return -1;
-		}
-
-		/*
-		 * MISC_EXACT_IP indicates that kernel is returning
-		 * th  IIP of an instruction which caused the event, i.e.,
-		 * no skid
-		 */
-		TMSG(stderr, "IIP:%#016"PRIx64"  ", val64);
-		sz -= sizeof(val64);
-	}
+double overhead_budget = 0;
 
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(index, &pid, sizeof(pid));
-		if (ret) {
-			TMSG(stderr, "cannot read PID");
-			return -1;
-		}
+#define ADAPT_MS 100
 
-		TMSG(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
-
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read time");
-			return -1;
-		}
-
-		TMSG(stderr, "TIME:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(index, &cpu, sizeof(cpu));
-		if (ret) {
-			TMSG(stderr, "cannot read cpu");
-			return -1;
-		}
-		TMSG(stderr, "CPU:%u  ", cpu.cpu);
-		sz -= sizeof(cpu);
-	}
-
-	if (type & PERF_SAMPLE_PERIOD) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read period");
-			return -1;
-		}
-		TMSG(stderr, "PERIOD:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
+struct adapt_thread_s {
+	struct event_data_s *events;
+	int num_events;
+	volatile int running;
+};
 
-	if (type & PERF_SAMPLE_CALLCHAIN) {
-		uint64_t nr, ip;
+/*
+ * IP histogram (-H ip|page): the samples are counted by (event, IP), or
+ * by (event, IP, data page) with PERF_SAMPLE_ADDR, in a table of the
+ * thread that drains them, the SIGIO handler or a collector. With -T
+ * the top of every event is printed every that many ms while it runs,
+ * the full report comes at the end.
+ */
+int ip_histogram = 0;
+int histogram_by_page = 0;
+int top_ms = 0;
+struct perf_iphist_s iphist;
+
+#define HISTOGRAM_BUCKETS 4096
+#define HISTOGRAM_THREADS 64
+#define TOP_KEYS 5
+
+struct top_thread_s {
+	const char *const *names;
+	int num_events;
+	volatile int running;
+};
 
-		ret = read_from_perf_buffer_64(index, &nr);
-		if (ret) {
-			TMSG(stderr, "cannot read callchain nr");
-			return -1;
-		}
-		sz -= sizeof(nr);
-
-		TMSG(stderr, "\n  CALLCHAIN :\n");
-		while(nr--) {
-			ret = read_from_perf_buffer_64(index, &ip);
-			if (ret) {
-				TMSG(stderr, "cannot read ip");
-				return -1;
-			}
+/*
+ * Counting mode (-c): no sampling, every event is read once at the end
+ * with PERF_FORMAT_TOTAL_TIME_ENABLED|RUNNING. When there are more
+ * events than counters the kernel multiplexes them and each one only
+ * counts for a fraction of the time it is enabled, so the count is
+ * scaled by enabled/running and reported with its coverage,
+ * running/enabled.
+ *
+ * With -G the events are opened in groups of that many members, which
+ * the kernel schedules together, so ratios within a group (IPC, miss
+ * rates) are measured over the same cycles. With -r the groups are
+ * rotated by hand every that many ms, only one of them enabled at a
+ * time: a group then covers running/T of the run, T being the sum of
+ * the time every group was enabled.
+ */
+int counting = 0;
+int group_size = 0;
+int rotate_ms = 0;
+const char *count_events = NULL;
 
-			sz -= sizeof(ip);
+struct count_data_s {
+	struct event_counter_s event;
+	int fd;
+	int group;
+	uint64_t value;
+	uint64_t enabled;
+	uint64_t running;
+};
 
-			TMSG(stderr, "\t0x%"PRIx64"\n", ip);
-		}
-	}
+struct rotate_s {
+	struct count_data_s *counts;
+	int num_counts;
+	int num_groups;
+	volatile int running;
+	uint64_t rotations;
+};
 
-	return 0;
-}
 
-static int
-parse_perf_switch(int index, struct perf_event_header *ehdr)
+static long
+perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
+		int cpu, int group_fd, unsigned long flags)
 {
-	size_t sz;
-	uint64_t type, fmt, val64;
 	int ret;
-	struct { uint32_t pid, tid; } pid;
 
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = event_attr[index].sample_type;
-	fmt = event_attr[index].read_format;
+	ret = syscall(__NR_perf_event_open, hw_event, pid, cpu,
+			group_fd, flags);
+	return ret;
+}
 
-	if (ehdr->misc == PERF_RECORD_MISC_SWITCH_OUT) {
-		TMSG(stderr, "CONTEXT SWITCH: OUT\n");
-	} else {
-		TMSG(stderr, "CONTEXT SWITCH: IN\n");
-	}
 
-	TMSG(stderr, "  ");
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(index, &pid, sizeof(pid));
-		if (ret) {
-			TMSG(stderr, "cannot read PID");
-			return -1;
-		}
+static void
+handle_record(const struct perf_event_header *ehdr, void *arg)
+{
+	struct event_data_s *event = arg;
+	struct perf_sample_s sample;
+	int ret;
 
-		TMSG(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
+	event->samples++;
 
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read time");
-			return -1;
+	if (ehdr->type == PERF_RECORD_SAMPLE) {
+		ret = perf_sample_parse(&event->layout, ehdr, &sample);
+		if (ret == 0) {
+			event->periods += sample.v[PERF_SF_PERIOD];
+			if (ip_histogram)
+				perf_iphist_add(&iphist, event - event_data, sample.v[PERF_SF_IP],
+						sample.v[PERF_SF_ADDR], 1);
 		}
-
-		TMSG(stderr, "TIME:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(index, &cpu, sizeof(cpu));
-		if (ret) {
-			TMSG(stderr, "cannot read cpu");
-			return -1;
+		TMSG(stderr, "CONTEXT SWITCH: SW_EVENT\n");
+
+	} else if (ehdr->type == PERF_RECORD_SWITCH) {
+		ret = perf_sample_parse_id(&event->layout, ehdr, &sample);
+		if (ehdr->misc & PERF_RECORD_MISC_SWITCH_OUT) {
+			TMSG(stderr, "CONTEXT SWITCH: OUT\n");
+		} else {
+			TMSG(stderr, "CONTEXT SWITCH: IN\n");
 		}
-		TMSG(stderr, "CPU:%u\n", cpu.cpu);
-		sz -= sizeof(cpu);
+	} else {
+		/* Not the sample we are looking for */
+		return;
 	}
 
-	return 0;
+	if (ret == 0 && !quiet)
+		perf_sample_fprint(stderr, &event->layout, &sample);
 }
 
 static void
@@ -415,36 +293,9 @@ sigio_handler(int n, siginfo_t *info, void *uc)
 
 	TMSG(stderr, "%d. FD %d, SIGIO: %d\n", index, info->si_fd, event_data[index].samples);
 
-	struct perf_event_header ehdr;
-	int ret;
-
-	i = index;
-again:
-
-	ret = read_from_perf_buffer(i, &ehdr, sizeof(ehdr));
-	if (ret != 0) {
-		return;
-	}
-
-	event_data[i].samples++;
-
-	if (ehdr.type != PERF_RECORD_SAMPLE && ehdr.type != PERF_RECORD_SWITCH) {
-		/* Not the sample we are looking for */
-		//fprintf(stderr, "%d skipping record type %x of %d bytes\n", i, ehdr.type, ehdr.size);
-		skip_perf_data(index, ehdr.size);
-	}
-
-	if (ehdr.type == PERF_RECORD_SAMPLE) {
-		ret = parse_perf_sample(i, &ehdr);
-
-	} else if (ehdr.type == PERF_RECORD_SWITCH) {
-		ret = parse_perf_switch(i, &ehdr);
-	}
+	perf_ring_drain(&event_data[index].ring, handle_record, &event_data[index]);
 
-	if (is_more_perf_data(i))
-		goto again;
-
-	ret = ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
+	int ret = ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
 	if (ret == -1) {
 		fprintf(stderr, "fd %d: Error enable counter in IOC_REFRESH: %s\n",
 				info->si_fd, strerror(errno));
@@ -502,28 +353,41 @@ wait_loop(void)
 }
 
 
-static int
-setup_perf(struct event_counter_s *event, struct event_data_s *event_data)
+static void
+init_attr(struct perf_event_attr *attr, struct event_counter_s *event)
 {
-	static int index = 0;
+	memset(attr, 0, sizeof(struct perf_event_attr));
 
-	memset(&event_attr[index], 0, sizeof(struct perf_event_attr));
+	attr->disabled = 1;
+	attr->size     = sizeof(struct perf_event_attr);
+	attr->type     = event->type;
+	attr->config   = event->config;
 
-	event_attr[index].disabled = 1;
-	event_attr[index].size 	   = sizeof(struct perf_event_attr);
-	event_attr[index].type 	   = event->type;
-	event_attr[index].config   = event->config;
-
-	event_attr[index].sample_period = event->sample_period;
-	event_attr[index].freq 		= event->type;
+	attr->sample_period = event->sample_period;
+	attr->freq	    = event->freq;
 
 	/* PERF_SAMPLE_STACK_USER may also be good to use */
-	event_attr[index].sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+	attr->sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID |
 			PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_CPU |
 			PERF_SAMPLE_PERIOD;
 
-	event_attr[index].context_switch = 1;
-	event_attr[index].sample_id_all = 1;
+	if (histogram_by_page)
+		attr->sample_type |= PERF_SAMPLE_ADDR;
+
+	attr->context_switch = 1;
+	attr->sample_id_all = 1;
+
+	if (watermark)
+		perf_ring_watermark(attr, buffer_pages);
+}
+
+static int
+setup_perf(int index, struct event_counter_s *event, struct event_data_s *event_data)
+{
+	init_attr(&event_attr[index], event);
+
+	memset(event_data, 0, sizeof(*event_data));
+	event_data->fd = -1;
 
 	struct perf_event_attr *attr = &(event_attr[index]);
 	int fd = perf_event_open(attr, 0, -1, -1, 0);
@@ -532,26 +396,29 @@ setup_perf(struct event_counter_s *event, struct event_data_s *event_data)
 		return -1;
 	}
 
-	size_t pagesize = sysconf(_SC_PAGESIZE);
-	void *buf = mmap(NULL, (buffer_pages + 1) * pagesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (buf == MAP_FAILED) {
-		fprintf(stderr, "Can't mmap buffer\n");
+	if (perf_ring_open(&event_data->ring, fd, buffer_pages))
 		return -1;
-	}
-	event_data->event_buff = buf;
+
+	perf_sample_layout_init(&event_data->layout, attr);
 	event_data->fd 		   = fd;
 	event_data->samples    = 0;
 
 	printf("setup %d: %s, code: %d, type: %d, thresh: %d, freq: %d, fd: %d.\n",
 			index, event->name, event->config, event->type, event->sample_period, event->freq,
 			 event_data->fd);
-	index++;
-	return index;
+	return index + 1;
 }
 
 static int
 setup_notification(int index)
 {
+	if (event_data[index].fd < 0)
+		return -1;
+
+	/* drained by the collector thread, no signal */
+	if (watermark)
+		return ioctl(event_data[index].fd, PERF_EVENT_IOC_ENABLE, 0);
+
 	/*
 	 * Setup notification on the file descriptor
 	 */
@@ -586,29 +453,181 @@ setup_notification(int index)
 static int
 disable_counter(int index)
 {
+	if (event_data[index].fd < 0)
+		return -1;
+
 	/* Disable the event counter */
 	int ret = ioctl(event_data[index].fd, PERF_EVENT_IOC_DISABLE, 1);
 	if (ret == -1) {
 		fprintf(stderr, "%d: Error in IOC_DISABLE: %s\n", index, strerror(errno));
 		return -1;
 	}
+
+	/* whatever is left below the watermark */
+	perf_ring_drain(&event_data[index].ring, handle_record, &event_data[index]);
+
 	close(event_data[index].fd);
 	return 0;
 }
 
+static void *
+adapt_thread(void *arg)
+{
+	struct adapt_thread_s *at = arg;
+	struct timespec ts = { 0, ADAPT_MS * 1000000L };
+
+	while (at->running) {
+		nanosleep(&ts, NULL);
+		for(int i=0; i<at->num_events; i++) {
+			if (at->events[i].adaptive)
+				perf_adapt_update(&at->events[i].adapt, &at->events[i].ring.stats);
+		}
+	}
+	return NULL;
+}
+
+static void *
+top_thread(void *arg)
+{
+	struct top_thread_s *tt = arg;
+	struct timespec ts = { top_ms / 1000, (top_ms % 1000) * 1000000L };
+
+	while (tt->running) {
+		nanosleep(&ts, NULL);
+		perf_iphist_report(&iphist, stdout, TOP_KEYS, tt->names, tt->num_events, NULL, NULL);
+	}
+	return NULL;
+}
+
+static const char *
+iphist_label(uint64_t ip, void *arg)
+{
+	static char buf[256];
+	const struct perf_frame_s *f = perf_symtab_resolve(arg, ip);
+
+	if (f->sym)
+		snprintf(buf, sizeof(buf), "%s+%#"PRIx64, f->sym, f->off);
+	else if (f->dso)
+		snprintf(buf, sizeof(buf), "%s+%#"PRIx64, f->dso, f->off);
+	else
+		return NULL;
+	return buf;
+}
+
+/*
+ * The histogram of a run, and the thread of its live top. Returns 1 if
+ * the thread is started.
+ */
+static int
+start_histogram(pthread_t *tid, struct top_thread_s *tt)
+{
+	if (perf_iphist_init(&iphist, HISTOGRAM_BUCKETS, HISTOGRAM_THREADS, histogram_by_page)) {
+		ip_histogram = 0;
+		return 0;
+	}
+	return top_ms > 0 && pthread_create(tid, NULL, top_thread, tt) == 0;
+}
+
+static void
+print_histogram(const char *const *names, int num_events)
+{
+	struct perf_symtab_s symtab;
+	int have_symtab = perf_symtab_init(&symtab, 0) == 0;
+
+	perf_iphist_report(&iphist, stdout, 20, names, num_events,
+			   have_symtab ? iphist_label : NULL, &symtab);
+	if (have_symtab)
+		perf_symtab_fini(&symtab);
+	perf_iphist_fini(&iphist);
+}
+
+/* share the budget between the period-based events */
+static int
+setup_adapt(struct event_counter_s *event, unsigned int num_events)
+{
+	int n = 0;
+
+	for(int i=0; i<num_events; i++) {
+		if (event_data[i].fd >= 0 && !event[i].freq)
+			n++;
+	}
+	for(int i=0; i<num_events; i++) {
+		if (event_data[i].fd < 0 || event[i].freq)
+			continue;
+		if (perf_adapt_init(&event_data[i].adapt, event_data[i].fd,
+				    event[i].sample_period, overhead_budget / 100 / n) == 0)
+			event_data[i].adaptive = 1;
+	}
+	return n;
+}
+
+/*
+ * The samples the kernel dropped are worth the average period of the
+ * ones that made it.
+ */
+static void
+print_estimate(struct event_data_s *ed)
+{
+	const struct perf_ring_stats_s *stats = &ed->ring.stats;
+
+	printf("    estimated count %"PRIu64, ed->periods);
+	if (stats->lost && stats->samples)
+		printf(" + %.0f lost", (double) ed->periods / stats->samples * stats->lost);
+	if (ed->adaptive)
+		printf(", period %"PRIu64" after %"PRIu64" changes (%.2f%% overhead last window)",
+		       ed->adapt.period, ed->adapt.changes, ed->adapt.overhead * 100);
+	printf("\n");
+}
+
 static void
 main_test(struct event_counter_s *event, unsigned int num_events)
 {
 	event_data = (struct event_data_s*)    malloc(sizeof(struct event_data_s)   * num_events);
 	event_attr = (struct perf_event_attr*) malloc(sizeof(struct perf_event_attr)* num_events);
 
-	size_t pagesize = sysconf(_SC_PAGESIZE);
-	size_t pgmsk = (buffer_pages * pagesize) - 1;
-	event_pgmsk  = pgmsk;
+	struct timespec start, end;
+	sigset_t sigio;
+
+	struct adapt_thread_s at = { event_data, num_events, 1 };
+	pthread_t adapt_tid;
+	int adapting = 0;
+
+	const char *names[num_events];
+	struct top_thread_s tt = { names, num_events, 1 };
+	pthread_t top_tid;
+	int topping = 0;
+
+	sigemptyset(&sigio);
+	sigaddset(&sigio, SIGIO);
 
 	// setup all the event counters
 	for(int i=0; i<num_events; i++) {
-		setup_perf(&event[i], &event_data[i]);
+		setup_perf(i, &event[i], &event_data[i]);
+	}
+
+	if (overhead_budget > 0 && setup_adapt(event, num_events) > 0) {
+		/* the thread must not take the SIGIOs of the main one */
+		sigprocmask(SIG_BLOCK, &sigio, NULL);
+		adapting = pthread_create(&adapt_tid, NULL, adapt_thread, &at) == 0;
+		sigprocmask(SIG_UNBLOCK, &sigio, NULL);
+	}
+
+	if (ip_histogram) {
+		for(int i=0; i<num_events; i++)
+			names[i] = event[i].name;
+		sigprocmask(SIG_BLOCK, &sigio, NULL);
+		topping = start_histogram(&top_tid, &tt);
+		sigprocmask(SIG_UNBLOCK, &sigio, NULL);
+	}
+
+	if (watermark) {
+		perf_collector_init(&collector);
+		for(int i=0; i<num_events; i++) {
+			if (event_data[i].fd >= 0)
+				perf_collector_add(&collector, event_data[i].fd, &event_data[i].ring,
+						   handle_record, &event_data[i]);
+		}
+		perf_collector_start(&collector);
 	}
 
 	// start the event
@@ -617,28 +636,577 @@ main_test(struct event_counter_s *event, unsigned int num_events)
 	}
 
 	// computation or waiting loop
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	wait_loop();
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-	// stop the counter
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+	if (adapting) {
+		at.running = 0;
+		pthread_join(adapt_tid, NULL);
+	}
+	if (topping) {
+		tt.running = 0;
+		pthread_join(top_tid, NULL);
+	}
+
+	if (watermark)
+		perf_collector_stop(&collector);
+
+	// stop the counter, with SIGIO blocked so the final drain is ours
+	sigprocmask(SIG_BLOCK, &sigio, NULL);
 	for(int i=0; i<num_events; i++) {
+		struct perf_ring_stats_s *stats = &event_data[i].ring.stats;
+
 		disable_counter(i);
 		printf("total samples for %s: %d\n", event[i].name, event_data[i].samples);
+		printf("    %"PRIu64" samples in %"PRIu64" wakeups, %.0f samples/sec, "
+		       "handler %.3f ms (%.2f%% overhead)\n",
+		       stats->samples, stats->wakeups, stats->samples / elapsed,
+		       stats->drain_ns * 1e-6, stats->drain_ns * 1e-7 / elapsed);
+		print_estimate(&event_data[i]);
+		perf_ring_report(stdout, "    ring", stats);
+		perf_ring_close(&event_data[i].ring);
 	}
+	sigprocmask(SIG_UNBLOCK, &sigio, NULL);
+
+	if (watermark) {
+		printf("collector thread cpu time: %.3f ms (%.2f%% overhead)\n",
+		       collector.cpu_ns * 1e-6, collector.cpu_ns * 1e-7 / elapsed);
+		perf_collector_fini(&collector);
+	}
+	if (ip_histogram)
+		print_histogram(names, num_events);
 	free(event_data);
 	free(event_attr);
 }
 
+static void
+handle_cpu_record(const struct perf_event_header *ehdr, void *arg)
+{
+	struct cpu_data_s *cd = arg;
+	struct perf_sample_s sample;
+	int ret;
+
+	if (ehdr->type == PERF_RECORD_SAMPLE)
+		ret = perf_sample_parse(&cpu_layout, ehdr, &sample);
+	else if (ehdr->type == PERF_RECORD_SWITCH ||
+		 ehdr->type == PERF_RECORD_SWITCH_CPU_WIDE)
+		ret = perf_sample_parse_id(&cpu_layout, ehdr, &sample);
+	else
+		return;
+
+	if (ret)
+		return;
+
+	for(int e=0; e<cd->num_events; e++) {
+		if (cd->fd[e] >= 0 && cd->id[e] == sample.v[PERF_SF_IDENTIFIER]) {
+			cd->samples[e]++;
+			if (ip_histogram && ehdr->type == PERF_RECORD_SAMPLE)
+				perf_iphist_add(&iphist, e, sample.v[PERF_SF_IP],
+						sample.v[PERF_SF_ADDR], 1);
+			break;
+		}
+	}
+
+	if (!quiet)
+		perf_sample_fprint(stderr, &cpu_layout, &sample);
+}
+
+/* 128 cpus times 8 events is already past the usual soft limit */
+static void
+raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static void
+main_test_system(struct event_counter_s *event, unsigned int num_events)
+{
+	int num_cpus  = sysconf(_SC_NPROCESSORS_CONF);
+	int *cpu_node = malloc(sizeof(int) * num_cpus);
+	int num_nodes = perf_numa_nodes(cpu_node, num_cpus);
+
+	struct cpu_data_s *cpus = calloc(num_cpus, sizeof(struct cpu_data_s));
+	struct perf_collector_s *collectors = calloc(num_nodes, sizeof(struct perf_collector_s));
+	cpu_set_t *node_cpus = calloc(num_nodes, sizeof(cpu_set_t));
+	int *warned = calloc(num_events, sizeof(int));
+	struct perf_event_attr attr;
+	struct timespec start, end;
+
+	const char *names[num_events];
+	struct top_thread_s tt = { names, num_events, 1 };
+	pthread_t top_tid;
+	int topping = 0;
+
+	/* all the events share the same sample_type */
+	init_attr(&attr, &event[0]);
+	attr.sample_type |= PERF_SAMPLE_IDENTIFIER;
+	perf_sample_layout_init(&cpu_layout, &attr);
+
+	for(int n=0; n<num_nodes; n++)
+		perf_collector_init(&collectors[n]);
+
+	if (ip_histogram) {
+		for(int e=0; e<num_events; e++)
+			names[e] = event[e].name;
+		topping = start_histogram(&top_tid, &tt);
+	}
+
+	for(int cpu=0; cpu<num_cpus; cpu++) {
+		struct cpu_data_s *cd = &cpus[cpu];
+		int leader = -1;
+
+		cd->cpu	       = cpu;
+		cd->node       = cpu_node[cpu];
+		cd->num_events = num_events;
+		cd->fd	       = malloc(sizeof(int) * num_events);
+		cd->id	       = calloc(num_events, sizeof(uint64_t));
+		cd->samples    = calloc(num_events, sizeof(unsigned int));
+
+		for(int e=0; e<num_events; e++) {
+			init_attr(&attr, &event[e]);
+			attr.sample_type |= PERF_SAMPLE_IDENTIFIER;
+
+			int fd = perf_event_open(&attr, -1, cpu, -1, 0);
+			cd->fd[e] = fd;
+			if (fd == -1) {
+				if (errno == ENODEV) {
+					/* offline cpu */
+					for(; e<num_events; e++)
+						cd->fd[e] = -1;
+					break;
+				}
+				if (!warned[e]++)
+					fprintf(stderr, "Error in perf_event_open for %s on cpu %d: %s\n",
+						event[e].name, cpu, strerror(errno));
+				continue;
+			}
+			ioctl(fd, PERF_EVENT_IOC_ID, &cd->id[e]);
+
+			if (leader < 0) {
+				if (perf_ring_open(&cd->ring, fd, buffer_pages) == 0) {
+					leader = fd;
+					continue;
+				}
+			} else if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, leader) == 0) {
+				continue;
+			}
+			fprintf(stderr, "cpu %d: cannot set the output of %s: %s\n",
+				cpu, event[e].name, strerror(errno));
+			close(fd);
+			cd->fd[e] = -1;
+		}
+
+		if (leader < 0)
+			continue;
+
+		perf_collector_add(&collectors[cd->node], leader, &cd->ring,
+				   handle_cpu_record, cd);
+		CPU_SET(cpu, &node_cpus[cd->node]);
+	}
+
+	for(int n=0; n<num_nodes; n++) {
+		if (collectors[n].nentries == 0)
+			continue;
+		perf_collector_bind(&collectors[n], &node_cpus[n]);
+		perf_collector_start(&collectors[n]);
+		printf("node %d: draining %d cpus\n", n, collectors[n].nentries);
+	}
+
+	for(int cpu=0; cpu<num_cpus; cpu++) {
+		for(int e=0; e<num_events; e++) {
+			if (cpus[cpu].fd[e] >= 0)
+				ioctl(cpus[cpu].fd[e], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	// computation or waiting loop
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wait_loop();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+	for(int cpu=0; cpu<num_cpus; cpu++) {
+		for(int e=0; e<num_events; e++) {
+			if (cpus[cpu].fd[e] >= 0)
+				ioctl(cpus[cpu].fd[e], PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+
+	if (topping) {
+		tt.running = 0;
+		pthread_join(top_tid, NULL);
+	}
+
+	// the collectors drain what is left before exiting
+	for(int n=0; n<num_nodes; n++) {
+		if (collectors[n].nentries == 0)
+			continue;
+		perf_collector_stop(&collectors[n]);
+		printf("node %d: collector thread cpu time: %.3f ms (%.2f%% overhead)\n",
+		       n, collectors[n].cpu_ns * 1e-6, collectors[n].cpu_ns * 1e-7 / elapsed);
+		perf_collector_fini(&collectors[n]);
+	}
+
+	for(int e=0; e<num_events; e++) {
+		unsigned int total = 0;
+
+		for(int cpu=0; cpu<num_cpus; cpu++)
+			total += cpus[cpu].samples[e];
+		printf("total samples for %s: %d\n", event[e].name, total);
+	}
+
+	struct perf_ring_stats_s sum;
+	uint64_t wakeups = 0, records = 0;
+
+	memset(&sum, 0, sizeof(sum));
+	for(int cpu=0; cpu<num_cpus; cpu++) {
+		struct cpu_data_s *cd = &cpus[cpu];
+
+		wakeups += cd->ring.stats.wakeups;
+		records += cd->ring.stats.records;
+		perf_ring_stats_add(&sum, &cd->ring.stats);
+
+		for(int e=0; e<num_events; e++) {
+			if (cd->fd[e] >= 0)
+				close(cd->fd[e]);
+		}
+		if (cd->ring.hdr)
+			perf_ring_close(&cd->ring);
+
+		free(cd->fd);
+		free(cd->id);
+		free(cd->samples);
+	}
+	printf("%"PRIu64" records in %"PRIu64" wakeups, %.0f records/sec\n",
+	       records, wakeups, records / elapsed);
+	perf_ring_report(stdout, "all cpus", &sum);
+	if (ip_histogram)
+		print_histogram(names, num_events);
+
+	free(warned);
+	free(node_cpus);
+	free(collectors);
+	free(cpus);
+	free(cpu_node);
+}
+
+/* the leader of each group is the first event with that group number */
+static int
+group_leader(struct count_data_s *counts, int num_counts, int group)
+{
+	for(int i=0; i<num_counts; i++) {
+		if (counts[i].group == group && counts[i].fd >= 0)
+			return counts[i].fd;
+	}
+	return -1;
+}
+
+static void *
+rotate_thread(void *arg)
+{
+	struct rotate_s *r = arg;
+	struct timespec ts = { rotate_ms / 1000, (rotate_ms % 1000) * 1000000L };
+	int cur = 0;
+
+	while (r->running) {
+		nanosleep(&ts, NULL);
+
+		int next = (cur + 1) % r->num_groups;
+		if (next == cur)
+			continue;
+
+		int fd = group_leader(r->counts, r->num_counts, cur);
+		if (fd >= 0)
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		fd = group_leader(r->counts, r->num_counts, next);
+		if (fd >= 0)
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		cur = next;
+		r->rotations++;
+	}
+	return NULL;
+}
+
+/*
+ * Events from a comma separated list of names, or the sampling table
+ * when there is none.
+ */
+static int
+parse_count_events(struct count_data_s **counts)
+{
+	if (count_events == NULL) {
+		*counts = calloc(num_events, sizeof(struct count_data_s));
+		for(int i=0; i<num_events; i++)
+			(*counts)[i].event = events_period[i];
+		return num_events;
+	}
+
+	char *list = strdup(count_events), *name, *save;
+	int n = 1;
+
+	for(const char *p = count_events; *p; p++)
+		n += (*p == ',');
+	*counts = calloc(n, sizeof(struct count_data_s));
+	n = 0;
+
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		if (perf_region_event(name, &attr)) {
+			free(list);
+			free(*counts);
+			return -1;
+		}
+		(*counts)[n].event.name	  = strdup(name);
+		(*counts)[n].event.type	  = attr.type;
+		(*counts)[n].event.config = attr.config;
+		n++;
+	}
+	free(list);
+	return n;
+}
+
+static void
+main_count(void)
+{
+	struct count_data_s *counts;
+	struct rotate_s rotate;
+	struct timespec start, end;
+	pthread_t thread;
+	int num_counts, num_groups = 0;
+
+	num_counts = parse_count_events(&counts);
+	if (num_counts <= 0)
+		return;
+
+	for(int i=0; i<num_counts; i++) {
+		struct count_data_s *cd = &counts[i];
+		struct perf_event_attr attr;
+
+		cd->group = group_size ? i / group_size : i;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size	 = sizeof(attr);
+		attr.type	 = cd->event.type;
+		attr.config	 = cd->event.config;
+		attr.exclude_hv	 = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		/* only the leaders are enabled, the members follow them */
+		int leader = group_size ? group_leader(counts, i, cd->group) : -1;
+		attr.disabled = (leader < 0);
+
+		cd->fd = perf_event_open(&attr, 0, -1, leader, 0);
+		if (cd->fd == -1 && errno == EACCES) {
+			attr.exclude_kernel = 1;
+			cd->fd = perf_event_open(&attr, 0, -1, leader, 0);
+		}
+		if (cd->fd == -1)
+			fprintf(stderr, "Error in perf_event_open for %s: %s\n",
+				cd->event.name, strerror(errno));
+		if (cd->group + 1 > num_groups)
+			num_groups = cd->group + 1;
+	}
+
+	/* without a rotation the kernel does the multiplexing */
+	for(int g=0; g<num_groups; g++) {
+		int fd = group_leader(counts, num_counts, g);
+		if (fd >= 0 && (g == 0 || rotate_ms == 0))
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	rotate.counts	  = counts;
+	rotate.num_counts = num_counts;
+	rotate.num_groups = num_groups;
+	rotate.running	  = 1;
+	rotate.rotations  = 0;
+	if (rotate_ms)
+		pthread_create(&thread, NULL, rotate_thread, &rotate);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wait_loop();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (rotate_ms) {
+		rotate.running = 0;
+		pthread_join(thread, NULL);
+	}
+
+	for(int i=0; i<num_counts; i++) {
+		struct count_data_s *cd = &counts[i];
+		uint64_t buf[3];
+
+		if (cd->fd < 0)
+			continue;
+		ioctl(cd->fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(cd->fd, buf, sizeof(buf)) == sizeof(buf)) {
+			cd->value   = buf[0];
+			cd->enabled = buf[1];
+			cd->running = buf[2];
+		}
+		close(cd->fd);
+	}
+
+	/* T: the time some group was enabled */
+	uint64_t total_enabled = 0;
+	for(int g=0; g<num_groups; g++) {
+		for(int i=0; i<num_counts; i++) {
+			if (counts[i].group == g && counts[i].fd >= 0) {
+				total_enabled += counts[i].enabled;
+				break;
+			}
+		}
+	}
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+	printf("%d events in %d groups, %.3f s", num_counts, num_groups, elapsed);
+	if (rotate_ms)
+		printf(", %"PRIu64" rotations every %d ms", rotate.rotations, rotate_ms);
+	printf("\n\n%20s %20s %20s %9s\n", "event", "count", "scaled", "coverage");
+
+	for(int i=0; i<num_counts; i++) {
+		struct count_data_s *cd = &counts[i];
+		uint64_t t = rotate_ms ? total_enabled : cd->enabled;
+
+		if (cd->fd < 0) {
+			printf("%20s %20s\n", cd->event.name, "<not supported>");
+			continue;
+		}
+		if (cd->running == 0) {
+			printf("%20s %20s\n", cd->event.name, "<not counted>");
+			continue;
+		}
+		printf("%20s %20"PRIu64" %20.0f %8.2f%%%s\n", cd->event.name, cd->value,
+		       (double) cd->value * t / cd->running, 100.0 * cd->running / t,
+		       cd->running < t / 10 ? "  (low confidence)" : "");
+	}
+
+	if (count_events) {
+		for(int i=0; i<num_counts; i++)
+			free((char *) counts[i].event.name);
+	}
+	free(counts);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b buffer_pages] [-w] [-a] [-o budget]\n"
+			"       [-H ip|page [-T ms]] [-c [-e events] [-G size] [-r ms]]\n"
+			"  -b  ring buffer size in pages (power of 2)\n"
+			"  -w  watermark drain mode: free-running counters drained\n"
+			"      by a collector thread once per half buffer instead of\n"
+			"      one SIGIO + IOC_REFRESH per sample\n"
+			"  -a  system-wide: one ring per cpu, one collector per\n"
+			"      NUMA node (implies -w)\n"
+			"  -o  adapt the period of the period-based events to\n"
+			"      keep the sampling overhead under budget percent\n"
+			"  -H  count the samples by event and IP, or by event, IP\n"
+			"      and data page, in per-thread tables\n"
+			"  -T  print the top of the histogram every that many ms\n"
+			"  -c  counting mode: read every event once, scaled by\n"
+			"      time_enabled/time_running when multiplexed\n"
+			"  -e  comma separated events to count (default: all of\n"
+			"      the sampling table)\n"
+			"  -G  open the events in groups of that many members\n"
+			"  -r  rotate the groups every that many ms, one at a time\n", prog);
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
 	struct sigaction act;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:wace:G:r:o:H:T:")) != -1) {
+		switch (opt) {
+		case 'b':
+			buffer_pages = atoi(optarg);
+			if (buffer_pages <= 0 || (buffer_pages & (buffer_pages - 1)))
+				usage(argv[0]);
+			break;
+		case 'w':
+			watermark = 1;
+			break;
+		case 'a':
+			system_wide = 1;
+			watermark   = 1;
+			break;
+		case 'c':
+			counting = 1;
+			break;
+		case 'e':
+			count_events = optarg;
+			break;
+		case 'G':
+			group_size = atoi(optarg);
+			if (group_size <= 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			rotate_ms = atoi(optarg);
+			if (rotate_ms <= 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			overhead_budget = atof(optarg);
+			if (overhead_budget <= 0 || overhead_budget >= 100)
+				usage(argv[0]);
+			break;
+		case 'H':
+			ip_histogram = 1;
+			if (strcmp(optarg, "page") == 0)
+				histogram_by_page = 1;
+			else if (strcmp(optarg, "ip") != 0)
+				usage(argv[0]);
+			break;
+		case 'T':
+			top_ms = atoi(optarg);
+			if (top_ms <= 0)
+				usage(argv[0]);
+			ip_histogram = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
 
 	memset(&act, 0, sizeof(act));
 	act.sa_sigaction = sigio_handler;
 	act.sa_flags     = SA_SIGINFO;
 	sigaction(SIGIO, &act, 0);
 
-	printf("Testing with frequency sampling\n");
 	const unsigned int num_events = sizeof(events_freq)/sizeof(struct event_counter_s);
+
+	if (counting) {
+		printf("Testing with counting\n");
+		main_count();
+		return 0;
+	}
+
+	if (system_wide) {
+		raise_fd_limit();
+
+		printf("Testing system-wide with frequency sampling\n");
+		main_test_system(events_freq, num_events);
+
+		printf("\n\nTesting system-wide with period sampling\n");
+		main_test_system(events_period, num_events);
+		return 0;
+	}
+
+	printf("Testing with frequency sampling\n");
 	main_test(events_freq, num_events);
 
 	printf("\n\nTesting with period sampling\n");
@@ -24,6 +24,8 @@
 #include <asm/unistd.h>
 #include <time.h>
 
+#include "perf_ring.h"
+
 /* How many signals do we want? */
 #define NR_COUNT 10
 
@@ -31,10 +33,10 @@
 int buffer_pages = 1;
 
 int event_fd = -1;
-size_t event_pgmsk;
-void *event_buf = NULL;
+struct perf_ring_s event_ring;
 
 struct perf_event_attr event_attr;
+struct perf_sample_layout_s event_layout;
 /* = { .type = 1, .size = 96, .config = 3, 
 {.sample_period = 1, .sample_freq = 1}, .sample_type = 39, 
 .read_format = 0, .disabled = 1, .inherit = 0, .pinned = 0, 
@@ -58,209 +60,6 @@ long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 	return ret;
 }
 
-/*
- * event_buf already has the mmap'ed address for perf buffer,
- * So, go ahead and read the data.
- *
- * The payload data (event data) starts after the first page of control
- * information.
- */
-static int read_from_perf_buffer(void *buf, size_t sz)
-{
-	struct perf_event_mmap_page *header = event_buf;
-	size_t pgmsk = event_pgmsk;
-	void *data;
-	unsigned long tail;
-	size_t avail_sz, min, c;
-
-	/*
-	 * data points to beginning of buffer payload
-	 */
-	data = ((void *)header) + sysconf(_SC_PAGESIZE);
-
-	/*
-	 * position of tail within the buffer payload.
-	 */
-	tail = header->data_tail & pgmsk;
-
-	/*
-	 * Size of available data.
-	 */
-	avail_sz = header->data_head - header->data_tail;
-	if (sz > avail_sz) {
-		fprintf(stderr, "Needed size is more than available size\n");
-		return -1;
-	}
-
-	/*
-	 * c = size till the end of buffer
-	 *
-	 * buffer size is a power of two.
-	 */
-	c = pgmsk + 1 - tail;
-
-	/*
-	 * min with requested size.
-	 */
-	min = c < sz ? c : sz;
-
-	/* copy beginning */
-	memcpy(buf, data + tail, min);
-
-	/* copy wrapped around leftover */
-	if (sz > min)
-		memcpy(buf + min, data, sz - min);
-
-	/* header->data_tail should reflect the last read data */
-	header->data_tail += sz;
-
-	return 0;
-}
-
-static int read_from_perf_buffer_64(void *buf)
-{
-	return read_from_perf_buffer(buf, sizeof(uint64_t));
-}
-
-/*
- * Not the data we need? Skip the data.
- */
-static void skip_perf_data(size_t sz)
-{
-	struct perf_event_mmap_page *hdr = event_buf;
-
-	if ((hdr->data_tail + sz) > hdr->data_head)
-		sz = hdr->data_head - hdr->data_tail;
-
-	hdr->data_tail += sz;
-}
-
-/*
- * The below parser is a stripped down version of perf source. To keep it
- * simple, it only looks for PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_CALLCHAIN,
- * PERF_SAMPLE_IP, PERF_SAMPLE_RAW and PERF_SAMPLE_TIME.
- * More parsers can be added if needed.
- */
-static int parse_perf_sample(struct perf_event_header *ehdr)
-{
-	size_t sz;
-	uint64_t type, fmt, val64;
-	uint64_t time_enabled, time_running;
-	const char *str;
-	int ret;
-	uint64_t value;
-	uint64_t id;
-	struct { uint32_t pid, tid; } pid;
-	
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = event_attr.sample_type;
-	fmt = event_attr.read_format;
-
-	if (type & PERF_SAMPLE_IDENTIFIER) {
-		ret = read_from_perf_buffer_64(&val64);
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-		fprintf(stderr, "ID :%"PRIu64" ", val64);
-		sz -= sizeof(val64);
-	}
-
-	/*
-	 * the sample_type information is laid down
-	 * based on the PERF_RECORD_SAMPLE format specified
-	 * in the perf_event.h header file.
-	 * That order is different from the enum perf_event_sample_format.
-	 */
-	if (type & PERF_SAMPLE_IP) {
-		ret = read_from_perf_buffer_64(&val64);
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-
-		/*
-		 * MISC_EXACT_IP indicates that kernel is returning
-		 * th  IIP of an instruction which caused the event, i.e.,
-		 * no skid
-		 */
-		fprintf(stderr, "IIP:%#016"PRIx64, val64);
-		sz -= sizeof(val64);
-	}
-	
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(&pid, sizeof(pid));
-		if (ret) {
-			fprintf(stderr, "cannot read PID");
-			return -1;
-		}
-
-		fprintf(stderr, "  PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
-
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(&val64);
-		if (ret) {
-			fprintf(stderr, "cannot read time");
-			return -1;
-		}
-
-		fprintf(stderr, "TIME:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(&cpu, sizeof(cpu));
-		if (ret) {
-			fprintf(stderr, "cannot read cpu");
-			return -1;
-		}
-		fprintf(stderr, " CPU:%u  ", cpu.cpu);
-		sz -= sizeof(cpu);
-	}
-
-	if (type & PERF_SAMPLE_PERIOD) {
-		ret = read_from_perf_buffer_64(&val64);
-		if (ret) {
-			fprintf(stderr, "cannot read period");
-			return -1;
-		}
-		fprintf(stderr, " PERIOD:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_CALLCHAIN) {
-		uint64_t nr, ip;
-
-		ret = read_from_perf_buffer_64(&nr);
-		if (ret) {
-			fprintf(stderr, "cannot read callchain nr");
-			return -1;
-		}
-		sz -= sizeof(nr);
-
-		fprintf(stderr, "\nCALLCHAIN :\n");
-		while(nr--) {
-			ret = read_from_perf_buffer_64(&ip);
-			if (ret) {
-				fprintf(stderr, "cannot read ip");
-				return -1;
-			}
-
-			sz -= sizeof(ip);
-
-			fprintf(stderr, "\t0x%"PRIx64"\n", ip);
-		}
-	}
-
-	return 0;
-}
-
 void display_current_time(void)
 {
   struct timespec ts;
@@ -272,7 +71,8 @@ void display_current_time(void)
 
 static void sigio_handler(int n, siginfo_t *info, void *uc)
 {
-	struct perf_event_header ehdr;
+	const struct perf_event_header *ehdr;
+	struct perf_sample_s sample;
 	int ret;
 
 	/*
@@ -298,26 +98,24 @@ static void sigio_handler(int n, siginfo_t *info, void *uc)
 		return;
 	}
 
-	ret = read_from_perf_buffer(&ehdr, sizeof(ehdr));
-	if (ret) {
-		fprintf(stderr, "cannot read event header\n");
-		return;
-	}
+	perf_ring_begin(&event_ring);
+	while ((ehdr = perf_ring_next(&event_ring)) != NULL) {
+		if (ehdr->type != PERF_RECORD_SAMPLE) {
+			/* Not the sample we are looking for */
+			continue;
+		}
 
-	if (ehdr.type != PERF_RECORD_SAMPLE) {
-		/* Not the sample we are looking for */
-		skip_perf_data(ehdr.size);
-		goto skip;
-	}
+		fprintf(stderr, "\nNumber : %lu\n", nr_count);
 
-	fprintf(stderr, "\nNumber : %lu\n", nr_count);
+		display_current_time();
 
-	display_current_time();
-	
-	ret = parse_perf_sample(&ehdr);
+		if (perf_sample_parse(&event_layout, ehdr, &sample) == 0)
+			perf_sample_fprint(stderr, &event_layout, &sample);
+
+		nr_count++;
+	}
+	perf_ring_end(&event_ring);
 
-	nr_count++;
-skip:
 	/*
 	 * refresh the counter again
 	 */
@@ -337,14 +135,9 @@ void wait_loop(void)
 int main(int argc, char *argv[])
 {
 	struct sigaction act;
-	size_t pagesize;
 	int ret;
 	int fd;
-	void *buf;
-	size_t pgmsk;
 	
-	pagesize = sysconf(_SC_PAGESIZE);
-
 	/*
 	 * Register the sig handler (SIGIO)
 	 */
@@ -395,21 +188,14 @@ int main(int argc, char *argv[])
 	event_fd = fd;
 
 	/*
-	 * map the perf buffer with buf here. But, there wouldn't be any data at this
+	 * map the perf buffer here. But, there wouldn't be any data at this
 	 * point. So, put the parsing logic for the buffer in signal handler, since
 	 * that will called once an event occurs.
 	 */
-	buf = mmap(NULL, (buffer_pages + 1) * pagesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (buf == MAP_FAILED) {
-		fprintf(stderr, "Can't mmap buffer\n");
+	if (perf_ring_open(&event_ring, fd, buffer_pages))
 		return -1;
-	}
-
-	pgmsk = (buffer_pages * pagesize) - 1;
 
-	/* We will need these two things in the signal handler */
-	event_buf = buf;
-	event_pgmsk = pgmsk;
+	perf_sample_layout_init(&event_layout, &event_attr);
 
 	/*
 	 * Setup notification on the file descriptor
@@ -452,6 +238,8 @@ int main(int argc, char *argv[])
 
 	/* That's it, done. Close the fd */
 	close(fd);
+	perf_ring_report(stdout, "ring", &event_ring.stats);
+	perf_ring_close(&event_ring);
 
 	return 0;
 }
@@ -8,6 +8,12 @@
  * time stamp. The difference between the current time stamp (obtained from the
  * signal handler) and the event time stamp gives us the approximate off-cpu
  * time.
+ *
+ * The OpenMP workers of the child are followed with inherit. The kernel
+ * refuses to mmap an inherited per-task (cpu == -1) event, so the child
+ * is monitored with one inherited event and ring per CPU instead: every
+ * worker thread ends up in the ring of the CPU it runs on, and the
+ * records are attributed per thread with their TID.
  */
 
 #define _GNU_SOURCE
@@ -30,21 +36,52 @@
 #include <sched.h>
 #include <sys/wait.h>
 
+#include "perf_ring.h"
+
 /* How many signals do we want? */
 #define NR_COUNT 40
 
 /* Size of buffer data (must be power of 2 */
 int buffer_pages = 1;
 
-int event_fd = -1;
-size_t event_pgmsk;
-void *event_buf = NULL;
+#define MAX_THREADS 256
+
+/* one event and ring per CPU */
+int num_cpus;
+int *event_fd;
+struct perf_ring_s *event_ring;
+
+struct thread_stat_s {
+	pid_t tid;
+	unsigned long samples;
+	unsigned long switch_in;
+	unsigned long switch_out;
+};
+
+/* written from the signal handler only */
+static struct thread_stat_s thread_stats[MAX_THREADS];
+static int num_thread_stats;
 
 struct perf_event_attr event_attr;
+struct perf_sample_layout_s event_layout;
 
 /* This will keep track of the no. of signals delivered */
 static unsigned long nr_count = 0;
 
+static struct thread_stat_s *
+get_thread_stat(pid_t tid)
+{
+	for (int i = 0; i < num_thread_stats; i++) {
+		if (thread_stats[i].tid == tid)
+			return &thread_stats[i];
+	}
+	if (num_thread_stats == MAX_THREADS)
+		return NULL;
+
+	thread_stats[num_thread_stats].tid = tid;
+	return &thread_stats[num_thread_stats++];
+}
+
 long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 		int cpu, int group_fd, unsigned long flags)
 {
@@ -56,281 +93,56 @@ long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 }
 
 /*
- * event_buf already has the mmap'ed address for perf buffer,
- * So, go ahead and read the data.
- *
- * The payload data (event data) starts after the first page of control
- * information.
- */
-static int read_from_perf_buffer(void *buf, size_t sz)
-{
-	struct perf_event_mmap_page *header = event_buf;
-	size_t pgmsk = event_pgmsk;
-	void *data;
-	unsigned long tail;
-	size_t avail_sz, min, c;
-
-	/*
-	 * data points to beginning of buffer payload
-	 */
-	data = ((void *)header) + sysconf(_SC_PAGESIZE);
-
-	/*
-	 * position of tail within the buffer payload.
-	 */
-	tail = header->data_tail & pgmsk;
-
-	/*
-	 * Size of available data.
-	 */
-	avail_sz = header->data_head - header->data_tail;
-	if (sz > avail_sz) {
-		fprintf(stderr, "Needed size is more than available size\n");
-		return -1;
-	}
-
-	/*
-	 * c = size till the end of buffer
-	 *
-	 * buffer size is a power of two.
-	 */
-	c = pgmsk + 1 - tail;
-
-	/*
-	 * min with requested size.
-	 */
-	min = c < sz ? c : sz;
-
-	/* copy beginning */
-	memcpy(buf, data + tail, min);
-
-	/* copy wrapped around leftover */
-	if (sz > min)
-		memcpy(buf + min, data, sz - min);
-
-	/* header->data_tail should reflect the last read data */
-	header->data_tail += sz;
-
-	return 0;
-}
-
-static int read_from_perf_buffer_64(void *buf)
-{
-	return read_from_perf_buffer(buf, sizeof(uint64_t));
-}
-
-/*
- * Not the data we need? Skip the data.
+ * Walk the records of one CPU ring, from the handler and once more after
+ * the events are disabled.
  */
-static void skip_perf_data(size_t sz)
-{
-	struct perf_event_mmap_page *hdr = event_buf;
-
-	if ((hdr->data_tail + sz) > hdr->data_head)
-		sz = hdr->data_head - hdr->data_tail;
-
-	hdr->data_tail += sz;
-}
-
-static int is_more_perf_data(void)
-{
-	struct perf_event_mmap_page *hdr = event_buf;
-
-	if (hdr->data_tail < hdr->data_head)
-		return 1;
-
-	return 0;
-}
-
-/*
- * The below parser is a stripped down version of perf source. To keep it
- * simple, it only looks for PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_CALLCHAIN,
- * PERF_SAMPLE_IP, PERF_SAMPLE_RAW and PERF_SAMPLE_TIME.
- * More parsers can be added if needed.
- */
-static int parse_perf_sample(struct perf_event_header *ehdr)
-{
-	size_t sz;
-	uint64_t type, fmt, val64;
-	uint64_t time_enabled, time_running;
-	const char *str;
-	int ret;
-	uint64_t value;
-	uint64_t id;
-	struct { uint32_t pid, tid; } pid;
-	
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = event_attr.sample_type;
-	fmt = event_attr.read_format;
-
-	fprintf(stderr, "CONTEXT SWITCH: SW_EVENT\n");
-	fprintf(stderr, "  ");
-
-	if (type & PERF_SAMPLE_IDENTIFIER) {
-		ret = read_from_perf_buffer_64(&val64);
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-		fprintf(stderr, "ID :%"PRIu64" ", val64);
-		sz -= sizeof(val64);
-	}
-
-	/*
-	 * the sample_type information is laid down
-	 * based on the PERF_RECORD_SAMPLE format specified
-	 * in the perf_event.h header file.
-	 * That order is different from the enum perf_event_sample_format.
-	 */
-	if (type & PERF_SAMPLE_IP) {
-		ret = read_from_perf_buffer_64(&val64);
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-
-		/*
-		 * MISC_EXACT_IP indicates that kernel is returning
-		 * th  IIP of an instruction which caused the event, i.e.,
-		 * no skid
-		 */
-		fprintf(stderr, "IIP:%#016"PRIx64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(&pid, sizeof(pid));
-		if (ret) {
-			fprintf(stderr, "cannot read PID");
-			return -1;
-		}
-
-		fprintf(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
-
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(&val64);
-		if (ret) {
-			fprintf(stderr, "cannot read time");
-			return -1;
-		}
-
-		fprintf(stderr, "TIME:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(&cpu, sizeof(cpu));
-		if (ret) {
-			fprintf(stderr, "cannot read cpu");
-			return -1;
-		}
-		fprintf(stderr, "CPU:%u  ", cpu.cpu);
-		sz -= sizeof(cpu);
-	}
-
-	if (type & PERF_SAMPLE_PERIOD) {
-		ret = read_from_perf_buffer_64(&val64);
-		if (ret) {
-			fprintf(stderr, "cannot read period");
-			return -1;
-		}
-		fprintf(stderr, "PERIOD:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_CALLCHAIN) {
-		uint64_t nr, ip;
-
-		ret = read_from_perf_buffer_64(&nr);
-		if (ret) {
-			fprintf(stderr, "cannot read callchain nr");
-			return -1;
-		}
-		sz -= sizeof(nr);
-
-		fprintf(stderr, "\n  CALLCHAIN :\n");
-		while(nr--) {
-			ret = read_from_perf_buffer_64(&ip);
-			if (ret) {
-				fprintf(stderr, "cannot read ip");
-				return -1;
-			}
-
-			sz -= sizeof(ip);
-
-			fprintf(stderr, "\t0x%"PRIx64"\n", ip);
-		}
-	}
-
-	return 0;
-}
-
-static int parse_perf_switch(struct perf_event_header *ehdr)
+static void
+drain_ring(int cpu)
 {
-	size_t sz;
-	uint64_t type, fmt, val64;
+	const struct perf_event_header *ehdr;
+	struct perf_sample_s sample;
+	struct thread_stat_s *stat;
 	int ret;
-	struct { uint32_t pid, tid; } pid;
-	
-	if (!ehdr)
-		return -1;
 
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = event_attr.sample_type;
-	fmt = event_attr.read_format;
-
-	if (ehdr->misc == PERF_RECORD_MISC_SWITCH_OUT)
-		fprintf(stderr, "CONTEXT SWITCH: OUT\n");
-	else
-		fprintf(stderr, "CONTEXT SWITCH: IN\n");
-
-	fprintf(stderr, "  ");
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(&pid, sizeof(pid));
-		if (ret) {
-			fprintf(stderr, "cannot read PID");
-			return -1;
+	perf_ring_begin(&event_ring[cpu]);
+	while ((ehdr = perf_ring_next(&event_ring[cpu])) != NULL) {
+		if (ehdr->type == PERF_RECORD_SAMPLE) {
+			fprintf(stderr, "CONTEXT SWITCH: SW_EVENT\n");
+			ret = perf_sample_parse(&event_layout, ehdr, &sample);
+			nr_count++;
+		} else if (ehdr->type == PERF_RECORD_SWITCH) {
+			if (ehdr->misc & PERF_RECORD_MISC_SWITCH_OUT)
+				fprintf(stderr, "CONTEXT SWITCH: OUT\n");
+			else
+				fprintf(stderr, "CONTEXT SWITCH: IN\n");
+			ret = perf_sample_parse_id(&event_layout, ehdr, &sample);
+		} else {
+			/* Not the sample we are looking for */
+			fprintf(stderr, "skipping record type %d\n", ehdr->type);
+			continue;
 		}
 
-		fprintf(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
+		if (ret != 0)
+			continue;
 
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(&val64);
-		if (ret) {
-			fprintf(stderr, "cannot read time");
-			return -1;
-		}
+		perf_sample_fprint(stderr, &event_layout, &sample);
 
-		fprintf(stderr, "TIME:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(&cpu, sizeof(cpu));
-		if (ret) {
-			fprintf(stderr, "cannot read cpu");
-			return -1;
-		}
-		fprintf(stderr, "CPU:%u\n", cpu.cpu);
-		sz -= sizeof(cpu);
+		stat = get_thread_stat(perf_sample_tid(&sample));
+		if (stat == NULL)
+			continue;
+		if (ehdr->type == PERF_RECORD_SAMPLE)
+			stat->samples++;
+		else if (ehdr->misc & PERF_RECORD_MISC_SWITCH_OUT)
+			stat->switch_out++;
+		else
+			stat->switch_in++;
 	}
-
-	return 0;
+	perf_ring_end(&event_ring[cpu]);
 }
 
 static void sigio_handler(int n, siginfo_t *info, void *uc)
 {
-	struct perf_event_header ehdr;
-	int ret;
+	int cpu;
 
 	fprintf(stderr, "SIGIO %lu\n", nr_count);
 
@@ -345,49 +157,68 @@ static void sigio_handler(int n, siginfo_t *info, void *uc)
 
 	/*
 	 * SIGPOLL = SIGIO
-	 * expect POLL_HUP instead of POLL_IN
+	 * The inherited events can't be re-armed with IOC_REFRESH, they
+	 * run freely and every overflow comes with POLL_IN.
 	 */
-	if (info->si_code != POLL_HUP) {
-		fprintf(stderr, "POLL_HUP signal not generated by SIGIO, %d\n", info->si_code);
+	if (info->si_code != POLL_IN && info->si_code != POLL_HUP) {
+		fprintf(stderr, "POLL_IN signal not generated by SIGIO, %d\n", info->si_code);
 		return;
 	}
 
-	if (info->si_fd != event_fd) {
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		if (info->si_fd == event_fd[cpu])
+			break;
+	}
+	if (cpu == num_cpus) {
 		fprintf(stderr, "Wrong fd\n");
 		return;
 	}
 
-again:
-	ret = read_from_perf_buffer(&ehdr, sizeof(ehdr));
-	if (ret) {
-		fprintf(stderr, "cannot read event header\n");
-		return;
-	}
+	drain_ring(cpu);
 
-	if (ehdr.type != PERF_RECORD_SAMPLE && ehdr.type != PERF_RECORD_SWITCH) {
-		/* Not the sample we are looking for */
-		fprintf(stderr, "skipping record type %d\n", ehdr.type);
-		skip_perf_data(ehdr.size);
-	}
+	fprintf(stderr, "\n");
+}
+
+static void
+print_thread_stats(void)
+{
+	unsigned long samples = 0, switch_in = 0, switch_out = 0;
+
+	printf("%8s %10s %10s %10s\n", "tid", "samples", "switch-in", "switch-out");
+	for (int i = 0; i < num_thread_stats; i++) {
+		struct thread_stat_s *stat = &thread_stats[i];
 
-	if (ehdr.type == PERF_RECORD_SAMPLE) {
-		ret = parse_perf_sample(&ehdr);
-		nr_count++;
-	} else if (ehdr.type == PERF_RECORD_SWITCH) {
-		ret = parse_perf_switch(&ehdr);
+		printf("%8d %10lu %10lu %10lu\n", stat->tid, stat->samples,
+		       stat->switch_in, stat->switch_out);
+		samples    += stat->samples;
+		switch_in  += stat->switch_in;
+		switch_out += stat->switch_out;
 	}
+	printf("%8s %10lu %10lu %10lu\n", "total", samples, switch_in, switch_out);
+}
 
-	if (is_more_perf_data())
-		goto again;
+static int
+setup_notification(int fd)
+{
+	int ret = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_ASYNC);
+	if (ret == -1) {
+		fprintf(stderr, "Can't set notification\n");
+		return -1;
+	}
 
-	fprintf(stderr, "\n");
+	ret = fcntl(fd, F_SETSIG, SIGIO);
+	if (ret == -1) {
+		fprintf(stderr, "Cannot set sigio\n");
+		return -1;
+	}
 
-	/*
-	 * refresh the counter again
-	 */
-	ret = ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
-	if (ret == -1)
-		fprintf(stderr, "Error in IOC_REFRESH\n");
+	/* Get ownership of the descriptor */
+	ret = fcntl(fd, F_SETOWN, getpid());
+	if (ret == -1) {
+		fprintf(stderr, "Error in setting owner\n");
+		return -1;
+	}
+	return 0;
 }
 
 int wait_loop(void)
@@ -409,11 +240,9 @@ int wait_loop(void)
 int main(int argc, char *argv[])
 {
 	struct sigaction act;
-	size_t pagesize;
+	sigset_t sigio;
 	int ret;
-	int fd;
-	void *buf;
-	size_t pgmsk;
+	int fd, cpu;
 	pid_t pid;
 	int wstat;
 	
@@ -427,8 +256,6 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	pagesize = sysconf(_SC_PAGESIZE);
-
 	/*
 	 * Register the sig handler (SIGIO)
 	 */
@@ -465,59 +292,47 @@ int main(int argc, char *argv[])
 	// event_attr.use_clockid = 1;
 	// event_attr.clockid = 1;
 
-	fd = perf_event_open(&event_attr, pid, -1, -1, 0);
-	if (fd == -1) {
-		fprintf(stderr, "Error in perf_event_open : %d\n", errno);
-		return -1;
-	}
-
-	event_fd = fd;
-
-	/*
-	 * map the perf buffer with buf here. But, there wouldn't be any data at this
-	 * point. So, put the parsing logic for the buffer in signal handler, since
-	 * that will called once an event occurs.
-	 */
-	buf = mmap(NULL, (buffer_pages + 1) * pagesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (buf == MAP_FAILED) {
-		fprintf(stderr, "Can't mmap buffer\n");
-		return -1;
-	}
-
-	pgmsk = (buffer_pages * pagesize) - 1;
-
-	/* We will need these two things in the signal handler */
-	event_buf = buf;
-	event_pgmsk = pgmsk;
-
-	/*
-	 * Setup notification on the file descriptor
-	 */
-	ret = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_ASYNC);
-	if (ret == -1) {
-		fprintf(stderr, "Can't set notification\n");
-		return -1;
-	}
+	perf_sample_layout_init(&event_layout, &event_attr);
+
+	num_cpus   = sysconf(_SC_NPROCESSORS_CONF);
+	event_fd   = malloc(sizeof(int) * num_cpus);
+	event_ring = calloc(num_cpus, sizeof(struct perf_ring_s));
+
+	/* Block SIGIO until all the rings are mapped */
+	sigemptyset(&sigio);
+	sigaddset(&sigio, SIGIO);
+	sigprocmask(SIG_BLOCK, &sigio, NULL);
+
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		fd = perf_event_open(&event_attr, pid, cpu, -1, 0);
+		event_fd[cpu] = fd;
+		if (fd == -1) {
+			/* offline CPU */
+			if (errno == ENODEV)
+				continue;
+			fprintf(stderr, "Error in perf_event_open on cpu %d: %d\n", cpu, errno);
+			return -1;
+		}
 
-	ret = fcntl(fd, F_SETSIG, SIGIO);
-	if (ret == -1) {
-		fprintf(stderr, "Cannot set sigio\n");
-		return -1;
-	}
+		/*
+		 * map the perf buffer here. But, there wouldn't be any data at this
+		 * point. So, put the parsing logic for the buffer in signal handler, since
+		 * that will called once an event occurs.
+		 */
+		if (perf_ring_open(&event_ring[cpu], fd, buffer_pages))
+			return -1;
 
-	/* Get ownership of the descriptor */
-	ret = fcntl(fd, F_SETOWN, getpid());
-	if (ret == -1) {
-		fprintf(stderr, "Error in setting owner\n");
-		return -1;
-	}
+		if (setup_notification(fd))
+			return -1;
 
-	/* Enable the event for one period */
-	ret = ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
-	if (ret == -1) {
-		fprintf(stderr, "Error in IOC_REFRESH\n");
-		return -1;
+		/* inherited events can't use IOC_REFRESH, let them run */
+		ret = ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		if (ret == -1) {
+			fprintf(stderr, "Error in IOC_ENABLE\n");
+			return -1;
+		}
 	}
+	sigprocmask(SIG_UNBLOCK, &sigio, NULL);
 
 wait:
 	/* Wait for the signal */
@@ -525,15 +340,41 @@ wait:
 		if (errno == EINTR)
 			goto wait;
 
-	/* Disable the event counter */
-	ret = ioctl(fd, PERF_EVENT_IOC_DISABLE, 1);
-	if (ret == -1) {
-		fprintf(stderr, "Error in IOC_DISABLE\n");
-		return -1;
+	/* Disable the event counters, with SIGIO blocked so the last drain is ours */
+	sigprocmask(SIG_BLOCK, &sigio, NULL);
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		if (event_fd[cpu] < 0)
+			continue;
+
+		ret = ioctl(event_fd[cpu], PERF_EVENT_IOC_DISABLE, 1);
+		if (ret == -1) {
+			fprintf(stderr, "Error in IOC_DISABLE\n");
+			return -1;
+		}
+	}
+
+	/* whatever the handler has not seen yet */
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		if (event_fd[cpu] >= 0)
+			drain_ring(cpu);
 	}
 
-	/* That's it, done. Close the fd */
-	close(fd);
+	/* That's it, done. Close the fds */
+	struct perf_ring_stats_s stats;
+	memset(&stats, 0, sizeof(stats));
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		if (event_fd[cpu] < 0)
+			continue;
+		close(event_fd[cpu]);
+		perf_ring_stats_add(&stats, &event_ring[cpu].stats);
+		perf_ring_close(&event_ring[cpu]);
+	}
+	perf_ring_report(stdout, "rings", &stats);
+
+	print_thread_stats();
+
+	free(event_fd);
+	free(event_ring);
 
 	return 0;
 }
@@ -64,3 +64,22 @@ void naive_matrix_multiply(int quiet) {
   return;
 }
 
+
+void gemm_omp(double *A, double *B, double *C, int n)
+{
+    #pragma omp parallel
+    {
+        int i, j, k;
+        #pragma omp for
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < n; j++) {
+                double dot  = 0;
+                for (k = 0; k < n; k++) {
+                    dot += A[i*n+k]*B[k*n+j];
+                }
+                C[i*n+j ] = dot;
+            }
+        }
+
+    }
+}
@@ -1,4 +1,6 @@
 long long naive_matrix_multiply_estimated_flops(int quiet);
 void naive_matrix_multiply(int quiet);
+void gemm_omp(double *A, double *B, double *C, int n);
+
 
 
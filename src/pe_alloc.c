@@ -0,0 +1,636 @@
+/*
+ * Data-centric sampling for unmodified binaries.
+ *
+ * A preloadable library that does what wrap_malloc() and update() do
+ * in pe_page.c without touching the workload:
+ *
+ *   LD_PRELOAD=./libpe_alloc.so ./mmul
+ *   LD_PRELOAD=./libpe_alloc.so PE_ALLOC_THRESHOLD=1M ./lulesh2.0 -s 60
+ *
+ * malloc, calloc, realloc, posix_memalign, aligned_alloc, free, mmap
+ * and munmap are interposed. Every allocation of at least the threshold
+ * is entered in a perf_addrmap with the hash of its allocation site,
+ * the return addresses of its callers. Smaller ones only pay for a
+ * size compare.
+ *
+ * At load time the library opens inherited PERF_SAMPLE_ADDR events on
+ * the process, one per cpu so that every thread created later is
+ * sampled into a ring, drained by a collector thread which looks the
+ * data address of each sample up in the map. At exit the sites are
+ * printed with their allocations, bytes and sample count per event,
+ * most sampled first.
+ *
+ * Environment:
+ *   PE_ALLOC_THRESHOLD  smallest tracked allocation, in bytes, k/M/G
+ *                       suffixes allowed (default 64k)
+ *   PE_ALLOC_DEPTH      callers hashed into the site (default 4, max 8)
+ *   PE_ALLOC_RAW        extra event, type:config[:period] in hex or
+ *                       decimal, e.g. 7:0x80000:40 for IBS op
+ *   PE_ALLOC_OUTPUT     report file (default stderr)
+ *   PE_ALLOC_NUMA       if set, the node of the sampled pages against the
+ *                       node of the sampling cpu, per site, with a
+ *                       suggested placement. The pages are looked up
+ *                       with move_pages() before every tracked free and
+ *                       at exit.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
+
+#include "perf_ring.h"
+#include "perf_collector.h"
+#include "perf_addrmap.h"
+#include "perf_numa.h"
+
+#define MAX_EVENTS	3
+#define MAX_FRAMES	8
+#define MAX_SITES	4096		/* power of 2 */
+#define MAX_CPUS	1024
+#define SKIP_FRAMES	2		/* record_alloc() and the hook */
+#define NUMA_PAGES	(1 << 18)	/* power of 2 */
+
+#define buffer_pages	8
+
+/* glibc's own entry points, so there is no dlsym() bootstrap to solve */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void  __libc_free(void *ptr);
+
+struct site_s {
+	uint64_t	hash;		/* 0: free slot */
+	int		nframes;	/* set once frames is valid */
+	void		*frames[MAX_FRAMES];
+	uint64_t	allocs;
+	uint64_t	bytes;
+	uint64_t	samples[MAX_EVENTS];
+};
+
+struct event_s {
+	const char	*name;
+	uint32_t	 type;
+	uint64_t	 config;
+	uint64_t	 period;
+	int		 precise;
+	int		 opened;	/* on some cpu */
+	uint64_t	 samples;
+	uint64_t	 unattributed;
+};
+
+struct cpu_ring_s {
+	int		   fd;
+	int		   event;
+	struct perf_ring_s ring;
+};
+
+static struct event_s events[MAX_EVENTS] = {
+	{ .name = "cache-misses", .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_CACHE_MISSES,
+	  .period = 1000, .precise = 2 },
+	{ .name = "page-faults", .type = PERF_TYPE_SOFTWARE, .config = PERF_COUNT_SW_PAGE_FAULTS,
+	  .period = 1 },
+};
+static int num_events = 2;
+
+static struct site_s sites[MAX_SITES];
+static uint64_t site_overflow;
+
+static struct perf_addrmap_s alloc_map;
+static struct perf_addrmap_cache_s alloc_cache;	/* collector thread only */
+
+static struct perf_collector_s collector;
+static struct cpu_ring_s *rings;
+static int num_rings;
+static struct perf_sample_layout_s sample_layout;
+
+static size_t threshold = 64 * 1024;
+static int depth = 4;
+static int ready;
+
+/* labelled by site index, MAX_SITES for the untracked addresses */
+static int use_numa;
+static struct perf_numa_s numa;
+
+/*
+ * Set while this library itself allocates or maps memory, including
+ * the chunks perf_addrmap mmap()s with its lock held, so none of it is
+ * tracked and the hooks never re-enter the map.
+ */
+static __thread int in_hook __attribute__((tls_model("initial-exec")));
+
+static inline
+int sys_perf_event_open(struct perf_event_attr *attr, pid_t pid,
+			int cpu, int group_fd, unsigned long flags)
+{
+	attr->size = sizeof(*attr);
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static uint64_t
+hash_frames(void **frames, int n)
+{
+	uint64_t h = 0xcbf29ce484222325ull;	/* FNV-1a */
+
+	for (int i = 0; i < n; i++) {
+		h ^= (uintptr_t) frames[i];
+		h *= 0x100000001b3ull;
+	}
+	return h ? h : 1;
+}
+
+/* find or claim the slot of a site, lock-free */
+static struct site_s *
+get_site(void **frames, int n)
+{
+	uint64_t hash = hash_frames(frames, n);
+
+	for (int i = 0; i < MAX_SITES; i++) {
+		struct site_s *site = &sites[(hash + i) & (MAX_SITES - 1)];
+		uint64_t cur = __atomic_load_n(&site->hash, __ATOMIC_ACQUIRE);
+
+		if (cur == 0) {
+			if (!__atomic_compare_exchange_n(&site->hash, &cur, hash, 0,
+							 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				if (cur != hash)
+					continue;
+				return site;
+			}
+			memcpy(site->frames, frames, n * sizeof(void *));
+			__atomic_store_n(&site->nframes, n, __ATOMIC_RELEASE);
+			return site;
+		}
+		if (cur == hash)
+			return site;
+	}
+	__atomic_fetch_add(&site_overflow, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* not inlined, SKIP_FRAMES counts on it */
+static __attribute__((noinline)) void
+record_alloc(void *ptr, size_t size)
+{
+	void *frames[MAX_FRAMES + SKIP_FRAMES];
+	struct site_s *site;
+	int n;
+
+	in_hook = 1;
+	n = backtrace(frames, depth + SKIP_FRAMES) - SKIP_FRAMES;
+	if (n > 0 && (site = get_site(frames + SKIP_FRAMES, n)) != NULL) {
+		__atomic_fetch_add(&site->allocs, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&site->bytes, size, __ATOMIC_RELAXED);
+		perf_addrmap_insert(&alloc_map, (uintptr_t) ptr, (uintptr_t) ptr + size,
+				    (uintptr_t) site);
+	}
+	in_hook = 0;
+}
+
+/*
+ * The samples still in the rings may point into the range, have the
+ * collector look them up before the range goes away. Only ranges that
+ * are tracked pay for the round trip.
+ */
+static void
+record_free(void *ptr)
+{
+	struct perf_addrmap_entry_s entry;
+
+	if (perf_addrmap_lookup(&alloc_map, (uintptr_t) ptr, NULL, &entry) != 1 ||
+	    entry.start != (uintptr_t) ptr)
+		return;
+
+	in_hook = 1;
+	perf_collector_flush(&collector);
+	if (use_numa)
+		perf_numa_resolve(&numa);
+	perf_addrmap_remove(&alloc_map, (uintptr_t) ptr, NULL);
+	in_hook = 0;
+}
+
+static inline int
+tracked(size_t size)
+{
+	return size >= threshold && __atomic_load_n(&ready, __ATOMIC_ACQUIRE) && !in_hook;
+}
+
+void *
+malloc(size_t size)
+{
+	void *ptr = __libc_malloc(size);
+
+	if (ptr && tracked(size))
+		record_alloc(ptr, size);
+	return ptr;
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __libc_calloc(nmemb, size);
+
+	if (ptr && tracked(nmemb * size))
+		record_alloc(ptr, nmemb * size);
+	return ptr;
+}
+
+void
+free(void *ptr)
+{
+	/* the usable size is never below the requested one */
+	if (ptr && alloc_map.count && tracked(malloc_usable_size(ptr)))
+		record_free(ptr);
+	__libc_free(ptr);
+}
+
+void *
+realloc(void *old, size_t size)
+{
+	int was_tracked = old && alloc_map.count && tracked(malloc_usable_size(old));
+	void *ptr = __libc_realloc(old, size);
+
+	/* a failed realloc leaves old allocated, realloc(old, 0) frees it */
+	if (was_tracked && (ptr || size == 0))
+		record_free(old);
+	if (ptr && tracked(size))
+		record_alloc(ptr, size);
+	return ptr;
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	/* a power of two multiple of sizeof(void *), as glibc checks */
+	if (alignment == 0 || alignment % sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+
+	ptr = __libc_memalign(alignment, size);
+	if (ptr == NULL)
+		return ENOMEM;
+	if (tracked(size))
+		record_alloc(ptr, size);
+	*memptr = ptr;
+	return 0;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	void *ptr = __libc_memalign(alignment, size);
+
+	if (ptr && tracked(size))
+		record_alloc(ptr, size);
+	return ptr;
+}
+
+/* only anonymous mappings are data, file mappings are left alone */
+void *
+mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	void *ptr = (void *) syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+
+	if (ptr != MAP_FAILED && (flags & MAP_ANONYMOUS) && tracked(length))
+		record_alloc(ptr, length);
+	return ptr;
+}
+
+/*
+ * A partial unmap drops the whole range. Unmaps that miss every tracked
+ * range, most of them, skip the collector round trip.
+ */
+int
+munmap(void *addr, size_t length)
+{
+	if (alloc_map.count && __atomic_load_n(&ready, __ATOMIC_ACQUIRE) && !in_hook &&
+	    perf_addrmap_overlaps(&alloc_map, (uintptr_t) addr, (uintptr_t) addr + length)) {
+		in_hook = 1;
+		perf_collector_flush(&collector);
+		if (use_numa)
+			perf_numa_resolve(&numa);
+		perf_addrmap_remove_range(&alloc_map, (uintptr_t) addr, (uintptr_t) addr + length);
+		in_hook = 0;
+	}
+	return syscall(SYS_munmap, addr, length);
+}
+
+/* collector thread */
+static void
+aggregate(const struct perf_event_header *hdr, void *arg)
+{
+	struct event_s *event = arg;
+	struct perf_addrmap_entry_s entry;
+	struct perf_sample_s sample;
+	uint32_t label = MAX_SITES;
+
+	if (hdr->type != PERF_RECORD_SAMPLE)
+		return;
+	if (perf_sample_parse(&sample_layout, hdr, &sample))
+		return;
+
+	event->samples++;
+	if (sample.v[PERF_SF_ADDR] &&
+	    perf_addrmap_lookup(&alloc_map, sample.v[PERF_SF_ADDR], &alloc_cache, &entry) == 1) {
+		struct site_s *site = (struct site_s *)(uintptr_t) entry.value;
+		site->samples[event - events]++;
+		label = site - sites;
+	} else {
+		event->unattributed++;
+	}
+
+	if (use_numa)
+		perf_numa_add(&numa, sample.v[PERF_SF_ADDR], perf_sample_cpu(&sample), label);
+}
+
+static size_t
+parse_size(const char *s)
+{
+	char *end;
+	size_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		v <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		v <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		v <<= 10;
+	}
+	return v;
+}
+
+static int
+parse_raw(const char *s, struct event_s *event)
+{
+	char *end;
+
+	memset(event, 0, sizeof(*event));
+	event->name   = "raw";
+	event->period = 10000;
+
+	event->type = strtoul(s, &end, 0);
+	if (*end != ':')
+		return -1;
+	event->config = strtoull(end + 1, &end, 0);
+	if (*end == ':')
+		event->period = strtoull(end + 1, &end, 0);
+	return *end ? -1 : 0;
+}
+
+static void
+init_attr(struct perf_event_attr *attr, struct event_s *event)
+{
+	memset(attr, 0, sizeof(struct perf_event_attr));
+
+	attr->size	    = sizeof(struct perf_event_attr);
+	attr->type	    = event->type;
+	attr->config	    = event->config;
+	attr->sample_period = event->period;
+	attr->precise_ip    = event->precise;
+	attr->sample_type   = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_ADDR;
+	if (use_numa)
+		attr->sample_type |= PERF_SAMPLE_CPU;
+	attr->inherit	    = 1;
+	attr->exclude_kernel = 1;
+	attr->exclude_hv    = 1;
+
+	perf_ring_watermark(attr, buffer_pages);
+}
+
+/*
+ * One inherited event per cpu and per event: inherit does not mix with
+ * a cpu = -1 ring, and a per-cpu one is fed by every thread on it.
+ */
+static void
+open_events(void)
+{
+	int ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	struct perf_event_attr attr;
+
+	if (ncpus > MAX_CPUS)
+		ncpus = MAX_CPUS;
+
+	rings = __libc_calloc(ncpus * num_events, sizeof(struct cpu_ring_s));
+	if (rings == NULL)
+		return;
+
+	for (int e = 0; e < num_events; e++) {
+		init_attr(&attr, &events[e]);
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			struct cpu_ring_s *r = &rings[num_rings];
+			int fd = sys_perf_event_open(&attr, 0, cpu, -1, 0);
+
+			/* no precise variant of the event, the address may be missing */
+			if (fd < 0 && attr.precise_ip && (errno == EINVAL || errno == EOPNOTSUPP)) {
+				attr.precise_ip = 0;
+				fd = sys_perf_event_open(&attr, 0, cpu, -1, 0);
+			}
+			if (fd < 0) {
+				if (errno == ENODEV)	/* offline cpu */
+					continue;
+				fprintf(stderr, "pe_alloc: cannot open %s: %s\n",
+					events[e].name, strerror(errno));
+				break;
+			}
+			if (perf_ring_open(&r->ring, fd, buffer_pages)) {
+				close(fd);
+				break;
+			}
+			r->fd	 = fd;
+			r->event = e;
+			perf_collector_add(&collector, fd, &r->ring, aggregate, &events[e]);
+			events[e].opened = 1;
+			num_rings++;
+		}
+	}
+	perf_sample_layout_init(&sample_layout, &attr);
+}
+
+/* the collector thread is not forked, the child runs untracked */
+static void
+pe_alloc_atfork_child(void)
+{
+	__atomic_store_n(&ready, 0, __ATOMIC_RELEASE);
+}
+
+__attribute__((constructor)) static void
+pe_alloc_init(void)
+{
+	const char *s;
+
+	in_hook = 1;
+
+	if ((s = getenv("PE_ALLOC_THRESHOLD")) != NULL)
+		threshold = parse_size(s);
+	if ((s = getenv("PE_ALLOC_DEPTH")) != NULL) {
+		depth = atoi(s);
+		if (depth < 1 || depth > MAX_FRAMES)
+			depth = MAX_FRAMES;
+	}
+	if ((s = getenv("PE_ALLOC_RAW")) != NULL) {
+		if (parse_raw(s, &events[num_events]) == 0)
+			num_events++;
+		else
+			fprintf(stderr, "pe_alloc: bad PE_ALLOC_RAW, want type:config[:period]: %s\n", s);
+	}
+	if (getenv("PE_ALLOC_NUMA") && perf_numa_init(&numa, NUMA_PAGES) == 0)
+		use_numa = 1;
+
+	/* backtrace() loads libgcc_s on first use, do it before any hook needs it */
+	void *frames[1];
+	backtrace(frames, 1);
+
+	if (perf_addrmap_init(&alloc_map) || perf_collector_init(&collector)) {
+		in_hook = 0;
+		return;
+	}
+
+	open_events();
+	if (num_rings)
+		perf_collector_start(&collector);
+	pthread_atfork(NULL, NULL, pe_alloc_atfork_child);
+
+	__atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+	in_hook = 0;
+}
+
+static int
+cmp_site(const void *a, const void *b)
+{
+	const struct site_s *x = *(struct site_s * const *)a, *y = *(struct site_s * const *)b;
+	uint64_t sx = 0, sy = 0;
+
+	for (int e = 0; e < num_events; e++) {
+		sx += x->samples[e];
+		sy += y->samples[e];
+	}
+	if (sx != sy)
+		return sx < sy ? 1 : -1;
+	return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+static void
+print_frame(FILE *out, void *addr)
+{
+	Dl_info info;
+
+	if (dladdr(addr, &info) && info.dli_sname)
+		fprintf(out, "        %p %s+0x%lx (%s)\n", addr, info.dli_sname,
+			(unsigned long)((char *) addr - (char *) info.dli_saddr), info.dli_fname);
+	else if (dladdr(addr, &info) && info.dli_fname)
+		fprintf(out, "        %p %s+0x%lx\n", addr, info.dli_fname,
+			(unsigned long)((char *) addr - (char *) info.dli_fbase));
+	else
+		fprintf(out, "        %p\n", addr);
+}
+
+static void
+report(FILE *out)
+{
+	struct site_s *sorted[MAX_SITES];
+	int n = 0;
+
+	for (int i = 0; i < MAX_SITES; i++) {
+		if (sites[i].hash && sites[i].nframes)
+			sorted[n++] = &sites[i];
+	}
+	qsort(sorted, n, sizeof(sorted[0]), cmp_site);
+
+	fprintf(out, "pe_alloc: %d allocation sites of %zu bytes or more\n", n, threshold);
+	for (int e = 0; e < num_events; e++) {
+		if (!events[e].opened)
+			continue;
+		fprintf(out, "  %-14s %10"PRIu64" samples, %10"PRIu64" not in a tracked allocation\n",
+			events[e].name, events[e].samples, events[e].unattributed);
+	}
+	struct perf_ring_stats_s stats;
+	memset(&stats, 0, sizeof(stats));
+	for (int i = 0; i < num_rings; i++)
+		perf_ring_stats_add(&stats, &rings[i].ring.stats);
+	perf_ring_report(out, "  rings", &stats);
+
+	if (site_overflow)
+		fprintf(out, "  %"PRIu64" allocations not tracked, site table full\n", site_overflow);
+	if (alloc_map.busy)
+		fprintf(out, "  %"PRIu64" lookups gave up on a busy map\n", alloc_map.busy);
+
+	/* the freed ranges were resolved before they went away */
+	struct perf_numa_summary_s *numa_sum = NULL;
+	if (use_numa) {
+		perf_numa_resolve(&numa);
+		fprintf(out, "  numa: %d nodes, %"PRIu64" samples on %zu pages, %"PRIu64" move_pages calls\n",
+			numa.num_nodes, numa.samples, numa.npages, numa.queries);
+		numa_sum = malloc((MAX_SITES + 1) * sizeof(*numa_sum));
+		if (numa_sum)
+			perf_numa_summarize(&numa, numa_sum, MAX_SITES + 1);
+		if (numa_sum && numa_sum[MAX_SITES].samples) {
+			fprintf(out, "  untracked: ");
+			perf_numa_fprint(out, &numa, &numa_sum[MAX_SITES]);
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct site_s *site = sorted[i];
+
+		fprintf(out, "\nsite %016"PRIx64": %"PRIu64" allocations, %"PRIu64" bytes\n",
+			site->hash, site->allocs, site->bytes);
+		for (int e = 0; e < num_events; e++) {
+			if (events[e].opened)
+				fprintf(out, "    %-14s %10"PRIu64"\n", events[e].name, site->samples[e]);
+		}
+		if (numa_sum && numa_sum[site - sites].samples) {
+			fprintf(out, "    numa: ");
+			perf_numa_fprint(out, &numa, &numa_sum[site - sites]);
+		}
+		for (int f = 0; f < site->nframes; f++)
+			print_frame(out, site->frames[f]);
+	}
+	free(numa_sum);
+}
+
+__attribute__((destructor)) static void
+pe_alloc_fini(void)
+{
+	const char *path = getenv("PE_ALLOC_OUTPUT");
+	FILE *out = stderr;
+
+	if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+		return;
+
+	in_hook = 1;
+
+	/* the counters stop with their fds, the collector drains what is left */
+	for (int i = 0; i < num_rings; i++)
+		ioctl(rings[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (num_rings)
+		perf_collector_stop(&collector);
+
+	if (path && (out = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "pe_alloc: cannot open %s: %s\n", path, strerror(errno));
+		out = stderr;
+	}
+	report(out);
+	if (out != stderr)
+		fclose(out);
+
+	in_hook = 0;
+}
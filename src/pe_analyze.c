@@ -0,0 +1,785 @@
+/*
+ * Offline analysis of a capture, on every core:
+ *
+ *   pe_analyze [-j threads] [-n top] file
+ *
+ * file is a perf.data written by perf_writer or perf_flight (pe_sample
+ * -o, for instance), or a pack of pe_pack. It is mapped, cut into
+ * chunks at record boundaries (see perf_data.h), or into its blocks for
+ * a pack, and -j threads (all the cpus by default) take the chunks one
+ * after the other. Every thread adds its samples up in a hash table of
+ * its own, per event, by
+ *
+ *   ip		the process and the ip, folded into symbols at the end
+ *   thread	the tid
+ *   cpu	with PERF_SAMPLE_CPU
+ *   allocation	the data mapping holding the sampled address, with
+ *		PERF_SAMPLE_ADDR
+ *
+ * and the tables are merged once all are done. Only the distinct ips
+ * go through the symbol tables, on one thread, since perf_symtab is not
+ * thread safe.
+ *
+ * The comm and mmap records of a perf.data are handled in file order
+ * while it is cut. The executable mappings give the symbols of every
+ * process. The data mappings, from events with mmap_data, stand for
+ * the allocations: glibc serves the large ones with an mmap of their
+ * own, and the heap and the stacks are mappings too. A pack has neither,
+ * its ips and threads are printed as numbers and it has no allocations.
+ *
+ * The reports are per event, the -n rows with the most samples each.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include "perf_data.h"
+#include "perf_pack.h"
+#include "perf_region.h"
+#include "perf_symtab.h"
+
+#define COMM_LEN	16
+#define CHUNKS		8		/* per thread, so the last ones even out */
+#define TABLE_INIT	(1 << 12)
+#define NO_MAPPING	UINT32_MAX
+
+enum kind {
+	BY_IP,		/* a: pid, b: ip */
+	BY_THREAD,	/* a: tid, b: pid */
+	BY_CPU,		/* a: cpu */
+	BY_ALLOC,	/* a: mapping, or NO_MAPPING */
+	BY_SYMBOL,	/* a: perf_sym_s, b: dso; or a: ip, b: 0 */
+	NKINDS
+};
+
+static const char *kind_names[NKINDS] = {
+	"ips", "threads", "cpus", "allocations", "symbols"
+};
+
+struct entry_s {
+	uint64_t	a;
+	uint64_t	b;
+	uint32_t	kind;
+	uint32_t	event;
+	uint64_t	samples;	/* 0: free slot */
+	uint64_t	period;
+};
+
+/* open addressing, grown at half full */
+struct table_s {
+	struct entry_s	*e;
+	size_t		 size;		/* power of 2 */
+	size_t		 used;
+};
+
+struct id_s {
+	uint64_t	id;
+	int		event;
+};
+
+/* a mapping, executable or data, in file order */
+struct mapping_s {
+	uint32_t	 pid;
+	uint64_t	 start;
+	uint64_t	 end;
+	uint64_t	 pgoff;
+	uint64_t	 seq;
+	char		*path;
+};
+
+struct comm_s {
+	uint32_t	tid;
+	uint32_t	pid;
+	uint64_t	seq;
+	char		comm[COMM_LEN];
+};
+
+struct process_s {
+	uint32_t	pid;
+	struct perf_symtab_s symtab;
+};
+
+struct worker_s {
+	pthread_t	 thread;
+	struct table_s	 table;
+	uint64_t	 samples;
+	int		 last_event;	/* of the id before */
+	uint64_t	 last_id;
+	char		 pad[64];
+};
+
+/* the capture, shared by the threads, read only while they run */
+static struct perf_data_s data;
+static struct perf_pack_reader_s pack;
+static int is_pack;
+static uint64_t sample_type;
+static struct perf_event_attr *attrs[PERF_DATA_MAX_ATTRS];
+static int nattrs;
+
+static struct id_s *ids;
+static size_t nids;
+
+static struct mapping_s *data_maps, *exec_maps;
+static size_t ndata_maps, nexec_maps, max_data_maps, max_exec_maps;
+static struct comm_s *comms;
+static size_t ncomms, max_comms;
+static uint64_t side_seq;
+
+static uint64_t *bounds;
+static size_t nchunks, next_chunk;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *
+grow(void *array, size_t *max, size_t size)
+{
+	size_t n = *max ? 2 * *max : 1024;
+	void *p = realloc(array, n * size);
+
+	if (p == NULL) {
+		fprintf(stderr, "cannot allocate %zu entries\n", n);
+		exit(1);
+	}
+	*max = n;
+	return p;
+}
+
+/*
+ * Hash tables
+ */
+
+static inline uint64_t
+entry_hash(uint32_t kind, uint32_t event, uint64_t a, uint64_t b)
+{
+	uint64_t h = (a * 0x9e3779b97f4a7c15ull) ^ b;
+
+	h = (h ^ ((uint64_t) kind << 32 | event)) * 0xff51afd7ed558ccdull;
+	return h ^ (h >> 32);
+}
+
+static void
+table_init(struct table_s *t, size_t size)
+{
+	t->e	= calloc(size, sizeof(struct entry_s));
+	t->size = size;
+	t->used = 0;
+	if (t->e == NULL) {
+		fprintf(stderr, "cannot allocate %zu entries\n", size);
+		exit(1);
+	}
+}
+
+static struct entry_s *
+table_find(struct table_s *t, uint32_t kind, uint32_t event, uint64_t a, uint64_t b)
+{
+	size_t h = entry_hash(kind, event, a, b);
+
+	for (;; h++) {
+		struct entry_s *e = &t->e[h & (t->size - 1)];
+
+		if (e->samples == 0 ||
+		    (e->a == a && e->b == b && e->kind == kind && e->event == event))
+			return e;
+	}
+}
+
+static void table_add(struct table_s *t, uint32_t kind, uint32_t event, uint64_t a,
+		      uint64_t b, uint64_t samples, uint64_t period);
+
+static void
+table_grow(struct table_s *t)
+{
+	struct table_s old = *t;
+
+	table_init(t, 2 * old.size);
+	for (size_t i = 0; i < old.size; i++) {
+		const struct entry_s *e = &old.e[i];
+
+		if (e->samples)
+			table_add(t, e->kind, e->event, e->a, e->b, e->samples, e->period);
+	}
+	free(old.e);
+}
+
+static void
+table_add(struct table_s *t, uint32_t kind, uint32_t event, uint64_t a, uint64_t b,
+	  uint64_t samples, uint64_t period)
+{
+	struct entry_s *e = table_find(t, kind, event, a, b);
+
+	if (e->samples == 0) {
+		if (2 * (t->used + 1) > t->size) {
+			table_grow(t);
+			e = table_find(t, kind, event, a, b);
+		}
+		e->a	 = a;
+		e->b	 = b;
+		e->kind	 = kind;
+		e->event = event;
+		t->used++;
+	}
+	e->samples += samples;
+	e->period  += period;
+}
+
+/*
+ * The side band, known before the samples
+ */
+
+static int
+cmp_mapping(const void *x, const void *y)
+{
+	const struct mapping_s *m = x, *n = y;
+
+	if (m->pid != n->pid)
+		return m->pid < n->pid ? -1 : 1;
+	if (m->start != n->start)
+		return m->start < n->start ? -1 : 1;
+	return m->seq < n->seq ? -1 : m->seq > n->seq;
+}
+
+static int
+cmp_comm(const void *x, const void *y)
+{
+	const struct comm_s *c = x, *d = y;
+
+	if (c->tid != d->tid)
+		return c->tid < d->tid ? -1 : 1;
+	return c->seq < d->seq ? -1 : c->seq > d->seq;
+}
+
+static void
+add_mapping(uint32_t pid, uint64_t start, uint64_t len, uint64_t pgoff, const char *path,
+	    int exec)
+{
+	struct mapping_s *m;
+
+	if (exec) {
+		if (nexec_maps == max_exec_maps)
+			exec_maps = grow(exec_maps, &max_exec_maps, sizeof(*exec_maps));
+		m = &exec_maps[nexec_maps++];
+	} else {
+		if (ndata_maps == max_data_maps)
+			data_maps = grow(data_maps, &max_data_maps, sizeof(*data_maps));
+		m = &data_maps[ndata_maps++];
+	}
+	m->pid	 = pid;
+	m->start = start;
+	m->end	 = start + len;
+	m->pgoff = pgoff;
+	m->seq	 = side_seq++;
+	m->path	 = strdup(path);
+}
+
+/* perf_record_cb for perf_data_split(), the records other than samples */
+static void
+side_band(const struct perf_event_header *hdr, void *arg)
+{
+	const char *end = (const char *) hdr + hdr->size;
+
+	switch (hdr->type) {
+	case PERF_RECORD_MMAP: {
+		const struct {
+			uint32_t pid, tid;
+			uint64_t addr, len, pgoff;
+			char	 filename[];
+		} *r = (const void *) (hdr + 1);
+
+		if (r->filename < end && memchr(r->filename, '\0', end - r->filename))
+			add_mapping(r->pid, r->addr, r->len, r->pgoff, r->filename,
+				    !(hdr->misc & PERF_RECORD_MISC_MMAP_DATA));
+		break;
+	}
+	case PERF_RECORD_MMAP2: {
+		const struct {
+			uint32_t pid, tid;
+			uint64_t addr, len, pgoff;
+			uint8_t	 dev_ino[24];	/* or the build id */
+			uint32_t prot, flags;
+			char	 filename[];
+		} *r = (const void *) (hdr + 1);
+
+		if (r->filename < end && memchr(r->filename, '\0', end - r->filename))
+			add_mapping(r->pid, r->addr, r->len, r->pgoff, r->filename,
+				    r->prot & PROT_EXEC);
+		break;
+	}
+	case PERF_RECORD_COMM: {
+		const struct {
+			uint32_t pid, tid;
+			char	 comm[];
+		} *r = (const void *) (hdr + 1);
+
+		if (r->comm >= end)
+			break;
+		if (ncomms == max_comms)
+			comms = grow(comms, &max_comms, sizeof(*comms));
+		comms[ncomms].tid = r->tid;
+		comms[ncomms].pid = r->pid;
+		comms[ncomms].seq = side_seq++;
+		snprintf(comms[ncomms].comm, COMM_LEN, "%.*s", (int) (end - r->comm), r->comm);
+		ncomms++;
+		break;
+	}
+	}
+}
+
+/* the data mapping of pid holding addr, the last one mapped there */
+static uint32_t
+find_data_map(uint32_t pid, uint64_t addr)
+{
+	size_t lo = 0, hi = ndata_maps;
+
+	/* the last mapping starting at or before addr */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		const struct mapping_s *m = &data_maps[mid];
+
+		if (m->pid < pid || (m->pid == pid && m->start <= addr))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo && data_maps[lo - 1].pid == pid && addr < data_maps[lo - 1].end)
+		return lo - 1;
+	return NO_MAPPING;
+}
+
+static const char *
+find_comm(uint32_t tid)
+{
+	size_t lo = 0, hi = ncomms;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (comms[mid].tid <= tid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo && comms[lo - 1].tid == tid ? comms[lo - 1].comm : "";
+}
+
+static int
+cmp_id(const void *x, const void *y)
+{
+	const struct id_s *a = x, *b = y;
+
+	return a->id < b->id ? -1 : a->id > b->id;
+}
+
+static void
+add_ids(int event, const uint64_t *list, uint32_t n)
+{
+	ids = realloc(ids, (nids + n + 1) * sizeof(*ids));
+	for (uint32_t i = 0; i < n; i++) {
+		ids[nids].id	= list[i];
+		ids[nids].event = event;
+		nids++;
+	}
+}
+
+/*
+ * The threads
+ */
+
+static int
+event_of(struct worker_s *w, uint64_t id)
+{
+	size_t lo = 0, hi = nids;
+
+	if (nattrs == 1)
+		return 0;
+	if (id == w->last_id)
+		return w->last_event;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (ids[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	w->last_id    = id;
+	w->last_event = lo < nids && ids[lo].id == id ? ids[lo].event : 0;
+	return w->last_event;
+}
+
+static void
+add_sample(const struct perf_pack_sample_s *s, void *arg)
+{
+	struct worker_s *w = arg;
+	int event = event_of(w, s->id);
+	uint64_t period = s->period ? s->period : 1;
+
+	w->samples++;
+	table_add(&w->table, BY_IP, event, s->pid, s->ip, 1, period);
+	table_add(&w->table, BY_THREAD, event, s->tid, s->pid, 1, period);
+	if (sample_type & PERF_SAMPLE_CPU)
+		table_add(&w->table, BY_CPU, event, s->cpu, 0, 1, period);
+	if ((sample_type & PERF_SAMPLE_ADDR) && s->addr && ndata_maps)
+		table_add(&w->table, BY_ALLOC, event, find_data_map(s->pid, s->addr), 0, 1, period);
+}
+
+static void
+add_record(const struct perf_event_header *hdr, void *arg)
+{
+	struct perf_sample_s s;
+	struct perf_pack_sample_s ps;
+
+	if (perf_sample_parse(&data.layout, hdr, &s) ||
+	    s.nr_ips > hdr->size / sizeof(uint64_t))
+		return;
+	perf_pack_sample(&ps, &s, sample_type);
+	add_sample(&ps, arg);
+}
+
+static void *
+chunk_thread(void *arg)
+{
+	struct worker_s *w = arg;
+	size_t c;
+
+	while ((c = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < nchunks)
+		perf_data_walk(&data, bounds[c], bounds[c + 1], add_record, w);
+	return NULL;
+}
+
+/*
+ * Reports
+ */
+
+static struct process_s *processes;
+static size_t nprocesses;
+
+/* the symbols of pid, from its executable mappings */
+static struct perf_symtab_s *
+symtab_of(uint32_t pid)
+{
+	for (size_t i = 0; i < nprocesses; i++) {
+		if (processes[i].pid == pid)
+			return &processes[i].symtab;
+	}
+	return NULL;
+}
+
+static void
+load_symtabs(void)
+{
+	for (size_t i = 0; i < nexec_maps; i++) {
+		const struct mapping_s *m = &exec_maps[i];
+		struct perf_symtab_s *st = symtab_of(m->pid);
+
+		if (st == NULL) {
+			processes = realloc(processes, (nprocesses + 1) * sizeof(*processes));
+			processes[nprocesses].pid = m->pid;
+			st = &processes[nprocesses++].symtab;
+			perf_symtab_init(st, -1);
+		}
+		perf_symtab_add_map(st, m->start, m->end, m->pgoff, m->path);
+	}
+}
+
+/* fold the ips into their functions */
+static void
+add_symbols(struct table_s *t)
+{
+	struct entry_s *ips = malloc((t->used ? t->used : 1) * sizeof(*ips));
+	size_t n = 0;
+
+	/* out of the table first, adding to it may move it */
+	for (size_t i = 0; i < t->size; i++) {
+		if (t->e[i].samples && t->e[i].kind == BY_IP)
+			ips[n++] = t->e[i];
+	}
+	for (size_t i = 0; i < n; i++) {
+		const struct entry_s *e = &ips[i];
+		const struct perf_frame_s *f = NULL;
+		struct perf_symtab_s *st;
+
+		if ((st = symtab_of(e->a)) != NULL)
+			f = perf_symtab_resolve(st, e->b);
+		if (f && f->id)
+			table_add(t, BY_SYMBOL, e->event, (uintptr_t) f->id, (uintptr_t) f->dso,
+				  e->samples, e->period);
+		else if (f && f->dso)
+			table_add(t, BY_SYMBOL, e->event, 0, (uintptr_t) f->dso, e->samples, e->period);
+		else
+			table_add(t, BY_SYMBOL, e->event, e->b, 0, e->samples, e->period);
+	}
+	free(ips);
+}
+
+static const char *
+basename_of(const char *path)
+{
+	const char *s = strrchr(path, '/');
+
+	return s ? s + 1 : path;
+}
+
+static void
+print_key(const struct entry_s *e)
+{
+	switch (e->kind) {
+	case BY_SYMBOL:
+		if (e->a && e->b)
+			printf("%s (%s)", ((const struct perf_sym_s *) (uintptr_t) e->a)->name,
+			       basename_of((const char *) (uintptr_t) e->b));
+		else if (e->b && *(const char *) (uintptr_t) e->b == '[')
+			printf("%s", (const char *) (uintptr_t) e->b);
+		else if (e->b)
+			printf("[%s]", basename_of((const char *) (uintptr_t) e->b));
+		else
+			printf("%#"PRIx64, e->a);
+		break;
+	case BY_THREAD:
+		printf("%-16s %7"PRIu64" %7"PRIu64, find_comm(e->a), e->b, e->a);
+		break;
+	case BY_CPU:
+		printf("cpu %"PRIu64, e->a);
+		break;
+	case BY_ALLOC:
+		if (e->a == NO_MAPPING) {
+			printf("[not mapped]");
+		} else {
+			const struct mapping_s *m = &data_maps[e->a];
+
+			printf("%7u %#14"PRIx64" %10"PRIu64"k %s", m->pid, m->start,
+			       (m->end - m->start) >> 10, m->path);
+		}
+		break;
+	}
+}
+
+static int
+cmp_entry(const void *x, const void *y)
+{
+	const struct entry_s *a = *(const struct entry_s * const *) x;
+	const struct entry_s *b = *(const struct entry_s * const *) y;
+
+	if (a->event != b->event)
+		return a->event < b->event ? -1 : 1;
+	return a->samples > b->samples ? -1 : a->samples < b->samples;
+}
+
+static void
+report(struct table_s *t, enum kind kind, const uint64_t *totals, int top)
+{
+	struct entry_s **rows = malloc(t->used * sizeof(*rows));
+	size_t n = 0;
+	char name[64];
+
+	for (size_t i = 0; i < t->size; i++) {
+		if (t->e[i].samples && t->e[i].kind == kind)
+			rows[n++] = &t->e[i];
+	}
+	if (n == 0) {
+		free(rows);
+		return;
+	}
+	qsort(rows, n, sizeof(*rows), cmp_entry);
+
+	for (size_t i = 0, shown = 0; i < n; i++) {
+		const struct entry_s *e = rows[i];
+
+		if (i == 0 || e->event != rows[i - 1]->event) {
+			size_t distinct = 0;
+
+			for (size_t j = i; j < n && rows[j]->event == e->event; j++)
+				distinct++;
+			printf("\n%s, %s: %zu\n", kind_names[kind],
+			       perf_region_event_name(attrs[e->event], name, sizeof(name)), distinct);
+			if (kind == BY_THREAD)
+				printf("  %10s %6s  %-16s %7s %7s\n", "samples", "", "comm", "pid", "tid");
+			else if (kind == BY_ALLOC)
+				printf("  %10s %6s  %7s %14s %11s %s\n", "samples", "", "pid",
+				       "start", "size", "mapping");
+			shown = 0;
+		}
+		if (shown++ >= (size_t) top)
+			continue;
+		printf("  %10"PRIu64" %5.1f%%  ", e->samples,
+		       totals[e->event] ? 100.0 * e->samples / totals[e->event] : 0.0);
+		print_key(e);
+		printf("\n");
+	}
+	free(rows);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-n top] file\n"
+			"  -j  threads (default: all the cpus)\n"
+			"  -n  rows per report (default: 10)\n"
+			"  file is a perf.data, or a pack of pe_pack\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN), top = 10, opt;
+	uint64_t t0, t1, t2, t3, samples = 0, bytes;
+	uint64_t totals[PERF_DATA_MAX_ATTRS] = { 0 };
+	struct worker_s *workers;
+	struct table_s merged;
+	char magic[8] = { 0 };
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "j:n:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			top = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc)
+		usage(argv[0]);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	f = fopen(argv[optind], "r");
+	if (f == NULL || fread(magic, 1, sizeof(magic), f) != sizeof(magic)) {
+		fprintf(stderr, "cannot read %s\n", argv[optind]);
+		return 1;
+	}
+	fclose(f);
+	is_pack = memcmp(magic, "PERFPAK1", 8) == 0;
+
+	/* the attrs and their ids, then the side band and the chunks */
+	t0 = now_ns();
+	if (is_pack) {
+		if (perf_pack_reader_open(&pack, argv[optind]))
+			return 1;
+		sample_type = pack.sample_type;
+		nattrs	    = pack.nattrs;
+		for (int i = 0; i < nattrs; i++) {
+			attrs[i] = &pack.attrs[i].attr;
+			add_ids(i, pack.attrs[i].ids, pack.attrs[i].nids);
+		}
+		bytes = pack.len;
+	} else {
+		if (perf_data_open(&data, argv[optind]))
+			return 1;
+		sample_type = data.sample_type;
+		nattrs	    = data.nattrs;
+		for (int i = 0; i < nattrs; i++) {
+			attrs[i] = &data.attrs[i].attr;
+			add_ids(i, data.attrs[i].ids, data.attrs[i].nids);
+		}
+		bounds	= malloc((nthreads * CHUNKS + 1) * sizeof(*bounds));
+		nchunks = perf_data_split(&data, bounds, nthreads * CHUNKS, side_band, NULL);
+		qsort(data_maps, ndata_maps, sizeof(*data_maps), cmp_mapping);
+		qsort(comms, ncomms, sizeof(*comms), cmp_comm);
+		bytes = data.data_size;
+	}
+	if (nattrs == 0) {
+		fprintf(stderr, "%s: no events\n", argv[optind]);
+		return 1;
+	}
+	qsort(ids, nids, sizeof(*ids), cmp_id);
+
+	/* every thread its own table */
+	t1 = now_ns();
+	workers = calloc(nthreads, sizeof(*workers));
+	for (int i = 0; i < nthreads; i++) {
+		table_init(&workers[i].table, TABLE_INIT);
+		workers[i].last_id = UINT64_MAX;
+	}
+	if (is_pack) {
+		void **args = calloc(nthreads, sizeof(*args));
+
+		for (int i = 0; i < nthreads; i++)
+			args[i] = &workers[i];
+		if (perf_pack_read(&pack, nthreads, add_sample, args))
+			return 1;
+		free(args);
+	} else {
+		for (int i = 0; i < nthreads; i++) {
+			if (pthread_create(&workers[i].thread, NULL, chunk_thread, &workers[i])) {
+				fprintf(stderr, "cannot start thread %d\n", i);
+				return 1;
+			}
+		}
+		for (int i = 0; i < nthreads; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	/* merged into the table of the first thread, the biggest first */
+	t2 = now_ns();
+	merged = workers[0].table;
+	for (int i = 1; i < nthreads; i++) {
+		struct table_s *t = &workers[i].table;
+
+		if (t->used > merged.used) {
+			struct table_s x = merged;
+
+			merged = *t;
+			*t     = x;
+		}
+		for (size_t j = 0; j < t->size; j++) {
+			const struct entry_s *e = &t->e[j];
+
+			if (e->samples)
+				table_add(&merged, e->kind, e->event, e->a, e->b, e->samples, e->period);
+		}
+		free(t->e);
+	}
+	for (int i = 0; i < nthreads; i++)
+		samples += workers[i].samples;
+	for (size_t i = 0; i < merged.size; i++) {
+		if (merged.e[i].samples && merged.e[i].kind == BY_THREAD)
+			totals[merged.e[i].event] += merged.e[i].samples;
+	}
+	load_symtabs();
+	add_symbols(&merged);
+	t3 = now_ns();
+
+	printf("%s: %"PRIu64" samples, %d events, %zu %s with %d threads\n", argv[optind],
+	       samples, nattrs, is_pack ? pack.nblocks : nchunks, is_pack ? "blocks" : "chunks",
+	       nthreads);
+	printf("  cut %.3f ms, added up %.3f ms (%.1f M samples/s, %.0f MB/s), "
+	       "merged and resolved %.3f ms\n", (t1 - t0) * 1e-6, (t2 - t1) * 1e-6,
+	       t2 > t1 ? samples * 1e3 / (t2 - t1) : 0.0,
+	       t2 > t1 ? bytes * 1e3 / (t2 - t1) : 0.0, (t3 - t2) * 1e-6);
+	if (!is_pack)
+		printf("  %"PRIu64" records, %zu executable and %zu data mappings, %zu comms\n",
+		       data.records, nexec_maps, ndata_maps, ncomms);
+
+	report(&merged, BY_SYMBOL, totals, top);
+	report(&merged, BY_THREAD, totals, top);
+	report(&merged, BY_CPU, totals, top);
+	report(&merged, BY_ALLOC, totals, top);
+
+	for (size_t i = 0; i < nprocesses; i++)
+		perf_symtab_fini(&processes[i].symtab);
+	if (is_pack)
+		perf_pack_reader_close(&pack);
+	else
+		perf_data_close(&data);
+	return 0;
+}
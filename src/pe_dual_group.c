@@ -20,6 +20,11 @@
 
 #include <sched.h>
 
+#include "perf_hash.h"
+#include "perf_ring.h"
+#include "perf_region.h"
+#include "perf_symtab.h"
+
 #define MATRIX_SIZE 512
 
 static double a[MATRIX_SIZE][MATRIX_SIZE];
@@ -63,15 +68,44 @@ void naive_matrix_multiply(int quiet) {
 
 #define TMSG(fd,...) do { if (!quiet) fprintf(fd, __VA_ARGS__); } while(0);
 
-struct perf_event_attr event_attr[2];
+/*
+ * Only the leader samples. Its records carry PERF_SAMPLE_READ with
+ * PERF_FORMAT_GROUP|PERF_FORMAT_ID: one snapshot of every member taken
+ * at the overflow, so the difference with the previous snapshot is what
+ * each member counted over the same interval as the leader, and their
+ * ratios (IPC, miss rates) can be charged to the sampled IP. One
+ * interrupt per leader period instead of one per member.
+ */
+#define MAX_MEMBERS	PERF_READ_MAX
+
+/* distinct sampled IPs, power of 2 */
+#define MAX_IPS		4096
+
+struct ip_stat_s {
+	uint64_t key;		/* ip plus one; 0: free slot */
+	uint64_t samples;
+	uint64_t delta[MAX_MEMBERS];
+};
+
+struct perf_event_attr event_attr[MAX_MEMBERS];
+struct perf_sample_layout_s event_layout;
 /* Size of buffer data (must be power of 2 */
 int buffer_pages = 1;
-void *event_buf[] = {NULL, NULL};
-size_t event_pgmsk;
+struct perf_ring_s event_ring;
+
+const char *events = "cycles,instructions";
+int num_members;
+char *member_name[MAX_MEMBERS];
+uint64_t member_id[MAX_MEMBERS];
+uint64_t member_last[MAX_MEMBERS];	/* value at the previous sample */
+
+struct ip_stat_s ip_stats[MAX_IPS];
+size_t num_ips;
+uint64_t ip_dropped;
 
 int quiet = 1;
-int fd[2];
-int samples[2];
+int fd[MAX_MEMBERS];
+uint64_t samples, switches, bad_reads;
 
 
 long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
@@ -84,286 +118,87 @@ long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 	return ret;
 }
 
-
-/*
- * event_buf already has the mmap'ed address for perf buffer,
- * So, go ahead and read the data.
- *
- * The payload data (event data) starts after the first page of control
- * information.
- */
-static int read_from_perf_buffer(int index, void *buf, size_t sz)
-{
-	struct perf_event_mmap_page *header = event_buf[index];
-	size_t pgmsk = event_pgmsk;
-	void *data;
-	unsigned long tail;
-	size_t avail_sz, min, c;
-
-	/*
-	 * data points to beginning of buffer payload
-	 */
-	data = ((void *)header) + sysconf(_SC_PAGESIZE);
-
-	/*
-	 * position of tail within the buffer payload.
-	 */
-	tail = header->data_tail & pgmsk;
-
-	/*
-	 * Size of available data.
-	 */
-	avail_sz = header->data_head - header->data_tail;
-	if (sz > avail_sz) {
-		TMSG(stderr, "Needed size is more than available size\n");
-		return -1;
-	}
-
-	/*
-	 * c = size till the end of buffer
-	 *
-	 * buffer size is a power of two.
-	 */
-	c = pgmsk + 1 - tail;
-
-	/*
-	 * min with requested size.
-	 */
-	min = c < sz ? c : sz;
-
-	/* copy beginning */
-	memcpy(buf, data + tail, min);
-
-	/* copy wrapped around leftover */
-	if (sz > min)
-		memcpy(buf + min, data, sz - min);
-
-	/* header->data_tail should reflect the last read data */
-	header->data_tail += sz;
-
-	return 0;
-}
-
-
-static int read_from_perf_buffer_64(int index, void *buf)
+static struct ip_stat_s *
+get_ip_stat(uint64_t ip)
 {
-	return read_from_perf_buffer(index, buf, sizeof(uint64_t));
-}
+	int fresh;
 
-
-/*
- * Not the data we need? Skip the data.
- */
-static void skip_perf_data(int index, size_t sz)
-{
-	struct perf_event_mmap_page *hdr = event_buf[index];
-
-	if ((hdr->data_tail + sz) > hdr->data_head)
-		sz = hdr->data_head - hdr->data_tail;
-
-	hdr->data_tail += sz;
+	return perf_hash_get(ip_stats, sizeof(struct ip_stat_s), MAX_IPS, &num_ips,
+			     perf_hash_u64(ip + 1), ip + 1, 1, NULL, NULL, &fresh);
 }
 
-static int is_more_perf_data(int index)
+static int
+member_index(uint64_t id)
 {
-	struct perf_event_mmap_page *hdr = event_buf[index];
-
-	if (hdr->data_tail < hdr->data_head)
-		return 1;
-
-	return 0;
+	for(int m=0; m<num_members; m++) {
+		if (member_id[m] == id)
+			return m;
+	}
+	return -1;
 }
 
-
-/*
- * The below parser is a stripped down version of perf source. To keep it
- * simple, it only looks for PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_CALLCHAIN,
- * PERF_SAMPLE_IP, PERF_SAMPLE_RAW and PERF_SAMPLE_TIME.
- * More parsers can be added if needed.
- */
-static int parse_perf_sample(int index, struct perf_event_header *ehdr)
+static void
+handle_sample(const struct perf_event_header *ehdr)
 {
-	size_t sz;
-	uint64_t type, fmt, val64;
-	uint64_t time_enabled, time_running;
-	const char *str;
-	int ret;
-	uint64_t value;
-	uint64_t id;
-	struct { uint32_t pid, tid; } pid;
+	struct perf_sample_s sample;
+	struct perf_read_s r;
+	uint64_t delta[MAX_MEMBERS];
 
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = event_attr[index].sample_type;
-	fmt = event_attr[index].read_format;
-
-	TMSG(stderr, "CONTEXT SWITCH: SW_EVENT\n");
-	TMSG(stderr, "  ");
-
-	if (type & PERF_SAMPLE_IDENTIFIER) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read IP");
-			return -1;
-		}
-		TMSG(stderr, "ID :%"PRIu64" ", val64);
-		sz -= sizeof(val64);
-	}
-
-	/*
-	 * the sample_type information is laid down
-	 * based on the PERF_RECORD_SAMPLE format specified
-	 * in the perf_event.h header file.
-	 * That order is different from the enum perf_event_sample_format.
-	 */
-	if (type & PERF_SAMPLE_IP) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read IP");
-			return -1;
-		}
-
-		/*
-		 * MISC_EXACT_IP indicates that kernel is returning
-		 * th  IIP of an instruction which caused the event, i.e.,
-		 * no skid
-		 */
-		TMSG(stderr, "IIP:%#016"PRIx64"  ", val64);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(index, &pid, sizeof(pid));
-		if (ret) {
-			TMSG(stderr, "cannot read PID");
-			return -1;
-		}
-
-		TMSG(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
+	if (perf_sample_parse(&event_layout, ehdr, &sample) ||
+	    perf_read_parse(event_layout.read_format, sample.read, sample.read_size, &r)) {
+		bad_reads++;
+		return;
 	}
+	samples++;
 
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read time");
-			return -1;
-		}
+	memset(delta, 0, sizeof(delta));
+	for(int i=0; i<r.nr; i++) {
+		int m = member_index(r.cntr[i].id);
 
-		TMSG(stderr, "TIME:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(index, &cpu, sizeof(cpu));
-		if (ret) {
-			TMSG(stderr, "cannot read cpu");
-			return -1;
-		}
-		TMSG(stderr, "CPU:%u  ", cpu.cpu);
-		sz -= sizeof(cpu);
+		if (m < 0)
+			continue;
+		delta[m] = r.cntr[i].value - member_last[m];
+		member_last[m] = r.cntr[i].value;
 	}
 
-	if (type & PERF_SAMPLE_PERIOD) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read period");
-			return -1;
-		}
-		TMSG(stderr, "PERIOD:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
+	struct ip_stat_s *st = get_ip_stat(sample.v[PERF_SF_IP]);
+	if (st == NULL) {
+		ip_dropped++;
+		return;
 	}
-
-	if (type & PERF_SAMPLE_CALLCHAIN) {
-		uint64_t nr, ip;
-
-		ret = read_from_perf_buffer_64(index, &nr);
-		if (ret) {
-			TMSG(stderr, "cannot read callchain nr");
-			return -1;
-		}
-		sz -= sizeof(nr);
-
-		TMSG(stderr, "\n  CALLCHAIN :\n");
-		while(nr--) {
-			ret = read_from_perf_buffer_64(index, &ip);
-			if (ret) {
-				TMSG(stderr, "cannot read ip");
-				return -1;
-			}
-
-			sz -= sizeof(ip);
-
-			TMSG(stderr, "\t0x%"PRIx64"\n", ip);
-		}
+	st->samples++;
+	for(int m=0; m<num_members; m++)
+		st->delta[m] += delta[m];
+
+	if (!quiet) {
+		TMSG(stderr, "IP:%#016"PRIx64" ", sample.v[PERF_SF_IP]);
+		for(int m=0; m<num_members; m++)
+			TMSG(stderr, " %s:%"PRIu64, member_name[m], delta[m]);
+		TMSG(stderr, "\n");
 	}
-
-	return 0;
 }
 
-static int parse_perf_switch(int index, struct perf_event_header *ehdr)
+static void
+handle_record(const struct perf_event_header *ehdr, void *arg)
 {
-	size_t sz;
-	uint64_t type, fmt, val64;
-	int ret;
-	struct { uint32_t pid, tid; } pid;
-
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = event_attr[index].sample_type;
-	fmt = event_attr[index].read_format;
-
-	if (ehdr->misc == PERF_RECORD_MISC_SWITCH_OUT) {
-		TMSG(stderr, "CONTEXT SWITCH: OUT\n");
-	} else {
-		TMSG(stderr, "CONTEXT SWITCH: IN\n");
-	}
-
-	TMSG(stderr, "  ");
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(index, &pid, sizeof(pid));
-		if (ret) {
-			TMSG(stderr, "cannot read PID");
-			return -1;
+	if (ehdr->type == PERF_RECORD_SAMPLE) {
+		handle_sample(ehdr);
+	} else if (ehdr->type == PERF_RECORD_SWITCH) {
+		switches++;
+		if (ehdr->misc & PERF_RECORD_MISC_SWITCH_OUT) {
+			TMSG(stderr, "CONTEXT SWITCH: OUT\n");
+		} else {
+			TMSG(stderr, "CONTEXT SWITCH: IN\n");
 		}
-
-		TMSG(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
-
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(index, &val64);
-		if (ret) {
-			TMSG(stderr, "cannot read time");
-			return -1;
-		}
-
-		TMSG(stderr, "TIME:%'"PRIu64"  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(index, &cpu, sizeof(cpu));
-		if (ret) {
-			TMSG(stderr, "cannot read cpu");
-			return -1;
-		}
-		TMSG(stderr, "CPU:%u\n", cpu.cpu);
-		sz -= sizeof(cpu);
+	} else {
+		/* Not the sample we are looking for */
+		TMSG(stderr, "skipping record type %d of %d bytes\n", ehdr->type, ehdr->size);
 	}
-
-	return 0;
 }
 
 static void sigio_handler(int n, siginfo_t *info, void *uc)
 {
-	static int num_samples = 0;
+	static int num_signals = 0;
 
 	if (info->si_code < 0) {
 		fprintf(stderr, "Required signal not generated\n");
@@ -375,56 +210,16 @@ static void sigio_handler(int n, siginfo_t *info, void *uc)
 		return;
 	}
 
-	int i, index = -1;
-	for(i=0; i<2; i++) {
-		if (info->si_fd == fd[i]) {
-			index = i;
-			break;
-		}
-	}
-
-	if (index < 0 || index > 1) {
+	if (info->si_fd != fd[0]) {
 		fprintf(stderr, "Wrong fd: %d\n", info->si_fd);
 		return;
 	}
 
-	TMSG(stderr, "%d. FD %d, SIGIO: %d\n", index, fd[index], num_samples++);
-
-	struct perf_event_header ehdr;
-	int ret;
-
-again:
-
-	ret = read_from_perf_buffer(index, &ehdr, sizeof(ehdr));
-	if (ret) {
-		fprintf(stderr, "cannot read event header\n");
-		return;
-	}
-
-	if (ehdr.type != PERF_RECORD_SAMPLE && ehdr.type != PERF_RECORD_SWITCH) {
-		/* Not the sample we are looking for */
-		fprintf(stderr, "skipping record type %d of %d bytes\n", ehdr.type, ehdr.size);
-		skip_perf_data(index, ehdr.size);
-	}
-	struct perf_event_mmap_page *header = event_buf[index];
-	int counter = header->index;
-	if (counter<0 || counter>1) {
-		fprintf(stderr, "Error counter: %d\n", counter);
-	}
-	
-	samples[counter]++;
-
-	if (ehdr.type == PERF_RECORD_SAMPLE) {
-		ret = parse_perf_sample(index, &ehdr);
+	TMSG(stderr, "FD %d, SIGIO: %d\n", fd[0], num_signals++);
 
-	} else if (ehdr.type == PERF_RECORD_SWITCH) {
-		ret = parse_perf_switch(index, &ehdr);
-	}
-
-	if (is_more_perf_data(index))
-		goto again;
+	perf_ring_drain(&event_ring, handle_record, NULL);
 
-	ret = ioctl(fd[0], PERF_EVENT_IOC_REFRESH, 1);
+	int ret = ioctl(fd[0], PERF_EVENT_IOC_REFRESH, 1);
 	if (ret == -1)
 		fprintf(stderr, "Error enable counter in IOC_REFRESH\n");
 }
@@ -438,54 +233,45 @@ int wait_loop(void)
 }
 
 int
-setup_perf(int index, unsigned int type, unsigned int config)
+setup_perf(int index, const char *name)
 {
-	memset(&event_attr[index], 0, sizeof(event_attr));
+	struct perf_event_attr *attr = &(event_attr[index]);
 
-	event_attr[index].disabled = index==0 ? 1 : 0;
-	event_attr[index].size 	   = sizeof(struct perf_event_attr);
-	event_attr[index].type 	   = type;
-	event_attr[index].config   = config;
+	memset(attr, 0, sizeof(struct perf_event_attr));
+	if (perf_region_event(name, attr))
+		return -1;
 
-	event_attr[index].sample_period = 4000;
-	event_attr[index].freq 		= 1;
+	attr->disabled = index==0 ? 1 : 0;
+	attr->size     = sizeof(struct perf_event_attr);
 
-	/* PERF_SAMPLE_STACK_USER may also be good to use */
-	event_attr[index].sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID |
-			PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_CPU |
-			PERF_SAMPLE_PERIOD;
+	/* the members only count, they are read in the leader's samples */
+	if (index == 0) {
+		attr->sample_period = 4000;
+		attr->freq	    = 1;
 
-	event_attr[index].context_switch = 1;
-	event_attr[index].sample_id_all = 1;
+		attr->sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+				PERF_SAMPLE_TIME | PERF_SAMPLE_CPU |
+				PERF_SAMPLE_PERIOD | PERF_SAMPLE_READ;
+		attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+
+		attr->context_switch = 1;
+		attr->sample_id_all = 1;
+	}
 
-	struct perf_event_attr *attr = &(event_attr[index]);
 	int fd_group_leader = -1;
 	if (index > 0) {
 		fd_group_leader = fd[0];
-	} 
+	}
 
 	fd[index] = perf_event_open(attr, 0, -1, fd_group_leader, 0);
 	if (fd[index] == -1) {
-		fprintf(stderr, "Error in perf_event_open : %d\n", errno);
+		fprintf(stderr, "Error in perf_event_open for %s: %s\n", name, strerror(errno));
 		return -1;
 	}
-	printf("%d. Opening %d, leader: %d = %d\n", index, config, fd_group_leader, fd[index]);
-	return 0;
-}
-
-int
-setup_buffer(int index)
-{
-	size_t pagesize = sysconf(_SC_PAGESIZE);
-	void *buf = mmap(NULL, (buffer_pages + 1) * pagesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd[index], 0);
-	if (buf == MAP_FAILED) {
-		fprintf(stderr, "Can't mmap buffer\n");
-		return -1;
-	}
-	event_buf[index]    = buf;
+	ioctl(fd[index], PERF_EVENT_IOC_ID, &member_id[index]);
+	member_name[index] = strdup(name);
 
-	size_t pgmsk = (buffer_pages * pagesize) - 1;
-	event_pgmsk  = pgmsk;
+	printf("%d. Opening %s, leader: %d = %d\n", index, name, fd_group_leader, fd[index]);
 	return 0;
 }
 
@@ -532,23 +318,139 @@ disable_counter(int index)
 		fprintf(stderr, "Error in IOC_DISABLE\n");
 		return -1;
 	}
-
-	close(fd[index]);
 	return 0;
 }
+
+static int
+cmp_ip_stat(const void *a, const void *b)
+{
+	const struct ip_stat_s *x = *(struct ip_stat_s * const *)a, *y = *(struct ip_stat_s * const *)b;
+
+	return x->delta[0] < y->delta[0] ? 1 : x->delta[0] > y->delta[0] ? -1 : 0;
+}
+
+/*
+ * The whole run from one read() of the leader, then the IPs by leader
+ * count with what each member counted per leader event there.
+ */
+static void
+report(int top)
+{
+	struct perf_read_s r;
+	uint64_t buf[1 + 2 * MAX_MEMBERS];
+	ssize_t n;
+
+	n = read(fd[0], buf, sizeof(buf));
+	if (n > 0 && perf_read_parse(event_attr[0].read_format, buf, n, &r) == 0) {
+		printf("\ntotal:\n");
+		for(int i=0; i<r.nr; i++) {
+			int m = member_index(r.cntr[i].id);
+
+			printf("%20s %20"PRIu64, m < 0 ? "?" : member_name[m], r.cntr[i].value);
+			if (i > 0 && r.cntr[0].value)
+				printf("   %.4f per %s", (double) r.cntr[i].value / r.cntr[0].value,
+				       member_name[0]);
+			printf("\n");
+		}
+	}
+
+	printf("\n%"PRIu64" samples, %"PRIu64" context switches, %zu ips", samples, switches, num_ips);
+	if (bad_reads)
+		printf(", %"PRIu64" samples without a group read", bad_reads);
+	if (ip_dropped)
+		printf(", %"PRIu64" samples dropped", ip_dropped);
+	printf("\n\n%9s %16s", "samples", member_name[0]);
+	for(int m=1; m<num_members; m++)
+		printf(" %16.16s", member_name[m]);
+	printf("  ip\n");
+
+	struct ip_stat_s **sorted = malloc(sizeof(struct ip_stat_s *) * (num_ips + 1));
+	int nsorted = 0;
+	for(int i=0; i<MAX_IPS; i++) {
+		if (ip_stats[i].samples)
+			sorted[nsorted++] = &ip_stats[i];
+	}
+	qsort(sorted, nsorted, sizeof(struct ip_stat_s *), cmp_ip_stat);
+
+	struct perf_symtab_s symtab;
+	int have_symtab = perf_symtab_init(&symtab, 0) == 0;
+
+	for(int i=0; i<nsorted && i<top; i++) {
+		struct ip_stat_s *st = sorted[i];
+
+		printf("%9"PRIu64" %16"PRIu64, st->samples, st->delta[0]);
+		for(int m=1; m<num_members; m++) {
+			if (st->delta[0])
+				printf(" %16.4f", (double) st->delta[m] / st->delta[0]);
+			else
+				printf(" %16s", "-");
+		}
+
+		const struct perf_frame_s *f = have_symtab ? perf_symtab_resolve(&symtab, st->key - 1) : NULL;
+		if (f && f->sym)
+			printf("  %s+0x%"PRIx64"\n", f->sym, f->off);
+		else
+			printf("  %#"PRIx64"\n", st->key - 1);
+	}
+	if (num_members > 1)
+		printf("(members per %s event at the ip)\n", member_name[0]);
+
+	if (have_symtab)
+		perf_symtab_fini(&symtab);
+	free(sorted);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-e events] [-v]\n"
+			"  -e  comma separated group, the leader first and sampling\n"
+			"      (default: %s)\n"
+			"  -v  print every sample\n", prog, events);
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
 	struct sigaction act;
+	char *list, *name, *save;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:v")) != -1) {
+		switch (opt) {
+		case 'e':
+			events = optarg;
+			break;
+		case 'v':
+			quiet = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
 
 	memset(&act, 0, sizeof(act));
 	act.sa_sigaction = sigio_handler;
 	act.sa_flags     = SA_SIGINFO;
 	sigaction(SIGIO, &act, 0);
 
-	setup_perf(0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
-	setup_perf(1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	list = strdup(events);
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		if (num_members == MAX_MEMBERS) {
+			fprintf(stderr, "at most %d events in the group\n", MAX_MEMBERS);
+			return -1;
+		}
+		if (setup_perf(num_members, name))
+			return -1;
+		num_members++;
+	}
+	free(list);
+	if (num_members == 0)
+		usage(argv[0]);
 
-	setup_buffer(0);
+	if (perf_ring_open(&event_ring, fd[0], buffer_pages))
+		return -1;
+	perf_sample_layout_init(&event_layout, &event_attr[0]);
 
 	setup_notification(0);
 
@@ -556,6 +458,19 @@ int main(int argc, char *argv[])
 
 	disable_counter(0);
 
-	printf("total samples cycles: %d\n", samples[0]);
-	printf("total samples instructions: %d\n", samples[1]);
+	/* whatever is left in the ring */
+	sigset_t sigio;
+	sigemptyset(&sigio);
+	sigaddset(&sigio, SIGIO);
+	sigprocmask(SIG_BLOCK, &sigio, NULL);
+	perf_ring_drain(&event_ring, handle_record, NULL);
+
+	report(20);
+	perf_ring_report(stdout, "\nring", &event_ring.stats);
+
+	perf_ring_close(&event_ring);
+	for(int m=0; m<num_members; m++) {
+		close(fd[m]);
+		free(member_name[m]);
+	}
 }
@@ -24,7 +24,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <errno.h>
 
 #include <sys/ioctl.h>
 #include <signal.h>
@@ -34,6 +36,13 @@
 
 #include <linux/perf_event.h>
 
+#include "perf_ring.h"
+#include "perf_addrmap.h"
+#include "perf_numa.h"
+#include "perf_ibs.h"
+#include "perf_symtab.h"
+#include "matrix_multiply.h"
+
 /* Profile everything (kernel/hypervisor/idle/user) or just user? */
 #undef USERSPACE_ONLY
 
@@ -52,85 +61,162 @@
 #define PERF_SIGNAL (SIGRTMIN+4)
 #define MAX_EVENTS  2
 
-typedef void * perf_buffer_t;
-
 static int count_total[MAX_EVENTS] = {0,0};
 static int event_fd[MAX_EVENTS];
-static perf_buffer_t event_buf[MAX_EVENTS];
+static struct perf_ring_s event_ring[MAX_EVENTS];
 
 #define buffer_pages 1
-static size_t pagesize;
-static size_t pgmsk;
 
 static uint64_t sample_type = PERF_SAMPLE_PERIOD | PERF_SAMPLE_IP 
 			    | PERF_SAMPLE_ADDR   | PERF_SAMPLE_CPU
 			    | PERF_SAMPLE_TID    | PERF_SAMPLE_RAW;
 
-#define MAX_MALLOC	3
-
 struct mem_alloc_s {
 	void *address;
 	size_t size;
 	char *var_name;
+	uint32_t id;			/* from 1, the numa label */
 	uint64_t num_samples;
+	struct mem_alloc_s *next;
 };
 
-struct perf_mmap_data_s {
-  uint64_t period;
-  uint64_t ip;
-  uint64_t address;
-  uint32_t cpu;
-  uint32_t res;
-  uint32_t pid;
-  uint32_t tid;
-};
+/* every allocation, in order; mem_map maps the live ones to their record */
+static struct mem_alloc_s *mem_allocations = NULL;
+static struct mem_alloc_s **mem_allocations_tail = &mem_allocations;
+static uint32_t num_allocations = 0;
+static struct perf_addrmap_s mem_map;
+static struct perf_addrmap_cache_s mem_cache;
+static struct perf_sample_layout_s sample_layout;
+
+/* -n: node of the sampled pages against the node of the sampling cpu */
+#define NUMA_PAGES	(1 << 18)
+
+static int use_numa = 0;
+static struct perf_numa_s numa;
 
-static char *var_names[] = {"A", "B", "C"};
-static int num_mallocs = 0;
-static struct mem_alloc_s  mem_allocation[MAX_MALLOC];
-static struct perf_mmap_data_s   event_data[MAX_EVENTS];
+/* the raw IBS op records, decoded as they come; -o keeps them for bench_ibs -r */
+#define IBS_IPS		(1 << 14)
+#define FIXTURE_RECORDS	(1 << 16)
+#define FIXTURE_RECORD	80	/* u32 size and a raw record with every register */
+
+static struct perf_ibs_batch_s ibs_batch;
+static struct perf_ibs_profile_s ibs_profile;
+static unsigned char *fixture;
+static size_t fixture_len;
+static uint64_t fixture_records, fixture_dropped;
 
 static void*
-wrap_malloc(size_t size)
+wrap_malloc(size_t size, char *name)
 {
+	struct mem_alloc_s *mem = calloc(1, sizeof(*mem));
 	void *var = malloc(size);
-	for (int i=0; i<MAX_MALLOC; i++) {
-		if (mem_allocation[i].address == NULL) {
-			mem_allocation[num_mallocs].address = var;
-			mem_allocation[num_mallocs].size    = size;
-      mem_allocation[num_mallocs].var_name = var_names[i];
-			num_mallocs++;
-
-			return var;
-		}
+
+	if (mem == NULL || var == NULL) {
+		free(mem);
+		free(var);
+		return NULL; // out of memory
+	}
+	mem->address  = var;
+	mem->size     = size;
+	mem->var_name = name;
+	mem->id	      = num_allocations + 1;
+
+	if (perf_addrmap_insert(&mem_map, (uintptr_t) var, (uintptr_t) var + size,
+				(uintptr_t) mem) < 0) {
+		fprintf(stderr, "cannot track allocation %s\n", name);
+		free(mem);
+		free(var);
+		return NULL;
 	}
-	return NULL; // out of memory
+	num_allocations++;
+
+	*mem_allocations_tail = mem;
+	mem_allocations_tail  = &mem->next;
+	return var;
 }
 
 
 static void
 wrap_free(void *address)
 {
-	for(int i=0; i<MAX_MALLOC; i++) {
-		if (mem_allocation[i].address == address) {
-			mem_allocation[i].address = NULL;
-			mem_allocation[i].size	  = 0;
-      mem_allocation[i].var_name = NULL;
-			num_mallocs--;
-		}
-	}
+	perf_addrmap_remove(&mem_map, (uintptr_t) address, NULL);
+}
+
+/* async-signal-safe */
+static void
+update_ibs(const struct perf_sample_s *sample)
+{
+  if (perf_ibs_batch_add(&ibs_batch, sample->raw, sample->raw_size) == 1) {
+      perf_ibs_decode(&ibs_batch);
+      perf_ibs_profile_add(&ibs_profile, &ibs_batch);
+  }
+
+  if (fixture == NULL)
+      return;
+  if (fixture_len + sizeof(uint32_t) + sample->raw_size > FIXTURE_RECORDS * FIXTURE_RECORD) {
+      fixture_dropped++;
+      return;
+  }
+  memcpy(fixture + fixture_len, &sample->raw_size, sizeof(uint32_t));
+  memcpy(fixture + fixture_len + sizeof(uint32_t), sample->raw, sample->raw_size);
+  fixture_len += sizeof(uint32_t) + sample->raw_size;
+  fixture_records++;
 }
 
 static int
-update(void *address)
+write_fixture(const char *path)
 {
-  for(int i=0; i<MAX_MALLOC; i++) {
-      if (mem_allocation[i].address != NULL    &&
-          address >= mem_allocation[i].address &&
-          address <  mem_allocation[i].address+mem_allocation[i].size) {
-          mem_allocation[i].num_samples++;
-      }
+  FILE *out = fopen(path, "w");
+
+  if (out == NULL) {
+      fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+      return -1;
+  }
+  if (perf_ibs_fixture_header(out, fixture_records) ||
+      fwrite(fixture, 1, fixture_len, out) != fixture_len) {
+      fprintf(stderr, "cannot write %s\n", path);
+      fclose(out);
+      return -1;
+  }
+  fclose(out);
+
+  printf("%"PRIu64" ibs records written to %s", fixture_records, path);
+  if (fixture_dropped)
+      printf(", %"PRIu64" dropped", fixture_dropped);
+  printf("\n");
+  return 0;
+}
+
+static const char *
+ibs_label(uint64_t ip, void *arg)
+{
+  static char buf[256];
+  const struct perf_frame_s *f = perf_symtab_resolve(arg, ip);
+
+  if (f->sym)
+      snprintf(buf, sizeof(buf), "%s+%#"PRIx64, f->sym, f->off);
+  else if (f->dso)
+      snprintf(buf, sizeof(buf), "%s+%#"PRIx64, f->dso, f->off);
+  else
+      return NULL;
+  return buf;
+}
+
+/* async-signal-safe */
+static void
+update(const struct perf_sample_s *sample)
+{
+  struct perf_addrmap_entry_s entry;
+  uint32_t label = 0;
+
+  if (perf_addrmap_lookup(&mem_map, sample->v[PERF_SF_ADDR], &mem_cache, &entry) == 1) {
+      struct mem_alloc_s *mem = (struct mem_alloc_s *)(uintptr_t) entry.value;
+      mem->num_samples++;
+      label = mem->id;
   }
+
+  if (use_numa)
+      perf_numa_add(&numa, sample->v[PERF_SF_ADDR], perf_sample_cpu(sample), label);
 }
 
 
@@ -182,241 +268,6 @@ get_fd(int sig_fd)
 	return -1;
 }
 
-/*
- * event_buf already has the mmap'ed address for perf buffer,
- * So, go ahead and read the data.
- *
- * The payload data (event data) starts after the first page of control
- * information.
- */
-static int read_from_perf_buffer(void *event_buf, void *buf, size_t sz)
-{
-	struct perf_event_mmap_page *header = event_buf;
-	void *data;
-	unsigned long tail;
-	size_t avail_sz, min, c;
-
-	/*
-	 * data points to beginning of buffer payload
-	 */
-	data = ((void *)header) + sysconf(_SC_PAGESIZE);
-
-	/*
-	 * position of tail within the buffer payload.
-	 */
-	tail = header->data_tail & pgmsk;
-
-	/*
-	 * Size of available data.
-	 */
-	avail_sz = header->data_head - header->data_tail;
-	if (sz > avail_sz) {
-		fprintf(stderr, "Needed size is more than available size\n");
-		return -1;
-	}
-
-	/*
-	 * c = size till the end of buffer
-	 *
-	 * buffer size is a power of two.
-	 */
-	c = pgmsk + 1 - tail;
-
-	/*
-	 * min with requested size.
-	 */
-	min = c < sz ? c : sz;
-
-	/* copy beginning */
-	memcpy(buf, data + tail, min);
-
-	/* copy wrapped around leftover */
-	if (sz > min)
-		memcpy(buf + min, data, sz - min);
-
-	/* header->data_tail should reflect the last read data */
-	header->data_tail += sz;
-
-	return 0;
-}
-
-
-static int read_from_perf_buffer_64(void *event_buf, void *buf)
-{
-	return read_from_perf_buffer(event_buf, buf, sizeof(uint64_t));
-}
-
-
-
-/*
- * The below parser is a stripped down version of perf source. To keep it
- * simple, it only looks for PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_CALLCHAIN,
- * PERF_SAMPLE_IP, PERF_SAMPLE_RAW and PERF_SAMPLE_TIME.
- * More parsers can be added if needed.
- */
-static int parse_perf_sample(void *event_buf, struct perf_event_header *ehdr,
-                             struct perf_mmap_data_s *data, int verbose)
-{
-	size_t sz;
-	uint64_t type, val64;
-	uint64_t time_enabled, time_running;
-	const char *str;
-	int ret;
-	uint64_t value;
-	uint64_t id;
-	struct { uint32_t pid, tid; } pid;
-
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = sample_type;
-
-	if (type & PERF_SAMPLE_IDENTIFIER) {
-		ret = read_from_perf_buffer_64(event_buf, &val64);
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-		fprintf(stderr, "ID :%llu ", val64);
-		sz -= sizeof(val64);
-	}
-
-	/*
-	 * the sample_type information is laid down
-	 * based on the PERF_RECORD_SAMPLE format specified
-	 * in the perf_event.h header file.
-	 * That order is different from the enum perf_event_sample_format.
-	 */
-	if (type & PERF_SAMPLE_IP) {
-		ret = read_from_perf_buffer_64(event_buf, &(data->ip));
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-
-		/*
-		 * MISC_EXACT_IP indicates that kernel is returning
-		 * th  IIP of an instruction which caused the event, i.e.,
-		 * no skid
-		 */
-		if (verbose) fprintf(stderr, "IP: 0x%x  ", data->ip);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(event_buf, &pid, sizeof(pid));
-		if (ret) {
-			fprintf(stderr, "cannot read PID");
-			return -1;
-		}
-		data->pid = pid.pid;
-		data->tid = pid.tid;
-
-		if (verbose) fprintf(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
-
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(event_buf, &val64);
-		if (ret) {
-			fprintf(stderr, "cannot read time");
-			return -1;
-		}
-
-		if (verbose) fprintf(stderr, "TIME:%llu  ", val64);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_ADDR) {
-		ret = read_from_perf_buffer_64(event_buf, &(data->address));
-		if (ret) {
-			fprintf(stderr, "cannot read time");
-			return -1;
-		}
-
-		if (verbose) fprintf(stderr, "ADDR: 0x%x  ", data->address);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(event_buf, &cpu, sizeof(cpu));
-		if (ret) {
-			fprintf(stderr, "cannot read cpu");
-			return -1;
-		}
-		data->cpu = cpu.cpu;
-		data->res = cpu.reserved;
-
-		if (verbose) fprintf(stderr, "CPU:%u  ", cpu.cpu);
-		sz -= sizeof(cpu);
-	}
-
-	if (type & PERF_SAMPLE_PERIOD) {
-		ret = read_from_perf_buffer_64(event_buf, &(data->period));
-		if (ret) {
-			fprintf(stderr, "cannot read period");
-			return -1;
-		}
-
-		if (verbose) fprintf(stderr, "PERIOD:%llu  ", data->period);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_CALLCHAIN) {
-		uint64_t nr, ip;
-
-		ret = read_from_perf_buffer_64(event_buf, &nr);
-		if (ret) {
-			fprintf(stderr, "cannot read callchain nr");
-			return -1;
-		}
-		sz -= sizeof(nr);
-
-		if (verbose) fprintf(stderr, "\n  CALLCHAIN :\n");
-		while(nr--) {
-			ret = read_from_perf_buffer_64(event_buf, &ip);
-			if (ret) {
-				fprintf(stderr, "cannot read ip");
-				return -1;
-			}
-
-			sz -= sizeof(ip);
-
-			if (verbose) fprintf(stderr, "\t0x%llu\n", ip);
-		}
-	}
-
-	if (verbose) fprintf(stderr, "\n");
-	return 0;
-}
-
-
-/*
- * Not the data we need? Skip the data.
- */
-static void skip_perf_data(void *event_buf, size_t sz)
-{
-	struct perf_event_mmap_page *hdr = event_buf;
-
-	if ((hdr->data_tail + sz) > hdr->data_head)
-		sz = hdr->data_head - hdr->data_tail;
-
-	hdr->data_tail += sz;
-}
-
-static int is_more_perf_data(void *event_buf)
-{
-	struct perf_event_mmap_page *hdr = event_buf;
-
-	if (hdr->data_tail < hdr->data_head)
-		return 1;
-
-	return 0;
-}
-
-
 static 
 void event_handler(int signum, siginfo_t *info, void *uc)
 {
@@ -438,23 +289,22 @@ void event_handler(int signum, siginfo_t *info, void *uc)
 		fprintf(stderr, "unknown fd: %d\n", fd);
 	}
 
-	struct perf_event_header ehdr;
-again:
-	ret = read_from_perf_buffer(event_buf[index], &ehdr, sizeof(ehdr));
-	if (ret) {
-		fprintf(stderr, "cannot read event header\n");
-		return;
-	}
-	if (ehdr.type == PERF_RECORD_SAMPLE) {
-		ret = parse_perf_sample(event_buf[index], &ehdr, &event_data[index], 0);
-		update((void*)event_data[index].address);
+	const struct perf_event_header *ehdr;
+	struct perf_sample_s sample;
 
-	}  else {
-		skip_perf_data(event_buf[index], ehdr.size);
-	}
+	perf_ring_begin(&event_ring[index]);
+	while ((ehdr = perf_ring_next(&event_ring[index])) != NULL) {
+		if (ehdr->type != PERF_RECORD_SAMPLE)
+			continue;
 
-	if (is_more_perf_data(event_buf))
-		goto again;
+		if (perf_sample_parse(&sample_layout, ehdr, &sample) != 0)
+			continue;
+		update(&sample);
+		/* the first event is the ibs_op one */
+		if (index == 0)
+			update_ibs(&sample);
+	}
+	perf_ring_end(&event_ring[index]);
 
 	count_total[index]++;
 
@@ -497,19 +347,6 @@ int setup_notification(int fd)
 	return ret;
 }
 
-static void*
-setup_buffer(int fd)
-{
-	void *buf = mmap(NULL, (buffer_pages + 1) * pagesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (buf == MAP_FAILED) {
-		fprintf(stderr, "Can't mmap buffer\n");
-		return NULL;
-	}
-
-	return buf;
-}
-
-
 static
 int setup_counters(uint64_t type, uint64_t config, uint64_t period, uint64_t freq)
 {
@@ -544,6 +381,9 @@ int setup_counters(uint64_t type, uint64_t config, uint64_t period, uint64_t fre
 	attr.read_format   = 0;
 	attr.pinned = 0;
 
+	/* all the events share the same sample_type */
+	if (perf_sample_layout_init(&sample_layout, &attr))
+		exit(1);
 
 	event_fd[index] = sys_perf_event_open(&attr, 0, -1, -1, 0);
 	if (event_fd[index] < 0) {
@@ -551,8 +391,7 @@ int setup_counters(uint64_t type, uint64_t config, uint64_t period, uint64_t fre
 	}
 	int fd = event_fd[index];
 
-	event_buf[index] = setup_buffer(fd);
-	if (event_buf[index] == NULL) {
+	if (perf_ring_open(&event_ring[index], fd, buffer_pages)) {
 		exit(2);
 	}
 
@@ -572,7 +411,9 @@ read_counters(int index)
 	res = read(event_fd[index], &counter_result, sizeof(unsigned long long));
 	assert(res == sizeof(unsigned long long));
 
-	printf("[%d] counter:\t\t%lld\n[%d] Num counter: %d\n\n", index, counter_result, index, count_total[index]);
+	printf("[%d] counter:\t\t%lld\n[%d] Num counter: %d\n", index, counter_result, index, count_total[index]);
+	perf_ring_report(stdout, "    ring", &event_ring[index].stats);
+	printf("\n");
 }
 
 static void
@@ -586,37 +427,45 @@ setup_handler()
 	sigaction(PERF_SIGNAL, &act, 0);
 }
 
-void gemm_omp(double *A, double *B, double *C, int n) 
-{   
-    #pragma omp parallel
-    {
-        int i, j, k;
-        #pragma omp for
-        for (i = 0; i < n; i++) { 
-            for (j = 0; j < n; j++) {
-                double dot  = 0;
-                for (k = 0; k < n; k++) {
-                    dot += A[i*n+k]*B[k*n+j];
-                } 
-                C[i*n+j ] = dot;
-            }
-        }
-
-    }
-}
-
-
-
 int
 main(int argc, char *argv[])
 {
 	const unsigned int  n=164;
 	const unsigned int  nn=n*n;
+	const char *fixture_path = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "no:")) != -1) {
+		switch (c) {
+		case 'n':
+			use_numa = 1;
+			break;
+		case 'o':
+			fixture_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n] [-o fixture]\n"
+					"  -n  node of the sampled pages against the node of\n"
+					"      the sampling cpu, per variable\n"
+					"  -o  keep the raw ibs records in a fixture for bench_ibs -r\n", argv[0]);
+			exit(1);
+		}
+	}
 
-	memset(mem_allocation, 0, sizeof(mem_allocation));
-
-	pagesize = sysconf(_SC_PAGESIZE);
-	pgmsk = (buffer_pages * pagesize) - 1;
+	if (perf_addrmap_init(&mem_map))
+		exit(1);
+	if (use_numa && perf_numa_init(&numa, NUMA_PAGES))
+		exit(1);
+	if (perf_ibs_profile_init(&ibs_profile, IBS_IPS))
+		exit(1);
+	if (fixture_path) {
+		fixture = mmap(NULL, FIXTURE_RECORDS * FIXTURE_RECORD, PROT_READ|PROT_WRITE,
+			       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (fixture == MAP_FAILED) {
+			fprintf(stderr, "cannot map the fixture: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
 
 	setup_handler();
 
@@ -637,9 +486,9 @@ main(int argc, char *argv[])
 	int i;
 	double *A, *B, *C, dtime;
 
-  A = (double*)wrap_malloc(sizeof(double)*nn);
-  B = (double*)wrap_malloc(sizeof(double)*nn);
-  C = (double*)wrap_malloc(sizeof(double)*nn);
+  A = (double*)wrap_malloc(sizeof(double)*nn, "A");
+  B = (double*)wrap_malloc(sizeof(double)*nn, "B");
+  C = (double*)wrap_malloc(sizeof(double)*nn, "C");
 
 	printf("A: %p - %p   B: %p - %p     C: %p - %p\n", A, A+nn, B, B+nn, C, C+nn);
 
@@ -653,18 +502,49 @@ main(int argc, char *argv[])
 
 	gemm_omp(A, B, C, n);
 
-	stop_counters(fd);
+	stop_all();
 	read_counters(0);
 	read_counters(1);
 
-	for (i=0; i<MAX_MALLOC; i++) {
-	    printf("Var: %s, address: %p-%p, size: %d, samples: %d\n", mem_allocation[i].var_name, mem_allocation[i].address,
-	           mem_allocation[i].address+mem_allocation[i].size, mem_allocation[i].size, mem_allocation[i].num_samples);
+	for (struct mem_alloc_s *mem = mem_allocations; mem; mem = mem->next) {
+	    printf("Var: %s, address: %p-%p, size: %zu, samples: %"PRIu64"\n", mem->var_name, mem->address,
+	           mem->address+mem->size, mem->size, mem->num_samples);
+	}
+
+	/* what is left in the batch, the handler is done */
+	perf_ibs_decode(&ibs_batch);
+	perf_ibs_profile_add(&ibs_profile, &ibs_batch);
+	if (ibs_batch.short_records)
+	    printf("%"PRIu64" raw records too short for an ibs op\n", ibs_batch.short_records);
+
+	struct perf_symtab_s symtab;
+	int have_symtab = perf_symtab_init(&symtab, 0) == 0;
+	perf_ibs_report(&ibs_profile, stdout, 20, have_symtab ? ibs_label : NULL, &symtab);
+	if (have_symtab)
+	    perf_symtab_fini(&symtab);
+	perf_ibs_profile_fini(&ibs_profile);
+
+	if (fixture_path) {
+	    write_fixture(fixture_path);
+	    munmap(fixture, FIXTURE_RECORDS * FIXTURE_RECORD);
+	}
+
+	/* the variables are still there, ask where their pages are */
+	if (use_numa) {
+	    const char **names = calloc(num_allocations + 1, sizeof(char *));
+	    names[0] = "(untracked)";
+	    for (struct mem_alloc_s *mem = mem_allocations; mem; mem = mem->next)
+	        names[mem->id] = mem->var_name;
+	    perf_numa_resolve(&numa);
+	    perf_numa_report(&numa, stdout, names, num_allocations + 1);
+	    perf_numa_fini(&numa);
+	    free(names);
 	}
 
 	wrap_free(A);
 	wrap_free(B);
-	wrap_free(B);
+	wrap_free(C);
+	perf_addrmap_fini(&mem_map);
 
 	return 0;
 }
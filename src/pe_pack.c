@@ -0,0 +1,256 @@
+/*
+ * Packed sample files, see perf_pack.h:
+ *
+ *   pe_pack [-b samples] [-j threads] in.data out.pack
+ *   pe_pack -r file.pack [-j threads]
+ *
+ * The first form packs the samples of a perf.data written by
+ * perf_writer (pe_sample -o, for instance), blocks of -b samples, and
+ * prints how much smaller they got. It then reads the pack back with -j
+ * threads and checks that every sample came back: the samples of the
+ * perf.data and of the pack are hashed, and the sums compared, as the
+ * blocks come back in any order.
+ *
+ * -r only reads a pack back, with -j threads (all the cpus by
+ * default), and prints how fast.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "perf_data.h"
+#include "perf_pack.h"
+
+/* what every thread adds up, a line of its own */
+struct sum_s {
+	uint64_t	samples;
+	uint64_t	hash;		/* sum of the hashes of the samples */
+	uint64_t	ips;
+	char		pad[40];
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t
+mix(uint64_t h, uint64_t v)
+{
+	h = (h ^ v) * 0x9e3779b97f4a7c15ull;
+	return h ^ (h >> 29);
+}
+
+static uint64_t
+sample_hash(const struct perf_pack_sample_s *s)
+{
+	uint64_t h = mix(0, s->id);
+
+	h = mix(h, (uint64_t) s->pid << 32 | s->tid);
+	h = mix(h, s->cpu);
+	h = mix(h, s->period);
+	h = mix(h, s->time);
+	h = mix(h, s->ip);
+	h = mix(h, s->addr);
+	h = mix(h, s->nr_ips);
+	for (uint64_t i = 0; i < s->nr_ips; i++)
+		h = mix(h, s->ips[i]);
+	return h;
+}
+
+static void
+add_sample(const struct perf_pack_sample_s *s, void *arg)
+{
+	struct sum_s *sum = arg;
+
+	sum->samples++;
+	sum->hash += sample_hash(s);
+	sum->ips  += s->nr_ips;
+}
+
+/* decode with nthreads threads, returns the sum of them all */
+static int
+read_pack(struct perf_pack_reader_s *r, int nthreads, struct sum_s *total)
+{
+	struct sum_s *sums = calloc(nthreads, sizeof(*sums));
+	void **args = calloc(nthreads, sizeof(*args));
+	uint64_t start, ns;
+	int ret;
+
+	if (sums == NULL || args == NULL) {
+		free(sums);
+		free(args);
+		return -1;
+	}
+	for (int i = 0; i < nthreads; i++)
+		args[i] = &sums[i];
+
+	start = now_ns();
+	ret = perf_pack_read(r, nthreads, add_sample, args);
+	ns = now_ns() - start;
+
+	memset(total, 0, sizeof(*total));
+	for (int i = 0; i < nthreads; i++) {
+		total->samples += sums[i].samples;
+		total->hash    += sums[i].hash;
+		total->ips     += sums[i].ips;
+	}
+	printf("read %"PRIu64" samples of %zu blocks with %d threads in %.3f ms: "
+	       "%.1f M samples/s, %.0f MB/s, %"PRIu64" corrupt blocks\n",
+	       total->samples, r->nblocks, nthreads, ns * 1e-6,
+	       ns ? total->samples * 1e3 / ns : 0.0, ns ? r->len * 1e3 / ns : 0.0,
+	       r->errors);
+
+	free(sums);
+	free(args);
+	return ret || r->errors ? -1 : 0;
+}
+
+/* what packing a perf.data goes through */
+struct convert_s {
+	struct perf_pack_s	 pack;
+	struct perf_data_s	*data;
+	struct sum_s		 expect;
+};
+
+/* hash a sample the way the pack will give it back, then pack it */
+static void
+convert_record(const struct perf_event_header *hdr, void *arg)
+{
+	struct convert_s *c = arg;
+	struct perf_sample_s s;
+	struct perf_pack_sample_s ps;
+
+	if (perf_sample_parse(&c->data->layout, hdr, &s) == 0 &&
+	    s.nr_ips <= hdr->size / sizeof(uint64_t)) {
+		perf_pack_sample(&ps, &s, c->data->sample_type);
+		add_sample(&ps, &c->expect);
+	}
+	perf_pack_record(&c->pack, hdr);
+}
+
+static int
+pack(const char *in, const char *out, size_t block, int nthreads)
+{
+	struct perf_data_s d;
+	struct convert_s c;
+	struct perf_pack_reader_s r;
+	struct sum_s got;
+	uint64_t bounds[2], start, ns;
+	int ret = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.data = &d;
+	if (perf_data_open(&d, in))
+		return 1;
+	if (perf_pack_open(&c.pack, out, block)) {
+		perf_data_close(&d);
+		return 1;
+	}
+	for (int i = 0; i < d.nattrs; i++) {
+		if (perf_pack_add_attr(&c.pack, &d.attrs[i].attr, d.attrs[i].ids, d.attrs[i].nids)) {
+			perf_pack_close(&c.pack);
+			perf_data_close(&d);
+			return 1;
+		}
+	}
+
+	start = now_ns();
+	if (perf_data_split(&d, bounds, 1, NULL, NULL))
+		perf_data_walk(&d, bounds[0], bounds[1], convert_record, &c);
+	if (perf_pack_close(&c.pack)) {
+		perf_data_close(&d);
+		return 1;
+	}
+	ns = now_ns() - start;
+	perf_data_close(&d);
+
+	printf("%s: %"PRIu64" records, %"PRIu64" samples of %"PRIu64" bytes, "
+	       "%"PRIu64" callchain entries\n", in, d.records, c.pack.samples,
+	       c.pack.record_bytes, c.expect.ips);
+	printf("%s: %"PRIu64" blocks, %"PRIu64" bytes, %.2f bytes per sample, "
+	       "%.1fx smaller, packed in %.3f ms\n", out, c.pack.blocks, c.pack.bytes,
+	       c.pack.samples ? (double) c.pack.bytes / c.pack.samples : 0.0,
+	       c.pack.bytes ? (double) c.pack.record_bytes / c.pack.bytes : 0.0, ns * 1e-6);
+
+	if (perf_pack_reader_open(&r, out))
+		return 1;
+	if (read_pack(&r, nthreads, &got))
+		ret = 1;
+	if (got.samples != c.expect.samples || got.hash != c.expect.hash) {
+		fprintf(stderr, "check: %"PRIu64" samples read back, %"PRIu64" packed, "
+			"hashes %016"PRIx64" %016"PRIx64"\n", got.samples, c.expect.samples,
+			got.hash, c.expect.hash);
+		ret = 1;
+	} else {
+		printf("check: every sample read back\n");
+	}
+	perf_pack_reader_close(&r);
+	return ret;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b samples] [-j threads] in.data out.pack\n"
+			"       %s -r file.pack [-j threads]\n"
+			"  -b  samples per block (default: %d)\n"
+			"  -j  threads reading the pack (default: all the cpus)\n"
+			"  -r  only read a pack, and time it\n",
+		prog, prog, PERF_PACK_BLOCK);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct perf_pack_reader_s r;
+	struct sum_s sum;
+	const char *in = NULL;
+	size_t block = 0;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN), opt, ret;
+
+	while ((opt = getopt(argc, argv, "b:j:r:")) != -1) {
+		switch (opt) {
+		case 'b':
+			block = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'r':
+			in = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	if (in == NULL) {
+		if (optind + 2 != argc)
+			usage(argv[0]);
+		return pack(argv[optind], argv[optind + 1], block, nthreads);
+	}
+
+	if (optind != argc)
+		usage(argv[0]);
+	if (perf_pack_reader_open(&r, in))
+		return 1;
+	printf("%s: %"PRIu64" samples, sample_type %#"PRIx64", %d attrs\n",
+	       in, r.samples, r.sample_type, r.nattrs);
+	ret = read_pack(&r, nthreads, &sum);
+	perf_pack_reader_close(&r);
+	return ret != 0;
+}
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <errno.h>
 
@@ -33,8 +34,18 @@
 #include <sys/mman.h>
 #include <sys/prctl.h>
 
+#include <omp.h>
+
 #include <linux/perf_event.h>
 
+#include "perf_ring.h"
+#include "perf_collector.h"
+#include "perf_spsc.h"
+#include "perf_addrmap.h"
+#include "perf_heatmap.h"
+#include "perf_numa.h"
+#include "matrix_multiply.h"
+
 /* Profile everything (kernel/hypervisor/idle/user) or just user? */
 #undef USERSPACE_ONLY
 
@@ -52,32 +63,25 @@
 
 #define PERF_SIGNAL (SIGRTMIN+4)
 #define MAX_EVENTS  2
+#define MAX_THREADS 256
 
 #define buffer_pages 1
 
-#define MAX_MALLOC  3
-
 struct mem_alloc_s {
   void *address;
   size_t size;
   char *var_name;
-  uint64_t num_samples;
-};
-
-struct perf_mmap_data_s {
-  uint64_t period;
-  uint64_t ip;
-  uint64_t address;
-  uint32_t cpu;
-  uint32_t res;
-  uint32_t pid;
-  uint32_t tid;
+  uint32_t id;				/* from 1, the numa label */
+  uint64_t num_samples[MAX_THREADS];	/* per sampled thread */
+  struct mem_alloc_s *next;
 };
 
 struct event_data_s {
-  void *buffer;
+  struct perf_ring_s ring;
   int   fd;
   int   total;
+  int   thread;	/* OpenMP thread number of the sampled thread */
+  pid_t tid;
 };
 
 struct event_info_s {
@@ -92,21 +96,89 @@ struct event_info_s event_info[] = {
     {.config = PERF_COUNT_SW_PAGE_FAULTS, .type = PERF_TYPE_SOFTWARE, .threshold = 1,    .freq = 0}
 };
 
-static struct event_data_s events[MAX_EVENTS];
-
-static size_t pagesize;
-static size_t pgmsk;
+/* events[thread * MAX_EVENTS + event] */
+static struct event_data_s events[MAX_THREADS * MAX_EVENTS];
 
 static uint64_t sample_type = PERF_SAMPLE_PERIOD | PERF_SAMPLE_IP 
 			    | PERF_SAMPLE_ADDR   | PERF_SAMPLE_CPU
-			    | PERF_SAMPLE_TID;
+			    | PERF_SAMPLE_TID    | PERF_SAMPLE_TIME;
+
+/*
+ * Every allocation made through wrap_malloc(), in allocation order. The
+ * records are kept after wrap_free() so the samples taken before can
+ * still be reported; mem_map only holds the live ones and maps their
+ * address range to the record.
+ */
+static struct mem_alloc_s *mem_allocations = NULL;
+static struct mem_alloc_s **mem_allocations_tail = &mem_allocations;
+static uint32_t num_allocations = 0;
+static struct perf_addrmap_s mem_map;
+
+/* update() page cache of each sampled thread, used by one thread at a time */
+static struct perf_addrmap_cache_s mem_cache[MAX_THREADS];
+
+static struct perf_sample_layout_s sample_layout;
+
+/*
+ * Collector mode (-c): the counters run freely and the rings are
+ * drained by a background thread, the gemm threads are never
+ * interrupted by PERF_SIGNAL.
+ */
+static int use_collector = 0;
+static struct perf_collector_s collector;
 
-static char *var_names[] = {"A", "B", "C"};
-static int num_mallocs = 0;
+/*
+ * Per-thread mode (-t): every OpenMP thread opens its own counters and
+ * rings on itself before the parallel kernel, so the samples of all the
+ * gemm_omp workers are attributed and not only the ones of thread 0.
+ * The events are opened from inside a parallel region, which is how
+ * the worker threads are hooked at start up; inherit would not help
+ * here since libgomp may have created its pool earlier, and inherited
+ * events would all write into the parent ring.
+ *
+ * This relies on gemm_omp running on the very threads that opened the
+ * events: the team size is fixed for both regions, dynamic teams are
+ * off, and libgomp keeps its pool threads from one region to the next
+ * of the same size. OpenMP does not promise that, other runtimes may
+ * hand the work to threads without events.
+ */
+static int per_thread = 0;
+static int num_threads = 1;
+
+/*
+ * Queue mode (-s): keep PERF_SIGNAL, but the handler only copies the
+ * records into its thread's spsc queue and re-arms the counter. The
+ * decoding and update() run on the aggregation thread.
+ */
+#define SPSC_SIZE (1 << 18)
+
+static int use_spsc = 0;
+static struct perf_spsc_s *queues[MAX_THREADS];
+static int queue_thread[MAX_THREADS];
+static struct perf_spsc_notify_s queue_notify;
+static pthread_t aggregator;
+static int aggregator_stop = 0;
 
-static struct mem_alloc_s  mem_allocation[MAX_MALLOC];
+/*
+ * Heatmap mode (-g): every sampled address is also binned at each of
+ * the given granularities, whether or not it is in a tracked
+ * allocation, with the working set measured every -w ms.
+ */
+#define MAX_HEATMAPS	4
+#define HEATMAP_BINS	(1 << 20)
 
-static struct perf_mmap_data_s   mmap_data[MAX_EVENTS];
+static struct perf_heatmap_s heatmaps[MAX_HEATMAPS];
+static int num_heatmaps = 0;
+static uint64_t window_ms = 10;
+
+/*
+ * NUMA mode (-n): the node of every sampled page, looked up at the end
+ * of the run, against the node of the cpu that sampled it.
+ */
+#define NUMA_PAGES	(1 << 18)
+
+static int use_numa = 0;
+static struct perf_numa_s numa;
 
 static int
 get_num_events()
@@ -116,46 +188,81 @@ get_num_events()
 }
 
 static void*
-wrap_malloc(size_t size)
+wrap_malloc(size_t size, char *name)
 {
+	struct mem_alloc_s *mem = calloc(1, sizeof(*mem));
 	void *var = malloc(size);
-	for (int i=0; i<MAX_MALLOC; i++) {
-		if (mem_allocation[i].address == NULL) {
-			mem_allocation[num_mallocs].address = var;
-			mem_allocation[num_mallocs].size    = size;
-      mem_allocation[num_mallocs].var_name = var_names[i];
-			num_mallocs++;
-
-			return var;
-		}
+
+	if (mem == NULL || var == NULL) {
+		free(mem);
+		free(var);
+		return NULL; // out of memory
+	}
+	mem->address  = var;
+	mem->size     = size;
+	mem->var_name = name;
+	mem->id	      = num_allocations + 1;
+
+	if (perf_addrmap_insert(&mem_map, (uintptr_t) var, (uintptr_t) var + size,
+				(uintptr_t) mem) < 0) {
+		fprintf(stderr, "cannot track allocation %s\n", name);
+		free(mem);
+		free(var);
+		return NULL;
 	}
-	return NULL; // out of memory
+	num_allocations++;
+
+	*mem_allocations_tail = mem;
+	mem_allocations_tail  = &mem->next;
+	return var;
 }
 
 
 static void
 wrap_free(void *address)
 {
-	for(int i=0; i<MAX_MALLOC; i++) {
-		if (mem_allocation[i].address == address) {
-			mem_allocation[i].address = NULL;
-			mem_allocation[i].size	  = 0;
-      mem_allocation[i].var_name = NULL;
-			num_mallocs--;
-		}
-	}
+	perf_addrmap_remove(&mem_map, (uintptr_t) address, NULL);
 }
 
-static int
-update(void *address)
+/* async-signal-safe, thread is the sampled thread */
+static void
+update(const struct perf_sample_s *sample, int thread)
 {
-  for(int i=0; i<MAX_MALLOC; i++) {
-      if (mem_allocation[i].address != NULL    &&
-          address >= mem_allocation[i].address &&
-          address <  mem_allocation[i].address+mem_allocation[i].size) {
-          mem_allocation[i].num_samples++;
-      }
+  struct perf_addrmap_entry_s entry;
+  uint64_t address = sample->v[PERF_SF_ADDR];
+  uint32_t label = 0;
+
+  for(int h=0; h<num_heatmaps; h++)
+      perf_heatmap_add(&heatmaps[h], address, sample->v[PERF_SF_TIME]);
+
+  if (perf_addrmap_lookup(&mem_map, address, &mem_cache[thread], &entry) == 1) {
+      struct mem_alloc_s *mem = (struct mem_alloc_s *)(uintptr_t) entry.value;
+      mem->num_samples[thread]++;
+      label = mem->id;
   }
+
+  if (use_numa)
+      perf_numa_add(&numa, address, perf_sample_cpu(sample), label);
+}
+
+/* the variable of a heatmap bin, freed or not */
+static const char *
+heatmap_label(uint64_t addr, void *arg)
+{
+  for (struct mem_alloc_s *mem = mem_allocations; mem; mem = mem->next) {
+      if (addr < (uintptr_t) mem->address + mem->size && (uintptr_t) mem->address < addr + *(uint64_t *)arg)
+	  return mem->var_name;
+  }
+  return NULL;
+}
+
+static uint64_t
+total_samples(struct mem_alloc_s *mem)
+{
+  uint64_t total = 0;
+  for(int t=0; t<num_threads; t++)
+      total += mem->num_samples[t];
+  return total;
 }
 
 
@@ -172,6 +279,8 @@ int sys_perf_event_open(struct perf_event_attr *attr, pid_t pid,
 static int
 start_counters(int fd)
 {
+	if (use_collector)
+		return ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
 	return ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
 }
 
@@ -185,7 +294,7 @@ static int
 stop_all()
 {
   int ret = 0;
-  for(int i=0; i<MAX_EVENTS; i++) {
+  for(int i=0; i<num_threads*MAX_EVENTS; i++) {
       	if (events[i].fd >= 0)
 		ret += stop_counters(events[i].fd);
   }
@@ -197,7 +306,7 @@ static int
 start_all()
 {
   int ret = 0;
-  for(int i=0; i<MAX_EVENTS; i++) {
+  for(int i=0; i<num_threads*MAX_EVENTS; i++) {
       	if (events[i].fd >= 0)
       		ret    += ioctl(events[i].fd, PERF_EVENT_IOC_ENABLE);
   }
@@ -208,297 +317,159 @@ start_all()
 static int
 get_fd(int sig_fd)
 {
-	for(int i=0; i<MAX_EVENTS; i++) {
+	for(int i=0; i<num_threads*MAX_EVENTS; i++) {
 		if (events[i].fd == sig_fd)
 			return i;
 	}
 	return -1;
 }
 
-/*
- * event_buf already has the mmap'ed address for perf buffer,
- * So, go ahead and read the data.
- *
- * The payload data (event data) starts after the first page of control
- * information.
- */
-static int read_from_perf_buffer(void *event_buf, void *buf, size_t sz)
-{
-	struct perf_event_mmap_page *header = event_buf;
-	void *data;
-	unsigned long tail;
-	size_t avail_sz, min, c;
-
-	/*
-	 * data points to beginning of buffer payload
-	 */
-	data = ((void *)header) + sysconf(_SC_PAGESIZE);
-
-	/*
-	 * position of tail within the buffer payload.
-	 */
-	tail = header->data_tail & pgmsk;
-
-	/*
-	 * Size of available data.
-	 */
-	avail_sz = header->data_head - header->data_tail;
-	if (sz > avail_sz) {
-		fprintf(stderr, "Needed size is more than available size\n");
-		return -1;
-	}
-
-	/*
-	 * c = size till the end of buffer
-	 *
-	 * buffer size is a power of two.
-	 */
-	c = pgmsk + 1 - tail;
-
-	/*
-	 * min with requested size.
-	 */
-	min = c < sz ? c : sz;
-
-	/* copy beginning */
-	memcpy(buf, data + tail, min);
-
-	/* copy wrapped around leftover */
-	if (sz > min)
-		memcpy(buf + min, data, sz - min);
-
-	/* header->data_tail should reflect the last read data */
-	header->data_tail += sz;
-
-	return 0;
-}
-
-
-static int read_from_perf_buffer_64(void *event_buf, void *buf)
-{
-	return read_from_perf_buffer(event_buf, buf, sizeof(uint64_t));
-}
-
-
-
-/*
- * The below parser is a stripped down version of perf source. To keep it
- * simple, it only looks for PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_CALLCHAIN,
- * PERF_SAMPLE_IP, PERF_SAMPLE_RAW and PERF_SAMPLE_TIME.
- * More parsers can be added if needed.
- */
-static int parse_perf_sample(void *event_buf, struct perf_event_header *ehdr,
-                             struct perf_mmap_data_s *data, int verbose)
+static 
+void event_handler(int signum, siginfo_t *info, void *uc)
 {
-	size_t sz;
-	uint64_t type, val64;
-	uint64_t time_enabled, time_running;
-	const char *str;
 	int ret;
-	uint64_t value;
-	uint64_t id;
-	struct { uint32_t pid, tid; } pid;
-
-	if (!ehdr)
-		return -1;
 
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = sample_type;
-
-	if (type & PERF_SAMPLE_IDENTIFIER) {
-		ret = read_from_perf_buffer_64(event_buf, &val64);
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-		fprintf(stderr, "ID :%llu ", val64);
-		sz -= sizeof(val64);
+	if (info->si_code < 0) {
+		fprintf(stderr, "Required signal not generated\n");
+		return;
 	}
 
-	/*
-	 * the sample_type information is laid down
-	 * based on the PERF_RECORD_SAMPLE format specified
-	 * in the perf_event.h header file.
-	 * That order is different from the enum perf_event_sample_format.
-	 */
-	if (type & PERF_SAMPLE_IP) {
-		ret = read_from_perf_buffer_64(event_buf, &(data->ip));
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-
-		/*
-		 * MISC_EXACT_IP indicates that kernel is returning
-		 * th  IIP of an instruction which caused the event, i.e.,
-		 * no skid
-		 */
-		if (verbose) fprintf(stderr, "IP: 0x%x  ", data->ip);
-		sz -= sizeof(val64);
+	if (info->si_code != POLL_HUP) {
+		fprintf(stderr, "POLL_HUP signal not generated by PERF_SIGNAL , %d\n", info->si_code);
+		return;
 	}
 
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(event_buf, &pid, sizeof(pid));
-		if (ret) {
-			fprintf(stderr, "cannot read PID");
-			return -1;
-		}
-		data->pid = pid.pid;
-		data->tid = pid.tid;
-
-		if (verbose) fprintf(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
+	int fd = info->si_fd;
+	int index = get_fd(fd);
+	if (index < 0) {
+		fprintf(stderr, "unknown fd: %d\n", fd);
+		return;
 	}
 
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(event_buf, &val64);
-		if (ret) {
-			fprintf(stderr, "cannot read time");
-			return -1;
-		}
+	const struct perf_event_header *ehdr;
+	struct perf_sample_s sample;
 
-		if (verbose) fprintf(stderr, "TIME:%llu  ", val64);
-		sz -= sizeof(val64);
+	if (use_spsc) {
+		perf_spsc_push_ring(queues[events[index].thread], &events[index].ring);
+		events[index].total++;
+		start_counters(fd);
+		return;
 	}
 
-	if (type & PERF_SAMPLE_ADDR) {
-		ret = read_from_perf_buffer_64(event_buf, &(data->address));
-		if (ret) {
-			fprintf(stderr, "cannot read time");
-			return -1;
-		}
-
-		if (verbose) fprintf(stderr, "ADDR: 0x%x  ", data->address);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(event_buf, &cpu, sizeof(cpu));
-		if (ret) {
-			fprintf(stderr, "cannot read cpu");
-			return -1;
-		}
-		data->cpu = cpu.cpu;
-		data->res = cpu.reserved;
+	perf_ring_begin(&events[index].ring);
+	while ((ehdr = perf_ring_next(&events[index].ring)) != NULL) {
+		if (ehdr->type != PERF_RECORD_SAMPLE)
+			continue;
 
-		if (verbose) fprintf(stderr, "CPU:%u  ", cpu.cpu);
-		sz -= sizeof(cpu);
+		if (perf_sample_parse(&sample_layout, ehdr, &sample) == 0)
+			update(&sample, events[index].thread);
 	}
+	perf_ring_end(&events[index].ring);
 
-	if (type & PERF_SAMPLE_PERIOD) {
-		ret = read_from_perf_buffer_64(event_buf, &(data->period));
-		if (ret) {
-			fprintf(stderr, "cannot read period");
-			return -1;
-		}
+	events[index].total++;
 
-		if (verbose) fprintf(stderr, "PERIOD:%llu  ", data->period);
-		sz -= sizeof(val64);
-	}
+	ret=start_counters(fd);
 
-	if (type & PERF_SAMPLE_CALLCHAIN) {
-		uint64_t nr, ip;
+	(void) ret;
+}
 
-		ret = read_from_perf_buffer_64(event_buf, &nr);
-		if (ret) {
-			fprintf(stderr, "cannot read callchain nr");
-			return -1;
-		}
-		sz -= sizeof(nr);
-
-		if (verbose) fprintf(stderr, "\n  CALLCHAIN :\n");
-		while(nr--) {
-			ret = read_from_perf_buffer_64(event_buf, &ip);
-			if (ret) {
-				fprintf(stderr, "cannot read ip");
-				return -1;
-			}
+/* collector thread callback, one call per record */
+static void
+collect_record(const struct perf_event_header *ehdr, void *arg)
+{
+	struct event_data_s *event = arg;
+	struct perf_sample_s sample;
 
-			sz -= sizeof(ip);
+	if (ehdr->type != PERF_RECORD_SAMPLE)
+		return;
 
-			if (verbose) fprintf(stderr, "\t0x%llu\n", ip);
-		}
-	}
+	if (perf_sample_parse(&sample_layout, ehdr, &sample) == 0)
+		update(&sample, event->thread);
 
-	if (verbose) fprintf(stderr, "\n");
-	return 0;
+	event->total++;
 }
 
-
-/*
- * Not the data we need? Skip the data.
- */
-static void skip_perf_data(void *event_buf, size_t sz)
+/* aggregation thread callback, arg is the thread number */
+static void
+decode_record(const struct perf_event_header *ehdr, void *arg)
 {
-	struct perf_event_mmap_page *hdr = event_buf;
+	struct perf_sample_s sample;
 
-	if ((hdr->data_tail + sz) > hdr->data_head)
-		sz = hdr->data_head - hdr->data_tail;
+	if (ehdr->type != PERF_RECORD_SAMPLE)
+		return;
 
-	hdr->data_tail += sz;
+	if (perf_sample_parse(&sample_layout, ehdr, &sample) == 0)
+		update(&sample, *(int *)arg);
 }
 
-static int is_more_perf_data(void *event_buf)
+static void *
+aggregator_thread(void *arg)
 {
-	struct perf_event_mmap_page *hdr = event_buf;
+	for (;;) {
+		int stop = __atomic_load_n(&aggregator_stop, __ATOMIC_ACQUIRE);
+		size_t n = 0;
 
-	if (hdr->data_tail < hdr->data_head)
-		return 1;
+		for (int t=0; t<num_threads; t++)
+			n += perf_spsc_drain(queues[t], decode_record, &queue_thread[t]);
 
-	return 0;
+		if (n == 0) {
+			if (stop)
+				break;
+			perf_spsc_wait(&queue_notify, queues, num_threads, 1);
+		}
+	}
+	return NULL;
 }
 
-
-static 
-void event_handler(int signum, siginfo_t *info, void *uc)
+static int
+start_aggregator(void)
 {
+	sigset_t all, old;
 	int ret;
 
-	if (info->si_code < 0) {
-		fprintf(stderr, "Required signal not generated\n");
-		return;
-	}
-
-	if (info->si_code != POLL_HUP) {
-		fprintf(stderr, "POLL_HUP signal not generated by PERF_SIGNAL , %d\n", info->si_code);
-		return;
-	}
-
-	int fd = info->si_fd;
-	int index = get_fd(fd);
-	if (index < 0) {
-		fprintf(stderr, "unknown fd: %d\n", fd);
-	}
+	if (perf_spsc_notify_init(&queue_notify))
+		return -1;
 
-	struct perf_event_header ehdr;
-again:
-	ret = read_from_perf_buffer(events[index].buffer, &ehdr, sizeof(ehdr));
-	if (ret) {
-		fprintf(stderr, "cannot read event header\n");
-		return;
+	for (int t=0; t<num_threads; t++) {
+		queues[t] = aligned_alloc(PERF_SPSC_CACHELINE, sizeof(struct perf_spsc_s));
+		queue_thread[t] = t;
+		if (queues[t] == NULL || perf_spsc_init(queues[t], SPSC_SIZE, &queue_notify))
+			return -1;
 	}
-	if (ehdr.type == PERF_RECORD_SAMPLE) {
-		ret = parse_perf_sample(events[index].buffer, &ehdr, &mmap_data[index], 0);
-		update((void*)mmap_data[index].address);
 
-	}  else {
-		skip_perf_data(events[index].buffer, ehdr.size);
-	}
+	/* PERF_SIGNAL is for the sampled threads only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&aggregator, NULL, aggregator_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return ret ? -1 : 0;
+}
 
-	if (is_more_perf_data(events[index].buffer))
-		goto again;
+static void
+stop_aggregator(void)
+{
+	uint64_t pushed = 0, dropped = 0;
 
-	events[index].total++;
+	__atomic_store_n(&aggregator_stop, 1, __ATOMIC_RELEASE);
+	perf_spsc_wake(&queue_notify);
+	pthread_join(aggregator, NULL);
 
-	ret=start_counters(fd);
+	for (int t=0; t<num_threads; t++) {
+		pushed  += queues[t]->pushed;
+		dropped += queues[t]->dropped;
+		perf_spsc_fini(queues[t]);
+		free(queues[t]);
+	}
+	perf_spsc_notify_fini(&queue_notify);
 
-	(void) ret;
+	printf("queues: %"PRIu64" records, %"PRIu64" dropped\n", pushed, dropped);
 }
 
 static 
-int setup_notification(int fd)
+int setup_notification(int fd, pid_t tid)
 {
+	struct f_owner_ex owner;
+
 	/*
 	 * Setup notification on the file descriptor
 	 */
@@ -514,8 +485,13 @@ int setup_notification(int fd)
 		return -1;
 	}
 
-	/* Get ownership of the descriptor */
-	ret = fcntl(fd, F_SETOWN, getpid());
+	/*
+	 * Get ownership of the descriptor. The signal goes to the sampled
+	 * thread itself, otherwise any thread of the process may get it.
+	 */
+	owner.type = F_OWNER_TID;
+	owner.pid  = tid;
+	ret = fcntl(fd, F_SETOWN_EX, &owner);
 	if (ret == -1) {
 		fprintf(stderr, "Error in setting owner\n");
 		return -1;
@@ -523,23 +499,15 @@ int setup_notification(int fd)
 	return ret;
 }
 
-static void*
-setup_buffer(int fd)
-{
-	void *buf = mmap(NULL, (buffer_pages + 1) * pagesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (buf == MAP_FAILED) {
-		fprintf(stderr, "Can't mmap buffer\n");
-		return NULL;
-	}
-
-	return buf;
-}
-
-
+/*
+ * Open an event on the calling thread. May be called from several
+ * threads at once, each with its own thread number.
+ */
 static
-int setup_counters(uint64_t type, uint64_t config, uint64_t period, uint64_t freq)
+int setup_counters(int thread, int event, uint64_t type, uint64_t config,
+		   uint64_t period, uint64_t freq)
 {
-	static int index = 0;
+	int index = thread * MAX_EVENTS + event;
 	struct perf_event_attr attr;
 
 	memset(&attr, 0, sizeof(attr));
@@ -559,9 +527,18 @@ int setup_counters(uint64_t type, uint64_t config, uint64_t period, uint64_t fre
 	attr.size	   = sizeof(struct perf_event_attr);
 	attr.sample_type   = sample_type;
 
-	printf("Creating event %d: ", config);
-	events[index].fd = sys_perf_event_open(&attr, 0, -1, -1, 0);
-	printf("%d\n", events[index].fd);
+	if (use_collector)
+		perf_ring_watermark(&attr, buffer_pages);
+
+	/* all the events share the same sample_type */
+	if (thread == 0 && perf_sample_layout_init(&sample_layout, &attr))
+		exit(1);
+
+	events[index].thread = thread;
+	events[index].tid    = syscall(SYS_gettid);
+	events[index].fd     = sys_perf_event_open(&attr, 0, -1, -1, 0);
+	printf("Creating event %d on thread %d (tid %d): %d\n", config, thread,
+	       events[index].tid, events[index].fd);
 	if (events[index].fd < 0) {
 		fprintf(stderr, "Error: %s\n", strerror(errno));
 		perror("sys_perf_event_open");
@@ -569,14 +546,14 @@ int setup_counters(uint64_t type, uint64_t config, uint64_t period, uint64_t fre
 	}
 	int fd = events[index].fd;
 
-	events[index].buffer = setup_buffer(fd);
-	if (events[index].buffer == NULL) {
+	if (perf_ring_open(&events[index].ring, fd, buffer_pages)) {
 		exit(2);
 	}
 
-	setup_notification(fd);
+	/* the collector is not thread safe, the fds are added by main() */
+	if (!use_collector)
+		setup_notification(fd, events[index].tid);
 
-	index++;
 	return fd;
 }
 
@@ -590,7 +567,10 @@ read_counters(int index)
 	res = read(events[index].fd, &counter_result, sizeof(unsigned long long));
 	assert(res == sizeof(unsigned long long));
 
-	printf("[%d] counter:\t\t%lld\n[%d] Num counter: %d\n\n", index, counter_result, index, events[index].total);
+	printf("[%d] thread %d (tid %d) counter:\t\t%lld\n[%d] Num counter: %d\n", index,
+	       events[index].thread, events[index].tid, counter_result, index, events[index].total);
+	perf_ring_report(stdout, "    ring", &events[index].ring.stats);
+	printf("\n");
 }
 
 static void
@@ -604,59 +584,132 @@ setup_handler()
 	sigaction(PERF_SIGNAL, &act, 0);
 }
 
-void gemm_omp(double *A, double *B, double *C, int n) 
-{   
-    #pragma omp parallel
-    {
-        int i, j, k;
-        #pragma omp for
-        for (i = 0; i < n; i++) { 
-            for (j = 0; j < n; j++) {
-                double dot  = 0;
-                for (k = 0; k < n; k++) {
-                    dot += A[i*n+k]*B[k*n+j];
-                } 
-                C[i*n+j ] = dot;
-            }
-        }
-
-    }
-}
-
-
-
 int
 main(int argc, char *argv[])
 {
 	const unsigned int  n=164;
 	const unsigned int  nn=n*n;
 
-	memset(mem_allocation, 0, sizeof(mem_allocation));
+	if (perf_addrmap_init(&mem_map))
+		exit(1);
+
+	int opt, shift;
+	char *gran[MAX_HEATMAPS];
+	while ((opt = getopt(argc, argv, "cstg:w:n")) != -1) {
+		switch (opt) {
+		case 'c':
+			use_collector = 1;
+			break;
+		case 's':
+			use_spsc = 1;
+			break;
+		case 't':
+			per_thread = 1;
+			break;
+		case 'g':
+			for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+				if (num_heatmaps == MAX_HEATMAPS) {
+					fprintf(stderr, "at most %d heatmaps\n", MAX_HEATMAPS);
+					exit(1);
+				}
+				gran[num_heatmaps++] = tok;
+			}
+			break;
+		case 'w':
+			window_ms = strtoull(optarg, NULL, 10);
+			if (window_ms == 0)
+				goto usage;
+			break;
+		case 'n':
+			use_numa = 1;
+			break;
+		default:
+		usage:
+			fprintf(stderr, "Usage: %s [-c|-s] [-t] [-g granularities [-w ms]] [-n]\n"
+					"  -c  drain the rings from a collector thread\n"
+					"  -s  signal handler only queues the records, an\n"
+					"      aggregation thread decodes them\n"
+					"  -t  sample every OpenMP thread, not only the main one\n"
+					"  -g  heatmap of the sampled addresses at each comma\n"
+					"      separated granularity, e.g. 64,4k,2m\n"
+					"  -w  working set window in ms (default 10)\n"
+					"  -n  node of the sampled pages against the node of\n"
+					"      the sampling cpu, per variable\n",
+					argv[0]);
+			exit(1);
+		}
+	}
+
+	for (int h=0; h<num_heatmaps; h++) {
+		if ((shift = perf_heatmap_granularity(gran[h])) < 0 ||
+		    perf_heatmap_init(&heatmaps[h], shift, HEATMAP_BINS, window_ms * 1000000))
+			exit(1);
+	}
+	if (use_numa && perf_numa_init(&numa, NUMA_PAGES))
+		exit(1);
 
-	pagesize = sysconf(_SC_PAGESIZE);
-	pgmsk = (buffer_pages * pagesize) - 1;
+	if (per_thread) {
+		num_threads = omp_get_max_threads();
+		if (num_threads > MAX_THREADS)
+			num_threads = MAX_THREADS;
+		/* gemm_omp gets the team that opened the events */
+		omp_set_dynamic(0);
+		omp_set_num_threads(num_threads);
+	}
 
-	setup_handler();
+	if (use_collector && use_spsc) {
+		fprintf(stderr, "-c and -s are exclusive\n");
+		exit(1);
+	}
+
+	if (use_collector) {
+		if (perf_collector_init(&collector))
+			exit(1);
+	} else {
+		if (use_spsc && start_aggregator())
+			exit(1);
+		setup_handler();
+	}
 
 	int i;
 	int num_events = get_num_events();
-	for(i=0; i<num_events; i++) {
-	    int fd = setup_counters(event_info[i].type, event_info[i].config,
-	                            event_info[i].threshold, event_info[i].freq);
-	    printf("event %d, fd: %d\n", i, fd);
+	for(i=0; i<num_threads*MAX_EVENTS; i++)
+	    events[i].fd = -1;
+
+	/* each thread of the team opens its own events */
+	#pragma omp parallel num_threads(num_threads) if(per_thread)
+	{
+	    int t = omp_get_thread_num();
+	    for(int e=0; e<num_events; e++) {
+	        int fd = setup_counters(t, e, event_info[e].type, event_info[e].config,
+	                                event_info[e].threshold, event_info[e].freq);
+	        printf("thread %d event %d, fd: %d\n", t, e, fd);
+	    }
+	}
+
+	if (use_collector) {
+	    for(i=0; i<num_threads*MAX_EVENTS; i++) {
+	        if (events[i].fd >= 0)
+	            perf_collector_add(&collector, events[i].fd, &events[i].ring,
+	                               collect_record, &events[i]);
+	    }
 	}
 
 	/* Do something */
 	double *A, *B, *C, dtime;
 
-  	A = (double*)wrap_malloc(sizeof(double)*nn);
-  	B = (double*)wrap_malloc(sizeof(double)*nn);
-  	C = (double*)wrap_malloc(sizeof(double)*nn);
+  	A = (double*)wrap_malloc(sizeof(double)*nn, "A");
+  	B = (double*)wrap_malloc(sizeof(double)*nn, "B");
+  	C = (double*)wrap_malloc(sizeof(double)*nn, "C");
 
 	printf("A: %p - %p   B: %p - %p     C: %p - %p\n", A, A+nn, B, B+nn, C, C+nn);
 
-	for(i=0; i<MAX_EVENTS; i++) {
-	    start_counters(events[i].fd);
+	if (use_collector)
+		perf_collector_start(&collector);
+
+	for(i=0; i<num_threads*MAX_EVENTS; i++) {
+	    if (events[i].fd >= 0)
+	        start_counters(events[i].fd);
 	}
 
 	for(i=0; i<n*n; i++) {
@@ -667,19 +720,61 @@ main(int argc, char *argv[])
 	gemm_omp(A, B, C, n);
 
 
-  for(i=0; i<MAX_EVENTS; i++) {
-      stop_counters(events[i].fd);
-      read_counters(i);
+  stop_all();
+
+  if (use_spsc) {
+      /* nothing is pushed once the counters are stopped, except a late signal */
+      sigset_t sig;
+      sigemptyset(&sig);
+      sigaddset(&sig, PERF_SIGNAL);
+      sigprocmask(SIG_BLOCK, &sig, NULL);
+      stop_aggregator();
   }
 
-	for (i=0; i<MAX_MALLOC; i++) {
-	    printf("Var: %s, address: %p-%p, size: %d, samples: %d\n", mem_allocation[i].var_name, mem_allocation[i].address,
-	           mem_allocation[i].address+mem_allocation[i].size, mem_allocation[i].size, mem_allocation[i].num_samples);
+  if (use_collector) {
+      perf_collector_stop(&collector);
+      printf("collector thread cpu time: %.3f ms\n", collector.cpu_ns * 1e-6);
+      perf_collector_fini(&collector);
+  }
+
+  for(i=0; i<num_threads*MAX_EVENTS; i++) {
+      if (events[i].fd >= 0)
+          read_counters(i);
+  }
+
+	for (struct mem_alloc_s *mem = mem_allocations; mem; mem = mem->next) {
+	    printf("Var: %s, address: %p-%p, size: %zu, samples: %"PRIu64"\n", mem->var_name, mem->address,
+	           mem->address+mem->size, mem->size, total_samples(mem));
+	    if (!per_thread)
+	        continue;
+	    for (int t=0; t<num_threads; t++)
+	        printf("    thread %d: %"PRIu64"\n", t, mem->num_samples[t]);
+	}
+	if (mem_map.busy)
+	    printf("samples not attributed, map busy: %"PRIu64"\n", mem_map.busy);
+
+	for (int h=0; h<num_heatmaps; h++) {
+	    uint64_t gran = 1ull << heatmaps[h].shift;
+	    perf_heatmap_report(&heatmaps[h], stdout, 20, heatmap_label, &gran);
+	    perf_heatmap_fini(&heatmaps[h]);
+	}
+
+	/* the variables are still there, ask where their pages are */
+	if (use_numa) {
+	    const char **names = calloc(num_allocations + 1, sizeof(char *));
+	    names[0] = "(untracked)";
+	    for (struct mem_alloc_s *mem = mem_allocations; mem; mem = mem->next)
+	        names[mem->id] = mem->var_name;
+	    perf_numa_resolve(&numa);
+	    perf_numa_report(&numa, stdout, names, num_allocations + 1);
+	    perf_numa_fini(&numa);
+	    free(names);
 	}
 
 	wrap_free(A);
 	wrap_free(B);
-	wrap_free(B);
+	wrap_free(C);
+	perf_addrmap_fini(&mem_map);
 
 	return 0;
 }
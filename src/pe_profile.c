@@ -0,0 +1,631 @@
+/*
+ * Profile a whole process tree: pe_profile [options] -- cmd args
+ *
+ * cmd is forked and the sampling event is opened on it before the exec
+ * with inherit, so every thread and process it creates is sampled too,
+ * and enable_on_exec, so the launcher itself is not. comm, mmap2 and
+ * task add the side-band records that tell who is who:
+ *
+ *   PERF_RECORD_FORK	a new process, or a new thread if pid == ppid.
+ *			A process starts with the comm and maps of its
+ *			parent.
+ *   PERF_RECORD_COMM	a new name; with PERF_RECORD_MISC_COMM_EXEC a new
+ *			image: the samples before and after an exec are
+ *			kept apart, each with its own maps.
+ *   PERF_RECORD_MMAP2	an executable mapping, for the symbols.
+ *   PERF_RECORD_EXIT	a thread or process is gone.
+ *
+ * The kernel can't mmap an inherited event opened on every CPU
+ * (cpu == -1), so there is one event and one ring per CPU, each holding
+ * the records of whatever ran there. The state of a process or thread,
+ * its symbols and its profile, is only created when its first record
+ * shows up. The rings are drained in batches, sorted by time so that a
+ * fork on one CPU is seen before the samples of the child on another.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+
+#include <errno.h>
+
+#include <linux/perf_event.h>
+#include <asm/unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "perf_ring.h"
+#include "perf_region.h"
+#include "perf_profile.h"
+#include "perf_symtab.h"
+
+#define COMM_LEN	16
+
+/* a process between two execs */
+struct image_s {
+	pid_t pid;
+	pid_t ppid;
+	int depth;		/* in the process tree */
+	int exec;		/* started by an exec rather than a fork */
+	int exited;
+	int threads;
+	char comm[COMM_LEN];
+
+	uint64_t samples;
+	struct perf_symtab_s symtab;	/* maps from the records */
+	struct perf_profile_s profile;	/* created with the first sample */
+
+	struct image_s *next;	/* in creation order */
+};
+
+struct thread_s {
+	pid_t tid;
+	pid_t pid;
+	int exited;
+	char comm[COMM_LEN];
+	uint64_t samples;
+};
+
+/* pid or tid -> state, open addressing */
+struct pid_table_s {
+	struct pid_slot_s {
+		pid_t key;
+		void *val;
+	} *slots;
+	size_t size;		/* power of 2 */
+	size_t used;
+};
+
+/* a record copied out of a ring, to be sorted with the other rings' */
+struct batch_rec_s {
+	uint64_t time;
+	uint64_t seq;
+	size_t off;
+};
+
+const char *event_name = "cycles";
+uint64_t sample_period = 0;
+uint64_t sample_freq = 1000;
+int buffer_pages = 8;
+int top = 10;
+
+int num_cpus;
+int *cpu_fd;
+struct perf_ring_s *cpu_ring;
+struct perf_event_attr event_attr;
+struct perf_sample_layout_s event_layout;
+
+struct image_s *images, **images_tail = &images;
+struct pid_table_s current_image;	/* pid -> image */
+struct pid_table_s threads;		/* tid -> thread */
+int num_images;
+
+uint64_t total_samples, total_records;
+
+unsigned char *batch;
+size_t batch_size, batch_used;
+struct batch_rec_s *batch_recs;
+size_t batch_max, batch_nrecs;
+
+
+static long
+perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
+		int cpu, int group_fd, unsigned long flags)
+{
+	int ret;
+
+	ret = syscall(__NR_perf_event_open, hw_event, pid, cpu,
+			group_fd, flags);
+	return ret;
+}
+
+static struct pid_slot_s *
+pid_find(struct pid_table_s *t, pid_t key)
+{
+	size_t h = ((uint64_t) key * 0x9e3779b97f4a7c15ull) >> 32;
+
+	for (;; h++) {
+		struct pid_slot_s *s = &t->slots[h & (t->size - 1)];
+
+		if (s->key == key || s->key == 0)
+			return s;
+	}
+}
+
+static void
+pid_set(struct pid_table_s *t, pid_t key, void *val)
+{
+	if (2 * (t->used + 1) > t->size) {
+		struct pid_table_s old = *t;
+
+		t->size  = old.size ? 2 * old.size : 256;
+		t->slots = calloc(t->size, sizeof(struct pid_slot_s));
+		t->used	 = 0;
+		for (size_t i = 0; i < old.size; i++) {
+			if (old.slots[i].key)
+				pid_set(t, old.slots[i].key, old.slots[i].val);
+		}
+		free(old.slots);
+	}
+
+	struct pid_slot_s *s = pid_find(t, key);
+	if (s->key == 0) {
+		s->key = key;
+		t->used++;
+	}
+	s->val = val;
+}
+
+static void *
+pid_get(struct pid_table_s *t, pid_t key)
+{
+	if (t->size == 0)
+		return NULL;
+	return pid_find(t, key)->val;
+}
+
+static struct image_s *
+new_image(pid_t pid, pid_t ppid, const char *comm)
+{
+	struct image_s *img = calloc(1, sizeof(*img));
+	struct image_s *parent = pid_get(&current_image, ppid);
+
+	img->pid   = pid;
+	img->ppid  = ppid;
+	img->depth = parent ? parent->depth + 1 : 0;
+	snprintf(img->comm, COMM_LEN, "%s", comm);
+	perf_symtab_init(&img->symtab, -1);
+
+	*images_tail = img;
+	images_tail  = &img->next;
+	pid_set(&current_image, pid, img);
+	num_images++;
+	return img;
+}
+
+/* the image of a pid, created if its first record comes out of order */
+static struct image_s *
+get_image(pid_t pid)
+{
+	struct image_s *img = pid_get(&current_image, pid);
+
+	return img ? img : new_image(pid, 0, "?");
+}
+
+static struct thread_s *
+get_thread(pid_t tid, pid_t pid)
+{
+	struct thread_s *t = pid_get(&threads, tid);
+
+	if (t == NULL) {
+		struct image_s *img = get_image(pid);
+
+		t = calloc(1, sizeof(*t));
+		t->tid = tid;
+		t->pid = pid;
+		memcpy(t->comm, img->comm, COMM_LEN);
+		img->threads++;
+		pid_set(&threads, tid, t);
+	}
+	return t;
+}
+
+static void
+handle_fork(const struct perf_event_header *ehdr)
+{
+	const struct { uint32_t pid, ppid, tid, ptid; uint64_t time; } *r = (const void *)(ehdr + 1);
+
+	if (r->pid != r->ppid) {
+		struct image_s *parent = get_image(r->ppid);
+		struct image_s *img = new_image(r->pid, r->ppid, parent->comm);
+
+		/* the child starts with the parent's address space */
+		for (int i = 0; i < parent->symtab.nmaps; i++) {
+			const struct perf_map_s *m = &parent->symtab.maps[i];
+			perf_symtab_add_map(&img->symtab, m->start, m->end, m->pgoff, m->dso->path);
+		}
+	}
+	get_thread(r->tid, r->pid);
+}
+
+static void
+handle_exit(const struct perf_event_header *ehdr)
+{
+	const struct { uint32_t pid, ppid, tid, ptid; uint64_t time; } *r = (const void *)(ehdr + 1);
+
+	get_thread(r->tid, r->pid)->exited = 1;
+	if (r->pid == r->tid)
+		get_image(r->pid)->exited = 1;
+}
+
+static void
+handle_comm(const struct perf_event_header *ehdr)
+{
+	const struct { uint32_t pid, tid; char comm[]; } *r = (const void *)(ehdr + 1);
+	struct image_s *img = get_image(r->pid);
+
+	if (ehdr->misc & PERF_RECORD_MISC_COMM_EXEC) {
+		/* a new image, unless the old one has no sample to keep */
+		if (img->samples) {
+			struct image_s *old = img;
+
+			img = new_image(old->pid, old->ppid, r->comm);
+			img->depth   = old->depth;
+			img->threads = old->threads;
+			old->exited  = 1;
+		} else {
+			perf_symtab_fini(&img->symtab);
+			perf_symtab_init(&img->symtab, -1);
+		}
+		img->exec = 1;
+	}
+	snprintf(img->comm, COMM_LEN, "%s", r->comm);
+	snprintf(get_thread(r->tid, r->pid)->comm, COMM_LEN, "%s", r->comm);
+}
+
+static void
+handle_mmap2(const struct perf_event_header *ehdr)
+{
+	const struct {
+		uint32_t pid, tid;
+		uint64_t addr, len, pgoff;
+		uint8_t	 dev_ino[24];	/* or the build id */
+		uint32_t prot, flags;
+		char	 filename[];
+	} *r = (const void *)(ehdr + 1);
+
+	if (!(r->prot & PROT_EXEC))
+		return;
+	perf_symtab_add_map(&get_image(r->pid)->symtab, r->addr, r->addr + r->len,
+			    r->pgoff, r->filename);
+}
+
+static void
+handle_sample(const struct perf_event_header *ehdr)
+{
+	struct perf_sample_s sample;
+
+	if (perf_sample_parse(&event_layout, ehdr, &sample) || perf_sample_pid(&sample) == 0)
+		return;
+
+	struct image_s *img = get_image(perf_sample_pid(&sample));
+	struct thread_s *t  = get_thread(perf_sample_tid(&sample), perf_sample_pid(&sample));
+
+	if (img->profile.chains == NULL && perf_profile_init(&img->profile, 1 << 12, 1 << 16))
+		return;
+
+	img->samples++;
+	t->samples++;
+	total_samples++;
+	perf_profile_add(&img->profile, sample.ips, sample.nr_ips, sample.v[PERF_SF_PERIOD]);
+}
+
+static void
+handle_record(const struct perf_event_header *ehdr)
+{
+	total_records++;
+
+	switch (ehdr->type) {
+	case PERF_RECORD_SAMPLE:
+		handle_sample(ehdr);
+		break;
+	case PERF_RECORD_FORK:
+		handle_fork(ehdr);
+		break;
+	case PERF_RECORD_EXIT:
+		handle_exit(ehdr);
+		break;
+	case PERF_RECORD_COMM:
+		handle_comm(ehdr);
+		break;
+	case PERF_RECORD_MMAP2:
+		handle_mmap2(ehdr);
+		break;
+	}
+}
+
+/* copy a record into the batch, with its time for the sort */
+static void
+batch_record(const struct perf_event_header *ehdr, void *arg)
+{
+	struct perf_sample_s sample;
+	uint64_t time = 0;
+
+	if (ehdr->type == PERF_RECORD_SAMPLE) {
+		if (perf_sample_parse(&event_layout, ehdr, &sample) == 0)
+			time = sample.v[PERF_SF_TIME];
+	} else if (perf_sample_parse_id(&event_layout, ehdr, &sample) == 0) {
+		time = sample.v[PERF_SF_TIME];
+	}
+
+	while (batch_used + ehdr->size > batch_size) {
+		batch_size = batch_size ? 2 * batch_size : 1 << 20;
+		batch = realloc(batch, batch_size);
+	}
+	if (batch_nrecs == batch_max) {
+		batch_max  = batch_max ? 2 * batch_max : 1 << 14;
+		batch_recs = realloc(batch_recs, batch_max * sizeof(struct batch_rec_s));
+	}
+
+	memcpy(batch + batch_used, ehdr, ehdr->size);
+	batch_recs[batch_nrecs].time = time;
+	batch_recs[batch_nrecs].seq  = batch_nrecs;
+	batch_recs[batch_nrecs].off  = batch_used;
+	batch_nrecs++;
+	batch_used += ehdr->size;
+}
+
+static int
+cmp_batch_rec(const void *a, const void *b)
+{
+	const struct batch_rec_s *x = a, *y = b;
+
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void
+drain_all(void)
+{
+	batch_used  = 0;
+	batch_nrecs = 0;
+
+	for (int cpu = 0; cpu < num_cpus; cpu++) {
+		if (cpu_fd[cpu] >= 0)
+			perf_ring_drain(&cpu_ring[cpu], batch_record, NULL);
+	}
+
+	qsort(batch_recs, batch_nrecs, sizeof(struct batch_rec_s), cmp_batch_rec);
+	for (size_t i = 0; i < batch_nrecs; i++)
+		handle_record((const struct perf_event_header *)(batch + batch_recs[i].off));
+}
+
+static int
+open_events(pid_t pid)
+{
+	struct perf_event_attr *attr = &event_attr;
+	int opened = 0;
+
+	memset(attr, 0, sizeof(*attr));
+	if (perf_region_event(event_name, attr))
+		return -1;
+
+	attr->size	     = sizeof(*attr);
+	attr->disabled	     = 1;
+	attr->enable_on_exec = 1;
+	attr->inherit	     = 1;
+	attr->exclude_hv     = 1;
+
+	if (sample_period) {
+		attr->sample_period = sample_period;
+	} else {
+		attr->sample_freq = sample_freq;
+		attr->freq	  = 1;
+	}
+	attr->sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+			PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_PERIOD;
+
+	/* who is who */
+	attr->comm	    = 1;
+	attr->comm_exec	    = 1;
+	attr->mmap	    = 1;
+	attr->mmap2	    = 1;
+	attr->task	    = 1;
+	attr->sample_id_all = 1;
+
+	perf_ring_watermark(attr, buffer_pages);
+
+	for (int cpu = 0; cpu < num_cpus; cpu++) {
+		int fd = perf_event_open(attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+
+		if (fd == -1 && cpu == 0 && errno == ENOENT && attr->type == PERF_TYPE_HARDWARE) {
+			/* no PMU, e.g. in a VM */
+			fprintf(stderr, "%s is not supported, sampling cpu-clock\n", event_name);
+			event_name   = "cpu-clock";
+			attr->type   = PERF_TYPE_SOFTWARE;
+			attr->config = PERF_COUNT_SW_CPU_CLOCK;
+			fd = perf_event_open(attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+		}
+		cpu_fd[cpu] = fd;
+		if (fd == -1) {
+			if (errno != ENODEV)	/* offline cpu */
+				fprintf(stderr, "Error in perf_event_open on cpu %d: %s\n",
+					cpu, strerror(errno));
+			continue;
+		}
+		if (perf_ring_open(&cpu_ring[cpu], fd, buffer_pages)) {
+			close(fd);
+			cpu_fd[cpu] = -1;
+			continue;
+		}
+		opened++;
+	}
+
+	perf_sample_layout_init(&event_layout, attr);
+	return opened ? 0 : -1;
+}
+
+static int
+cmp_thread(const void *a, const void *b)
+{
+	const struct thread_s *x = *(struct thread_s * const *)a, *y = *(struct thread_s * const *)b;
+
+	return x->samples < y->samples ? 1 : x->samples > y->samples ? -1 : 0;
+}
+
+static void
+report(void)
+{
+	uint64_t total = total_samples ? total_samples : 1;
+
+	printf("\n%s: %"PRIu64" samples, %"PRIu64" records, %d images, %zu threads\n",
+	       event_name, total_samples, total_records, num_images, threads.used);
+
+	/* the processes, in fork order, indented by depth */
+	printf("\n    pid    ppid threads   samples       %%  command\n");
+	for (struct image_s *img = images; img; img = img->next) {
+		printf("%7d %7d %7d %9"PRIu64" %6.2f%%  %*s%s%s%s\n", img->pid, img->ppid,
+		       img->threads, img->samples, 100.0 * img->samples / total,
+		       2 * img->depth, "", img->comm, img->exec ? " (exec)" : "",
+		       img->exited ? "" : " (running)");
+	}
+
+	struct thread_s **sorted = malloc((threads.used + 1) * sizeof(struct thread_s *));
+	size_t n = 0;
+	for (size_t i = 0; i < threads.size; i++) {
+		if (threads.slots[i].key)
+			sorted[n++] = threads.slots[i].val;
+	}
+	qsort(sorted, n, sizeof(struct thread_s *), cmp_thread);
+
+	printf("\n    tid     pid   samples       %%  comm\n");
+	for (size_t i = 0; i < n && (int) i < top; i++) {
+		printf("%7d %7d %9"PRIu64" %6.2f%%  %s\n", sorted[i]->tid, sorted[i]->pid,
+		       sorted[i]->samples, 100.0 * sorted[i]->samples / total, sorted[i]->comm);
+	}
+	free(sorted);
+
+	/* the profile of every image worth 1% or more, with its own symbols */
+	for (struct image_s *img = images; img; img = img->next) {
+		if (img->samples == 0 || img->samples * 100 < total)
+			continue;
+		printf("\n== %s [%d]", img->comm, img->pid);
+		perf_profile_report(&img->profile, &img->symtab, stdout, top);
+	}
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-e event] [-c period | -F freq] [-m pages] [-n top] -- cmd args\n"
+			"  -e  event to sample (default: cycles, cpu-clock without a PMU)\n"
+			"  -c  sample every that many events\n"
+			"  -F  sample that many times per second (default: %"PRIu64")\n"
+			"  -m  ring buffer pages per cpu (power of 2, default: %d)\n"
+			"  -n  lines per table (default: %d)\n", prog, sample_freq, buffer_pages, top);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, go[2], wstat;
+	char c = 0;
+
+	while ((opt = getopt(argc, argv, "+e:c:F:m:n:")) != -1) {
+		switch (opt) {
+		case 'e':
+			event_name = optarg;
+			break;
+		case 'c':
+			sample_period = strtoull(optarg, NULL, 0);
+			break;
+		case 'F':
+			sample_freq = strtoull(optarg, NULL, 0);
+			break;
+		case 'm':
+			buffer_pages = atoi(optarg);
+			if (buffer_pages <= 0 || (buffer_pages & (buffer_pages - 1)))
+				usage(argv[0]);
+			break;
+		case 'n':
+			top = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	cpu_fd	 = malloc(num_cpus * sizeof(int));
+	cpu_ring = calloc(num_cpus, sizeof(struct perf_ring_s));
+
+	/* the child waits for the events before the exec */
+	if (pipe(go)) {
+		perror("pipe");
+		return 1;
+	}
+
+	pid_t child = fork();
+	if (child == 0) {
+		close(go[1]);
+		if (read(go[0], &c, 1) != 1)
+			_exit(127);
+		close(go[0]);
+		execvp(argv[optind], &argv[optind]);
+		fprintf(stderr, "cannot run %s: %s\n", argv[optind], strerror(errno));
+		_exit(127);
+	} else if (child == -1) {
+		perror("fork");
+		return 1;
+	}
+	close(go[0]);
+
+	new_image(child, getpid(), argv[optind]);
+	if (open_events(child)) {
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+		return 1;
+	}
+
+	if (write(go[1], &c, 1) != 1)
+		perror("write");
+	close(go[1]);
+
+	struct pollfd *pfd = calloc(num_cpus, sizeof(struct pollfd));
+	for (int cpu = 0; cpu < num_cpus; cpu++) {
+		pfd[cpu].fd	= cpu_fd[cpu];	/* ignored if negative */
+		pfd[cpu].events = POLLIN;
+	}
+
+	/* until the command exits, its descendants may keep running */
+	for (;;) {
+		pid_t ret = waitpid(child, &wstat, WNOHANG);
+
+		if (ret == child || (ret == -1 && errno != EINTR))
+			break;
+		poll(pfd, num_cpus, 100);
+		drain_all();
+	}
+
+	for (int cpu = 0; cpu < num_cpus; cpu++) {
+		if (cpu_fd[cpu] >= 0)
+			ioctl(cpu_fd[cpu], PERF_EVENT_IOC_DISABLE, 0);
+	}
+	drain_all();
+
+	if (WIFEXITED(wstat))
+		printf("%s exited with %d\n", argv[optind], WEXITSTATUS(wstat));
+	else if (WIFSIGNALED(wstat))
+		printf("%s killed by signal %d\n", argv[optind], WTERMSIG(wstat));
+
+	struct perf_ring_stats_s stats;
+	memset(&stats, 0, sizeof(stats));
+	for (int cpu = 0; cpu < num_cpus; cpu++) {
+		if (cpu_fd[cpu] >= 0)
+			perf_ring_stats_add(&stats, &cpu_ring[cpu].stats);
+	}
+	perf_ring_report(stdout, "rings", &stats);
+
+	report();
+
+	for (int cpu = 0; cpu < num_cpus; cpu++) {
+		if (cpu_fd[cpu] < 0)
+			continue;
+		perf_ring_close(&cpu_ring[cpu]);
+		close(cpu_fd[cpu]);
+	}
+	return 0;
+}
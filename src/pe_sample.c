@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 
 #include <sys/ioctl.h>
@@ -34,6 +35,10 @@
 
 #include <linux/perf_event.h>
 
+#include "perf_ring.h"
+#include "perf_writer.h"
+#include "perf_flight.h"
+
 /* Profile everything (kernel/hypervisor/idle/user) or just user? */
 #undef USERSPACE_ONLY
 
@@ -51,17 +56,35 @@
 
 #define PERF_SIGNAL (SIGRTMIN+4)
 
-typedef void * perf_buffer_t;
-
 static int count_total[] = {0,0};
 static int event_fd[2];
-static perf_buffer_t event_buf[2];
+static struct perf_ring_s event_ring[2];
 
 #define buffer_pages 1
-static size_t pagesize;
-static size_t pgmsk;
 
 static uint64_t sample_type = PERF_SAMPLE_PERIOD | PERF_SAMPLE_IP | PERF_SAMPLE_ADDR;
+static struct perf_sample_layout_s sample_layout;
+
+/*
+ * -o file: copy the records verbatim into a perf.data file instead of
+ * decoding and printing them in the handler.
+ */
+static struct perf_writer_s writer;
+static int use_writer = 0;
+
+/*
+ * -f prefix: flight recorder. The rings are overwritten by the kernel
+ * and nobody reads them until SIGUSR2, the -t threshold or the end of
+ * the run asks for a snapshot of the last FLIGHT_PAGES of samples.
+ */
+#define FLIGHT_PAGES	128
+#define FLIGHT_MS	10	/* interval of the threshold */
+
+static struct perf_flight_s flight;
+static int use_flight = 0;
+
+/* -v: print every field of every sample, not just a dot */
+static int verbose = 0;
 
 static inline
 int sys_perf_event_open(struct perf_event_attr *attr, pid_t pid,
@@ -111,234 +134,6 @@ get_fd(int sig_fd)
 	return -1;
 }
 
-/*
- * event_buf already has the mmap'ed address for perf buffer,
- * So, go ahead and read the data.
- *
- * The payload data (event data) starts after the first page of control
- * information.
- */
-static int read_from_perf_buffer(void *event_buf, void *buf, size_t sz)
-{
-	struct perf_event_mmap_page *header = event_buf;
-	void *data;
-	unsigned long tail;
-	size_t avail_sz, min, c;
-
-	/*
-	 * data points to beginning of buffer payload
-	 */
-	data = ((void *)header) + sysconf(_SC_PAGESIZE);
-
-	/*
-	 * position of tail within the buffer payload.
-	 */
-	tail = header->data_tail & pgmsk;
-
-	/*
-	 * Size of available data.
-	 */
-	avail_sz = header->data_head - header->data_tail;
-	if (sz > avail_sz) {
-		fprintf(stderr, "Needed size is more than available size\n");
-		return -1;
-	}
-
-	/*
-	 * c = size till the end of buffer
-	 *
-	 * buffer size is a power of two.
-	 */
-	c = pgmsk + 1 - tail;
-
-	/*
-	 * min with requested size.
-	 */
-	min = c < sz ? c : sz;
-
-	/* copy beginning */
-	memcpy(buf, data + tail, min);
-
-	/* copy wrapped around leftover */
-	if (sz > min)
-		memcpy(buf + min, data, sz - min);
-
-	/* header->data_tail should reflect the last read data */
-	header->data_tail += sz;
-
-	return 0;
-}
-
-
-static int read_from_perf_buffer_64(void *event_buf, void *buf)
-{
-	return read_from_perf_buffer(event_buf, buf, sizeof(uint64_t));
-}
-
-
-
-/*
- * The below parser is a stripped down version of perf source. To keep it
- * simple, it only looks for PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_CALLCHAIN,
- * PERF_SAMPLE_IP, PERF_SAMPLE_RAW and PERF_SAMPLE_TIME.
- * More parsers can be added if needed.
- */
-static int parse_perf_sample(void *event_buf, struct perf_event_header *ehdr)
-{
-	size_t sz;
-	uint64_t type, val64;
-	uint64_t time_enabled, time_running;
-	const char *str;
-	int ret;
-	uint64_t value;
-	uint64_t id;
-	struct { uint32_t pid, tid; } pid;
-
-	if (!ehdr)
-		return -1;
-
-	sz = ehdr->size - sizeof(*ehdr);
-
-	type = sample_type;
-
-	if (type & PERF_SAMPLE_IDENTIFIER) {
-		ret = read_from_perf_buffer_64(event_buf, &val64);
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-		fprintf(stderr, "ID :%llu ", val64);
-		sz -= sizeof(val64);
-	}
-
-	/*
-	 * the sample_type information is laid down
-	 * based on the PERF_RECORD_SAMPLE format specified
-	 * in the perf_event.h header file.
-	 * That order is different from the enum perf_event_sample_format.
-	 */
-	if (type & PERF_SAMPLE_IP) {
-		ret = read_from_perf_buffer_64(event_buf, &val64);
-		if (ret) {
-			fprintf(stderr, "cannot read IP");
-			return -1;
-		}
-
-		/*
-		 * MISC_EXACT_IP indicates that kernel is returning
-		 * th  IIP of an instruction which caused the event, i.e.,
-		 * no skid
-		 */
-		//fprintf(stderr, "IIP:%#016llu  ", val64);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_TID) {
-		ret = read_from_perf_buffer(event_buf, &pid, sizeof(pid));
-		if (ret) {
-			fprintf(stderr, "cannot read PID");
-			return -1;
-		}
-
-		//fprintf(stderr, "PID:%d  TID:%d  ", pid.pid, pid.tid);
-		sz -= sizeof(pid);
-	}
-
-	if (type & PERF_SAMPLE_TIME) {
-		ret = read_from_perf_buffer_64(event_buf, &val64);
-		if (ret) {
-			fprintf(stderr, "cannot read time");
-			return -1;
-		}
-
-		//fprintf(stderr, "TIME:%llu  ", val64);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_ADDR) {
-		ret = read_from_perf_buffer_64(event_buf, &val64);
-		if (ret) {
-			fprintf(stderr, "cannot read time");
-			return -1;
-		}
-
-		//fprintf(stderr, "ADDR:%llu  ", val64);
-		sz -= sizeof(val64);
-	}
-	if (type & PERF_SAMPLE_CPU) {
-		struct { uint32_t cpu, reserved; } cpu;
-		ret = read_from_perf_buffer(event_buf, &cpu, sizeof(cpu));
-		if (ret) {
-			fprintf(stderr, "cannot read cpu");
-			return -1;
-		}
-		//fprintf(stderr, "CPU:%u  ", cpu.cpu);
-		sz -= sizeof(cpu);
-	}
-
-	if (type & PERF_SAMPLE_PERIOD) {
-		ret = read_from_perf_buffer_64(event_buf, &val64);
-		if (ret) {
-			fprintf(stderr, "cannot read period");
-			return -1;
-		}
-		//fprintf(stderr, "PERIOD:%llu  ", val64);
-		sz -= sizeof(val64);
-	}
-
-	if (type & PERF_SAMPLE_CALLCHAIN) {
-		uint64_t nr, ip;
-
-		ret = read_from_perf_buffer_64(event_buf, &nr);
-		if (ret) {
-			fprintf(stderr, "cannot read callchain nr");
-			return -1;
-		}
-		sz -= sizeof(nr);
-
-		//fprintf(stderr, "\n  CALLCHAIN :\n");
-		while(nr--) {
-			ret = read_from_perf_buffer_64(event_buf, &ip);
-			if (ret) {
-				fprintf(stderr, "cannot read ip");
-				return -1;
-			}
-
-			sz -= sizeof(ip);
-
-			//fprintf(stderr, "\t0x%llu\n", ip);
-		}
-	}
-
-	fprintf(stderr, ".");
-	return 0;
-}
-
-
-/*
- * Not the data we need? Skip the data.
- */
-static void skip_perf_data(void *event_buf, size_t sz)
-{
-	struct perf_event_mmap_page *hdr = event_buf;
-
-	if ((hdr->data_tail + sz) > hdr->data_head)
-		sz = hdr->data_head - hdr->data_tail;
-
-	hdr->data_tail += sz;
-}
-
-static int is_more_perf_data(void *event_buf)
-{
-	struct perf_event_mmap_page *hdr = event_buf;
-
-	if (hdr->data_tail < hdr->data_head)
-		return 1;
-
-	return 0;
-}
-
-
 static 
 void event_handler(int signum, siginfo_t *info, void *uc)
 {
@@ -360,23 +155,33 @@ void event_handler(int signum, siginfo_t *info, void *uc)
 		fprintf(stderr, "unknown fd: %d\n", fd);
 	}
 
-	struct perf_event_header ehdr;
-again:
-	ret = read_from_perf_buffer(event_buf[index], &ehdr, sizeof(ehdr));
-	if (ret) {
-		fprintf(stderr, "cannot read event header\n");
+	const struct perf_event_header *ehdr;
+	struct perf_sample_s sample;
+
+	if (use_writer) {
+		perf_ring_drain(&event_ring[index], perf_writer_cb, &writer);
+		count_total[index]++;
+		start_counters(fd);
 		return;
 	}
-	if (ehdr.type == PERF_RECORD_SAMPLE) {
-		//fprintf(stderr, "[%d] fd: %d    ", index, fd);
-		ret = parse_perf_sample(event_buf[index], &ehdr);
 
-	}  else {
-		skip_perf_data(event_buf[index], ehdr.size);
-	}
+	perf_ring_begin(&event_ring[index]);
+	while ((ehdr = perf_ring_next(&event_ring[index])) != NULL) {
+		if (ehdr->type != PERF_RECORD_SAMPLE)
+			continue;
 
-	if (is_more_perf_data(event_buf))
-		goto again;
+		//fprintf(stderr, "[%d] fd: %d    ", index, fd);
+		if (perf_sample_parse(&sample_layout, ehdr, &sample))
+			continue;
+		if (verbose) {
+			perf_sample_fprint(stderr, &sample_layout, &sample);
+			continue;
+		}
+		if (sample_layout.sample_type & PERF_SAMPLE_IDENTIFIER)
+			fprintf(stderr, "ID :%"PRIu64" ", sample.v[PERF_SF_IDENTIFIER]);
+		fprintf(stderr, ".");
+	}
+	perf_ring_end(&event_ring[index]);
 
 	count_total[index]++;
 
@@ -419,19 +224,6 @@ int setup_notification(int fd)
 	return ret;
 }
 
-static void*
-setup_buffer(int fd)
-{
-	void *buf = mmap(NULL, (buffer_pages + 1) * pagesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (buf == MAP_FAILED) {
-		fprintf(stderr, "Can't mmap buffer\n");
-		return NULL;
-	}
-
-	return buf;
-}
-
-
 static
 int setup_counters(uint64_t type, uint64_t config)
 {
@@ -456,17 +248,51 @@ int setup_counters(uint64_t type, uint64_t config)
 	attr.size	   = sizeof(struct perf_event_attr);
 	attr.sample_type   = sample_type;
 
+	if (use_writer || use_flight) {
+		/* what perf report needs to split the events and find the symbols */
+		attr.sample_type  |= PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID | PERF_SAMPLE_TIME;
+		attr.mmap	   = 1;
+		attr.mmap_data	   = 1;
+		attr.comm	   = 1;
+		attr.sample_id_all = 1;
+	}
+
+	/* all the events share the same sample_type */
+	if (perf_sample_layout_init(&sample_layout, &attr))
+		exit(1);
+
+	if (use_flight)
+		perf_flight_attr(&attr);
+
 	event_fd[index] = sys_perf_event_open(&attr, 0, -1, -1, 0);
 	if (event_fd[index] < 0) {
 		perror("sys_perf_event_open");
 	}
 	int fd = event_fd[index];
 
-	event_buf[index] = setup_buffer(fd);
-	if (event_buf[index] == NULL) {
+	/* no reader and no signal, the ring only goes out in a snapshot */
+	if (use_flight) {
+		if (fd < 0 || perf_flight_add(&flight, fd, FLIGHT_PAGES, &attr))
+			exit(2);
+		index++;
+		return fd;
+	}
+
+	if (perf_ring_open(&event_ring[index], fd, buffer_pages)) {
 		exit(2);
 	}
 
+	if (use_writer) {
+		uint64_t id;
+
+		if (ioctl(fd, PERF_EVENT_IOC_ID, &id) == 0)
+			perf_writer_add_attr(&writer, &attr, &id, 1);
+
+		/* the task is already running, tell perf what is mapped */
+		if (index == 0)
+			perf_writer_synthesize(&writer, getpid(), &attr);
+	}
+
 	setup_notification(fd);
 
 	index++;
@@ -483,7 +309,10 @@ read_counters(int index)
 	res = read(event_fd[index], &counter_result, sizeof(unsigned long long));
 	assert(res == sizeof(unsigned long long));
 
-	printf("[%d] counter:\t\t%lld\n[%d] Num counter: %d\n\n", index, counter_result, index, count_total[index]);
+	printf("[%d] counter:\t\t%lld\n[%d] Num counter: %d\n", index, counter_result, index, count_total[index]);
+	if (!use_flight)
+		perf_ring_report(stdout, "    ring", &event_ring[index].stats);
+	printf("\n");
 }
 
 static void
@@ -586,8 +415,46 @@ int instructions_million(void) {
 int
 main(int argc, char *argv[])
 {
-	pagesize = sysconf(_SC_PAGESIZE);
-	pgmsk = (buffer_pages * pagesize) - 1;
+	uint64_t threshold = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "o:f:t:gv")) != -1) {
+		switch (c) {
+		case 'g':
+			sample_type |= PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_CPU;
+			break;
+		case 'o':
+			if (perf_writer_open(&writer, optarg, 0))
+				exit(1);
+			use_writer = 1;
+			break;
+		case 'f':
+			if (perf_flight_init(&flight, optarg, getpid()))
+				exit(1);
+			use_flight = 1;
+			break;
+		case 't':
+			threshold = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || (use_writer && use_flight) || (threshold && !use_flight)) {
+usage:
+		fprintf(stderr, "Usage: %s [-g] [-v] [-o perf.data | -f prefix [-t count]]\n"
+				"  -g  sample the callchain and the cpu too\n"
+				"  -v  print every sample in full, not a dot\n"
+				"  -o  copy the records into a perf.data file\n"
+				"  -f  flight recorder: keep the last samples in the rings and\n"
+				"      write them to prefix.<n> on SIGUSR2 and at the end\n"
+				"  -t  also when the first event counts more than count in\n"
+				"      %d ms\n", argv[0], FLIGHT_MS);
+		exit(1);
+	}
 
 	setup_handler();
 
@@ -606,15 +473,46 @@ main(int argc, char *argv[])
 	}
 	printf("fd page-faults: %d\n", fd);
 
-	start_counters(fd);
+	if (use_flight) {
+		if (threshold)
+			perf_flight_threshold(&flight, event_fd[0], threshold, FLIGHT_MS);
+		perf_flight_signal(&flight, SIGUSR2);
+		if (perf_flight_start(&flight))
+			exit(1);
+		start_all();
+	} else {
+		start_counters(fd);
+	}
 
 	/* Do something */
 	instructions_million();
 
+	if (use_flight) {
+		/* the last window before the exit */
+		perf_flight_trigger(&flight, PERF_FLIGHT_API);
+		perf_flight_stop(&flight);
+		stop_all();
+	}
 	stop_counters(fd);
 	fprintf(stderr, "\n");
 	read_counters(0);
 	read_counters(1);
 
+	if (use_writer) {
+		stop_all();
+		for (int i = 0; i < 2; i++) {
+			if (event_fd[i] >= 0)
+				perf_ring_drain(&event_ring[i], perf_writer_cb, &writer);
+		}
+		printf("%"PRIu64" records written, %"PRIu64" lost\n", writer.records, writer.lost);
+		if (perf_writer_close(&writer))
+			exit(1);
+	}
+
+	if (use_flight) {
+		perf_flight_report(&flight, stdout);
+		perf_flight_fini(&flight);
+	}
+
 	return 0;
 }
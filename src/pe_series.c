@@ -0,0 +1,291 @@
+/*
+ * Counting mode time series:
+ *
+ *   pe_series [-e events] [-i ms] [-o file] [-u] [-n loops] [-- cmd args]
+ *   pe_series -d file [-q]
+ *
+ * A group of counting events is read every -i ms (50 by default) and
+ * written to a series file, see perf_series.h. With a command, the
+ * command is forked and counted, with its threads and children, until
+ * it exits. Without, pe_series counts itself over -n naive matrix
+ * multiplications; -u then reads the group with rdpmc on the thread it
+ * counts instead of read() from another thread.
+ *
+ * -d prints a file: one line per interval with the counts scaled to the
+ * time enabled, the IPC when there are cycles and instructions, then
+ * the intervals whose throughput, the instructions or else the first
+ * event, fell under half of its median, next to how far every event
+ * was from its own median then. -q only prints the summary.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "perf_series.h"
+#include "matrix_multiply.h"
+
+#define DEFAULT_EVENTS	"cycles,instructions,cache-misses,context-switches"
+#define MAX_DIPS	20
+
+/* what -d keeps of every interval for the dips */
+struct interval_s {
+	uint64_t	time;
+	double		rate[PERF_SERIES_MAX_EVENTS];	/* per second */
+};
+
+static int
+find_event(const struct perf_series_file_s *f, const char *name)
+{
+	for (int i = 0; i < f->nevents; i++) {
+		if (strcmp(f->names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+median(const struct interval_s *iv, size_t n, int e, double *scratch)
+{
+	for (size_t i = 0; i < n; i++)
+		scratch[i] = iv[i].rate[e];
+	qsort(scratch, n, sizeof(double), cmp_double);
+	return scratch[n / 2];
+}
+
+static int
+dump(const char *path, int quiet)
+{
+	struct perf_series_file_s f;
+	struct perf_series_block_s *b = malloc(sizeof(*b));
+	struct interval_s *iv = NULL;
+	size_t n = 0, max = 0;
+	uint64_t totals[PERF_SERIES_MAX_EVENTS] = { 0 };
+	int ret;
+
+	if (b == NULL || perf_series_file_open(&f, path)) {
+		free(b);
+		return 1;
+	}
+
+	int cycles = find_event(&f, "cycles");
+	int instructions = find_event(&f, "instructions");
+	int throughput = instructions >= 0 ? instructions : 0;
+
+	printf("%s: %d events every %.3f ms\n", path, f.nevents, f.interval_us * 1e-3);
+	if (!quiet) {
+		printf("%10s %8s", "ms", "running");
+		for (int e = 0; e < f.nevents; e++)
+			printf(" %16s", f.names[e]);
+		if (cycles >= 0 && instructions >= 0)
+			printf(" %6s", "ipc");
+		printf("\n");
+	}
+
+	while ((ret = perf_series_file_next(&f, b)) == 1) {
+		for (int r = 0; r < b->nrows; r++) {
+			double scale = b->running[r] && b->running[r] < b->enabled[r] ?
+				(double) b->enabled[r] / b->running[r] : 1.0;
+			double dt = b->enabled[r] * 1e-9;
+
+			if (n == max) {
+				max = max ? 2 * max : 4096;
+				iv  = realloc(iv, max * sizeof(*iv));
+				if (iv == NULL) {
+					fprintf(stderr, "cannot allocate %zu intervals\n", max);
+					return 1;
+				}
+			}
+			iv[n].time = b->time[r];
+			for (int e = 0; e < f.nevents; e++) {
+				iv[n].rate[e] = dt > 0 ? b->v[e][r] * scale / dt : 0;
+				totals[e]    += b->v[e][r] * scale;
+			}
+			n++;
+
+			if (quiet)
+				continue;
+			printf("%10.1f %7.1f%%", (b->time[r] - f.monotonic) * 1e-6,
+			       b->enabled[r] ? 100.0 * b->running[r] / b->enabled[r] : 0.0);
+			for (int e = 0; e < f.nevents; e++)
+				printf(" %16.0f", b->v[e][r] * scale);
+			if (cycles >= 0 && instructions >= 0)
+				printf(" %6.2f", b->v[cycles][r] ?
+				       (double) b->v[instructions][r] / b->v[cycles][r] : 0.0);
+			printf("\n");
+		}
+	}
+
+	double elapsed = n ? (iv[n - 1].time - f.monotonic) * 1e-9 : 0;
+	printf("\n%zu intervals, %.3f s\n", n, elapsed);
+	for (int e = 0; e < f.nevents; e++)
+		printf("  %-20s %20"PRIu64" %16.0f /s\n", f.names[e], totals[e],
+		       elapsed > 0 ? totals[e] / elapsed : 0.0);
+	if (cycles >= 0 && instructions >= 0 && totals[cycles])
+		printf("  %-20s %20.2f\n", "ipc", (double) totals[instructions] / totals[cycles]);
+
+	if (n) {
+		double *scratch = malloc(n * sizeof(double));
+		double med[PERF_SERIES_MAX_EVENTS];
+		int dips = 0;
+
+		for (int e = 0; e < f.nevents; e++)
+			med[e] = median(iv, n, e, scratch);
+		free(scratch);
+
+		printf("\nintervals under half the median of %s (%.0f /s), "
+		       "events against their median:\n", f.names[throughput], med[throughput]);
+		for (size_t i = 0; i < n; i++) {
+			if (iv[i].rate[throughput] >= med[throughput] / 2)
+				continue;
+			if (dips++ == MAX_DIPS)
+				continue;
+			printf("  %10.1f ms", (iv[i].time - f.monotonic) * 1e-6);
+			for (int e = 0; e < f.nevents; e++) {
+				if (med[e] > 0)
+					printf("  %s x%.2f", f.names[e], iv[i].rate[e] / med[e]);
+				else
+					printf("  %s %.0f/s", f.names[e], iv[i].rate[e]);
+			}
+			printf("\n");
+		}
+		if (dips > MAX_DIPS)
+			printf("  ... %d more\n", dips - MAX_DIPS);
+		printf("  %d of %zu intervals\n", dips, n);
+	}
+
+	perf_series_file_close(&f);
+	free(iv);
+	free(b);
+	return ret < 0;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-e events] [-i ms] [-o file] [-u] [-n loops] [-- cmd args]\n"
+			"       %s -d file [-q]\n"
+			"  -e  comma separated events of the group (default: %s)\n"
+			"  -i  read the group every that many ms (default: 50)\n"
+			"  -o  series file (default: series.data)\n"
+			"  -u  read with rdpmc on the counted thread, without a command\n"
+			"  -n  matrix multiplications to count, without a command\n"
+			"  -d  print a series file, -q only its summary\n",
+		prog, prog, DEFAULT_EVENTS);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *events = DEFAULT_EVENTS, *out = "series.data", *in = NULL;
+	struct perf_series_s s;
+	int interval_ms = 50, flags = 0, loops = 3, quiet = 0, opt;
+	int go[2], wstat = 0;
+	pid_t child = 0;
+	char c = 0;
+
+	while ((opt = getopt(argc, argv, "e:i:o:un:d:q")) != -1) {
+		switch (opt) {
+		case 'e':
+			events = optarg;
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			if (interval_ms <= 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'u':
+			flags |= PERF_SERIES_RDPMC;
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'd':
+			in = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (in)
+		return dump(in, quiet);
+	if (optind < argc && (flags & PERF_SERIES_RDPMC))
+		usage(argv[0]);
+
+	if (optind < argc) {
+		/* the child waits for the group before the exec */
+		if (pipe(go)) {
+			perror("pipe");
+			return 1;
+		}
+		child = fork();
+		if (child == 0) {
+			close(go[1]);
+			if (read(go[0], &c, 1) != 1)
+				_exit(127);
+			close(go[0]);
+			execvp(argv[optind], &argv[optind]);
+			fprintf(stderr, "cannot run %s: %s\n", argv[optind], strerror(errno));
+			_exit(127);
+		} else if (child == -1) {
+			perror("fork");
+			return 1;
+		}
+		close(go[0]);
+	}
+
+	if (perf_series_open(&s, events, child, interval_ms, flags) ||
+	    perf_series_create(&s, out) || perf_series_start(&s)) {
+		if (child > 0) {
+			kill(child, SIGKILL);
+			waitpid(child, NULL, 0);
+		}
+		return 1;
+	}
+
+	if (child > 0) {
+		if (write(go[1], &c, 1) != 1)
+			perror("write");
+		close(go[1]);
+		while (waitpid(child, &wstat, 0) == -1 && errno == EINTR)
+			;
+	} else {
+		for (int i = 0; i < loops; i++)
+			naive_matrix_multiply(1);
+	}
+
+	perf_series_stop(&s);
+	if (child > 0 && WIFEXITED(wstat))
+		printf("%s exited with %d\n", argv[optind], WEXITSTATUS(wstat));
+	else if (child > 0 && WIFSIGNALED(wstat))
+		printf("%s killed by signal %d\n", argv[optind], WTERMSIG(wstat));
+	perf_series_report(&s, stdout);
+	printf("written to %s\n", out);
+	perf_series_close(&s);
+	return 0;
+}
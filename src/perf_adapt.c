@@ -0,0 +1,106 @@
+/*
+ * Adaptive sample period.
+ * See perf_adapt.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#include "perf_adapt.h"
+
+/* at most a factor 4 per window, so one odd window cannot swing it */
+#define MAX_STEP	4.0
+
+/* no change while the overhead is within this factor of the budget */
+#define DEAD_BAND	1.25
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int
+perf_adapt_init(struct perf_adapt_s *a, int fd, uint64_t period, double budget)
+{
+	memset(a, 0, sizeof(*a));
+
+	if (period == 0 || budget <= 0 || budget >= 1) {
+		fprintf(stderr, "invalid adaptive period: period %"PRIu64", budget %g\n",
+			period, budget);
+		return -1;
+	}
+	a->fd		  = fd;
+	a->budget	  = budget;
+	a->sample_cost_ns = PERF_ADAPT_SAMPLE_COST;
+	a->period	  = period;
+	a->min_period	  = period / 1000 ? period / 1000 : 1;
+	a->max_period	  = period < UINT64_MAX / 1000 ? period * 1000 : UINT64_MAX;
+	a->last_ns	  = now_ns();
+	return 0;
+}
+
+/*
+ * Close a window: estimate the overhead since the last call and move
+ * the period toward the budget. Returns 1 if the period changed, 0 if
+ * not and -1 if the ioctl failed.
+ */
+int
+perf_adapt_update(struct perf_adapt_s *a, const struct perf_ring_stats_s *stats)
+{
+	uint64_t now	 = now_ns();
+	uint64_t elapsed = now - a->last_ns;
+	uint64_t samples = stats->samples  - a->last.samples;
+	uint64_t drain	 = stats->drain_ns - a->last.drain_ns;
+	int	 overrun = stats->lost > a->last.lost || stats->throttled > a->last.throttled;
+	double	 ratio;
+
+	if (elapsed == 0)
+		return 0;
+	a->last_ns = now;
+	a->last	   = *stats;
+
+	a->overhead = (drain + samples * a->sample_cost_ns) / (double) elapsed;
+	ratio	    = a->overhead / a->budget;
+
+	/*
+	 * The period goes with the overhead: twice the period, half the
+	 * samples. A window without samples says nothing about the cost,
+	 * the event may just not be happening: keep the period.
+	 */
+	if (samples == 0 && !overrun)
+		return 0;
+	if (overrun || ratio > MAX_STEP)
+		ratio = MAX_STEP;
+	else if (ratio < 1 / MAX_STEP)
+		ratio = 1 / MAX_STEP;
+	else if (ratio < DEAD_BAND && ratio > 1 / DEAD_BAND)
+		return 0;
+
+	double	 next	= a->period * ratio;
+	uint64_t period = next < a->min_period ? a->min_period :
+			  next > a->max_period ? a->max_period : (uint64_t) next;
+
+	if (period == a->period)
+		return 0;
+
+	if (ioctl(a->fd, PERF_EVENT_IOC_PERIOD, &period) != 0) {
+		if (a->errors++ == 0)
+			fprintf(stderr, "cannot change the sample period to %"PRIu64": %s\n",
+				period, strerror(errno));
+		return -1;
+	}
+	a->period = period;
+	a->changes++;
+	return 1;
+}
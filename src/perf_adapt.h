@@ -0,0 +1,58 @@
+/*
+ * Adaptive sample period.
+ *
+ * A fixed sample_period is either too small for a hot loop, where the
+ * interrupts and the drain slow the program down and the kernel starts
+ * throttling, or too large for a quiet phase, where nothing is sampled.
+ * The controller holds the cost of sampling under a budget, a fraction
+ * of the wall time, and moves the period of the event with
+ * PERF_EVENT_IOC_PERIOD:
+ *
+ *   perf_adapt_init(&a, fd, attr.sample_period, 0.01);
+ *   ... every 100 ms or so, from a thread or the drain loop:
+ *   perf_adapt_update(&a, &ring.stats);
+ *
+ * The cost of a window is the time spent in perf_ring_drain() plus
+ * sample_cost_ns per sample for the kernel side (the interrupt, the
+ * callchain walk and the copy into the ring). Lost samples and throttling
+ * count as over budget whatever the estimate says.
+ *
+ * Samples taken with different periods do not weigh the same: sample
+ * with PERF_SAMPLE_PERIOD and sum the periods rather than count the
+ * samples, then the totals stay unbiased while the period moves.
+ *
+ * The new period only reaches the event the fd was opened for; the
+ * copies of an inherited event in the child tasks keep the old one.
+ */
+
+#ifndef PERF_ADAPT_H
+#define PERF_ADAPT_H
+
+#include <stdint.h>
+
+#include "perf_ring.h"
+
+/* default kernel cost of one sample */
+#define PERF_ADAPT_SAMPLE_COST	2000
+
+struct perf_adapt_s {
+	int		fd;
+	double		budget;		/* fraction of the wall time */
+	uint64_t	sample_cost_ns;
+	uint64_t	period;
+	uint64_t	min_period;
+	uint64_t	max_period;
+
+	/* the end of the last window */
+	uint64_t	last_ns;
+	struct perf_ring_stats_s last;
+
+	double		overhead;	/* estimated over the last window */
+	uint64_t	changes;	/* periods applied */
+	uint64_t	errors;		/* PERF_EVENT_IOC_PERIOD failures */
+};
+
+int	perf_adapt_init(struct perf_adapt_s *a, int fd, uint64_t period, double budget);
+int	perf_adapt_update(struct perf_adapt_s *a, const struct perf_ring_stats_s *stats);
+
+#endif
@@ -0,0 +1,439 @@
+/*
+ * Address to allocation map for data-centric attribution.
+ * See perf_addrmap.h for the design.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "perf_addrmap.h"
+
+/* a treap is about 3 log2(n) deep, anything past this is a torn read */
+#define MAX_DEPTH	256
+#define MAX_RETRIES	64
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* while a writer is busy; any other architecture just spins */
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#else
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline struct perf_addrmap_node_s *
+node(struct perf_addrmap_s *m, uint32_t idx)
+{
+	return &m->chunk[idx >> PERF_ADDRMAP_CHUNK_SHIFT][idx & (PERF_ADDRMAP_CHUNK_NODES - 1)];
+}
+
+int
+perf_addrmap_init(struct perf_addrmap_s *m)
+{
+	memset(m, 0, sizeof(*m));
+	pthread_mutex_init(&m->lock, NULL);
+	m->rand	  = 2463534242U;
+	m->nnodes = 1;		/* node 0 is null */
+
+	m->chunk[0] = mmap(NULL, PERF_ADDRMAP_CHUNK_NODES * sizeof(struct perf_addrmap_node_s),
+			   PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (m->chunk[0] == MAP_FAILED) {
+		m->chunk[0] = NULL;
+		fprintf(stderr, "addrmap: cannot map nodes: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void
+perf_addrmap_fini(struct perf_addrmap_s *m)
+{
+	for (int i = 0; i < PERF_ADDRMAP_MAX_CHUNKS && m->chunk[i]; i++)
+		munmap(m->chunk[i], PERF_ADDRMAP_CHUNK_NODES * sizeof(struct perf_addrmap_node_s));
+	pthread_mutex_destroy(&m->lock);
+	memset(m, 0, sizeof(*m));
+}
+
+/*
+ * Writer side, called with the lock held and between write_begin() and
+ * write_end().
+ */
+static void
+write_begin(struct perf_addrmap_s *m)
+{
+	__atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+write_end(struct perf_addrmap_s *m)
+{
+	__atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t
+node_alloc(struct perf_addrmap_s *m)
+{
+	uint32_t idx = m->free_list;
+
+	if (idx) {
+		m->free_list = node(m, idx)->next_free;
+		return idx;
+	}
+
+	idx = m->nnodes;
+	uint32_t c = idx >> PERF_ADDRMAP_CHUNK_SHIFT;
+	if (c >= PERF_ADDRMAP_MAX_CHUNKS)
+		return 0;
+
+	if (m->chunk[c] == NULL) {
+		void *p = mmap(NULL, PERF_ADDRMAP_CHUNK_NODES * sizeof(struct perf_addrmap_node_s),
+			       PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return 0;
+		/* published before any node of it is linked */
+		__atomic_store_n(&m->chunk[c], p, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&m->nnodes, idx + 1, __ATOMIC_RELEASE);
+	return idx;
+}
+
+static void
+node_free(struct perf_addrmap_s *m, uint32_t idx)
+{
+	node(m, idx)->next_free = m->free_list;
+	m->free_list = idx;
+}
+
+/* xorshift32, only used for the treap priorities */
+static uint32_t
+next_prio(struct perf_addrmap_s *m)
+{
+	uint32_t x = m->rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return m->rand = x;
+}
+
+static uint32_t
+rotate_right(struct perf_addrmap_s *m, uint32_t r)
+{
+	uint32_t l = node(m, r)->left;
+
+	node(m, r)->left  = node(m, l)->right;
+	node(m, l)->right = r;
+	return l;
+}
+
+static uint32_t
+rotate_left(struct perf_addrmap_s *m, uint32_t r)
+{
+	uint32_t l = node(m, r)->right;
+
+	node(m, r)->right = node(m, l)->left;
+	node(m, l)->left  = r;
+	return l;
+}
+
+static uint32_t
+treap_insert(struct perf_addrmap_s *m, uint32_t root, uint32_t idx)
+{
+	if (root == 0)
+		return idx;
+
+	struct perf_addrmap_node_s *r = node(m, root);
+
+	if (node(m, idx)->start < r->start) {
+		r->left = treap_insert(m, r->left, idx);
+		if (node(m, r->left)->prio > r->prio)
+			root = rotate_right(m, root);
+	} else {
+		r->right = treap_insert(m, r->right, idx);
+		if (node(m, r->right)->prio > r->prio)
+			root = rotate_left(m, root);
+	}
+	return root;
+}
+
+static uint32_t
+treap_merge(struct perf_addrmap_s *m, uint32_t a, uint32_t b)
+{
+	if (a == 0)
+		return b;
+	if (b == 0)
+		return a;
+
+	if (node(m, a)->prio > node(m, b)->prio) {
+		node(m, a)->right = treap_merge(m, node(m, a)->right, b);
+		return a;
+	}
+	node(m, b)->left = treap_merge(m, a, node(m, b)->left);
+	return b;
+}
+
+static uint32_t
+treap_delete(struct perf_addrmap_s *m, uint32_t root, uint64_t start, uint32_t *removed)
+{
+	if (root == 0)
+		return 0;
+
+	struct perf_addrmap_node_s *r = node(m, root);
+
+	if (start < r->start) {
+		r->left = treap_delete(m, r->left, start, removed);
+	} else if (start > r->start) {
+		r->right = treap_delete(m, r->right, start, removed);
+	} else {
+		*removed = root;
+		return treap_merge(m, r->left, r->right);
+	}
+	return root;
+}
+
+/* first range overlapping [start, end), writer side */
+static uint32_t
+find_overlap(struct perf_addrmap_s *m, uint64_t start, uint64_t end)
+{
+	uint32_t idx = m->root, floor = 0, ceil = 0;
+
+	while (idx) {
+		struct perf_addrmap_node_s *n = node(m, idx);
+
+		if (start < n->start) {
+			ceil = idx;
+			idx  = n->left;
+		} else {
+			floor = idx;
+			idx   = n->right;
+		}
+	}
+
+	if (floor && node(m, floor)->end > start)
+		return floor;
+	if (ceil && node(m, ceil)->start < end)
+		return ceil;
+	return 0;
+}
+
+static void
+delete_node(struct perf_addrmap_s *m, uint64_t start, uint64_t *value)
+{
+	uint32_t removed = 0;
+
+	m->root = treap_delete(m, m->root, start, &removed);
+	if (removed == 0)
+		return;
+
+	if (value)
+		*value = node(m, removed)->value;
+	node_free(m, removed);
+	m->count--;
+	__atomic_store_n(&m->gen, m->gen + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add [start, end). Ranges it overlaps are dropped first, they belong
+ * to allocations whose release was missed. Returns the number of ranges
+ * dropped, or -1 if the map is full.
+ */
+int
+perf_addrmap_insert(struct perf_addrmap_s *m, uint64_t start, uint64_t end, uint64_t value)
+{
+	uint32_t idx, old;
+	int dropped = 0;
+
+	if (end <= start)
+		return -1;
+
+	pthread_mutex_lock(&m->lock);
+	write_begin(m);
+
+	while ((old = find_overlap(m, start, end)) != 0) {
+		delete_node(m, node(m, old)->start, NULL);
+		dropped++;
+	}
+
+	idx = node_alloc(m);
+	if (idx == 0) {
+		write_end(m);
+		pthread_mutex_unlock(&m->lock);
+		return -1;
+	}
+
+	struct perf_addrmap_node_s *n = node(m, idx);
+	n->start = start;
+	n->end	 = end;
+	n->value = value;
+	n->left	 = 0;
+	n->right = 0;
+	n->prio	 = next_prio(m);
+
+	m->root = treap_insert(m, m->root, idx);
+	m->count++;
+
+	write_end(m);
+	pthread_mutex_unlock(&m->lock);
+	return dropped;
+}
+
+/* Remove the range starting at start, 0 if there was one */
+int
+perf_addrmap_remove(struct perf_addrmap_s *m, uint64_t start, uint64_t *value)
+{
+	uint64_t count;
+
+	pthread_mutex_lock(&m->lock);
+	write_begin(m);
+	count = m->count;
+	delete_node(m, start, value);
+	count -= m->count;
+	write_end(m);
+	pthread_mutex_unlock(&m->lock);
+
+	return count ? 0 : -1;
+}
+
+/* Remove every range overlapping [start, end), e.g. on munmap() */
+int
+perf_addrmap_remove_range(struct perf_addrmap_s *m, uint64_t start, uint64_t end)
+{
+	uint32_t old;
+	int n = 0;
+
+	pthread_mutex_lock(&m->lock);
+	write_begin(m);
+	while ((old = find_overlap(m, start, end)) != 0) {
+		delete_node(m, node(m, old)->start, NULL);
+		n++;
+	}
+	write_end(m);
+	pthread_mutex_unlock(&m->lock);
+	return n;
+}
+
+/* 1 if a range overlaps [start, end), writer side like remove_range */
+int
+perf_addrmap_overlaps(struct perf_addrmap_s *m, uint64_t start, uint64_t end)
+{
+	int ret;
+
+	pthread_mutex_lock(&m->lock);
+	ret = find_overlap(m, start, end) != 0;
+	pthread_mutex_unlock(&m->lock);
+	return ret;
+}
+
+/*
+ * Find the range holding addr. Returns 1 and fills entry if there is
+ * one, 0 if there is none, -1 if a writer kept the map busy.
+ */
+int
+perf_addrmap_lookup(struct perf_addrmap_s *m, uint64_t addr,
+		    struct perf_addrmap_cache_s *cache,
+		    struct perf_addrmap_entry_s *entry)
+{
+	unsigned slot = (addr >> PERF_ADDRMAP_PAGE_SHIFT) & (PERF_ADDRMAP_CACHE_SIZE - 1);
+
+	/*
+	 * The cache holds copies, not nodes, so it can be used even while a
+	 * writer is busy, e.g. by a handler that interrupted it.
+	 */
+	if (cache && cache->e[slot].gen == LOAD(m->gen) &&
+	    addr >= cache->e[slot].start && addr < cache->e[slot].end) {
+		entry->start = cache->e[slot].start;
+		entry->end   = cache->e[slot].end;
+		entry->value = cache->e[slot].value;
+		cache->hits++;
+		return 1;
+	}
+
+	for (int retry = 0; retry < MAX_RETRIES; retry++) {
+		uint32_t seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		uint64_t start = 0, end = 0, value = 0;
+		uint32_t idx, nnodes;
+		uint64_t gen;
+		int depth = 0;
+
+		if (seq & 1) {
+			cpu_relax();
+			continue;
+		}
+
+		gen    = LOAD(m->gen);
+		nnodes = __atomic_load_n(&m->nnodes, __ATOMIC_ACQUIRE);
+		idx    = LOAD(m->root);
+		while (idx && idx < nnodes && depth++ < MAX_DEPTH) {
+			struct perf_addrmap_node_s *n = node(m, idx);
+			uint64_t s = LOAD(n->start);
+
+			if (addr < s) {
+				idx = LOAD(n->left);
+			} else {
+				start = s;
+				end   = LOAD(n->end);
+				value = LOAD(n->value);
+				idx   = LOAD(n->right);
+			}
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (LOAD(m->seq) != seq || depth > MAX_DEPTH)
+			continue;
+
+		if (cache)
+			cache->misses++;
+		if (end == 0 || addr >= end)
+			return 0;
+
+		entry->start = start;
+		entry->end   = end;
+		entry->value = value;
+
+		if (cache) {
+			cache->e[slot].start = start;
+			cache->e[slot].end   = end;
+			cache->e[slot].value = value;
+			cache->e[slot].gen   = gen;
+		}
+		return 1;
+	}
+
+	__atomic_fetch_add(&m->busy, 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+static void
+foreach(struct perf_addrmap_s *m, uint32_t idx, perf_addrmap_cb cb, void *arg)
+{
+	while (idx) {
+		struct perf_addrmap_node_s *n = node(m, idx);
+		struct perf_addrmap_entry_s entry = { n->start, n->end, n->value };
+
+		foreach(m, n->left, cb, arg);
+		cb(&entry, arg);
+		idx = n->right;
+	}
+}
+
+/* In address order, with the writers locked out */
+void
+perf_addrmap_foreach(struct perf_addrmap_s *m, perf_addrmap_cb cb, void *arg)
+{
+	pthread_mutex_lock(&m->lock);
+	foreach(m, m->root, cb, arg);
+	pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,98 @@
+/*
+ * Address to allocation map for data-centric attribution.
+ *
+ * Holds any number of live, non-overlapping [start, end) ranges, each
+ * with a 64-bit value (typically a pointer to the caller's allocation
+ * record), and finds the range holding a sampled address in O(log n).
+ *
+ * The ranges are kept in a treap whose nodes come from mmap'ed chunks
+ * that are never given back, indexed by 32-bit node numbers:
+ *
+ *   - insert and remove take a mutex and bump a sequence count around
+ *     each change; they may be called from any thread, but not from a
+ *     signal handler. They never call malloc, so they are safe to use
+ *     from a malloc interposer.
+ *   - lookup takes no lock. It walks the tree and retries if the
+ *     sequence count moved, which is memory-safe since a stale node
+ *     number still points into a mapped chunk. It is async-signal-safe;
+ *     a handler interrupting a writer on its own thread gives up after
+ *     a few retries and the lookup is counted in busy.
+ *
+ * Lookups can go through a small direct-mapped per-page cache owned by
+ * the caller (one per thread). Removing a range bumps a generation that
+ * invalidates every cache, inserting one does not.
+ */
+
+#ifndef PERF_ADDRMAP_H
+#define PERF_ADDRMAP_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define PERF_ADDRMAP_CHUNK_SHIFT	16
+#define PERF_ADDRMAP_CHUNK_NODES	(1U << PERF_ADDRMAP_CHUNK_SHIFT)
+#define PERF_ADDRMAP_MAX_CHUNKS		1024	/* 64M ranges */
+
+#define PERF_ADDRMAP_CACHE_SIZE		32	/* power of 2 */
+#define PERF_ADDRMAP_PAGE_SHIFT		12
+
+struct perf_addrmap_node_s {
+	uint64_t	start;
+	uint64_t	end;
+	uint64_t	value;
+	uint32_t	left;		/* 0 is the null node */
+	uint32_t	right;
+	uint32_t	prio;
+	uint32_t	next_free;
+};
+
+struct perf_addrmap_s {
+	uint32_t	seq __attribute__((aligned(64)));	/* odd while a writer is busy */
+	uint32_t	root;
+	uint32_t	nnodes;		/* node numbers handed out so far */
+	uint64_t	gen;		/* bumped by every removal */
+
+	uint64_t	count;		/* live ranges */
+	uint64_t	busy;		/* lookups that gave up */
+
+	pthread_mutex_t	lock __attribute__((aligned(64)));
+	uint32_t	free_list;
+	uint32_t	rand;
+
+	struct perf_addrmap_node_s *chunk[PERF_ADDRMAP_MAX_CHUNKS];
+};
+
+struct perf_addrmap_entry_s {
+	uint64_t	start;
+	uint64_t	end;
+	uint64_t	value;
+};
+
+struct perf_addrmap_cache_s {
+	struct {
+		uint64_t start;
+		uint64_t end;
+		uint64_t value;
+		uint64_t gen;
+	} e[PERF_ADDRMAP_CACHE_SIZE];
+	uint64_t	hits;
+	uint64_t	misses;
+};
+
+typedef void (*perf_addrmap_cb)(const struct perf_addrmap_entry_s *entry, void *arg);
+
+int	perf_addrmap_init(struct perf_addrmap_s *m);
+void	perf_addrmap_fini(struct perf_addrmap_s *m);
+
+int	perf_addrmap_insert(struct perf_addrmap_s *m, uint64_t start, uint64_t end,
+			    uint64_t value);
+int	perf_addrmap_remove(struct perf_addrmap_s *m, uint64_t start, uint64_t *value);
+int	perf_addrmap_remove_range(struct perf_addrmap_s *m, uint64_t start, uint64_t end);
+int	perf_addrmap_overlaps(struct perf_addrmap_s *m, uint64_t start, uint64_t end);
+
+int	perf_addrmap_lookup(struct perf_addrmap_s *m, uint64_t addr,
+			    struct perf_addrmap_cache_s *cache,
+			    struct perf_addrmap_entry_s *entry);
+void	perf_addrmap_foreach(struct perf_addrmap_s *m, perf_addrmap_cb cb, void *arg);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * Background collector thread for perf rings.
+ * See perf_collector.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "perf_collector.h"
+
+#define MAX_EPOLL_EVENTS 64
+
+/* epoll data of the flush fd, the stop fd is 0 and the rings 1 to n */
+#define FLUSH_ID	UINT64_MAX
+
+int
+perf_collector_init(struct perf_collector_s *c)
+{
+	struct epoll_event ev;
+
+	memset(c, 0, sizeof(*c));
+	c->epfd	   = -1;
+	c->stopfd  = -1;
+	c->flushfd = -1;
+	pthread_mutex_init(&c->flush_lock, NULL);
+	pthread_cond_init(&c->flush_cond, NULL);
+
+	c->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (c->epfd < 0) {
+		fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+		return -1;
+	}
+
+	c->stopfd = eventfd(0, EFD_CLOEXEC);
+	if (c->stopfd < 0) {
+		fprintf(stderr, "eventfd: %s\n", strerror(errno));
+		perf_collector_fini(c);
+		return -1;
+	}
+
+	/* data.ptr == NULL marks the stop fd */
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->stopfd, &ev)) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		perf_collector_fini(c);
+		return -1;
+	}
+
+	c->flushfd = eventfd(0, EFD_CLOEXEC);
+	if (c->flushfd < 0) {
+		fprintf(stderr, "eventfd: %s\n", strerror(errno));
+		perf_collector_fini(c);
+		return -1;
+	}
+
+	ev.data.u64 = FLUSH_ID;
+	if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->flushfd, &ev)) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		perf_collector_fini(c);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Register a perf fd and its ring. Must be called before
+ * perf_collector_start().
+ */
+int
+perf_collector_add(struct perf_collector_s *c, int fd, struct perf_ring_s *ring,
+		   perf_record_cb cb, void *arg)
+{
+	struct perf_collector_entry_s *e;
+	struct epoll_event ev;
+
+	if (c->running)
+		return -1;
+
+	if (c->nentries == c->maxentries) {
+		int max = c->maxentries ? c->maxentries * 2 : 16;
+		e = realloc(c->entries, max * sizeof(*e));
+		if (e == NULL)
+			return -1;
+		c->entries    = e;
+		c->maxentries = max;
+	}
+
+	e = &c->entries[c->nentries];
+	e->fd	= fd;
+	e->ring = ring;
+	e->cb	= cb;
+	e->arg	= arg;
+
+	/*
+	 * entries[] may still move with realloc, so store the index and
+	 * not the pointer. The index is offset by one since 0 is the
+	 * stop fd.
+	 */
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.u64 = c->nentries + 1;
+	if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		fprintf(stderr, "epoll_ctl fd %d: %s\n", fd, strerror(errno));
+		return -1;
+	}
+
+	c->nentries++;
+	return 0;
+}
+
+static void
+drain_all(struct perf_collector_s *c)
+{
+	for (int i = 0; i < c->nentries; i++) {
+		struct perf_collector_entry_s *e = &c->entries[i];
+		perf_ring_drain(e->ring, e->cb, e->arg);
+	}
+}
+
+/*
+ * Serve the flushes asked for so far: they were all asked for before
+ * this drain started.
+ */
+static void
+flush(struct perf_collector_s *c)
+{
+	uint64_t req, v;
+
+	if (read(c->flushfd, &v, sizeof(v)) < 0)
+		;
+
+	pthread_mutex_lock(&c->flush_lock);
+	req = c->flush_req;
+	pthread_mutex_unlock(&c->flush_lock);
+
+	drain_all(c);
+
+	pthread_mutex_lock(&c->flush_lock);
+	c->flushed = req;
+	pthread_cond_broadcast(&c->flush_cond);
+	pthread_mutex_unlock(&c->flush_lock);
+}
+
+static void *
+collector_thread(void *arg)
+{
+	struct perf_collector_s *c = arg;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct timespec cpu;
+	int stop = 0;
+
+	while (!stop) {
+		int n = epoll_wait(c->epfd, events, MAX_EPOLL_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			uint64_t idx = events[i].data.u64;
+
+			if (idx == 0) {
+				stop = 1;
+				continue;
+			}
+			if (idx == FLUSH_ID) {
+				flush(c);
+				continue;
+			}
+
+			struct perf_collector_entry_s *e = &c->entries[idx - 1];
+			if (events[i].events & EPOLLIN)
+				perf_ring_drain(e->ring, e->cb, e->arg);
+
+			/* the monitored task is gone, or the event got disabled for good */
+			if (events[i].events & (EPOLLHUP|EPOLLERR))
+				epoll_ctl(c->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+		}
+	}
+
+	/* whatever is left below the watermarks */
+	drain_all(c);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	c->cpu_ns = cpu.tv_sec * 1000000000ull + cpu.tv_nsec;
+
+	return NULL;
+}
+
+/*
+ * Keep the collector thread on the given cpus, typically the ones of the
+ * NUMA node whose rings it drains. Must be called before
+ * perf_collector_start().
+ */
+int
+perf_collector_bind(struct perf_collector_s *c, const cpu_set_t *cpus)
+{
+	if (c->running)
+		return -1;
+
+	c->cpus  = *cpus;
+	c->bound = 1;
+	return 0;
+}
+
+int
+perf_collector_start(struct perf_collector_s *c)
+{
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int ret;
+
+	if (c->running)
+		return -1;
+
+	pthread_attr_init(&attr);
+	if (c->bound)
+		pthread_attr_setaffinity_np(&attr, sizeof(c->cpus), &c->cpus);
+
+	/*
+	 * The collector must never pick up the signals meant for the
+	 * profiled threads.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&c->thread, &attr, collector_thread, c);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->flush_lock);
+	c->running = 1;
+	pthread_mutex_unlock(&c->flush_lock);
+	return 0;
+}
+
+/*
+ * Wake the collector up, let it drain the rings one last time and wait
+ * for it. Disable the events first if nothing should be missed.
+ */
+int
+perf_collector_stop(struct perf_collector_s *c)
+{
+	uint64_t one = 1;
+
+	if (!c->running)
+		return -1;
+
+	if (write(c->stopfd, &one, sizeof(one)) != sizeof(one)) {
+		fprintf(stderr, "cannot stop the collector: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pthread_join(c->thread, NULL);
+
+	/* the last drain served whoever is still waiting */
+	pthread_mutex_lock(&c->flush_lock);
+	c->running = 0;
+	c->flushed = c->flush_req;
+	pthread_cond_broadcast(&c->flush_cond);
+	pthread_mutex_unlock(&c->flush_lock);
+	return 0;
+}
+
+/*
+ * Wait until the records in the rings at the time of the call have been
+ * handed to the callbacks. Must not be called from a callback.
+ */
+int
+perf_collector_flush(struct perf_collector_s *c)
+{
+	uint64_t one = 1, req;
+
+	pthread_mutex_lock(&c->flush_lock);
+	if (!c->running) {
+		pthread_mutex_unlock(&c->flush_lock);
+		return -1;
+	}
+	req = ++c->flush_req;
+	pthread_mutex_unlock(&c->flush_lock);
+
+	if (write(c->flushfd, &one, sizeof(one)) != sizeof(one))
+		return -1;
+
+	pthread_mutex_lock(&c->flush_lock);
+	while (c->flushed < req)
+		pthread_cond_wait(&c->flush_cond, &c->flush_lock);
+	pthread_mutex_unlock(&c->flush_lock);
+	return 0;
+}
+
+void
+perf_collector_fini(struct perf_collector_s *c)
+{
+	if (c->running)
+		perf_collector_stop(c);
+
+	if (c->epfd >= 0)
+		close(c->epfd);
+	if (c->stopfd >= 0)
+		close(c->stopfd);
+	if (c->flushfd >= 0)
+		close(c->flushfd);
+	free(c->entries);
+	pthread_mutex_destroy(&c->flush_lock);
+	pthread_cond_destroy(&c->flush_cond);
+
+	c->epfd = c->stopfd = c->flushfd = -1;
+	c->entries = NULL;
+	c->nentries = c->maxentries = 0;
+}
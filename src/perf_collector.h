@@ -0,0 +1,76 @@
+/*
+ * Background collector thread for perf rings.
+ *
+ * Instead of parsing the ring buffers in a signal handler, which
+ * interrupts the profiled thread and is not async-signal-safe as soon
+ * as the handler does any real work, the collector owns a thread that
+ * epoll_wait()s on every registered perf fd and drains a ring when the
+ * kernel wakes it up. The records are handed to a per-fd callback
+ * (the aggregator) from that thread only.
+ *
+ * The events should be opened with perf_ring_watermark() and without
+ * O_ASYNC, so the profiled threads never see a signal:
+ *
+ *   perf_collector_init(&c);
+ *   perf_ring_watermark(&attr, pages);
+ *   fd = perf_event_open(&attr, ...);
+ *   perf_ring_open(&ring, fd, pages);
+ *   perf_collector_add(&c, fd, &ring, aggregate, arg);
+ *   perf_collector_start(&c);
+ *   ... workload ...
+ *   perf_collector_stop(&c);	drains what is left and joins
+ *   perf_collector_fini(&c);
+ *
+ * perf_collector_flush() lets another thread wait until everything
+ * already in the rings went through the callbacks, e.g. before it
+ * drops what the callbacks look the samples up in.
+ */
+
+#ifndef PERF_COLLECTOR_H
+#define PERF_COLLECTOR_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "perf_ring.h"
+
+struct perf_collector_entry_s {
+	int			 fd;
+	struct perf_ring_s	*ring;
+	perf_record_cb		 cb;
+	void			*arg;
+};
+
+struct perf_collector_s {
+	int			 epfd;
+	int			 stopfd;	/* eventfd, wakes the thread up to exit */
+	int			 flushfd;	/* eventfd, asks for a drain of every ring */
+	pthread_t		 thread;
+	int			 running;
+
+	int			 bound;		/* run the thread on cpus only */
+	cpu_set_t		 cpus;
+
+	struct perf_collector_entry_s *entries;
+	int			 nentries;
+	int			 maxentries;
+
+	uint64_t		 cpu_ns;	/* collector thread cpu time */
+
+	pthread_mutex_t		 flush_lock;
+	pthread_cond_t		 flush_cond;
+	uint64_t		 flush_req;	/* flushes asked for */
+	uint64_t		 flushed;	/* flushes done */
+};
+
+int	perf_collector_init(struct perf_collector_s *c);
+int	perf_collector_add(struct perf_collector_s *c, int fd, struct perf_ring_s *ring,
+			   perf_record_cb cb, void *arg);
+int	perf_collector_bind(struct perf_collector_s *c, const cpu_set_t *cpus);
+int	perf_collector_start(struct perf_collector_s *c);
+int	perf_collector_stop(struct perf_collector_s *c);
+int	perf_collector_flush(struct perf_collector_s *c);
+void	perf_collector_fini(struct perf_collector_s *c);
+
+#endif
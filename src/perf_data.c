@@ -0,0 +1,171 @@
+/*
+ * perf.data reader.
+ * See perf_data.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "perf_data.h"
+#include "perf_writer.h"
+
+void
+perf_data_close(struct perf_data_s *d)
+{
+	if (d->map)
+		munmap(d->map, d->len);
+	d->map	  = NULL;
+	d->data	  = NULL;
+	d->nattrs = 0;
+}
+
+static int
+read_attrs(struct perf_data_s *d, const struct perf_file_header *h, const char *path)
+{
+	const unsigned char *m = d->map;
+	size_t attr_size = h->attr_size, nattrs;
+
+	if (attr_size < sizeof(struct perf_file_section) + PERF_ATTR_SIZE_VER0) {
+		fprintf(stderr, "%s: attrs of %zu bytes\n", path, attr_size);
+		return -1;
+	}
+	nattrs = h->attrs.size / attr_size;
+	if (nattrs == 0 || nattrs > PERF_DATA_MAX_ATTRS) {
+		fprintf(stderr, "%s: %zu attrs\n", path, nattrs);
+		return -1;
+	}
+
+	for (size_t i = 0; i < nattrs; i++) {
+		struct perf_data_attr_s *a = &d->attrs[i];
+		const unsigned char *fa = m + h->attrs.offset + i * attr_size;
+		size_t size = attr_size - sizeof(struct perf_file_section);
+		struct perf_file_section ids;
+
+		memset(&a->attr, 0, sizeof(a->attr));
+		memcpy(&a->attr, fa, size < sizeof(a->attr) ? size : sizeof(a->attr));
+		memcpy(&ids, fa + size, sizeof(ids));
+		if (ids.offset > d->len || ids.size > d->len - ids.offset) {
+			fprintf(stderr, "%s: ids past the end of the file\n", path);
+			return -1;
+		}
+		a->ids	= (const uint64_t *) (m + ids.offset);
+		a->nids = ids.size / sizeof(uint64_t);
+		d->nattrs++;
+	}
+
+	d->sample_type = d->attrs[0].attr.sample_type;
+	return perf_sample_layout_init(&d->layout, &d->attrs[0].attr);
+}
+
+int
+perf_data_open(struct perf_data_s *d, const char *path)
+{
+	struct perf_file_header h;
+	struct stat st;
+	int fd;
+
+	memset(d, 0, sizeof(*d));
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if ((size_t) st.st_size < sizeof(h)) {
+		fprintf(stderr, "%s: not a perf.data file\n", path);
+		close(fd);
+		return -1;
+	}
+	d->len = st.st_size;
+	d->map = mmap(NULL, d->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (d->map == MAP_FAILED) {
+		fprintf(stderr, "cannot map %s: %s\n", path, strerror(errno));
+		d->map = NULL;
+		return -1;
+	}
+	/* read ahead, the whole file goes through the cache anyway */
+	madvise(d->map, d->len, MADV_WILLNEED);
+
+	memcpy(&h, d->map, sizeof(h));
+	if (h.magic != PERF_MAGIC) {
+		fprintf(stderr, "%s: not a perf.data file\n", path);
+		goto fail;
+	}
+	if (h.attrs.offset > d->len || h.attrs.size > d->len - h.attrs.offset ||
+	    h.data.offset > d->len) {
+		fprintf(stderr, "%s: sections past the end of the file\n", path);
+		goto fail;
+	}
+	if (read_attrs(d, &h, path))
+		goto fail;
+
+	d->data	     = (const unsigned char *) d->map + h.data.offset;
+	d->data_size = h.data.size < d->len - h.data.offset ? h.data.size :
+		       d->len - h.data.offset;
+	return 0;
+
+fail:
+	perf_data_close(d);
+	return -1;
+}
+
+/*
+ * Cut the data section into at most nchunks chunks, bounds[i] to
+ * bounds[i + 1], at record boundaries, and hand the records other than
+ * samples to cb. Returns the number of chunks.
+ */
+size_t
+perf_data_split(struct perf_data_s *d, uint64_t *bounds, size_t nchunks,
+		perf_record_cb cb, void *arg)
+{
+	uint64_t chunk = d->data_size / (nchunks ? nchunks : 1) + 1, off = 0;
+	size_t n = 0;
+
+	bounds[0] = 0;
+	d->records = 0;
+	while (off + sizeof(struct perf_event_header) <= d->data_size) {
+		const struct perf_event_header *hdr = (const void *) (d->data + off);
+
+		if (hdr->size < sizeof(*hdr) || hdr->size > d->data_size - off)
+			break;
+		if (hdr->type != PERF_RECORD_SAMPLE && cb)
+			cb(hdr, arg);
+		d->records++;
+		off += hdr->size;
+		if (off - bounds[n] >= chunk && n + 1 < nchunks)
+			bounds[++n] = off;
+	}
+	if (off > bounds[n])
+		bounds[++n] = off;
+	return n;
+}
+
+/* hand the samples between two bounds to cb, returns how many */
+uint64_t
+perf_data_walk(const struct perf_data_s *d, uint64_t begin, uint64_t end,
+	       perf_record_cb cb, void *arg)
+{
+	uint64_t samples = 0;
+
+	while (begin < end) {
+		const struct perf_event_header *hdr = (const void *) (d->data + begin);
+
+		if (hdr->type == PERF_RECORD_SAMPLE) {
+			cb(hdr, arg);
+			samples++;
+		}
+		begin += hdr->size;
+	}
+	return samples;
+}
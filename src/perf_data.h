@@ -0,0 +1,62 @@
+/*
+ * perf.data reader, for the files perf_writer and perf_flight write:
+ * the whole file is mapped, the attrs and their ids read from the
+ * header, and the records of the data section walked in place.
+ *
+ *   perf_data_open(&d, "perf.data");
+ *   n = perf_data_split(&d, bounds, nchunks, side_band, &state);
+ *   ... thread i, for every chunk it takes:
+ *   perf_data_walk(&d, bounds[c], bounds[c + 1], count_sample, args[i]);
+ *   perf_data_close(&d);
+ *
+ * The records have no index, so perf_data_split() hops from header to
+ * header over the data section once: one load per record, far less than
+ * parsing them. It cuts it into at most nchunks chunks of about the
+ * same size at record boundaries, and hands the records other than
+ * samples, the comms and mmaps, to its callback in file order on the
+ * way, so they are known before the samples are walked in parallel.
+ * perf_data_walk() only hands out the samples of a chunk.
+ *
+ * A data section cut short ends at the last whole record.
+ */
+
+#ifndef PERF_DATA_H
+#define PERF_DATA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/perf_event.h>
+
+#include "perf_ring.h"
+
+#define PERF_DATA_MAX_ATTRS	64
+
+struct perf_data_attr_s {
+	struct perf_event_attr	 attr;
+	const uint64_t		*ids;	/* in the map */
+	uint32_t		 nids;
+};
+
+struct perf_data_s {
+	void		*map;
+	size_t		 len;
+
+	struct perf_data_attr_s attrs[PERF_DATA_MAX_ATTRS];
+	int		 nattrs;
+	uint64_t	 sample_type;	/* of the first attr */
+	struct perf_sample_layout_s layout;
+
+	const unsigned char *data;
+	uint64_t	 data_size;
+	uint64_t	 records;	/* counted by perf_data_split() */
+};
+
+int	perf_data_open(struct perf_data_s *d, const char *path);
+size_t	perf_data_split(struct perf_data_s *d, uint64_t *bounds, size_t nchunks,
+			perf_record_cb cb, void *arg);
+uint64_t perf_data_walk(const struct perf_data_s *d, uint64_t begin, uint64_t end,
+			perf_record_cb cb, void *arg);
+void	perf_data_close(struct perf_data_s *d);
+
+#endif
@@ -0,0 +1,463 @@
+/*
+ * Folded stacks and flame graphs.
+ * See perf_flame.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/perf_event.h>
+
+#include "perf_flame.h"
+
+/* deeper chains are cut, the kernel default is 127 */
+#define MAX_DEPTH	256
+
+/* SVG geometry, in pixels */
+#define SVG_WIDTH	1200
+#define SVG_PAD		10
+#define SVG_FRAME	16
+#define SVG_TOP		40
+#define SVG_CHAR	7	/* average width of a character at 12px */
+#define SVG_MIN_WIDTH	0.1	/* narrower frames are left out */
+
+static uint32_t
+hash_node(uint32_t parent, uint64_t key)
+{
+	uint64_t h = (key ^ ((uint64_t) parent * 0xff51afd7ed558ccdull)) * 0x9e3779b97f4a7c15ull;
+	return h >> 32;
+}
+
+int
+perf_flame_init(struct perf_flame_s *f)
+{
+	memset(f, 0, sizeof(*f));
+
+	f->max_nodes	   = 1024;
+	f->index_size	   = 2048;
+	f->names_size	   = 16384;
+	f->name_index_size = 1024;
+
+	f->nodes      = calloc(f->max_nodes, sizeof(struct perf_flame_node_s));
+	f->index      = calloc(f->index_size, sizeof(uint32_t));
+	f->names      = malloc(f->names_size);
+	f->name_index = calloc(f->name_index_size, sizeof(struct perf_flame_name_s));
+	if (!f->nodes || !f->index || !f->names || !f->name_index) {
+		perf_flame_fini(f);
+		return -1;
+	}
+
+	/* the root, named "all" as flamegraph.pl does */
+	strcpy(f->names, "all");
+	f->names_used = sizeof("all");
+	f->nnodes     = 1;
+	return 0;
+}
+
+void
+perf_flame_fini(struct perf_flame_s *f)
+{
+	free(f->nodes);
+	free(f->index);
+	free(f->names);
+	free(f->name_index);
+	memset(f, 0, sizeof(*f));
+}
+
+/* the offset of the name of key in the pool, added the first time */
+static int
+intern_name(struct perf_flame_s *f, uint64_t key, const char *name, uint32_t *off)
+{
+	uint32_t mask = f->name_index_size - 1;
+	uint32_t h = hash_node(0, key) & mask;
+
+	for (;; h = (h + 1) & mask) {
+		struct perf_flame_name_s *n = &f->name_index[h];
+
+		if (n->off && n->key == key) {
+			*off = n->off - 1;
+			return 0;
+		}
+		if (n->off == 0)
+			break;
+	}
+
+	size_t len = strlen(name) + 1;
+	while (f->names_used + len > f->names_size) {
+		char *names = realloc(f->names, 2 * f->names_size);
+		if (names == NULL)
+			return -1;
+		f->names = names;
+		f->names_size *= 2;
+	}
+
+	/* ';' separates the frames of a folded stack */
+	char *s = f->names + f->names_used;
+	for (size_t i = 0; i < len; i++)
+		s[i] = (name[i] == ';' || name[i] == '\n') ? ':' : name[i];
+
+	f->name_index[h].key = key;
+	f->name_index[h].off = f->names_used + 1;
+	*off = f->names_used;
+	f->names_used += len;
+
+	if (2 * ++f->nnames > f->name_index_size) {
+		uint32_t size = 2 * f->name_index_size;
+		struct perf_flame_name_s *index = calloc(size, sizeof(struct perf_flame_name_s));
+
+		if (index == NULL)
+			return 0;	/* still usable, only slower */
+		for (uint32_t i = 0; i < f->name_index_size; i++) {
+			struct perf_flame_name_s *n = &f->name_index[i];
+
+			if (n->off == 0)
+				continue;
+			for (h = hash_node(0, n->key) & (size - 1); index[h].off; h = (h + 1) & (size - 1))
+				;
+			index[h] = *n;
+		}
+		free(f->name_index);
+		f->name_index	   = index;
+		f->name_index_size = size;
+	}
+	return 0;
+}
+
+static int
+grow_index(struct perf_flame_s *f)
+{
+	uint32_t size = 2 * f->index_size;
+	uint32_t *index = calloc(size, sizeof(uint32_t));
+
+	if (index == NULL)
+		return -1;
+	for (uint32_t i = 1; i < f->nnodes; i++) {
+		uint32_t h = hash_node(f->nodes[i].parent, f->nodes[i].key) & (size - 1);
+
+		while (index[h])
+			h = (h + 1) & (size - 1);
+		index[h] = i;
+	}
+	free(f->index);
+	f->index      = index;
+	f->index_size = size;
+	return 0;
+}
+
+/* the child of parent for the function key, 0 if there is no memory */
+static uint32_t
+get_child(struct perf_flame_s *f, uint32_t parent, uint64_t key, const char *name)
+{
+	uint32_t mask = f->index_size - 1;
+	uint32_t h = hash_node(parent, key) & mask;
+
+	for (; f->index[h]; h = (h + 1) & mask) {
+		struct perf_flame_node_s *n = &f->nodes[f->index[h]];
+
+		if (n->parent == parent && n->key == key)
+			return f->index[h];
+	}
+
+	if (f->nnodes == f->max_nodes) {
+		struct perf_flame_node_s *nodes = realloc(f->nodes,
+					2 * f->max_nodes * sizeof(struct perf_flame_node_s));
+		if (nodes == NULL)
+			return 0;
+		f->nodes = nodes;
+		f->max_nodes *= 2;
+	}
+
+	uint32_t off;
+	if (intern_name(f, key, name, &off))
+		return 0;
+
+	uint32_t i = f->nnodes++;
+	struct perf_flame_node_s *n = &f->nodes[i];
+
+	memset(n, 0, sizeof(*n));
+	n->key	   = key;
+	n->parent  = parent;
+	n->depth   = f->nodes[parent].depth + 1;
+	n->name	   = off;
+	n->sibling = f->nodes[parent].child;
+	f->nodes[parent].child = i;
+	f->index[h] = i;
+
+	if (n->depth > f->max_depth)
+		f->max_depth = n->depth;
+
+	if (2 * f->nnodes > f->index_size)
+		grow_index(f);
+	return i;
+}
+
+static uint64_t
+hash_string(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ull;	/* FNV-1a */
+
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+/*
+ * The function of a frame, and its name: the symbol, "_[k]" appended
+ * for the kernel as perf script does, or the dso when the symbol is
+ * unknown so that its frames still merge.
+ */
+static uint64_t
+frame_key(const struct perf_frame_s *fr, char *name, size_t size)
+{
+	const char *dso = fr->dso ? strrchr(fr->dso, '/') : NULL;
+
+	dso = dso ? dso + 1 : fr->dso;
+	if (fr->sym) {
+		int kernel = dso && strncmp(dso, "[kernel", 7) == 0;
+
+		snprintf(name, size, "%s%s", fr->sym, kernel ? "_[k]" : "");
+		return fr->id ? (uintptr_t) fr->id : hash_string(fr->sym) & ~3ull;
+	}
+	if (dso) {
+		snprintf(name, size, "[%s]", dso);
+		return hash_string(fr->dso) | 1;
+	}
+	snprintf(name, size, "[unknown]");
+	return 2;
+}
+
+/*
+ * Add a callchain, leaf first as the kernel writes it, with its value
+ * (samples, events or time).
+ */
+int
+perf_flame_add(struct perf_flame_s *f, struct perf_symtab_s *st,
+	       const uint64_t *ips, uint64_t nr, uint64_t value)
+{
+	uint32_t cur = 0;
+	char name[512];
+
+	if (nr > MAX_DEPTH)
+		nr = MAX_DEPTH;
+
+	for (uint64_t i = nr; i-- > 0;) {
+		if (ips[i] >= PERF_CONTEXT_MAX)
+			continue;
+
+		const struct perf_frame_s *fr = perf_symtab_resolve(st, ips[i]);
+		uint64_t key = frame_key(fr, name, sizeof(name));
+		uint32_t child = get_child(f, cur, key, name);
+
+		if (child == 0)
+			break;	/* out of memory, charged to the caller */
+		cur = child;
+	}
+
+	f->nodes[cur].self += value;
+	for (uint32_t n = cur;; n = f->nodes[n].parent) {
+		f->nodes[n].total += value;
+		if (n == 0)
+			break;
+	}
+	return 0;
+}
+
+/* every chain of a profile, weighted as perf_profile_report() does */
+int
+perf_flame_add_profile(struct perf_flame_s *f, struct perf_symtab_s *st,
+		       const struct perf_profile_s *p)
+{
+	for (size_t c = 0, seen = 0; c < p->max_chains && seen < p->nchains; c++) {
+		const struct perf_chain_s *chain = &p->chains[c];
+
+		if (chain->hash == 0)
+			continue;
+		seen++;
+		if (perf_flame_add(f, st, &p->ips[chain->off], chain->nr,
+				   p->period ? chain->period : chain->samples))
+			return -1;
+	}
+	return 0;
+}
+
+static void
+folded_node(struct perf_flame_s *f, FILE *out, uint32_t n, uint32_t *path, int depth)
+{
+	if (n) {
+		path[depth++] = n;
+		if (f->nodes[n].self) {
+			for (int i = 0; i < depth; i++)
+				fprintf(out, "%s%s", i ? ";" : "", f->names + f->nodes[path[i]].name);
+			fprintf(out, " %"PRIu64"\n", f->nodes[n].self);
+		}
+	}
+	for (uint32_t c = f->nodes[n].child; c; c = f->nodes[c].sibling)
+		folded_node(f, out, c, path, depth);
+}
+
+/* one line per distinct stack, "outermost;...;leaf value" */
+void
+perf_flame_folded(struct perf_flame_s *f, FILE *out)
+{
+	uint32_t *path = malloc((f->max_depth + 1) * sizeof(uint32_t));
+
+	if (path == NULL)
+		return;
+	if (f->nodes[0].self)
+		fprintf(out, "%s %"PRIu64"\n", f->names, f->nodes[0].self);
+	folded_node(f, out, 0, path, 0);
+	free(path);
+}
+
+static const struct perf_flame_s *sort_flame;
+
+static int
+cmp_name(const void *a, const void *b)
+{
+	const struct perf_flame_node_s *x = &sort_flame->nodes[*(const uint32_t *)a];
+	const struct perf_flame_node_s *y = &sort_flame->nodes[*(const uint32_t *)b];
+
+	return strcmp(sort_flame->names + x->name, sort_flame->names + y->name);
+}
+
+static void
+svg_escape(FILE *out, const char *s, size_t len)
+{
+	for (size_t i = 0; i < len && s[i]; i++) {
+		switch (s[i]) {
+		case '<':  fputs("&lt;", out);	 break;
+		case '>':  fputs("&gt;", out);	 break;
+		case '&':  fputs("&amp;", out);	 break;
+		case '"':  fputs("&quot;", out); break;
+		default:   fputc(s[i], out);
+		}
+	}
+}
+
+/* the warm palette of flamegraph.pl, stable for a given name */
+static void
+svg_color(const char *name, int *r, int *g, int *b)
+{
+	uint64_t h = hash_string(name);
+
+	*r = 205 + (h & 0xff) % 50;
+	*g = ((h >> 8) & 0xff) % 230;
+	*b = ((h >> 16) & 0xff) % 55;
+}
+
+static void
+svg_node(struct perf_flame_s *f, FILE *out, uint32_t n, double x, double scale,
+	 int height, const char *unit)
+{
+	const struct perf_flame_node_s *node = &f->nodes[n];
+	const char *name = f->names + node->name;
+	double w = node->total * scale;
+	double y = height - SVG_PAD - (node->depth + 1) * SVG_FRAME;
+	int r, g, b;
+
+	if (w < SVG_MIN_WIDTH)
+		return;
+
+	svg_color(name, &r, &g, &b);
+	fprintf(out, "<g><title>");
+	svg_escape(out, name, SIZE_MAX);
+	fprintf(out, " (%"PRIu64" %s, %.2f%%)</title>", node->total, unit,
+		100.0 * node->total / f->nodes[0].total);
+	fprintf(out, "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%d\" "
+		"fill=\"rgb(%d,%d,%d)\" rx=\"2\" ry=\"2\"/>", x, y, w, SVG_FRAME - 1, r, g, b);
+
+	size_t fit = w > 6 ? (size_t) ((w - 6) / SVG_CHAR) : 0;
+	size_t len = strlen(name);
+	if (fit >= 3) {
+		fprintf(out, "<text x=\"%.1f\" y=\"%.1f\">", x + 3, y + SVG_FRAME - 4);
+		if (len <= fit) {
+			svg_escape(out, name, len);
+		} else {
+			svg_escape(out, name, fit - 2);
+			fputs("..", out);
+		}
+		fprintf(out, "</text>");
+	}
+	fprintf(out, "</g>\n");
+
+	/* the children side by side, by name as flamegraph.pl sorts them */
+	uint32_t nchildren = 0;
+	for (uint32_t c = node->child; c; c = f->nodes[c].sibling)
+		nchildren++;
+	if (nchildren == 0)
+		return;
+
+	uint32_t *children = malloc(nchildren * sizeof(uint32_t));
+	if (children == NULL)
+		return;
+	nchildren = 0;
+	for (uint32_t c = node->child; c; c = f->nodes[c].sibling)
+		children[nchildren++] = c;
+	sort_flame = f;
+	qsort(children, nchildren, sizeof(uint32_t), cmp_name);
+
+	for (uint32_t i = 0; i < nchildren; i++) {
+		svg_node(f, out, children[i], x, scale, height, unit);
+		x += f->nodes[children[i]].total * scale;
+	}
+	free(children);
+}
+
+/*
+ * A self-contained SVG flame graph: the outermost frames at the bottom,
+ * each frame as wide as its total, the name and value in its tooltip.
+ */
+void
+perf_flame_svg(struct perf_flame_s *f, FILE *out, const char *title, const char *unit)
+{
+	int height = SVG_TOP + (f->max_depth + 1) * SVG_FRAME + 2 * SVG_PAD;
+	double scale = f->nodes[0].total ?
+		(double) (SVG_WIDTH - 2 * SVG_PAD) / f->nodes[0].total : 0;
+
+	fprintf(out, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+		"<svg version=\"1.1\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\" "
+		"xmlns=\"http://www.w3.org/2000/svg\">\n"
+		"<style>text { font-family: Verdana, sans-serif; font-size: 12px; fill: #000; }\n"
+		"rect:hover { stroke: #000; stroke-width: 0.5; }</style>\n"
+		"<rect x=\"0\" y=\"0\" width=\"100%%\" height=\"100%%\" fill=\"#f8f8f8\"/>\n"
+		"<text x=\"%d\" y=\"24\" style=\"font-size: 17px\">",
+		SVG_WIDTH, height, SVG_WIDTH, height, SVG_WIDTH / 2 - 100);
+	svg_escape(out, title ? title : "Flame Graph", SIZE_MAX);
+	fprintf(out, "</text>\n");
+
+	if (scale > 0)
+		svg_node(f, out, 0, SVG_PAD, scale, height, unit ? unit : "samples");
+	fprintf(out, "</svg>\n");
+}
+
+/* <prefix>.folded and <prefix>.svg */
+int
+perf_flame_write(struct perf_flame_s *f, const char *prefix, const char *title,
+		 const char *unit)
+{
+	char path[4096];
+	FILE *out;
+
+	snprintf(path, sizeof(path), "%s.folded", prefix);
+	if ((out = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	perf_flame_folded(f, out);
+	fclose(out);
+
+	snprintf(path, sizeof(path), "%s.svg", prefix);
+	if ((out = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	perf_flame_svg(f, out, title, unit);
+	fclose(out);
+	return 0;
+}
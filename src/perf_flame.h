@@ -0,0 +1,81 @@
+/*
+ * Folded stacks and flame graphs.
+ *
+ * Callchains are symbolized frame by frame and merged, outermost frame
+ * first, into a trie of functions: a node per distinct call path
+ * prefix, found through a hash of (parent, function), so the memory
+ * follows the number of distinct stacks rather than the number of
+ * samples. The trie is then written as folded stacks, one
+ * "main;foo;bar 1234" line per stack (the input of flamegraph.pl and
+ * most flame graph viewers), or drawn directly as a self-contained SVG:
+ *
+ *   perf_flame_init(&f);
+ *   perf_flame_add_profile(&f, &st, &profile);	or perf_flame_add() per chain
+ *   perf_flame_folded(&f, out);
+ *   perf_flame_svg(&f, svg, "cycles", "events");
+ *   or both at once: perf_flame_write(&f, "out", "cycles", "events");
+ *   perf_flame_fini(&f);
+ *
+ * Unlike perf_profile_add(), perf_flame_add() allocates and symbolizes:
+ * it is meant for the end of a run or an offline reader, not a signal
+ * handler.
+ */
+
+#ifndef PERF_FLAME_H
+#define PERF_FLAME_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "perf_profile.h"
+#include "perf_symtab.h"
+
+struct perf_flame_node_s {
+	uint64_t	key;		/* the function */
+	uint32_t	parent;
+	uint32_t	child;		/* first child, 0 if none */
+	uint32_t	sibling;	/* next child of the parent */
+	uint32_t	depth;
+	uint32_t	name;		/* offset in the name pool */
+	uint64_t	self;
+	uint64_t	total;
+};
+
+struct perf_flame_name_s {
+	uint64_t	key;
+	uint32_t	off;		/* in the name pool, plus one; 0: free slot */
+};
+
+struct perf_flame_s {
+	struct perf_flame_node_s *nodes;	/* 0 is the root */
+	uint32_t	 nnodes;
+	uint32_t	 max_nodes;
+
+	uint32_t	*index;		/* (parent, key) -> node, open addressing */
+	uint32_t	 index_size;	/* power of 2 */
+
+	char		*names;		/* NUL separated, interned by key */
+	size_t		 names_size;
+	size_t		 names_used;
+	struct perf_flame_name_s *name_index;	/* open addressing on the key */
+	uint32_t	 name_index_size;	/* power of 2 */
+	uint32_t	 nnames;
+
+	uint32_t	 max_depth;
+};
+
+int	perf_flame_init(struct perf_flame_s *f);
+void	perf_flame_fini(struct perf_flame_s *f);
+
+int	perf_flame_add(struct perf_flame_s *f, struct perf_symtab_s *st,
+		       const uint64_t *ips, uint64_t nr, uint64_t value);
+int	perf_flame_add_profile(struct perf_flame_s *f, struct perf_symtab_s *st,
+			       const struct perf_profile_s *p);
+
+void	perf_flame_folded(struct perf_flame_s *f, FILE *out);
+void	perf_flame_svg(struct perf_flame_s *f, FILE *out, const char *title,
+		       const char *unit);
+int	perf_flame_write(struct perf_flame_s *f, const char *prefix, const char *title,
+			 const char *unit);
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * Flight recorder on overwritten, backward rings.
+ * See perf_flight.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "perf_flight.h"
+#include "perf_ring.h"
+#include "perf_writer.h"
+
+#define STOP	(-1)	/* on the pipe, for the thread */
+
+static const char *const trigger_names[PERF_FLIGHT_NR] = {
+	[PERF_FLIGHT_API]	= "api",
+	[PERF_FLIGHT_SIGNAL]	= "signal",
+	[PERF_FLIGHT_THRESHOLD]	= "threshold",
+};
+
+/* perf_flight_signal() has one recorder per process */
+static struct perf_flight_s *signal_flight;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* the records go backward, from data_head to older ones */
+void
+perf_flight_attr(struct perf_event_attr *attr)
+{
+	attr->write_backward = 1;
+	attr->watermark	     = 0;
+	attr->wakeup_events  = 0;
+}
+
+int
+perf_flight_init(struct perf_flight_s *fr, const char *prefix, pid_t pid)
+{
+	memset(fr, 0, sizeof(*fr));
+	fr->count_fd = -1;
+	fr->pid	     = pid;
+	snprintf(fr->prefix, sizeof(fr->prefix), "%s", prefix);
+
+	if (pipe2(fr->wake, O_CLOEXEC|O_NONBLOCK)) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Map the ring of fd read-only, which is what tells the kernel to
+ * overwrite it. data_pages must be a power of 2.
+ */
+int
+perf_flight_add(struct perf_flight_s *fr, int fd, size_t data_pages,
+		const struct perf_event_attr *attr)
+{
+	struct perf_flight_ring_s *r = &fr->rings[fr->nrings];
+	size_t pagesize = perf_ring_pagesize();
+
+	if (fr->nrings == PERF_FLIGHT_MAX_RINGS) {
+		fprintf(stderr, "too many flight recorder rings\n");
+		return -1;
+	}
+	if (data_pages == 0 || (data_pages & (data_pages - 1))) {
+		fprintf(stderr, "buffer pages must be a power of 2: %zu\n", data_pages);
+		return -1;
+	}
+	if (!attr->write_backward)
+		fprintf(stderr, "warning: flight recorder ring without write_backward\n");
+
+	memset(r, 0, sizeof(*r));
+	r->hdr = mmap(NULL, (data_pages + 1) * pagesize, PROT_READ, MAP_SHARED, fd, 0);
+	if (r->hdr == MAP_FAILED) {
+		fprintf(stderr, "Can't mmap buffer: %s\n", strerror(errno));
+		return -1;
+	}
+	r->fd	= fd;
+	r->attr = *attr;
+	r->data = (unsigned char *)r->hdr + pagesize;
+	r->size = data_pages * pagesize;
+	r->copy = malloc(r->size);
+	if (r->copy == NULL || ioctl(fd, PERF_EVENT_IOC_ID, &r->id) != 0) {
+		fprintf(stderr, "cannot set up the flight recorder ring\n");
+		munmap(r->hdr, r->size + pagesize);
+		free(r->copy);
+		return -1;
+	}
+	fr->nrings++;
+	return 0;
+}
+
+int
+perf_flight_threshold(struct perf_flight_s *fr, int count_fd, uint64_t threshold,
+		      unsigned int interval_ms)
+{
+	if (interval_ms == 0) {
+		fprintf(stderr, "the threshold needs an interval\n");
+		return -1;
+	}
+	fr->count_fd	= count_fd;
+	fr->threshold	= threshold;
+	fr->interval_ms = interval_ms;
+	return 0;
+}
+
+static void
+signal_handler(int signo)
+{
+	if (signal_flight)
+		perf_flight_trigger(signal_flight, PERF_FLIGHT_SIGNAL);
+}
+
+int
+perf_flight_signal(struct perf_flight_s *fr, int signo)
+{
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = signal_handler;
+	act.sa_flags   = SA_RESTART;
+	signal_flight  = fr;
+	if (sigaction(signo, &act, NULL)) {
+		fprintf(stderr, "sigaction: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* async-signal-safe, a trigger is dropped if the thread is that far behind */
+void
+perf_flight_trigger(struct perf_flight_s *fr, enum perf_flight_trigger why)
+{
+	signed char c = why;
+
+	if (write(fr->wake[1], &c, 1) != 1)
+		__atomic_add_fetch(&fr->dropped, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * The records from data_head on, newest first, up to the first one the
+ * kernel did not write yet (a zero header) or the one it is overwriting.
+ */
+static void
+copy_ring(struct perf_flight_ring_s *r)
+{
+	uint64_t head = __atomic_load_n(&r->hdr->data_head, __ATOMIC_ACQUIRE);
+	uint64_t pos  = head;
+	size_t mask = r->size - 1, off, first;
+
+	for (;;) {
+		const struct perf_event_header *hdr = (void *)(r->data + (pos & mask));
+
+		if (hdr->size < sizeof(*hdr) || pos - head + hdr->size > r->size)
+			break;
+		pos += hdr->size;
+	}
+
+	r->len = pos - head;
+	off    = head & mask;
+	first  = r->len < r->size - off ? r->len : r->size - off;
+	memcpy(r->copy, r->data + off, first);
+	memcpy(r->copy + first, r->data, r->len - first);
+}
+
+/* the copies, oldest record first */
+static int
+write_snapshot(struct perf_flight_s *fr)
+{
+	struct perf_writer_s w;
+	char path[PATH_MAX + 32];
+	size_t total = 0;
+	int ret;
+
+	for (int i = 0; i < fr->nrings; i++)
+		total += fr->rings[i].len;
+
+	/* one buffer takes the whole snapshot, the writer drops nothing */
+	snprintf(path, sizeof(path), "%s.%"PRIu64, fr->prefix, fr->snapshots);
+	if (perf_writer_open(&w, path, total + PERF_WRITER_BUFSIZE))
+		return -1;
+
+	for (int i = 0; i < fr->nrings; i++)
+		perf_writer_add_attr(&w, &fr->rings[i].attr, &fr->rings[i].id, 1);
+	if (fr->nrings)
+		perf_writer_synthesize(&w, fr->pid, &fr->rings[0].attr);
+
+	for (int i = 0; i < fr->nrings; i++) {
+		struct perf_flight_ring_s *r = &fr->rings[i];
+		size_t *offs = malloc((r->len / sizeof(struct perf_event_header) + 1) * sizeof(size_t));
+		size_t n = 0;
+
+		if (offs == NULL) {
+			fr->errors++;
+			continue;
+		}
+		for (size_t off = 0; off < r->len; n++) {
+			offs[n] = off;
+			off    += ((const struct perf_event_header *)(r->copy + off))->size;
+		}
+		while (n-- > 0)
+			perf_writer_record(&w, (const struct perf_event_header *)(r->copy + offs[n]));
+		free(offs);
+		fr->bytes += r->len;
+	}
+	fr->records += w.records;
+
+	ret = perf_writer_close(&w);
+	fr->snapshots++;
+	return ret;
+}
+
+/*
+ * Pause the output of every ring, copy them all, resume. The rings are
+ * only written to disk once the events are running again.
+ */
+int
+perf_flight_snapshot(struct perf_flight_s *fr, enum perf_flight_trigger why)
+{
+	uint64_t start = now_ns();
+	int ret;
+
+	for (int i = 0; i < fr->nrings; i++) {
+		if (ioctl(fr->rings[i].fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 1))
+			fr->errors++;
+	}
+	for (int i = 0; i < fr->nrings; i++)
+		copy_ring(&fr->rings[i]);
+	for (int i = 0; i < fr->nrings; i++) {
+		if (ioctl(fr->rings[i].fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 0))
+			fr->errors++;
+	}
+	fr->paused_ns += now_ns() - start;
+	fr->triggers[why]++;
+
+	if ((ret = write_snapshot(fr)) != 0)
+		fr->errors++;
+	return ret;
+}
+
+static uint64_t
+read_count(int fd)
+{
+	uint64_t count = 0;
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
+
+/* a snapshot when the count goes over the threshold, once per spike */
+static void
+check_threshold(struct perf_flight_s *fr)
+{
+	uint64_t count = read_count(fr->count_fd);
+	uint64_t delta = count - fr->last_count;
+
+	fr->last_count = count;
+	if (delta <= fr->threshold) {
+		fr->armed = 1;
+	} else if (fr->armed) {
+		fr->armed = 0;
+		perf_flight_snapshot(fr, PERF_FLIGHT_THRESHOLD);
+	}
+}
+
+static void *
+flight_thread(void *arg)
+{
+	struct perf_flight_s *fr = arg;
+	struct pollfd pfd = { .fd = fr->wake[0], .events = POLLIN };
+	int timeout = fr->count_fd >= 0 ? (int) fr->interval_ms : -1;
+	uint64_t next = now_ns() + timeout * 1000000ull;
+	signed char why;
+
+	for (;;) {
+		if (timeout >= 0) {
+			int64_t left = next - now_ns();
+
+			if (left <= 0) {
+				check_threshold(fr);
+				next += timeout * 1000000ull;
+				continue;
+			}
+			if (poll(&pfd, 1, (left + 999999) / 1000000) == 0)
+				continue;
+		} else if (poll(&pfd, 1, -1) <= 0) {
+			continue;
+		}
+
+		while (read(fr->wake[0], &why, 1) == 1) {
+			if (why == STOP)
+				return NULL;
+			if (why >= 0 && why < PERF_FLIGHT_NR)
+				perf_flight_snapshot(fr, why);
+		}
+	}
+}
+
+int
+perf_flight_start(struct perf_flight_s *fr)
+{
+	sigset_t all, old;
+	int ret;
+
+	if (fr->count_fd >= 0) {
+		fr->last_count = read_count(fr->count_fd);
+		fr->armed      = 1;
+	}
+
+	/* keep the signals for the sampled threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&fr->thread, NULL, flight_thread, fr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		return -1;
+	}
+	fr->running = 1;
+	return 0;
+}
+
+/* after the snapshots already asked for */
+void
+perf_flight_stop(struct perf_flight_s *fr)
+{
+	signed char c = STOP;
+	struct pollfd pfd = { .fd = fr->wake[1], .events = POLLOUT };
+
+	if (!fr->running)
+		return;
+	while (write(fr->wake[1], &c, 1) != 1)
+		poll(&pfd, 1, -1);
+	pthread_join(fr->thread, NULL);
+	fr->running = 0;
+}
+
+void
+perf_flight_report(struct perf_flight_s *fr, FILE *out)
+{
+	size_t size = 0;
+
+	for (int i = 0; i < fr->nrings; i++)
+		size += fr->rings[i].size;
+
+	fprintf(out, "flight recorder: %d rings, %zu KiB, %"PRIu64" snapshots", fr->nrings,
+		size >> 10, fr->snapshots);
+	for (int i = 0; i < PERF_FLIGHT_NR; i++) {
+		if (fr->triggers[i])
+			fprintf(out, ", %"PRIu64" %s", fr->triggers[i], trigger_names[i]);
+	}
+	fprintf(out, "\n");
+	if (fr->snapshots) {
+		fprintf(out, "  %"PRIu64" records, %"PRIu64" KiB written to %s.*, output paused "
+			"%.1f us per snapshot\n", fr->records, fr->bytes >> 10, fr->prefix,
+			fr->paused_ns * 1e-3 / fr->snapshots);
+	}
+	if (fr->dropped)
+		fprintf(out, "  %"PRIu64" triggers dropped\n", fr->dropped);
+	if (fr->errors)
+		fprintf(out, "  %"PRIu64" errors\n", fr->errors);
+}
+
+void
+perf_flight_fini(struct perf_flight_s *fr)
+{
+	perf_flight_stop(fr);
+	if (signal_flight == fr)
+		signal_flight = NULL;
+
+	for (int i = 0; i < fr->nrings; i++) {
+		munmap(fr->rings[i].hdr, fr->rings[i].size + perf_ring_pagesize());
+		free(fr->rings[i].copy);
+	}
+	close(fr->wake[0]);
+	close(fr->wake[1]);
+	memset(fr, 0, sizeof(*fr));
+	fr->count_fd = -1;
+}
@@ -0,0 +1,119 @@
+/*
+ * Flight recorder: always-on sampling that only costs something when
+ * it is asked for the last few seconds.
+ *
+ * The events are opened with write_backward and their rings mapped
+ * read-only, so the kernel never waits for a reader: it overwrites the
+ * oldest records and the ring always holds the most recent ones. There
+ * is no signal, no wakeup and no draining while nothing happens. On a
+ * trigger the output of every ring is paused with
+ * PERF_EVENT_IOC_PAUSE_OUTPUT, the rings are copied, the output resumed,
+ * and the copy is written to <prefix>.<n>, a perf.data file in time
+ * order that perf report and perf script read as they are:
+ *
+ *   perf_flight_init(&fr, "flight.data", getpid());
+ *   perf_flight_attr(&attr);                       before perf_event_open()
+ *   perf_flight_add(&fr, fd, 128, &attr);          for every event
+ *   perf_flight_signal(&fr, SIGUSR2);              kill -USR2 takes a snapshot
+ *   perf_flight_threshold(&fr, count_fd, 5000000, 10);
+ *   perf_flight_start(&fr);
+ *   ... on a latency spike seen by the application:
+ *   perf_flight_trigger(&fr, PERF_FLIGHT_API);
+ *   ... at the end:
+ *   perf_flight_stop(&fr);
+ *   perf_flight_report(&fr, stdout);
+ *   perf_flight_fini(&fr);
+ *
+ * The snapshots are taken by a thread started by perf_flight_start(),
+ * which also watches the threshold: every interval_ms it reads the
+ * counting event and takes a snapshot when the count went up by more
+ * than threshold in the interval. It does not trigger again until the
+ * rate went back under the threshold. perf_flight_trigger() only
+ * write()s to a pipe, it is async-signal-safe.
+ *
+ * The rings are paused together and resumed together, so the snapshots
+ * of the rings cover the same window, minus whatever the smallest ring
+ * could hold. The events need PERF_SAMPLE_TIME for perf to order the
+ * rings, and the rest of what perf_writer wants (see perf_writer.h) for
+ * the symbols.
+ */
+
+#ifndef PERF_FLIGHT_H
+#define PERF_FLIGHT_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <linux/perf_event.h>
+
+#define PERF_FLIGHT_MAX_RINGS	256
+
+/* what took the snapshot */
+enum perf_flight_trigger {
+	PERF_FLIGHT_API,
+	PERF_FLIGHT_SIGNAL,
+	PERF_FLIGHT_THRESHOLD,
+	PERF_FLIGHT_NR
+};
+
+struct perf_flight_ring_s {
+	int		 fd;
+	uint64_t	 id;		/* PERF_EVENT_IOC_ID */
+	struct perf_event_attr attr;
+
+	struct perf_event_mmap_page *hdr;	/* mapped read-only */
+	unsigned char	*data;
+	size_t		 size;		/* payload size, power of 2 */
+
+	unsigned char	*copy;		/* the snapshot, newest record first */
+	size_t		 len;
+};
+
+struct perf_flight_s {
+	char		 prefix[PATH_MAX];
+	pid_t		 pid;		/* whose maps go in the snapshots */
+
+	struct perf_flight_ring_s rings[PERF_FLIGHT_MAX_RINGS];
+	int		 nrings;
+
+	int		 wake[2];	/* pipe: a trigger, or -1 to stop */
+	pthread_t	 thread;
+	int		 running;
+
+	/* threshold trigger */
+	int		 count_fd;	/* -1: none */
+	uint64_t	 threshold;	/* counts per interval */
+	unsigned int	 interval_ms;
+	uint64_t	 last_count;
+	int		 armed;
+
+	uint64_t	 snapshots;
+	uint64_t	 triggers[PERF_FLIGHT_NR];
+	uint64_t	 records;	/* written in all the snapshots */
+	uint64_t	 bytes;
+	uint64_t	 paused_ns;	/* output paused, all snapshots */
+	uint64_t	 dropped;	/* triggers, the pipe was full */
+	uint64_t	 errors;
+};
+
+void	perf_flight_attr(struct perf_event_attr *attr);
+
+int	perf_flight_init(struct perf_flight_s *fr, const char *prefix, pid_t pid);
+int	perf_flight_add(struct perf_flight_s *fr, int fd, size_t data_pages,
+			const struct perf_event_attr *attr);
+int	perf_flight_threshold(struct perf_flight_s *fr, int count_fd, uint64_t threshold,
+			      unsigned int interval_ms);
+int	perf_flight_signal(struct perf_flight_s *fr, int signo);
+int	perf_flight_start(struct perf_flight_s *fr);
+
+void	perf_flight_trigger(struct perf_flight_s *fr, enum perf_flight_trigger why);
+int	perf_flight_snapshot(struct perf_flight_s *fr, enum perf_flight_trigger why);
+
+void	perf_flight_stop(struct perf_flight_s *fr);
+void	perf_flight_report(struct perf_flight_s *fr, FILE *out);
+void	perf_flight_fini(struct perf_flight_s *fr);
+
+#endif
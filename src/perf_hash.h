@@ -0,0 +1,84 @@
+/*
+ * Linear probing of the open addressing tables.
+ *
+ * The profile, off-CPU, heatmap, NUMA and IBS tables are arrays of a
+ * power of 2 entries that start with a uint64_t key, 0 for a free slot.
+ * One slot is always left free so that the probing of a missing key
+ * ends. perf_hash_get() finds the entry of a key or enters it, with
+ * atomics only, so the lock-free tables may be updated by several
+ * signal handlers or collector threads at once:
+ *
+ *   int fresh;
+ *   e = perf_hash_get(t->entries, sizeof(*e), t->max, &t->used,
+ *                     perf_hash_u64(key), key, 1, NULL, NULL, &fresh);
+ *   if (e == NULL)
+ *           t->dropped++;
+ *   else if (fresh)
+ *           ... fill in the rest of the entry
+ *
+ * A fresh entry is seen by the other threads before it is filled in.
+ */
+
+#ifndef PERF_HASH_H
+#define PERF_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fibonacci hashing, the high bits of the product are the best mixed */
+static inline uint64_t
+perf_hash_u64(uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+/*
+ * Enter key in the free slot e unless that would fill the table. Out of
+ * line to keep the lookups small. Returns key with *fresh set, the key
+ * of somebody else who took the slot first, or 0 when the table is full.
+ */
+static __attribute__((noinline)) uint64_t
+perf_hash_enter(void *e, size_t max, size_t *used, uint64_t key, int *fresh)
+{
+	uint64_t k = 0;
+
+	if (__atomic_load_n(used, __ATOMIC_RELAXED) + 1 >= max)
+		return 0;
+	if (!__atomic_compare_exchange_n((uint64_t *) e, &k, key, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return k;
+	__atomic_add_fetch(used, 1, __ATOMIC_RELAXED);
+	*fresh = 1;
+	return key;
+}
+
+/*
+ * The entry of key (never 0) in table, max entries of size bytes, or
+ * NULL. A missing key is entered if create is set and a free slot is
+ * left; *used counts the entries. match, if not NULL, tells apart the
+ * entries whose keys collide.
+ */
+static inline void *
+perf_hash_get(void *table, size_t size, size_t max, size_t *used, uint64_t hash,
+	      uint64_t key, int create, int (*match)(const void *entry, const void *arg),
+	      const void *arg, int *fresh)
+{
+	*fresh = 0;
+	for (size_t i = 0; i < max; i++) {
+		char *e = (char *) table + ((hash + i) & (max - 1)) * size;
+		uint64_t k = __atomic_load_n((uint64_t *) e, __ATOMIC_RELAXED);
+
+		if (k == 0) {
+			if (!create || (k = perf_hash_enter(e, max, used, key, fresh)) == 0)
+				return NULL;
+			if (*fresh)
+				return e;
+			/* somebody else took the slot, maybe for the same key */
+		}
+		if (k == key && (match == NULL || match(e, arg)))
+			return e;
+	}
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * Memory access heatmap from sampled data addresses.
+ * See perf_heatmap.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "perf_hash.h"
+#include "perf_heatmap.h"
+
+/* rows of the working set curve, consecutive windows are skipped past it */
+#define CURVE_ROWS	40
+
+/*
+ * "64", "4k", "2m" or "1g", a power of 2 of at least 8 bytes.
+ * Returns its log2, -1 if invalid.
+ */
+int
+perf_heatmap_granularity(const char *s)
+{
+	char *end;
+	uint64_t n = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K':
+		n <<= 10;
+		end++;
+		break;
+	case 'm': case 'M':
+		n <<= 20;
+		end++;
+		break;
+	case 'g': case 'G':
+		n <<= 30;
+		end++;
+		break;
+	}
+	if (end == s || *end != '\0' || n < 8 || (n & (n - 1))) {
+		fprintf(stderr, "invalid heatmap granularity: %s\n", s);
+		return -1;
+	}
+	return __builtin_ctzll(n);
+}
+
+int
+perf_heatmap_init(struct perf_heatmap_s *h, int shift, size_t max_bins, uint64_t window_ns)
+{
+	memset(h, 0, sizeof(*h));
+
+	if (shift < 0 || shift > 40 || window_ns == 0) {
+		fprintf(stderr, "invalid heatmap: shift %d, window %"PRIu64" ns\n", shift, window_ns);
+		return -1;
+	}
+	if (max_bins < 2 || (max_bins & (max_bins - 1))) {
+		fprintf(stderr, "heatmap bins must be a power of 2: %zu\n", max_bins);
+		return -1;
+	}
+
+	h->bins = mmap(NULL, max_bins * sizeof(struct perf_heatmap_bin_s), PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (h->bins == MAP_FAILED) {
+		fprintf(stderr, "cannot map the heatmap: %s\n", strerror(errno));
+		h->bins = NULL;
+		return -1;
+	}
+	h->shift     = shift;
+	h->window_ns = window_ns;
+	h->max_bins  = max_bins;
+	return 0;
+}
+
+void
+perf_heatmap_fini(struct perf_heatmap_s *h)
+{
+	if (h->bins)
+		munmap(h->bins, h->max_bins * sizeof(struct perf_heatmap_bin_s));
+	memset(h, 0, sizeof(*h));
+}
+
+/* the first sample with a time sets the origin */
+static uint32_t
+window_of(struct perf_heatmap_s *h, uint64_t time)
+{
+	uint64_t origin = __atomic_load_n(&h->origin, __ATOMIC_RELAXED);
+	uint64_t w = 0;
+
+	/* without PERF_SAMPLE_TIME everything is in the first window */
+	if (time && origin == 0) {
+		__atomic_compare_exchange_n(&h->origin, &origin, time, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		origin = __atomic_load_n(&h->origin, __ATOMIC_RELAXED);
+	}
+	if (time > origin)
+		w = (time - origin) / h->window_ns;
+	if (w >= PERF_HEATMAP_WINDOWS) {
+		__atomic_add_fetch(&h->late, 1, __ATOMIC_RELAXED);
+		w = PERF_HEATMAP_WINDOWS - 1;
+	}
+
+	uint32_t n = __atomic_load_n(&h->nwindows, __ATOMIC_RELAXED);
+	while (n < w + 1 && !__atomic_compare_exchange_n(&h->nwindows, &n, w + 1, 0,
+							 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return w;
+}
+
+static struct perf_heatmap_bin_s *
+get_bin(struct perf_heatmap_s *h, uint64_t key, uint32_t w)
+{
+	struct perf_heatmap_bin_s *b;
+	int fresh;
+
+	b = perf_hash_get(h->bins, sizeof(*b), h->max_bins, &h->nbins, perf_hash_u64(key), key,
+			  1, NULL, NULL, &fresh);
+	if (b == NULL) {
+		__atomic_add_fetch(&h->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if (fresh) {
+		__atomic_add_fetch(&h->fresh[w], 1, __ATOMIC_RELAXED);
+		b->first = w;
+	}
+	return b;
+}
+
+/* async-signal-safe, may be called from several threads at once */
+void
+perf_heatmap_add(struct perf_heatmap_s *h, uint64_t addr, uint64_t time)
+{
+	struct perf_heatmap_bin_s *b;
+	uint32_t w;
+
+	if (addr == 0) {
+		__atomic_add_fetch(&h->noaddr, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&h->samples, 1, __ATOMIC_RELAXED);
+
+	w = window_of(h, time);
+	__atomic_add_fetch(&h->window_samples[w], 1, __ATOMIC_RELAXED);
+
+	b = get_bin(h, (addr >> h->shift) + 1, w);
+	if (b == NULL)
+		return;
+
+	__atomic_add_fetch(&b->samples, 1, __ATOMIC_RELAXED);
+	if (__atomic_exchange_n(&b->last, w + 1, __ATOMIC_RELAXED) != w + 1)
+		__atomic_add_fetch(&h->touched[w], 1, __ATOMIC_RELAXED);
+}
+
+static const char *
+fmt_size(char *buf, size_t len, uint64_t bytes)
+{
+	if (bytes >= 1ull << 30)
+		snprintf(buf, len, "%.1f GiB", bytes / (double) (1ull << 30));
+	else if (bytes >= 1ull << 20)
+		snprintf(buf, len, "%.1f MiB", bytes / (double) (1ull << 20));
+	else if (bytes >= 1ull << 10)
+		snprintf(buf, len, "%.1f KiB", bytes / (double) (1ull << 10));
+	else
+		snprintf(buf, len, "%"PRIu64" B", bytes);
+	return buf;
+}
+
+static int
+cmp_bin(const void *a, const void *b)
+{
+	const struct perf_heatmap_bin_s *x = *(const struct perf_heatmap_bin_s * const *)a;
+	const struct perf_heatmap_bin_s *y = *(const struct perf_heatmap_bin_s * const *)b;
+
+	return x->samples < y->samples ? 1 : x->samples > y->samples ? -1 : 0;
+}
+
+/* the number of hottest bins holding pct of the samples */
+static size_t
+bins_for(struct perf_heatmap_bin_s **sorted, size_t n, uint64_t total, double pct)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		sum += sorted[i]->samples;
+		if (sum >= total * pct / 100.0)
+			return i + 1;
+	}
+	return n;
+}
+
+void
+perf_heatmap_report(struct perf_heatmap_s *h, FILE *out, int top,
+		    perf_heatmap_label_cb label, void *arg)
+{
+	struct perf_heatmap_bin_s **sorted = malloc((h->nbins + 1) * sizeof(*sorted));
+	uint64_t gran = 1ull << h->shift, binned = 0;
+	char a[32], b[32];
+	size_t n = 0;
+
+	for (size_t i = 0; i < h->max_bins && n < h->nbins; i++) {
+		if (h->bins[i].key == 0)
+			continue;
+		sorted[n++] = &h->bins[i];
+		binned	   += h->bins[i].samples;
+	}
+	qsort(sorted, n, sizeof(*sorted), cmp_bin);
+
+	fprintf(out, "\nheatmap %s: %"PRIu64" samples in %zu bins, %s touched",
+		fmt_size(a, sizeof(a), gran), h->samples, n, fmt_size(b, sizeof(b), n * gran));
+	if (h->noaddr)
+		fprintf(out, ", %"PRIu64" without address", h->noaddr);
+	if (h->dropped)
+		fprintf(out, ", %"PRIu64" dropped", h->dropped);
+	fprintf(out, "\n");
+
+	if (n == 0) {
+		free(sorted);
+		return;
+	}
+
+	/* how concentrated the accesses are */
+	fprintf(out, "  samples in the hottest bins:");
+	static const double pcts[] = { 50, 90, 99 };
+	for (int p = 0; p < 3; p++) {
+		size_t k = bins_for(sorted, n, binned, pcts[p]);
+		fprintf(out, "%s %.0f%% in %zu (%.1f%%)", p ? "," : "", pcts[p], k, 100.0 * k / n);
+	}
+	fprintf(out, "\n\n     samples   share     cum  windows    range\n");
+
+	uint64_t cum = 0;
+	for (size_t i = 0; i < n && (int) i < top; i++) {
+		uint64_t start = (sorted[i]->key - 1) << h->shift;
+		const char *name = label ? label(start, arg) : NULL;
+
+		cum += sorted[i]->samples;
+		fprintf(out, "  %10"PRIu64" %6.2f%% %6.2f%% %4u-%-4u  %#014"PRIx64"-%#014"PRIx64"%s%s\n",
+			sorted[i]->samples, 100.0 * sorted[i]->samples / binned, 100.0 * cum / binned,
+			sorted[i]->first, sorted[i]->last - 1, start, start + gran - 1,
+			name ? "  " : "", name ? name : "");
+	}
+	free(sorted);
+
+	/* working set per window and footprint so far */
+	uint32_t step = (h->nwindows + CURVE_ROWS - 1) / CURVE_ROWS;
+	uint64_t footprint = 0, fresh = 0;
+
+	fprintf(out, "\n  working set per %.3f ms window", h->window_ns * 1e-6);
+	if (step > 1)
+		fprintf(out, ", every %u windows", step);
+	if (h->late)
+		fprintf(out, ", %"PRIu64" samples past the last one", h->late);
+	fprintf(out, "\n  window      ms    samples     bins     working set   new bins     footprint\n");
+	for (uint32_t w = 0; w < h->nwindows; w++) {
+		footprint += h->fresh[w];
+		fresh	  += h->fresh[w];
+		if ((w + 1) % step && w != h->nwindows - 1)
+			continue;
+		/* the new bins of the skipped windows are in the next row */
+		fprintf(out, "  %6u %7.1f %10"PRIu64" %8u %15s %10"PRIu64" %13s\n", w,
+			w * h->window_ns * 1e-6, h->window_samples[w], h->touched[w],
+			fmt_size(a, sizeof(a), (uint64_t) h->touched[w] * gran), fresh,
+			fmt_size(b, sizeof(b), footprint * gran));
+		fresh = 0;
+	}
+}
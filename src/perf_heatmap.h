@@ -0,0 +1,77 @@
+/*
+ * Memory access heatmap from sampled data addresses.
+ *
+ * The PERF_SAMPLE_ADDR of every sample is binned at a fixed granularity,
+ * a power of 2: 64 B for cache lines, 4 KiB for pages, 2 MiB for huge
+ * pages. The bins are an open addressing table on addr >> shift mapped
+ * by perf_heatmap_init(), updated with atomics only, so several signal
+ * handlers or collector threads may add to the same heatmap at once.
+ *
+ * The samples are also cut in windows of window_ns by their
+ * PERF_SAMPLE_TIME: a window counts the distinct bins it touched (its
+ * working set) and the bins touched for the first time (the growth of
+ * the footprint):
+ *
+ *   perf_heatmap_init(&h, perf_heatmap_granularity("4k"), 1 << 16, 10000000);
+ *   ... for every sample, with PERF_SAMPLE_ADDR|TIME:
+ *   perf_heatmap_add(&h, sample.v[PERF_SF_ADDR], sample.v[PERF_SF_TIME]);
+ *   ... at the end of the run:
+ *   perf_heatmap_report(&h, stdout, 20, NULL, NULL);
+ *
+ * The report gives the hottest bins, the skew (how few bins hold 50, 90
+ * and 99% of the samples) and the working set curve: what to back with
+ * huge pages, what to place on which NUMA node. When the samples of a
+ * window come from several threads out of time order, a bin may be
+ * counted twice in the working set of that window.
+ */
+
+#ifndef PERF_HEATMAP_H
+#define PERF_HEATMAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* windows of the working set curve, the last one takes the overflow */
+#define PERF_HEATMAP_WINDOWS	1024
+
+struct perf_heatmap_bin_s {
+	uint64_t	key;		/* addr >> shift, plus one; 0: free slot */
+	uint64_t	samples;
+	uint32_t	last;		/* last window touched, plus one */
+	uint32_t	first;		/* first window touched */
+};
+
+struct perf_heatmap_s {
+	unsigned int	 shift;		/* log2 of the granularity */
+	uint64_t	 window_ns;
+
+	struct perf_heatmap_bin_s *bins;	/* open addressing */
+	size_t		 max_bins;	/* power of 2 */
+	size_t		 nbins;
+
+	uint64_t	 origin;	/* time of the first sample */
+	uint32_t	 nwindows;	/* last window used, plus one */
+	uint32_t	 touched[PERF_HEATMAP_WINDOWS];
+	uint32_t	 fresh[PERF_HEATMAP_WINDOWS];
+	uint64_t	 window_samples[PERF_HEATMAP_WINDOWS];
+
+	uint64_t	 samples;
+	uint64_t	 noaddr;	/* samples without a data address */
+	uint64_t	 dropped;	/* no room left for a new bin */
+	uint64_t	 late;		/* past the last window */
+};
+
+/* label of an address in the report, e.g. the allocation it belongs to */
+typedef const char *(*perf_heatmap_label_cb)(uint64_t addr, void *arg);
+
+int	perf_heatmap_granularity(const char *s);
+int	perf_heatmap_init(struct perf_heatmap_s *h, int shift, size_t max_bins,
+			  uint64_t window_ns);
+void	perf_heatmap_fini(struct perf_heatmap_s *h);
+
+void	perf_heatmap_add(struct perf_heatmap_s *h, uint64_t addr, uint64_t time);
+
+void	perf_heatmap_report(struct perf_heatmap_s *h, FILE *out, int top,
+			    perf_heatmap_label_cb label, void *arg);
+
+#endif
@@ -0,0 +1,456 @@
+/*
+ * Decoder of the AMD IBS op samples.
+ * See perf_ibs.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "perf_hash.h"
+#include "perf_ibs.h"
+
+#define FIXTURE_MAGIC	"IBSOPFX1"
+#define FIXTURE_HEADER	16	/* magic and count */
+
+/* bit of an MSR field, moved to a decoded flag */
+#define FLAG(reg, bit, flag)	((((reg) >> (bit)) & 1) * (flag))
+
+const char *const perf_ibs_src_names[PERF_IBS_SRC_NR] = {
+	[PERF_IBS_SRC_NONE]		= "none",
+	[PERF_IBS_SRC_L1]		= "L1",
+	[PERF_IBS_SRC_L2]		= "L2",
+	[PERF_IBS_SRC_L3]		= "L3",
+	[PERF_IBS_SRC_NEAR_CACHE]	= "near cache",
+	[PERF_IBS_SRC_FAR_CACHE]	= "far cache",
+	[PERF_IBS_SRC_DRAM]		= "dram",
+	[PERF_IBS_SRC_REMOTE_DRAM]	= "remote dram",
+	[PERF_IBS_SRC_PMEM]		= "pmem",
+	[PERF_IBS_SRC_IO]		= "io",
+	[PERF_IBS_SRC_EXT_MEM]		= "ext mem",
+	[PERF_IBS_SRC_PEER_MEM]		= "peer mem",
+	[PERF_IBS_SRC_UNKNOWN]		= "unknown",
+};
+
+/*
+ * Copy the registers of a raw record into the batch. Returns 1 when
+ * the batch is full, 0 if there is room left, -1 if the record is too
+ * short for an op sample.
+ */
+int
+perf_ibs_batch_add(struct perf_ibs_batch_s *b, const void *raw, uint32_t size)
+{
+	uint64_t regs[PERF_IBS_OP_REGS];
+	size_t i = b->n;
+
+	if (size < sizeof(uint32_t) + sizeof(regs)) {
+		b->short_records++;
+		return -1;
+	}
+	memcpy(&b->caps[i], raw, sizeof(uint32_t));
+	memcpy(regs, (const char *) raw + sizeof(uint32_t), sizeof(regs));
+
+	b->ctl[i]	= regs[0];
+	b->rip[i]	= regs[1];
+	b->data[i]	= regs[2];
+	b->data2[i]	= regs[3];
+	b->data3[i]	= regs[4];
+	b->lin_addr[i]	= regs[5];
+	b->phys_addr[i]	= regs[6];
+
+	return ++b->n == PERF_IBS_BATCH;
+}
+
+/* src holds the DataSrc, plus 0x20 with the Zen 4 encoding */
+static uint8_t
+classify(uint16_t flags, uint8_t src)
+{
+	int remote = flags & PERF_IBS_REMOTE;
+
+	if (!(flags & PERF_IBS_VALID) || !(flags & (PERF_IBS_LOAD|PERF_IBS_STORE)))
+		return PERF_IBS_SRC_NONE;
+	if (!(flags & PERF_IBS_DC_MISS))
+		return PERF_IBS_SRC_L1;
+	if ((src & 0x1f) == 0)
+		return flags & PERF_IBS_L2_MISS ? PERF_IBS_SRC_UNKNOWN : PERF_IBS_SRC_L2;
+
+	if (src & 0x20) {
+		switch (src & 0x1f) {
+		case 1:  return PERF_IBS_SRC_L3;
+		case 2:  return PERF_IBS_SRC_NEAR_CACHE;
+		case 3:  return remote ? PERF_IBS_SRC_REMOTE_DRAM : PERF_IBS_SRC_DRAM;
+		case 5:  return PERF_IBS_SRC_FAR_CACHE;
+		case 6:  return PERF_IBS_SRC_PMEM;
+		case 7:  return PERF_IBS_SRC_IO;
+		case 8:  return PERF_IBS_SRC_EXT_MEM;
+		case 12: return PERF_IBS_SRC_PEER_MEM;
+		}
+		return PERF_IBS_SRC_UNKNOWN;
+	}
+
+	/* before Zen 4 */
+	switch (src) {
+	case 2: return PERF_IBS_SRC_L3;
+	case 3: return remote ? PERF_IBS_SRC_REMOTE_DRAM : PERF_IBS_SRC_DRAM;
+	case 4: return PERF_IBS_SRC_FAR_CACHE;
+	case 7: return PERF_IBS_SRC_IO;
+	}
+	return PERF_IBS_SRC_UNKNOWN;
+}
+
+/*
+ * The field extraction has no branch and no table so that it vectorizes,
+ * only the data source, which depends on the cpu generation, is looked
+ * at op by op afterwards.
+ */
+void
+perf_ibs_decode(struct perf_ibs_batch_s *b)
+{
+	size_t n = b->n;
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t ctl = b->ctl[i], d1 = b->data[i], d2 = b->data2[i], d3 = b->data3[i];
+		uint32_t zen4 = (b->caps[i] & PERF_IBS_CAPS_ZEN4) != 0;
+
+		b->flags[i] = (FLAG(ctl, 18, PERF_IBS_VALID) & ~FLAG(d1, 38, PERF_IBS_VALID))
+			    | FLAG(d3, 0, PERF_IBS_LOAD)
+			    | FLAG(d3, 1, PERF_IBS_STORE)
+			    | FLAG(d3, 7, PERF_IBS_DC_MISS)
+			    | FLAG(d3, 20, PERF_IBS_L2_MISS)
+			    | FLAG(d3, 2, PERF_IBS_L1TLB_MISS)
+			    | FLAG(d3, 3, PERF_IBS_L2TLB_MISS)
+			    | FLAG(d3, 17, PERF_IBS_LIN_ADDR)
+			    | FLAG(d3, 18, PERF_IBS_PHYS_ADDR)
+			    | FLAG(d2, 4, PERF_IBS_REMOTE)
+			    | FLAG(d1, 37, PERF_IBS_BRANCH)
+			    | FLAG(d1, 36, PERF_IBS_MISPREDICT)
+			    | FLAG(d3, 15, PERF_IBS_LOCKED)
+			    | FLAG(d3, 14, PERF_IBS_UNCACHED);
+		b->miss_lat[i]	 = d3 >> 32;
+		b->tlb_lat[i]	 = d3 >> 48;
+		b->tag_to_ret[i] = d1 >> 16;
+		b->width[i]	 = (d3 >> 22) & 0xf;
+		b->src[i]	 = (d2 & 7) | (((d2 >> 3) & 0x18) * zen4) | (zen4 << 5);
+	}
+
+	for (size_t i = 0; i < n; i++)
+		b->src[i] = classify(b->flags[i], b->src[i]);
+}
+
+int
+perf_ibs_lat_bucket(uint32_t lat)
+{
+	int i = lat ? 32 - __builtin_clz(lat) : 0;
+
+	return i < PERF_IBS_LAT_BUCKETS ? i : PERF_IBS_LAT_BUCKETS - 1;
+}
+
+int
+perf_ibs_profile_init(struct perf_ibs_profile_s *p, size_t max_ips)
+{
+	memset(p, 0, sizeof(*p));
+
+	if (max_ips < 2 || (max_ips & (max_ips - 1))) {
+		fprintf(stderr, "ibs ips must be a power of 2: %zu\n", max_ips);
+		return -1;
+	}
+	p->ips = mmap(NULL, max_ips * sizeof(struct perf_ibs_ip_s), PROT_READ|PROT_WRITE,
+		      MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (p->ips == MAP_FAILED) {
+		fprintf(stderr, "cannot map the ibs profile: %s\n", strerror(errno));
+		p->ips = NULL;
+		return -1;
+	}
+	p->max_ips = max_ips;
+	return 0;
+}
+
+void
+perf_ibs_profile_fini(struct perf_ibs_profile_s *p)
+{
+	if (p->ips)
+		munmap(p->ips, p->max_ips * sizeof(struct perf_ibs_ip_s));
+	memset(p, 0, sizeof(*p));
+}
+
+static struct perf_ibs_ip_s *
+get_ip(struct perf_ibs_profile_s *p, uint64_t key)
+{
+	struct perf_ibs_ip_s *e;
+	int fresh;
+
+	e = perf_hash_get(p->ips, sizeof(*e), p->max_ips, &p->nips, perf_hash_u64(key), key,
+			  1, NULL, NULL, &fresh);
+	if (e == NULL)
+		p->dropped++;
+	return e;
+}
+
+static inline void
+account(struct perf_ibs_ip_s *e, const struct perf_ibs_batch_s *b, size_t i)
+{
+	uint16_t flags = b->flags[i];
+
+	e->ops++;
+	e->src[b->src[i]]++;
+
+	if (flags & PERF_IBS_LOAD) {
+		e->loads++;
+		e->lat[perf_ibs_lat_bucket(b->miss_lat[i])]++;
+		if (flags & PERF_IBS_DC_MISS) {
+			e->misses++;
+			e->lat_sum += b->miss_lat[i];
+		}
+	}
+	if (flags & PERF_IBS_STORE)
+		e->stores++;
+	if ((flags & (PERF_IBS_LOAD|PERF_IBS_STORE)) && (flags & PERF_IBS_L1TLB_MISS))
+		e->tlb_misses++;
+}
+
+/* aggregate a decoded batch and empty it */
+void
+perf_ibs_profile_add(struct perf_ibs_profile_s *p, struct perf_ibs_batch_s *b)
+{
+	for (size_t i = 0; i < b->n; i++) {
+		struct perf_ibs_ip_s *e;
+
+		p->records++;
+		if (!(b->flags[i] & PERF_IBS_VALID)) {
+			p->invalid++;
+			continue;
+		}
+		account(&p->total, b, i);
+		if ((e = get_ip(p, b->rip[i] + 1)) != NULL)
+			account(e, b, i);
+	}
+	b->n = 0;
+}
+
+/* upper bound of the bucket holding pct of the loads that missed */
+static const char *
+fmt_pct(char *buf, size_t len, const struct perf_ibs_ip_s *e, double pct)
+{
+	uint64_t total = 0, sum = 0;
+	int i;
+
+	for (i = 1; i < PERF_IBS_LAT_BUCKETS; i++)
+		total += e->lat[i];
+	if (total == 0) {
+		snprintf(buf, len, "-");
+		return buf;
+	}
+
+	for (i = 1; i < PERF_IBS_LAT_BUCKETS - 1; i++) {
+		sum += e->lat[i];
+		if (sum >= total * pct / 100.0)
+			break;
+	}
+	if (i == PERF_IBS_LAT_BUCKETS - 1)
+		snprintf(buf, len, ">=%u", 1u << (i - 1));
+	else
+		snprintf(buf, len, "<%u", 1u << i);
+	return buf;
+}
+
+static int
+cmp_ip(const void *a, const void *b)
+{
+	const struct perf_ibs_ip_s *x = *(const struct perf_ibs_ip_s * const *)a;
+	const struct perf_ibs_ip_s *y = *(const struct perf_ibs_ip_s * const *)b;
+
+	if (x->lat_sum != y->lat_sum)
+		return x->lat_sum < y->lat_sum ? 1 : -1;
+	return x->ops < y->ops ? 1 : x->ops > y->ops ? -1 : 0;
+}
+
+/* the sources of the memory ops, down the hierarchy, or the top ones */
+static void
+print_sources(FILE *out, const struct perf_ibs_ip_s *e, int top)
+{
+	uint64_t memops = e->ops - e->src[PERF_IBS_SRC_NONE];
+	uint64_t printed = 0;
+
+	for (int n = 0; n < (top ? top : PERF_IBS_SRC_NR); n++) {
+		int s = 0;
+
+		for (int i = PERF_IBS_SRC_L1; i < PERF_IBS_SRC_NR; i++) {
+			if (!(printed & (1ull << i)) && e->src[i] && (s == 0 || (top && e->src[i] > e->src[s])))
+				s = i;
+		}
+		if (s == 0)
+			break;
+		printed |= 1ull << s;
+		fprintf(out, " %s %.1f%%", perf_ibs_src_names[s], 100.0 * e->src[s] / memops);
+	}
+}
+
+void
+perf_ibs_report(struct perf_ibs_profile_s *p, FILE *out, int top,
+		perf_ibs_label_cb label, void *arg)
+{
+	struct perf_ibs_ip_s **sorted = malloc((p->nips + 1) * sizeof(*sorted));
+	const struct perf_ibs_ip_s *t = &p->total;
+	char a[16], b[16], c[16];
+	size_t n = 0;
+
+	fprintf(out, "\nibs: %"PRIu64" records, %"PRIu64" ops, %"PRIu64" loads, %"PRIu64" stores, "
+		"%zu ips", p->records, t->ops, t->loads, t->stores, p->nips);
+	if (p->invalid)
+		fprintf(out, ", %"PRIu64" invalid", p->invalid);
+	if (p->dropped)
+		fprintf(out, ", %"PRIu64" dropped", p->dropped);
+	fprintf(out, "\n");
+	if (t->ops == 0) {
+		free(sorted);
+		return;
+	}
+
+	if (t->loads) {
+		fprintf(out, "  loads: %.1f%% DC miss, %.1f cycles per miss, p50 %s, p90 %s, p99 %s\n",
+			100.0 * t->misses / t->loads, t->misses ? (double) t->lat_sum / t->misses : 0.0,
+			fmt_pct(a, sizeof(a), t, 50), fmt_pct(b, sizeof(b), t, 90),
+			fmt_pct(c, sizeof(c), t, 99));
+	}
+	if (t->loads + t->stores) {
+		fprintf(out, "  data source:");
+		print_sources(out, t, 0);
+		fprintf(out, "\n  L1 TLB miss: %.1f%% of the memory ops\n",
+			100.0 * t->tlb_misses / (t->ops - t->src[PERF_IBS_SRC_NONE]));
+	}
+
+	/* latency of the loads that missed */
+	if (t->misses) {
+		fprintf(out, "\n     cycles      loads   share\n");
+		for (int i = 1; i < PERF_IBS_LAT_BUCKETS; i++) {
+			if (t->lat[i] == 0)
+				continue;
+			fprintf(out, "  %6u-%-6u %8"PRIu64" %6.2f%%\n", 1u << (i - 1),
+				i < PERF_IBS_LAT_BUCKETS - 1 ? (1u << i) - 1 : 65535,
+				t->lat[i], 100.0 * t->lat[i] / t->misses);
+		}
+	}
+
+	if (sorted == NULL)
+		return;
+	for (size_t i = 0; i < p->max_ips && n < p->nips; i++) {
+		if (p->ips[i].key)
+			sorted[n++] = &p->ips[i];
+	}
+	qsort(sorted, n, sizeof(*sorted), cmp_ip);
+
+	fprintf(out, "\n                 ip      ops    loads  miss%%  avg lat     p50     p90     p99  source\n");
+	for (size_t i = 0; i < n && (int) i < top; i++) {
+		const struct perf_ibs_ip_s *e = sorted[i];
+		uint64_t ip = e->key - 1;
+		const char *name = label ? label(ip, arg) : NULL;
+
+		fprintf(out, "  %#17"PRIx64" %8"PRIu64" %8"PRIu64" %5.1f%% %8.1f %7s %7s %7s ",
+			ip, e->ops, e->loads, e->loads ? 100.0 * e->misses / e->loads : 0.0,
+			e->misses ? (double) e->lat_sum / e->misses : 0.0,
+			fmt_pct(a, sizeof(a), e, 50), fmt_pct(b, sizeof(b), e, 90),
+			fmt_pct(c, sizeof(c), e, 99));
+		if (e->loads + e->stores)
+			print_sources(out, e, 3);
+		fprintf(out, "%s%s\n", name ? "  " : "", name ? name : "");
+	}
+	free(sorted);
+}
+
+int
+perf_ibs_fixture_header(FILE *out, uint64_t count)
+{
+	if (fwrite(FIXTURE_MAGIC, 8, 1, out) != 1 || fwrite(&count, sizeof(count), 1, out) != 1) {
+		fprintf(stderr, "cannot write the fixture header: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int
+perf_ibs_fixture_write(FILE *out, const void *raw, uint32_t size)
+{
+	if (fwrite(&size, sizeof(size), 1, out) != 1 || fwrite(raw, size, 1, out) != 1) {
+		fprintf(stderr, "cannot write the fixture: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int
+perf_ibs_fixture_open(struct perf_ibs_fixture_s *f, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	memset(f, 0, sizeof(*f));
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (st.st_size < FIXTURE_HEADER) {
+		fprintf(stderr, "%s: not an ibs fixture\n", path);
+		close(fd);
+		return -1;
+	}
+
+	f->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (f->map == MAP_FAILED) {
+		fprintf(stderr, "cannot map %s: %s\n", path, strerror(errno));
+		f->map = NULL;
+		return -1;
+	}
+	f->len = st.st_size;
+
+	if (memcmp(f->map, FIXTURE_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s: not an ibs fixture\n", path);
+		perf_ibs_fixture_close(f);
+		return -1;
+	}
+	memcpy(&f->count, (char *) f->map + 8, sizeof(f->count));
+	f->pos = FIXTURE_HEADER;
+	return 0;
+}
+
+/* 1 and the next record, 0 at the end of the file, -1 if it is cut short */
+int
+perf_ibs_fixture_next(struct perf_ibs_fixture_s *f, const void **raw, uint32_t *size)
+{
+	const char *p = (const char *) f->map + f->pos;
+
+	if (f->pos == f->len)
+		return 0;
+	if (f->len - f->pos < sizeof(*size))
+		goto truncated;
+	memcpy(size, p, sizeof(*size));
+	if (f->len - f->pos - sizeof(*size) < *size)
+		goto truncated;
+
+	*raw	= p + sizeof(*size);
+	f->pos += sizeof(*size) + *size;
+	return 1;
+
+truncated:
+	fprintf(stderr, "ibs fixture cut short at byte %zu\n", f->pos);
+	return -1;
+}
+
+void
+perf_ibs_fixture_close(struct perf_ibs_fixture_s *f)
+{
+	if (f->map)
+		munmap(f->map, f->len);
+	memset(f, 0, sizeof(*f));
+}
@@ -0,0 +1,174 @@
+/*
+ * Decoder of the AMD IBS op samples.
+ *
+ * The PERF_SAMPLE_RAW of an ibs_op event is a u32 with the IBS
+ * capabilities followed by the MSRs of the tagged op, as 64 bit words:
+ * IbsOpCtl, IbsOpRip, IbsOpData, IbsOpData2, IbsOpData3, IbsDcLinAd and
+ * IbsDcPhysAd, then IbsBrTarget and IbsOpData4 on the cpus that have
+ * them. The decoding works on batches laid out as one array per
+ * register: perf_ibs_batch_add() copies the registers of a record into
+ * the batch, perf_ibs_decode() extracts the fields of the whole batch
+ * with shifts and masks only, in a loop the compiler vectorizes, and
+ * perf_ibs_profile_add() aggregates it per IP:
+ *
+ *   perf_ibs_profile_init(&p, 1 << 14);
+ *   ... for every sample:
+ *   if (perf_ibs_batch_add(&b, sample.raw, sample.raw_size) == 1) {
+ *           perf_ibs_decode(&b);
+ *           perf_ibs_profile_add(&p, &b);
+ *   }
+ *   ... at the end, for what is left in the batch:
+ *   perf_ibs_decode(&b);
+ *   perf_ibs_profile_add(&p, &b);
+ *   perf_ibs_report(&p, stdout, 20, NULL, NULL);
+ *
+ * perf_ibs_profile_add() empties the batch. A profile is not shared:
+ * one per thread, nothing is allocated after perf_ibs_profile_init()
+ * so it may be fed from a signal handler.
+ *
+ * Every IP gets a histogram of the DC miss latency of its loads, in
+ * cycles from the miss to the fill, in powers of 2 (the loads that hit
+ * are in the first bucket, the percentiles of the report are the ones
+ * of the misses), and the data source of its memory ops: L1
+ * and L2 from the DC and L2 miss bits, the rest from the DataSrc of
+ * IbsOpData2, with the Zen 4 encoding when the capabilities have
+ * PERF_IBS_CAPS_ZEN4.
+ *
+ * The records can also be kept in a fixture file, to decode them again
+ * away from the machine that took them, or to feed the decoder with
+ * records of known content:
+ *
+ *   "IBSOPFX1", u64 number of records, then for every record
+ *   u32 size and the size bytes of the PERF_SAMPLE_RAW
+ *
+ * in the byte order of the host. The count is only a hint, the records
+ * go on to the end of the file: write a header with a count of 0 first
+ * and rewrite it once the records are in. bench_ibs generates, checks
+ * and times them, pe_ibsop -o writes the records of a real run.
+ */
+
+#ifndef PERF_IBS_H
+#define PERF_IBS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#define PERF_IBS_BATCH		256
+#define PERF_IBS_OP_REGS	7	/* IbsOpCtl to IbsDcPhysAd */
+#define PERF_IBS_LAT_BUCKETS	17	/* 0, then [2^(i-1), 2^i) cycles */
+
+/* IBS capabilities, the first word of the raw record */
+#define PERF_IBS_CAPS_ZEN4	(1u << 11)	/* DataSrcHi, the extended data sources */
+
+/* decoded flags of an op */
+enum {
+	PERF_IBS_VALID		= 1 << 0,	/* IbsOpVal, and the rip is valid */
+	PERF_IBS_LOAD		= 1 << 1,
+	PERF_IBS_STORE		= 1 << 2,
+	PERF_IBS_DC_MISS	= 1 << 3,
+	PERF_IBS_L2_MISS	= 1 << 4,
+	PERF_IBS_L1TLB_MISS	= 1 << 5,
+	PERF_IBS_L2TLB_MISS	= 1 << 6,
+	PERF_IBS_LIN_ADDR	= 1 << 7,	/* lin_addr is valid */
+	PERF_IBS_PHYS_ADDR	= 1 << 8,	/* phys_addr is valid */
+	PERF_IBS_REMOTE		= 1 << 9,	/* served by another node */
+	PERF_IBS_BRANCH		= 1 << 10,	/* retired branch */
+	PERF_IBS_MISPREDICT	= 1 << 11,
+	PERF_IBS_LOCKED		= 1 << 12,
+	PERF_IBS_UNCACHED	= 1 << 13,
+};
+
+/* where the data of a load or store came from */
+enum perf_ibs_src {
+	PERF_IBS_SRC_NONE,		/* not a memory op */
+	PERF_IBS_SRC_L1,
+	PERF_IBS_SRC_L2,
+	PERF_IBS_SRC_L3,		/* the cache of the CCX */
+	PERF_IBS_SRC_NEAR_CACHE,	/* another CCX of the node */
+	PERF_IBS_SRC_FAR_CACHE,		/* a CCX of another node */
+	PERF_IBS_SRC_DRAM,
+	PERF_IBS_SRC_REMOTE_DRAM,
+	PERF_IBS_SRC_PMEM,
+	PERF_IBS_SRC_IO,
+	PERF_IBS_SRC_EXT_MEM,		/* e.g. CXL */
+	PERF_IBS_SRC_PEER_MEM,		/* memory of another agent */
+	PERF_IBS_SRC_UNKNOWN,
+	PERF_IBS_SRC_NR
+};
+
+struct perf_ibs_batch_s {
+	size_t		n;
+	uint64_t	short_records;	/* raw records with fewer than PERF_IBS_OP_REGS */
+
+	/* the registers, from perf_ibs_batch_add() */
+	uint32_t	caps[PERF_IBS_BATCH];
+	uint64_t	ctl[PERF_IBS_BATCH];
+	uint64_t	rip[PERF_IBS_BATCH];
+	uint64_t	data[PERF_IBS_BATCH];
+	uint64_t	data2[PERF_IBS_BATCH];
+	uint64_t	data3[PERF_IBS_BATCH];
+	uint64_t	lin_addr[PERF_IBS_BATCH];
+	uint64_t	phys_addr[PERF_IBS_BATCH];
+
+	/* the fields, from perf_ibs_decode() */
+	uint16_t	flags[PERF_IBS_BATCH];
+	uint16_t	miss_lat[PERF_IBS_BATCH];	/* cycles from the DC miss to the fill */
+	uint16_t	tlb_lat[PERF_IBS_BATCH];	/* cycles of the L1 TLB refill */
+	uint16_t	tag_to_ret[PERF_IBS_BATCH];	/* cycles from tagging to retire */
+	uint8_t		width[PERF_IBS_BATCH];		/* 1 << (width - 1) bytes, 0 if no access */
+	uint8_t		src[PERF_IBS_BATCH];		/* enum perf_ibs_src */
+};
+
+struct perf_ibs_ip_s {
+	uint64_t	key;		/* ip plus one; 0: free slot */
+	uint64_t	ops;
+	uint64_t	loads;
+	uint64_t	stores;
+	uint64_t	misses;		/* loads that missed the DC */
+	uint64_t	tlb_misses;	/* memory ops that missed the L1 TLB */
+	uint64_t	lat_sum;	/* of the DC miss latency of the loads */
+	uint64_t	lat[PERF_IBS_LAT_BUCKETS];
+	uint64_t	src[PERF_IBS_SRC_NR];
+};
+
+struct perf_ibs_profile_s {
+	struct perf_ibs_ip_s *ips;	/* open addressing */
+	size_t		 max_ips;	/* power of 2 */
+	size_t		 nips;
+
+	struct perf_ibs_ip_s total;	/* of every valid op */
+	uint64_t	 records;
+	uint64_t	 invalid;	/* no IbsOpVal, or no valid rip */
+	uint64_t	 dropped;	/* no room left for a new IP */
+};
+
+struct perf_ibs_fixture_s {
+	void		*map;
+	size_t		 len;
+	uint64_t	 count;		/* from the header */
+	size_t		 pos;
+};
+
+/* name of an IP in the report, e.g. its symbol */
+typedef const char *(*perf_ibs_label_cb)(uint64_t ip, void *arg);
+
+extern const char *const perf_ibs_src_names[PERF_IBS_SRC_NR];
+
+int	perf_ibs_batch_add(struct perf_ibs_batch_s *b, const void *raw, uint32_t size);
+void	perf_ibs_decode(struct perf_ibs_batch_s *b);
+int	perf_ibs_lat_bucket(uint32_t lat);
+
+int	perf_ibs_profile_init(struct perf_ibs_profile_s *p, size_t max_ips);
+void	perf_ibs_profile_fini(struct perf_ibs_profile_s *p);
+void	perf_ibs_profile_add(struct perf_ibs_profile_s *p, struct perf_ibs_batch_s *b);
+void	perf_ibs_report(struct perf_ibs_profile_s *p, FILE *out, int top,
+			perf_ibs_label_cb label, void *arg);
+
+int	perf_ibs_fixture_header(FILE *out, uint64_t count);
+int	perf_ibs_fixture_write(FILE *out, const void *raw, uint32_t size);
+int	perf_ibs_fixture_open(struct perf_ibs_fixture_s *f, const char *path);
+int	perf_ibs_fixture_next(struct perf_ibs_fixture_s *f, const void **raw, uint32_t *size);
+void	perf_ibs_fixture_close(struct perf_ibs_fixture_s *f);
+
+#endif
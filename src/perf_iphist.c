@@ -0,0 +1,329 @@
+/*
+ * Sample histogram by (event, IP), per-thread tables merged at report.
+ * See perf_iphist.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "perf_iphist.h"
+
+#define PAGE_MASK	((UINT64_C(1) << 52) - 1)
+
+/* how many times the report reads a slot that keeps changing */
+#define READ_TRIES	4
+
+static uint64_t generation;
+
+/* the tables of the histograms this thread added to, by generation */
+static __thread struct {
+	uint64_t	gen;
+	struct perf_iphist_table_s *table;	/* NULL: no table left */
+} cached[PERF_IPHIST_CACHED];
+static __thread unsigned int next_cached;
+
+int
+perf_iphist_init(struct perf_iphist_s *h, size_t buckets, int max_threads, int by_page)
+{
+	size_t len = buckets * max_threads * PERF_IPHIST_WAYS * sizeof(struct perf_iphist_slot_s);
+
+	memset(h, 0, sizeof(*h));
+
+	if (buckets < 1 || (buckets & (buckets - 1))) {
+		fprintf(stderr, "histogram buckets must be a power of 2: %zu\n", buckets);
+		return -1;
+	}
+	if (max_threads < 1) {
+		fprintf(stderr, "invalid histogram threads: %d\n", max_threads);
+		return -1;
+	}
+
+	if (posix_memalign((void **) &h->tables, 64,
+			   max_threads * sizeof(struct perf_iphist_table_s))) {
+		fprintf(stderr, "cannot allocate the histogram tables\n");
+		h->tables = NULL;
+		return -1;
+	}
+	memset(h->tables, 0, max_threads * sizeof(struct perf_iphist_table_s));
+
+	h->slots = mmap(NULL, len, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (h->slots == MAP_FAILED) {
+		fprintf(stderr, "cannot map the histogram: %s\n", strerror(errno));
+		free(h->tables);
+		h->tables = NULL;
+		h->slots  = NULL;
+		return -1;
+	}
+	for (int i = 0; i < max_threads; i++)
+		h->tables[i].slots = h->slots + i * buckets * PERF_IPHIST_WAYS;
+
+	h->gen	       = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+	h->buckets     = buckets;
+	h->max_threads = max_threads;
+	h->by_page     = by_page;
+	return 0;
+}
+
+void
+perf_iphist_fini(struct perf_iphist_s *h)
+{
+	if (h->slots)
+		munmap(h->slots, h->buckets * h->max_threads * PERF_IPHIST_WAYS *
+		       sizeof(struct perf_iphist_slot_s));
+	free(h->tables);
+	h->slots  = NULL;
+	h->tables = NULL;
+}
+
+/* the table of the calling thread, claimed on its first add */
+static struct perf_iphist_table_s *
+thread_table(struct perf_iphist_s *h)
+{
+	struct perf_iphist_table_s *t = NULL;
+
+	for (int i = 0; i < PERF_IPHIST_CACHED; i++) {
+		if (cached[i].gen == h->gen)
+			return cached[i].table;
+	}
+
+	int n = __atomic_fetch_add(&h->nthreads, 1, __ATOMIC_RELAXED);
+	if (n < h->max_threads) {
+		t = &h->tables[n];
+		t->tid = syscall(SYS_gettid);
+	}
+	cached[next_cached].gen   = h->gen;
+	cached[next_cached].table = t;
+	next_cached = (next_cached + 1) % PERF_IPHIST_CACHED;
+	return t;
+}
+
+static inline size_t
+bucket_of(uint64_t ip, uint64_t key, size_t buckets)
+{
+	uint64_t x = (ip ^ (key * 0xff51afd7ed558ccdull)) * 0x9e3779b97f4a7c15ull;
+
+	return (x >> 32) & (buckets - 1);
+}
+
+/*
+ * Only the thread of the table writes it. The report reads the count of
+ * a slot before and after its key, so a key changes with the count at 0:
+ * the reader that saw the old count then sees a different one.
+ */
+void
+perf_iphist_add(struct perf_iphist_s *h, unsigned int event, uint64_t ip,
+		uint64_t addr, uint64_t n)
+{
+	struct perf_iphist_table_s *t = thread_table(h);
+	struct perf_iphist_slot_s *s, *victim = NULL;
+	uint64_t key;
+
+	if (t == NULL || event >= PERF_IPHIST_EVENTS) {
+		__atomic_add_fetch(&h->dropped, n, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_store_n(&t->samples[event], t->samples[event] + n, __ATOMIC_RELAXED);
+
+	key = (uint64_t) event << 52;
+	if (h->by_page)
+		key |= (addr >> PERF_IPHIST_PAGE_SHIFT) & PAGE_MASK;
+
+	s = &t->slots[bucket_of(ip, key, h->buckets) * PERF_IPHIST_WAYS];
+	for (int i = 0; i < PERF_IPHIST_WAYS; i++, s++) {
+		uint64_t count = s->count;
+
+		if (count == 0) {
+			/* the slots of a bucket fill in order and stay in use */
+			s->ip	 = ip;
+			s->key	 = key;
+			s->error = 0;
+			__atomic_store_n(&s->count, n, __ATOMIC_RELEASE);
+			__atomic_store_n(&t->entries, t->entries + 1, __ATOMIC_RELAXED);
+			return;
+		}
+		if (s->ip == ip && s->key == key) {
+			__atomic_store_n(&s->count, count + n, __ATOMIC_RELAXED);
+			return;
+		}
+		if (victim == NULL || count < victim->count)
+			victim = s;
+	}
+
+	/*
+	 * Space-Saving: the new key takes the smallest count over. Only the
+	 * victim's own samples are lost, its error was counted when the key
+	 * before it was evicted.
+	 */
+	uint64_t min = victim->count, own = min - victim->error;
+
+	__atomic_store_n(&victim->count, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&victim->ip, ip, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->key, key, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->error, min, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->count, min + n, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&t->evictions, t->evictions + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->evicted, t->evicted + own, __ATOMIC_RELAXED);
+}
+
+/* a copy of a slot that is being written, 0 if free or still changing */
+static int
+read_slot(const struct perf_iphist_slot_s *s, struct perf_iphist_slot_s *copy)
+{
+	for (int i = 0; i < READ_TRIES; i++) {
+		uint64_t count = __atomic_load_n(&s->count, __ATOMIC_ACQUIRE);
+
+		if (count == 0)
+			return 0;
+		copy->ip    = __atomic_load_n(&s->ip, __ATOMIC_RELAXED);
+		copy->key   = __atomic_load_n(&s->key, __ATOMIC_RELAXED);
+		copy->error = __atomic_load_n(&s->error, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->count, __ATOMIC_RELAXED) == count) {
+			copy->count = count;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sum the slot into the merged table, open addressing on (ip, key).
+ * Returns 1 if the key is new.
+ */
+static int
+merge_slot(struct perf_iphist_slot_s *merged, size_t size, const struct perf_iphist_slot_s *s)
+{
+	size_t i = bucket_of(s->ip, s->key, size);
+
+	for (;; i = (i + 1) & (size - 1)) {
+		struct perf_iphist_slot_s *m = &merged[i];
+
+		if (m->count == 0) {
+			*m = *s;
+			return 1;
+		}
+		if (m->ip == s->ip && m->key == s->key) {
+			m->count += s->count;
+			m->error += s->error;
+			return 0;
+		}
+	}
+}
+
+/* by event, then by decreasing count */
+static int
+cmp_slot(const void *a, const void *b)
+{
+	const struct perf_iphist_slot_s *x = a, *y = b;
+
+	if (x->key >> 52 != y->key >> 52)
+		return x->key >> 52 < y->key >> 52 ? -1 : 1;
+	if (x->count != y->count)
+		return x->count > y->count ? -1 : 1;
+	return x->ip < y->ip ? -1 : x->ip > y->ip;
+}
+
+void
+perf_iphist_report(struct perf_iphist_s *h, FILE *out, int top,
+		   const char *const *names, unsigned int nevents,
+		   perf_iphist_label_cb label, void *arg)
+{
+	int nthreads = __atomic_load_n(&h->nthreads, __ATOMIC_RELAXED);
+	uint64_t samples[PERF_IPHIST_EVENTS] = { 0 };
+	uint64_t entries = 0, evictions = 0, evicted = 0, total = 0;
+	size_t size = 2, n = 0, keys = 0;
+
+	if (nthreads > h->max_threads)
+		nthreads = h->max_threads;
+
+	for (int i = 0; i < nthreads; i++) {
+		struct perf_iphist_table_s *t = &h->tables[i];
+
+		for (int e = 0; e < PERF_IPHIST_EVENTS; e++)
+			samples[e] += __atomic_load_n(&t->samples[e], __ATOMIC_RELAXED);
+		entries	  += __atomic_load_n(&t->entries, __ATOMIC_RELAXED);
+		evictions += __atomic_load_n(&t->evictions, __ATOMIC_RELAXED);
+		evicted	  += __atomic_load_n(&t->evicted, __ATOMIC_RELAXED);
+	}
+	for (int e = 0; e < PERF_IPHIST_EVENTS; e++)
+		total += samples[e];
+
+	/*
+	 * The keys are at most the entries, plus the ones the threads add
+	 * while they are read: stop at half of the table, the rest is late.
+	 */
+	while (size < 4 * entries + 2)
+		size <<= 1;
+	struct perf_iphist_slot_s *merged = calloc(size, sizeof(*merged));
+	if (merged == NULL) {
+		fprintf(stderr, "cannot allocate the histogram merge: %zu keys\n", size);
+		return;
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		struct perf_iphist_table_s *t = &h->tables[i];
+		struct perf_iphist_slot_s copy;
+
+		for (size_t s = 0; s < h->buckets * PERF_IPHIST_WAYS && keys < size / 2; s++) {
+			if (read_slot(&t->slots[s], &copy))
+				keys += merge_slot(merged, size, &copy);
+		}
+	}
+
+	/* pack the merged keys at the front, then sort them */
+	for (size_t i = 0; i < size; i++) {
+		if (merged[i].count)
+			merged[n++] = merged[i];
+	}
+	qsort(merged, n, sizeof(*merged), cmp_slot);
+
+	fprintf(out, "\nip histogram: %"PRIu64" samples in %d threads, %zu keys",
+		total, nthreads, n);
+	if (evictions)
+		fprintf(out, ", %"PRIu64" evictions (%"PRIu64" samples)", evictions, evicted);
+	if (h->dropped)
+		fprintf(out, ", %"PRIu64" dropped", h->dropped);
+	fprintf(out, "\n");
+
+	for (size_t i = 0; i < n; ) {
+		unsigned int e = merged[i].key >> 52;
+		size_t end = i;
+
+		while (end < n && merged[end].key >> 52 == e)
+			end++;
+
+		if (e < nevents && names)
+			fprintf(out, "  %s", names[e]);
+		else
+			fprintf(out, "  event %u", e);
+		fprintf(out, ": %"PRIu64" samples, %zu keys\n", samples[e], end - i);
+		fprintf(out, "     samples   share      error  ip%s\n", h->by_page ? "              page" : "");
+
+		for (size_t k = i; k < end && (top <= 0 || (int) (k - i) < top); k++) {
+			const struct perf_iphist_slot_s *s = &merged[k];
+			const char *name = label ? label(s->ip, arg) : NULL;
+
+			fprintf(out, "  %10"PRIu64" %6.2f%% %10"PRIu64"  %#014"PRIx64,
+				s->count, samples[e] ? 100.0 * s->count / samples[e] : 0.0,
+				s->error, s->ip);
+			if (h->by_page && (s->key & PAGE_MASK) == 0)
+				fprintf(out, "  %14s", "-");	/* no data address */
+			else if (h->by_page)
+				fprintf(out, "  %#014"PRIx64, (s->key & PAGE_MASK) << PERF_IPHIST_PAGE_SHIFT);
+			fprintf(out, "%s%s\n", name ? "  " : "", name ? name : "");
+		}
+		i = end;
+	}
+	free(merged);
+}
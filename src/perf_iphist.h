@@ -0,0 +1,95 @@
+/*
+ * Sample histogram by (event, IP), optionally by (event, IP, data page).
+ *
+ * Every thread that adds samples gets a table of its own, so the sample
+ * path never takes a lock nor does an atomic read-modify-write: the
+ * tables are mapped for max_threads by perf_iphist_init(), and a thread
+ * claims one the first time it adds, with one fetch_add. Nothing is
+ * allocated after perf_iphist_init(), a signal handler may add too. A
+ * thread remembers the tables of the last PERF_IPHIST_CACHED histograms
+ * it added to, past that it claims a new table. The adds of a thread
+ * must not nest: no adding from a handler of a signal that may come in
+ * while that thread adds.
+ *
+ *   perf_iphist_init(&h, 1 << 12, 64, 0);
+ *   ... in the handler of every sample, of any thread:
+ *   perf_iphist_add(&h, event_index, sample.v[PERF_SF_IP], 0, 1);
+ *   ... at any time, from any thread:
+ *   perf_iphist_report(&h, stdout, 20, names, num_events, NULL, NULL);
+ *   ... at the end:
+ *   perf_iphist_fini(&h);
+ *
+ * A table is a fixed number of buckets of PERF_IPHIST_WAYS slots, the
+ * footprint is bounded by max_threads * buckets * 256 bytes. When the
+ * bucket of a new key is full, the slot with the smallest count is
+ * given to it (Space-Saving): the new key inherits that count plus its
+ * own, and the inherited part is kept as the error of the slot. The
+ * keys that are really hot stay in, the cold ones take turns in the
+ * slots they leave, and the count of any key in the report is at most
+ * its error above the true one. The sample counts of the events are
+ * kept apart, they are exact.
+ *
+ * The report merges the tables into a temporary one, sums the keys seen
+ * by several threads, and prints the top of every event. It reads the
+ * tables while they are written: a slot counts when its count was the
+ * same before and after reading its key, so a live report is a few
+ * samples behind, never a torn key.
+ */
+
+#ifndef PERF_IPHIST_H
+#define PERF_IPHIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#define PERF_IPHIST_WAYS	8	/* slots per bucket */
+#define PERF_IPHIST_EVENTS	64	/* event indexes, 12 bits of the key */
+#define PERF_IPHIST_PAGE_SHIFT	12
+#define PERF_IPHIST_CACHED	4
+
+struct perf_iphist_slot_s {
+	uint64_t	ip;
+	uint64_t	key;		/* event << 52 | data page */
+	uint64_t	count;		/* 0: free slot */
+	uint64_t	error;		/* inherited from the evicted keys */
+};
+
+struct perf_iphist_table_s {
+	struct perf_iphist_slot_s *slots;	/* buckets * PERF_IPHIST_WAYS */
+	int		 tid;		/* of the thread that claimed it */
+
+	uint64_t	 samples[PERF_IPHIST_EVENTS];
+	uint64_t	 entries;	/* slots in use */
+	uint64_t	 evictions;
+	uint64_t	 evicted;	/* samples counted by the evicted keys */
+} __attribute__((aligned(64)));
+
+struct perf_iphist_s {
+	uint64_t	 gen;		/* tells the histograms apart in the threads */
+	struct perf_iphist_table_s *tables;
+	int		 max_threads;
+	int		 nthreads;	/* claimed, may go past max_threads */
+
+	struct perf_iphist_slot_s *slots;	/* of all the tables */
+	size_t		 buckets;	/* per table, power of 2 */
+	int		 by_page;	/* key the data page too */
+
+	uint64_t	 dropped;	/* samples of the threads without a table,
+					   or of an event out of range */
+};
+
+/* name of an IP in the report, e.g. its symbol */
+typedef const char *(*perf_iphist_label_cb)(uint64_t ip, void *arg);
+
+int	perf_iphist_init(struct perf_iphist_s *h, size_t buckets, int max_threads, int by_page);
+void	perf_iphist_fini(struct perf_iphist_s *h);
+
+void	perf_iphist_add(struct perf_iphist_s *h, unsigned int event, uint64_t ip,
+			uint64_t addr, uint64_t n);
+
+void	perf_iphist_report(struct perf_iphist_s *h, FILE *out, int top,
+			   const char *const *names, unsigned int nevents,
+			   perf_iphist_label_cb label, void *arg);
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * NUMA placement of the sampled data addresses.
+ * See perf_numa.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "perf_hash.h"
+#include "perf_numa.h"
+
+/* a node taking this share of the accesses is worth binding to */
+#define DOMINANT	0.75
+
+/*
+ * Fill cpu_node[] from sysfs and return the number of nodes. Without
+ * NUMA information every cpu is on node 0.
+ */
+int
+perf_numa_nodes(int *cpu_node, int num_cpus)
+{
+	struct dirent *ent;
+	int max_node = 0;
+
+	memset(cpu_node, 0, sizeof(int) * num_cpus);
+
+	DIR *dir = opendir("/sys/devices/system/node");
+	if (dir == NULL)
+		return 1;
+
+	while ((ent = readdir(dir)) != NULL) {
+		char path[PATH_MAX];
+		int node, lo, hi, sep;
+
+		if (sscanf(ent->d_name, "node%d", &node) != 1)
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", ent->d_name);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+
+		/* e.g. 0-15,32-47 */
+		while (fscanf(f, "%d", &lo) == 1) {
+			hi  = lo;
+			sep = fgetc(f);
+			if (sep == '-') {
+				if (fscanf(f, "%d", &hi) != 1)
+					break;
+				sep = fgetc(f);
+			}
+			for(int cpu=lo; cpu<=hi && cpu<num_cpus; cpu++)
+				cpu_node[cpu] = node;
+			if (sep != ',')
+				break;
+		}
+		fclose(f);
+
+		if (node > max_node)
+			max_node = node;
+	}
+	closedir(dir);
+
+	return max_node + 1;
+}
+
+int
+perf_numa_init(struct perf_numa_s *n, size_t max_pages)
+{
+	memset(n, 0, sizeof(*n));
+
+	if (max_pages < 2 || (max_pages & (max_pages - 1))) {
+		fprintf(stderr, "numa pages must be a power of 2: %zu\n", max_pages);
+		return -1;
+	}
+
+	n->num_cpus   = sysconf(_SC_NPROCESSORS_CONF);
+	n->page_shift = __builtin_ctzl(sysconf(_SC_PAGESIZE));
+	n->cpu_node   = malloc(n->num_cpus * sizeof(int));
+	n->pages      = mmap(NULL, max_pages * sizeof(struct perf_numa_page_s),
+			     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (n->cpu_node == NULL || n->pages == MAP_FAILED) {
+		fprintf(stderr, "cannot allocate the numa tables: %s\n", strerror(errno));
+		free(n->cpu_node);
+		if (n->pages != MAP_FAILED)
+			munmap(n->pages, max_pages * sizeof(struct perf_numa_page_s));
+		memset(n, 0, sizeof(*n));
+		return -1;
+	}
+	n->num_nodes = perf_numa_nodes(n->cpu_node, n->num_cpus);
+	n->max_pages = max_pages;
+	return 0;
+}
+
+void
+perf_numa_fini(struct perf_numa_s *n)
+{
+	if (n->pages)
+		munmap(n->pages, n->max_pages * sizeof(struct perf_numa_page_s));
+	free(n->cpu_node);
+	memset(n, 0, sizeof(*n));
+}
+
+static struct perf_numa_page_s *
+get_page(struct perf_numa_s *n, uint64_t key, uint32_t label)
+{
+	struct perf_numa_page_s *p;
+	int fresh;
+
+	p = perf_hash_get(n->pages, sizeof(*p), n->max_pages, &n->npages, perf_hash_u64(key), key,
+			  1, NULL, NULL, &fresh);
+	if (p == NULL) {
+		__atomic_add_fetch(&n->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if (fresh) {
+		p->label = label;
+		__atomic_add_fetch(&n->unresolved, 1, __ATOMIC_RELAXED);
+	}
+	return p;
+}
+
+/* async-signal-safe, may be called from several threads at once */
+void
+perf_numa_add(struct perf_numa_s *n, uint64_t addr, uint32_t cpu, uint32_t label)
+{
+	struct perf_numa_page_s *p;
+	int node;
+
+	if (addr == 0 || cpu >= (uint32_t) n->num_cpus ||
+	    (node = n->cpu_node[cpu]) >= PERF_NUMA_MAX_NODES) {
+		__atomic_add_fetch(&n->noaddr, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&n->samples, 1, __ATOMIC_RELAXED);
+
+	p = get_page(n, (addr >> n->page_shift) + 1, label);
+	if (p)
+		__atomic_add_fetch(&p->samples[node], 1, __ATOMIC_RELAXED);
+}
+
+static int
+query(struct perf_numa_s *n, void **addrs, struct perf_numa_page_s **pages, int count)
+{
+	int status[PERF_NUMA_BATCH];
+	int ret = 0;
+
+	n->queries++;
+	if (syscall(SYS_move_pages, 0, (unsigned long) count, addrs, NULL, status, 0) != 0) {
+		ret = -errno;
+		for (int i = 0; i < count; i++)
+			status[i] = ret;
+	}
+
+	for (int i = 0; i < count; i++) {
+		int32_t zero = 0, s = status[i] >= 0 ? status[i] + 1 : status[i];
+
+		if (__atomic_compare_exchange_n(&pages[i]->status, &zero, s, 0,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			__atomic_sub_fetch(&n->unresolved, 1, __ATOMIC_RELAXED);
+	}
+	return ret;
+}
+
+/*
+ * Look up the node of the pages not resolved yet. Returns the number
+ * of pages asked for, or -1 if move_pages() itself failed, e.g. on a
+ * kernel without NUMA.
+ */
+int
+perf_numa_resolve(struct perf_numa_s *n)
+{
+	void *addrs[PERF_NUMA_BATCH];
+	struct perf_numa_page_s *pages[PERF_NUMA_BATCH];
+	int count = 0, total = 0, err = 0, ret;
+
+	if (__atomic_load_n(&n->unresolved, __ATOMIC_RELAXED) == 0)
+		return 0;
+
+	for (size_t i = 0; i < n->max_pages; i++) {
+		struct perf_numa_page_s *p = &n->pages[i];
+		uint64_t key = __atomic_load_n(&p->key, __ATOMIC_ACQUIRE);
+
+		if (key == 0 || __atomic_load_n(&p->status, __ATOMIC_RELAXED) != 0)
+			continue;
+
+		addrs[count] = (void *)(uintptr_t)((key - 1) << n->page_shift);
+		pages[count] = p;
+		if (++count == PERF_NUMA_BATCH) {
+			if ((ret = query(n, addrs, pages, count)) != 0)
+				err = -ret;
+			total += count;
+			count  = 0;
+		}
+	}
+	if (count) {
+		if ((ret = query(n, addrs, pages, count)) != 0)
+			err = -ret;
+		total += count;
+	}
+
+	if (err) {
+		fprintf(stderr, "move_pages: %s\n", strerror(err));
+		return -1;
+	}
+	return total;
+}
+
+static int
+top_node(const uint64_t *v)
+{
+	int top = 0;
+
+	for (int i = 1; i < PERF_NUMA_MAX_NODES; i++) {
+		if (v[i] > v[top])
+			top = i;
+	}
+	return top;
+}
+
+/*
+ * sum[label] for every label below nlabels. The affinity of the pages
+ * is only measured on the ones sampled more than once, a single sample
+ * is always from one node.
+ */
+void
+perf_numa_summarize(struct perf_numa_s *n, struct perf_numa_summary_s *sum, uint32_t nlabels)
+{
+	uint64_t *shared = calloc(nlabels, sizeof(uint64_t));
+
+	memset(sum, 0, nlabels * sizeof(*sum));
+
+	for (size_t i = 0; i < n->max_pages; i++) {
+		const struct perf_numa_page_s *p = &n->pages[i];
+		struct perf_numa_summary_s *s;
+		uint64_t total = 0, top = 0;
+
+		if (p->key == 0 || p->label >= nlabels)
+			continue;
+		s = &sum[p->label];
+
+		for (int c = 0; c < PERF_NUMA_MAX_NODES; c++) {
+			total	     += p->samples[c];
+			s->access[c] += p->samples[c];
+			if (p->samples[c] > top)
+				top = p->samples[c];
+		}
+		s->samples += total;
+		if (total > 1 && shared) {
+			shared[p->label] += total;
+			s->affine	 += top;
+		}
+
+		if (p->status > 0 && p->status <= PERF_NUMA_MAX_NODES) {
+			s->pages[p->status - 1]++;
+			s->local  += p->samples[p->status - 1];
+			s->remote += total - p->samples[p->status - 1];
+		} else {
+			s->unknown += total;
+		}
+	}
+
+	for (uint32_t l = 0; l < nlabels; l++) {
+		struct perf_numa_summary_s *s = &sum[l];
+
+		s->node = top_node(s->access);
+		if (s->samples == 0)
+			continue;
+		if (s->local + s->remote == 0)
+			s->advice = "unknown";
+		else if (n->num_nodes < 2)
+			s->advice = "single node";
+		else if (s->remote * 10 <= s->local + s->remote)
+			s->advice = "first-touch";
+		else if (s->access[s->node] >= s->samples * DOMINANT)
+			s->advice = "bind";
+		else if (shared && shared[l] && s->affine >= shared[l] * DOMINANT)
+			s->advice = "first-touch (parallel init)";
+		else
+			s->advice = "interleave";
+	}
+	free(shared);
+}
+
+void
+perf_numa_fprint(FILE *out, const struct perf_numa_s *n, const struct perf_numa_summary_s *s)
+{
+	uint64_t resolved = s->local + s->remote;
+	int nodes = n->num_nodes < PERF_NUMA_MAX_NODES ? n->num_nodes : PERF_NUMA_MAX_NODES;
+
+	fprintf(out, "%"PRIu64" samples, %.1f%% remote", s->samples,
+		resolved ? 100.0 * s->remote / resolved : 0.0);
+	if (s->unknown)
+		fprintf(out, ", %"PRIu64" unresolved", s->unknown);
+
+	fprintf(out, ", pages on");
+	for (int i = 0; i < nodes; i++)
+		fprintf(out, " %d:%"PRIu64, i, s->pages[i]);
+	fprintf(out, ", accessed from");
+	for (int i = 0; i < nodes; i++)
+		fprintf(out, " %d:%.0f%%", i, s->samples ? 100.0 * s->access[i] / s->samples : 0.0);
+
+	if (s->advice && strcmp(s->advice, "bind") == 0)
+		fprintf(out, " -> bind %d\n", s->node);
+	else
+		fprintf(out, " -> %s\n", s->advice ? s->advice : "no samples");
+}
+
+void
+perf_numa_report(struct perf_numa_s *n, FILE *out, const char **names, uint32_t nlabels)
+{
+	struct perf_numa_summary_s *sum = malloc(nlabels * sizeof(*sum));
+
+	fprintf(out, "\nnuma: %d nodes, %"PRIu64" samples on %zu pages, %"PRIu64" move_pages calls",
+		n->num_nodes, n->samples, n->npages, n->queries);
+	if (n->noaddr)
+		fprintf(out, ", %"PRIu64" without address", n->noaddr);
+	if (n->dropped)
+		fprintf(out, ", %"PRIu64" dropped", n->dropped);
+	fprintf(out, "\n");
+
+	if (sum == NULL)
+		return;
+	perf_numa_summarize(n, sum, nlabels);
+	for (uint32_t l = 0; l < nlabels; l++) {
+		if (sum[l].samples == 0)
+			continue;
+		fprintf(out, "  %-16s ", names[l] ? names[l] : "?");
+		perf_numa_fprint(out, n, &sum[l]);
+	}
+	free(sum);
+}
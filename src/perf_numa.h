@@ -0,0 +1,96 @@
+/*
+ * NUMA placement of the sampled data addresses.
+ *
+ * Every sample with PERF_SAMPLE_ADDR|CPU is counted on its page, per
+ * NUMA node of the cpu that took it. The node of the pages themselves
+ * comes from move_pages(2) with no target node, which only queries:
+ * perf_numa_resolve() asks for every page not resolved yet, up to
+ * PERF_NUMA_BATCH pages per call, and keeps the answer, so a page is
+ * only looked up once. A sample is local when its page is on the node
+ * of the sampling cpu, remote otherwise:
+ *
+ *   perf_numa_init(&n, 1 << 18);
+ *   ... for every sample, label being e.g. the allocation of the address:
+ *   perf_numa_add(&n, sample.v[PERF_SF_ADDR], perf_sample_cpu(&sample), label);
+ *   ... before the memory goes away, then at the end of the run:
+ *   perf_numa_resolve(&n);
+ *   perf_numa_report(&n, stdout, names, nlabels);
+ *
+ * perf_numa_add() only uses atomics on memory mapped by perf_numa_init(),
+ * from any number of threads or signal handlers. perf_numa_resolve() may
+ * run at the same time on another thread. A page migrated after it was
+ * resolved keeps its old node, and a page shared by two labels counts
+ * for the one of its first sample.
+ *
+ * The summary of a label suggests a placement from where its pages are
+ * and which nodes access them:
+ *
+ *   first-touch  most of the samples are already local
+ *   bind N       one node takes most of the accesses, put the pages there
+ *   first-touch (parallel init)
+ *                every page has a node that takes most of its accesses,
+ *                the threads that use a page should touch it first
+ *   interleave   the pages are shared by the nodes, spread them
+ */
+
+#ifndef PERF_NUMA_H
+#define PERF_NUMA_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define PERF_NUMA_MAX_NODES	8	/* pages on higher nodes are not counted */
+#define PERF_NUMA_BATCH		512	/* pages per move_pages() */
+
+struct perf_numa_page_s {
+	uint64_t	key;		/* page number plus one; 0: free slot */
+	int32_t		status;		/* 0: not resolved, node plus one, or -errno */
+	uint32_t	label;
+	uint32_t	samples[PERF_NUMA_MAX_NODES];	/* per node of the sampling cpu */
+};
+
+struct perf_numa_s {
+	int		 num_nodes;
+	int		 num_cpus;
+	int		*cpu_node;
+	unsigned int	 page_shift;
+
+	struct perf_numa_page_s *pages;	/* open addressing */
+	size_t		 max_pages;	/* power of 2 */
+	size_t		 npages;
+	size_t		 unresolved;
+
+	uint64_t	 samples;
+	uint64_t	 noaddr;	/* no address, or a cpu we don't know */
+	uint64_t	 dropped;	/* no room left for a new page */
+	uint64_t	 queries;	/* move_pages() calls */
+};
+
+struct perf_numa_summary_s {
+	uint64_t	samples;
+	uint64_t	local;
+	uint64_t	remote;
+	uint64_t	unknown;	/* page not resolved or not present */
+	uint64_t	affine;		/* samples from the top node of their page */
+	uint64_t	access[PERF_NUMA_MAX_NODES];	/* per node of the sampling cpu */
+	uint64_t	pages[PERF_NUMA_MAX_NODES];	/* per node of the page */
+	int		node;		/* the node that accesses the most */
+	const char	*advice;
+};
+
+int	perf_numa_nodes(int *cpu_node, int num_cpus);
+
+int	perf_numa_init(struct perf_numa_s *n, size_t max_pages);
+void	perf_numa_fini(struct perf_numa_s *n);
+
+void	perf_numa_add(struct perf_numa_s *n, uint64_t addr, uint32_t cpu, uint32_t label);
+int	perf_numa_resolve(struct perf_numa_s *n);
+
+void	perf_numa_summarize(struct perf_numa_s *n, struct perf_numa_summary_s *sum,
+			    uint32_t nlabels);
+void	perf_numa_fprint(FILE *out, const struct perf_numa_s *n,
+			 const struct perf_numa_summary_s *s);
+void	perf_numa_report(struct perf_numa_s *n, FILE *out, const char **names,
+			 uint32_t nlabels);
+
+#endif
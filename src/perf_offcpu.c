@@ -0,0 +1,271 @@
+/*
+ * Off-CPU time from context switches.
+ * See perf_offcpu.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+
+#include "perf_hash.h"
+#include "perf_offcpu.h"
+
+/* frames printed per call path, the kernel ones come first */
+#define PRINT_DEPTH	16
+
+int
+perf_offcpu_init(struct perf_offcpu_s *o, size_t max_chains, size_t max_threads)
+{
+	memset(o, 0, sizeof(*o));
+
+	if (max_threads < 2 || (max_threads & (max_threads - 1))) {
+		fprintf(stderr, "off-cpu threads must be a power of 2: %zu\n", max_threads);
+		return -1;
+	}
+
+	if (perf_profile_init(&o->profile, max_chains, max_chains * PERF_OFFCPU_DEPTH))
+		return -1;
+
+	o->hist	   = mmap(NULL, max_chains * sizeof(*o->hist), PROT_READ|PROT_WRITE,
+			  MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	o->threads = mmap(NULL, max_threads * sizeof(struct perf_offcpu_thread_s),
+			  PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (o->hist == MAP_FAILED || o->threads == MAP_FAILED) {
+		fprintf(stderr, "cannot map the off-cpu tables: %s\n", strerror(errno));
+		if (o->hist != MAP_FAILED)
+			munmap(o->hist, max_chains * sizeof(*o->hist));
+		if (o->threads != MAP_FAILED)
+			munmap(o->threads, max_threads * sizeof(struct perf_offcpu_thread_s));
+		perf_profile_fini(&o->profile);
+		memset(o, 0, sizeof(*o));
+		return -1;
+	}
+	o->max_threads = max_threads;
+	return 0;
+}
+
+void
+perf_offcpu_fini(struct perf_offcpu_s *o)
+{
+	if (o->hist)
+		munmap(o->hist, o->profile.max_chains * sizeof(*o->hist));
+	if (o->threads)
+		munmap(o->threads, o->max_threads * sizeof(struct perf_offcpu_thread_s));
+	perf_profile_fini(&o->profile);
+	memset(o, 0, sizeof(*o));
+}
+
+static struct perf_offcpu_thread_s *
+get_thread(struct perf_offcpu_s *o, uint32_t tid, int create)
+{
+	struct perf_offcpu_thread_s *t;
+	int fresh;
+
+	if (tid == 0)
+		return NULL;	/* the idle task */
+
+	t = perf_hash_get(o->threads, sizeof(*t), o->max_threads, &o->nthreads,
+			  perf_hash_u64(tid), tid, create, NULL, NULL, &fresh);
+	if (t == NULL && create)
+		o->dropped++;
+	return t;
+}
+
+/* 8 buckets per power of 2, exact below 8 ns */
+static unsigned int
+bucket_of(uint64_t ns)
+{
+	if (ns < 8)
+		return ns;
+
+	unsigned int e = 63 - __builtin_clzll(ns);
+	return (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+}
+
+static uint64_t
+bucket_start(unsigned int b)
+{
+	if (b < 8)
+		return b;
+	return (uint64_t) (8 + b % 8) << (b / 8 - 1);
+}
+
+/* the middle of a bucket, within 1/16 of any value in it */
+static uint64_t
+bucket_value(unsigned int b)
+{
+	return bucket_start(b) + (bucket_start(b + 1) - bucket_start(b)) / 2;
+}
+
+/* the callchain of a thread being switched out */
+void
+perf_offcpu_sample(struct perf_offcpu_s *o, uint32_t tid, uint64_t time,
+		   const uint64_t *ips, uint64_t nr)
+{
+	struct perf_offcpu_thread_s *t = get_thread(o, tid, 1);
+
+	if (t == NULL)
+		return;
+
+	if (nr > PERF_OFFCPU_DEPTH)
+		nr = PERF_OFFCPU_DEPTH;
+	memcpy(t->ips, ips, nr * sizeof(uint64_t));
+	t->nr	     = nr;
+	t->time	     = time;
+	t->pending   = 1;
+	t->out_seen  = 0;
+	t->preempted = 0;
+}
+
+static void
+account(struct perf_offcpu_s *o, struct perf_offcpu_thread_s *t, uint64_t ns)
+{
+	if (t->preempted) {
+		o->preempted++;
+		o->preempted_ns += ns;
+		return;
+	}
+
+	o->blocked++;
+	o->blocked_ns += ns;
+
+	struct perf_chain_s *c = perf_profile_add_chain(&o->profile, t->ips, t->nr, ns);
+	if (c == NULL) {
+		o->dropped++;
+		return;
+	}
+	o->hist[c - o->profile.chains][bucket_of(ns)]++;
+}
+
+void
+perf_offcpu_switch(struct perf_offcpu_s *o, uint16_t misc, uint32_t tid, uint64_t time)
+{
+	struct perf_offcpu_thread_s *t;
+
+	if (misc & PERF_RECORD_MISC_SWITCH_OUT) {
+		t = get_thread(o, tid, 1);
+		if (t == NULL)
+			return;
+
+		/*
+		 * The sample of the context switch comes first. Without it,
+		 * or if it belongs to an older switch whose switch-in was
+		 * lost, the time still counts, with an empty callchain.
+		 */
+		if (!t->pending || t->out_seen) {
+			t->nr	   = 0;
+			t->time	   = time;
+			t->pending = 1;
+		}
+		t->out_seen  = 1;
+		t->preempted = !!(misc & PERF_RECORD_MISC_SWITCH_OUT_PREEMPT);
+		return;
+	}
+
+	t = get_thread(o, tid, 0);
+	if (t == NULL || !t->pending || time < t->time) {
+		o->unpaired++;
+		return;
+	}
+	account(o, t, time - t->time);
+	t->pending = 0;
+}
+
+struct path_s {
+	size_t		chain;
+	uint64_t	p99;
+};
+
+static const struct perf_offcpu_s *sort_offcpu;
+
+static int
+cmp_path(const void *a, const void *b)
+{
+	const struct perf_chain_s *x = &sort_offcpu->profile.chains[((const struct path_s *)a)->chain];
+	const struct perf_chain_s *y = &sort_offcpu->profile.chains[((const struct path_s *)b)->chain];
+
+	return x->period < y->period ? 1 : x->period > y->period ? -1 : 0;
+}
+
+static uint64_t
+percentile(const uint32_t *hist, uint64_t count, double pct)
+{
+	uint64_t rank = (uint64_t) (count * pct / 100.0), seen = 0;
+
+	for (unsigned int b = 0; b < PERF_OFFCPU_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen > rank)
+			return bucket_value(b);
+	}
+	return bucket_value(PERF_OFFCPU_BUCKETS - 1);
+}
+
+static void
+print_frame(FILE *out, struct perf_symtab_s *st, uint64_t ip)
+{
+	const struct perf_frame_s *f = perf_symtab_resolve(st, ip);
+	const char *dso = f->dso ? strrchr(f->dso, '/') : NULL;
+
+	dso = dso ? dso + 1 : f->dso;
+	if (f->sym)
+		fprintf(out, "%s", f->sym);
+	else if (dso)
+		fprintf(out, "[%s+0x%"PRIx64"]", dso, f->off);
+	else
+		fprintf(out, "[unknown 0x%"PRIx64"]", f->ip);
+}
+
+/*
+ * The call paths by total off-CPU time, with the number of times they
+ * blocked and their p99, then the time per function.
+ */
+void
+perf_offcpu_report(struct perf_offcpu_s *o, struct perf_symtab_s *st, FILE *out, int top)
+{
+	struct perf_profile_s *p = &o->profile;
+	struct path_s *paths = malloc((p->nchains + 1) * sizeof(struct path_s));
+	size_t n = 0;
+
+	for (size_t c = 0; c < p->max_chains && n < p->nchains; c++) {
+		if (p->chains[c].hash == 0)
+			continue;
+		paths[n].chain = c;
+		paths[n].p99   = percentile(o->hist[c], p->chains[c].samples, 99);
+		n++;
+	}
+	sort_offcpu = o;
+	qsort(paths, n, sizeof(struct path_s), cmp_path);
+
+	fprintf(out, "\noff-cpu: %"PRIu64" blocked for %.3f ms, %"PRIu64" preempted for %.3f ms",
+		o->blocked, o->blocked_ns * 1e-6, o->preempted, o->preempted_ns * 1e-6);
+	if (o->unpaired)
+		fprintf(out, ", %"PRIu64" unpaired switch-ins", o->unpaired);
+	if (o->dropped)
+		fprintf(out, ", %"PRIu64" dropped", o->dropped);
+
+	fprintf(out, "\n\n    total ms    count    avg ms    p99 ms  call path\n");
+	for (size_t i = 0; i < n && (int) i < top; i++) {
+		const struct perf_chain_s *c = &p->chains[paths[i].chain];
+
+		fprintf(out, "%12.3f %8"PRIu64" %9.3f %9.3f  ", c->period * 1e-6, c->samples,
+			c->period * 1e-6 / c->samples, paths[i].p99 * 1e-6);
+		if (c->nr == 0)
+			fprintf(out, "[no callchain]");
+		for (uint32_t j = 0; j < c->nr && j < PRINT_DEPTH; j++) {
+			if (j)
+				fprintf(out, " <- ");
+			print_frame(out, st, p->ips[c->off + j]);
+		}
+		fprintf(out, "%s\n", c->nr > PRINT_DEPTH ? " <- ..." : "");
+	}
+	free(paths);
+
+	fprintf(out, "\noff-cpu time by function:");
+	perf_profile_report(p, st, out, top);
+}
@@ -0,0 +1,77 @@
+/*
+ * Off-CPU time from context switches.
+ *
+ * A PERF_COUNT_SW_CONTEXT_SWITCHES event with sample_period 1 samples
+ * the callchain of every thread that is switched out, and
+ * attr.context_switch adds a PERF_RECORD_SWITCH when it is switched out
+ * and back in. The time between the switch-out and the next switch-in
+ * of the same TID is charged to the callchain of the switch-out, so the
+ * report ranks the call paths that block (locks, sleeps, I/O) by their
+ * total and p99 off-CPU time:
+ *
+ *   perf_offcpu_init(&o, 1 << 14, 1 << 12);
+ *   ... for every record, with PERF_SAMPLE_TID|TIME and sample_id_all:
+ *   perf_offcpu_sample(&o, tid, time, sample.ips, sample.nr_ips);
+ *   perf_offcpu_switch(&o, ehdr->misc, tid, time);
+ *   ... at the end of the run:
+ *   perf_offcpu_report(&o, &st, stdout, 20);
+ *
+ * A thread switched out while still runnable (PERF_RECORD_MISC_SWITCH_OUT_PREEMPT)
+ * waits for a CPU rather than blocks: its time is only counted in the
+ * preempted total. Everything works on memory mapped by perf_offcpu_init()
+ * and is async-signal-safe, as perf_profile_add().
+ */
+
+#ifndef PERF_OFFCPU_H
+#define PERF_OFFCPU_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "perf_profile.h"
+#include "perf_symtab.h"
+
+/* frames kept from the switch-out until the switch-in */
+#define PERF_OFFCPU_DEPTH	64
+
+/* log-linear histogram, 8 buckets per power of 2 of ns */
+#define PERF_OFFCPU_BUCKETS	512
+
+struct perf_offcpu_thread_s {
+	uint64_t	tid;		/* 0: free slot */
+	uint8_t		pending;	/* switched out, waiting for the switch-in */
+	uint8_t		out_seen;	/* the PERF_RECORD_SWITCH of the switch-out */
+	uint8_t		preempted;
+	uint64_t	time;
+	uint64_t	nr;
+	uint64_t	ips[PERF_OFFCPU_DEPTH];
+};
+
+struct perf_offcpu_s {
+	struct perf_profile_s profile;	/* period: ns off-CPU */
+	uint32_t	(*hist)[PERF_OFFCPU_BUCKETS];	/* per chain of the profile */
+
+	struct perf_offcpu_thread_s *threads;	/* open addressing on the tid */
+	size_t		 max_threads;	/* power of 2 */
+	size_t		 nthreads;
+
+	uint64_t	 blocked;
+	uint64_t	 blocked_ns;
+	uint64_t	 preempted;
+	uint64_t	 preempted_ns;
+	uint64_t	 unpaired;	/* switch-in without a switch-out */
+	uint64_t	 dropped;	/* no room for the thread or the chain */
+};
+
+int	perf_offcpu_init(struct perf_offcpu_s *o, size_t max_chains, size_t max_threads);
+void	perf_offcpu_fini(struct perf_offcpu_s *o);
+
+void	perf_offcpu_sample(struct perf_offcpu_s *o, uint32_t tid, uint64_t time,
+			   const uint64_t *ips, uint64_t nr);
+void	perf_offcpu_switch(struct perf_offcpu_s *o, uint16_t misc, uint32_t tid,
+			   uint64_t time);
+
+void	perf_offcpu_report(struct perf_offcpu_s *o, struct perf_symtab_s *st,
+			   FILE *out, int top);
+
+#endif
@@ -0,0 +1,817 @@
+/*
+ * Packed sample files.
+ * See perf_pack.h for the usage and the format.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "perf_pack.h"
+#include "perf_varint.h"
+
+#define FILE_MAGIC	"PERFPAK1"
+#define BLOCK_HEADER	24
+#define MAX_BLOCK	(1 << 20)	/* samples */
+#define DICT_SLOTS	(4 * PERF_PACK_DICT)
+#define CHAIN_SLOTS	64		/* threads whose last callchain a block keeps */
+
+static const struct {
+	uint64_t	sample_type;
+	int		column;
+} columns[] = {
+	{ PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_ID, PERF_PACK_ID },
+	{ PERF_SAMPLE_TID,		PERF_PACK_TID },
+	{ PERF_SAMPLE_CPU,		PERF_PACK_CPU },
+	{ PERF_SAMPLE_PERIOD,		PERF_PACK_PERIOD },
+	{ PERF_SAMPLE_TIME,		PERF_PACK_TIME },
+	{ PERF_SAMPLE_IP,		PERF_PACK_IP },
+	{ PERF_SAMPLE_ADDR,		PERF_PACK_ADDR },
+	{ PERF_SAMPLE_CALLCHAIN,	PERF_PACK_CALLCHAIN },
+};
+
+static uint32_t
+columns_of(uint64_t sample_type)
+{
+	uint32_t mask = 0;
+
+	for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++) {
+		if (sample_type & columns[i].sample_type)
+			mask |= 1u << columns[i].column;
+	}
+	return mask;
+}
+
+static inline unsigned int
+dict_hash(uint64_t v)
+{
+	return (v * 0x9e3779b97f4a7c15ull) >> 54;	/* log2(DICT_SLOTS) bits */
+}
+
+/* the thread a callchain is kept for, by the tid column */
+static inline unsigned int
+chain_slot(uint64_t tid)
+{
+	return (tid * 0x9e3779b97f4a7c15ull) >> 58;	/* log2(CHAIN_SLOTS) bits */
+}
+
+/*
+ * Writer
+ */
+
+static int
+write_all(struct perf_pack_s *p, const void *buf, size_t len)
+{
+	const char *b = buf;
+
+	while (len) {
+		ssize_t n = write(p->fd, b, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (p->error == 0)
+				p->error = n < 0 ? errno : EIO;
+			return -1;
+		}
+		b	 += n;
+		len	 -= n;
+		p->bytes += n;
+	}
+	return 0;
+}
+
+static int
+write_header(struct perf_pack_s *p)
+{
+	uint32_t attr_size = sizeof(struct perf_event_attr), nattrs = p->nattrs;
+
+	p->started = 1;
+	if (write_all(p, FILE_MAGIC, 8) || write_all(p, &p->sample_type, 8) ||
+	    write_all(p, &attr_size, 4) || write_all(p, &nattrs, 4))
+		return -1;
+	for (int i = 0; i < p->nattrs; i++) {
+		const struct perf_pack_attr_s *a = &p->attrs[i];
+
+		if (write_all(p, &a->attr, attr_size) || write_all(p, &a->nids, 4) ||
+		    write_all(p, a->ids, a->nids * sizeof(uint64_t)))
+			return -1;
+	}
+	return 0;
+}
+
+int
+perf_pack_open(struct perf_pack_s *p, const char *path, size_t block_samples)
+{
+	memset(p, 0, sizeof(*p));
+	if (block_samples == 0)
+		block_samples = PERF_PACK_BLOCK;
+	if (block_samples > MAX_BLOCK) {
+		fprintf(stderr, "perf_pack: at most %d samples per block\n", MAX_BLOCK);
+		return -1;
+	}
+	p->block_samples = block_samples;
+
+	for (int c = 0; c < PERF_PACK_CALLCHAIN; c++)
+		p->col[c] = malloc(block_samples * sizeof(uint64_t));
+	p->nr = malloc(block_samples * sizeof(uint32_t));
+	for (int c = 0; c < PERF_PACK_CALLCHAIN; c++) {
+		if (p->col[c] == NULL || p->nr == NULL) {
+			fprintf(stderr, "perf_pack: cannot allocate %zu samples\n", block_samples);
+			p->fd = -1;
+			perf_pack_close(p);
+			return -1;
+		}
+	}
+
+	p->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (p->fd < 0) {
+		fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+		perf_pack_close(p);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Add an event and the ids of its fds, before the first sample. They all
+ * need the sample_type of the first one.
+ */
+int
+perf_pack_add_attr(struct perf_pack_s *p, const struct perf_event_attr *attr,
+		   const uint64_t *ids, uint32_t nids)
+{
+	struct perf_pack_attr_s *a;
+
+	if (p->started || p->n) {
+		fprintf(stderr, "perf_pack: attrs go before the samples\n");
+		return -1;
+	}
+	if (p->nattrs == PERF_PACK_MAX_ATTRS) {
+		fprintf(stderr, "perf_pack: at most %d attrs\n", PERF_PACK_MAX_ATTRS);
+		return -1;
+	}
+	if (p->nattrs && attr->sample_type != p->sample_type) {
+		fprintf(stderr, "perf_pack: sample_type %#llx, not %#llx as the first attr\n",
+			(unsigned long long) attr->sample_type,
+			(unsigned long long) p->sample_type);
+		return -1;
+	}
+	if (p->nattrs == 0 && perf_sample_layout_init(&p->layout, attr))
+		return -1;
+
+	a = &p->attrs[p->nattrs];
+	a->ids = malloc((nids ? nids : 1) * sizeof(uint64_t));
+	if (a->ids == NULL)
+		return -1;
+	memcpy(a->ids, ids, nids * sizeof(uint64_t));
+	a->attr = *attr;
+	a->nids = nids;
+
+	p->sample_type = attr->sample_type;
+	p->columns     = columns_of(attr->sample_type);
+	p->nattrs++;
+	return 0;
+}
+
+/*
+ * A column of values as a dictionary, or as deltas when the block has
+ * more than PERF_PACK_DICT of them.
+ */
+static unsigned char *
+put_dict(unsigned char *p, const uint64_t *v, size_t n)
+{
+	uint64_t keys[DICT_SLOTS], values[PERF_PACK_DICT];
+	int16_t index[DICT_SLOTS];
+	unsigned int h;
+	int nvalues = 0;
+
+	memset(index, -1, sizeof(index));
+	for (size_t i = 0; i < n; i++) {
+		for (h = dict_hash(v[i]); index[h] >= 0; h = (h + 1) % DICT_SLOTS) {
+			if (keys[h] == v[i])
+				break;
+		}
+		if (index[h] >= 0)
+			continue;
+		if (nvalues == PERF_PACK_DICT) {
+			uint64_t prev = 0;
+
+			*p++ = 1;
+			for (size_t j = 0; j < n; prev = v[j++])
+				p = perf_put_varint(p, v[j] - prev);
+			return p;
+		}
+		keys[h]		  = v[i];
+		index[h]	  = nvalues;
+		values[nvalues++] = v[i];
+	}
+
+	*p++ = 0;
+	p = perf_put_uvarint(p, nvalues);
+	for (int i = 0; i < nvalues; i++)
+		p = perf_put_uvarint(p, values[i]);
+	if (nvalues == 1)
+		return p;
+	for (size_t i = 0; i < n; i++) {
+		for (h = dict_hash(v[i]); keys[h] != v[i]; h = (h + 1) % DICT_SLOTS)
+			;
+		*p++ = index[h];
+	}
+	return p;
+}
+
+static unsigned char *
+put_deltas(unsigned char *p, const uint64_t *v, size_t n, uint64_t prev)
+{
+	for (size_t i = 0; i < n; prev = v[i++])
+		p = perf_put_varint(p, v[i] - prev);
+	return p;
+}
+
+static unsigned char *
+put_callchains(struct perf_pack_s *pk, unsigned char *p)
+{
+	size_t off[CHAIN_SLOTS] = { 0 }, pos = 0;
+	uint32_t len[CHAIN_SLOTS] = { 0 };
+
+	for (size_t i = 0; i < pk->n; i++) {
+		unsigned int slot = pk->columns & (1u << PERF_PACK_TID) ?
+			chain_slot(pk->col[PERF_PACK_TID][i]) : 0;
+		const uint64_t *ips = pk->ips + pos, *last = pk->ips + off[slot];
+		uint32_t nr = pk->nr[i], same = 0;
+		uint64_t prev = 0;
+
+		while (same < nr && same < len[slot] &&
+		       ips[nr - 1 - same] == last[len[slot] - 1 - same])
+			same++;
+
+		p = perf_put_uvarint(p, nr);
+		p = perf_put_uvarint(p, same);
+		for (uint32_t j = 0; j < nr - same; prev = ips[j++])
+			p = perf_put_varint(p, ips[j] - prev);
+
+		off[slot] = pos;
+		len[slot] = nr;
+		pos += nr;
+	}
+	return p;
+}
+
+/* the samples of the block, column by column, then the block in one write() */
+static int
+flush_block(struct perf_pack_s *p)
+{
+	size_t need = BLOCK_HEADER + 4 * (1 + PERF_VARINT_MAX + PERF_PACK_DICT * PERF_VARINT_MAX) +
+		      p->n * (7 + 2) * PERF_VARINT_MAX + p->nips * PERF_VARINT_MAX;
+	uint32_t magic = PERF_PACK_MAGIC, samples = p->n, len, entries = p->nips;
+	uint64_t first = p->columns & (1u << PERF_PACK_TIME) ? p->col[PERF_PACK_TIME][0] : 0;
+	unsigned char *b;
+	int ret;
+
+	if (!p->started && write_header(p))
+		return -1;
+	if (p->n == 0)
+		return 0;
+
+	if (need > p->bufsize) {
+		unsigned char *buf = realloc(p->buf, need);
+
+		if (buf == NULL) {
+			fprintf(stderr, "perf_pack: cannot allocate %zu bytes\n", need);
+			p->error = ENOMEM;
+			return -1;
+		}
+		p->buf	   = buf;
+		p->bufsize = need;
+	}
+
+	b = p->buf + BLOCK_HEADER;
+	for (int c = PERF_PACK_ID; c <= PERF_PACK_PERIOD; c++) {
+		if (p->columns & (1u << c))
+			b = put_dict(b, p->col[c], p->n);
+	}
+	if (p->columns & (1u << PERF_PACK_TIME))
+		b = put_deltas(b, p->col[PERF_PACK_TIME], p->n, first);
+	if (p->columns & (1u << PERF_PACK_IP))
+		b = put_deltas(b, p->col[PERF_PACK_IP], p->n, 0);
+	if (p->columns & (1u << PERF_PACK_ADDR))
+		b = put_deltas(b, p->col[PERF_PACK_ADDR], p->n, 0);
+	if (p->columns & (1u << PERF_PACK_CALLCHAIN))
+		b = put_callchains(p, b);
+
+	len = b - p->buf - BLOCK_HEADER;
+	memcpy(p->buf, &magic, 4);
+	memcpy(p->buf + 4, &samples, 4);
+	memcpy(p->buf + 8, &len, 4);
+	memcpy(p->buf + 12, &entries, 4);
+	memcpy(p->buf + 16, &first, 8);
+	ret = write_all(p, p->buf, b - p->buf);
+	if (ret == 0) {
+		p->blocks++;
+		p->samples += p->n;
+	}
+
+	p->n	= 0;
+	p->nips = 0;
+	return ret;
+}
+
+/*
+ * Add a record. Anything else than a sample of the sample_type is
+ * counted in skipped. Returns -1 once a block could not be written.
+ */
+int
+perf_pack_record(struct perf_pack_s *p, const struct perf_event_header *hdr)
+{
+	struct perf_sample_s s;
+	size_t n = p->n;
+
+	if (p->error)
+		return -1;
+	if (hdr->type != PERF_RECORD_SAMPLE || p->nattrs == 0 ||
+	    perf_sample_parse(&p->layout, hdr, &s) ||
+	    s.nr_ips > hdr->size / sizeof(uint64_t)) {
+		p->skipped++;
+		return 0;
+	}
+
+	p->col[PERF_PACK_ID][n]	    = p->sample_type & PERF_SAMPLE_IDENTIFIER ?
+				      s.v[PERF_SF_IDENTIFIER] : s.v[PERF_SF_ID];
+	p->col[PERF_PACK_TID][n]    = s.v[PERF_SF_TID];
+	p->col[PERF_PACK_CPU][n]    = s.v[PERF_SF_CPU];
+	p->col[PERF_PACK_PERIOD][n] = s.v[PERF_SF_PERIOD];
+	p->col[PERF_PACK_TIME][n]   = s.v[PERF_SF_TIME];
+	p->col[PERF_PACK_IP][n]	    = s.v[PERF_SF_IP];
+	p->col[PERF_PACK_ADDR][n]   = s.v[PERF_SF_ADDR];
+
+	if (p->columns & (1u << PERF_PACK_CALLCHAIN)) {
+		if (p->nips + s.nr_ips > p->max_ips) {
+			size_t max = p->max_ips ? p->max_ips : 4096;
+			uint64_t *ips;
+
+			while (max < p->nips + s.nr_ips)
+				max *= 2;
+			ips = realloc(p->ips, max * sizeof(uint64_t));
+			if (ips == NULL) {
+				p->skipped++;
+				return 0;
+			}
+			p->ips	   = ips;
+			p->max_ips = max;
+		}
+		memcpy(p->ips + p->nips, s.ips, s.nr_ips * sizeof(uint64_t));
+		p->nr[n]  = s.nr_ips;
+		p->nips	 += s.nr_ips;
+	}
+
+	p->record_bytes += hdr->size;
+	if (++p->n == p->block_samples)
+		return flush_block(p);
+	return 0;
+}
+
+void
+perf_pack_cb(const struct perf_event_header *hdr, void *arg)
+{
+	perf_pack_record(arg, hdr);
+}
+
+/* Write the last block and close the file. */
+int
+perf_pack_close(struct perf_pack_s *p)
+{
+	int ret = 0;
+
+	if (p->fd >= 0) {
+		if (p->error == 0)
+			flush_block(p);
+		if (p->error) {
+			fprintf(stderr, "perf_pack: %s\n", strerror(p->error));
+			ret = -1;
+		}
+		if (close(p->fd))
+			ret = -1;
+	}
+	for (int c = 0; c < PERF_PACK_CALLCHAIN; c++)
+		free(p->col[c]);
+	for (int i = 0; i < p->nattrs; i++)
+		free(p->attrs[i].ids);
+	free(p->nr);
+	free(p->ips);
+	free(p->buf);
+	p->fd	  = -1;
+	p->nattrs = 0;
+	p->buf	  = NULL;
+	p->ips	  = NULL;
+	p->nr	  = NULL;
+	memset(p->col, 0, sizeof(p->col));
+	return ret;
+}
+
+/* a parsed sample as the reader gives it back, for the tools reading both */
+void
+perf_pack_sample(struct perf_pack_sample_s *s, const struct perf_sample_s *in,
+		 uint64_t sample_type)
+{
+	memset(s, 0, sizeof(*s));
+	if (sample_type & PERF_SAMPLE_IDENTIFIER)
+		s->id = in->v[PERF_SF_IDENTIFIER];
+	else if (sample_type & PERF_SAMPLE_ID)
+		s->id = in->v[PERF_SF_ID];
+	if (sample_type & PERF_SAMPLE_TID) {
+		s->pid = perf_sample_pid(in);
+		s->tid = perf_sample_tid(in);
+	}
+	if (sample_type & PERF_SAMPLE_CPU)
+		s->cpu = perf_sample_cpu(in);
+	if (sample_type & PERF_SAMPLE_PERIOD)
+		s->period = in->v[PERF_SF_PERIOD];
+	if (sample_type & PERF_SAMPLE_TIME)
+		s->time = in->v[PERF_SF_TIME];
+	if (sample_type & PERF_SAMPLE_IP)
+		s->ip = in->v[PERF_SF_IP];
+	if (sample_type & PERF_SAMPLE_ADDR)
+		s->addr = in->v[PERF_SF_ADDR];
+	if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+		s->nr_ips = in->nr_ips;
+		s->ips	  = in->ips;
+	}
+}
+
+/*
+ * Reader
+ */
+
+void
+perf_pack_reader_close(struct perf_pack_reader_s *r)
+{
+	if (r->map && r->map != MAP_FAILED)
+		munmap(r->map, r->len);
+	for (int i = 0; i < r->nattrs; i++)
+		free(r->attrs[i].ids);
+	free(r->blocks);
+	r->map	   = NULL;
+	r->blocks  = NULL;
+	r->nblocks = 0;
+	r->nattrs  = 0;
+}
+
+/* the attrs of the header, returns where the blocks start or 0 */
+static size_t
+read_header(struct perf_pack_reader_s *r, const char *path)
+{
+	const unsigned char *m = r->map;
+	uint32_t attr_size, nattrs;
+	size_t pos = 24;
+
+	if (r->len < pos || memcmp(m, FILE_MAGIC, 8)) {
+		fprintf(stderr, "%s: not a pack file\n", path);
+		return 0;
+	}
+	memcpy(&r->sample_type, m + 8, 8);
+	memcpy(&attr_size, m + 16, 4);
+	memcpy(&nattrs, m + 20, 4);
+	if (nattrs > PERF_PACK_MAX_ATTRS || attr_size < PERF_ATTR_SIZE_VER0) {
+		fprintf(stderr, "%s: %u attrs of %u bytes\n", path, nattrs, attr_size);
+		return 0;
+	}
+	r->columns = columns_of(r->sample_type);
+
+	for (uint32_t i = 0; i < nattrs; i++) {
+		struct perf_pack_attr_s *a = &r->attrs[i];
+		size_t size = attr_size < sizeof(a->attr) ? attr_size : sizeof(a->attr);
+
+		if (pos + attr_size + 4 > r->len)
+			goto truncated;
+		memcpy(&a->attr, m + pos, size);
+		memcpy(&a->nids, m + pos + attr_size, 4);
+		pos += attr_size + 4;
+		if (a->nids > (r->len - pos) / sizeof(uint64_t))
+			goto truncated;
+		a->ids = malloc((a->nids ? a->nids : 1) * sizeof(uint64_t));
+		if (a->ids == NULL)
+			return 0;
+		memcpy(a->ids, m + pos, a->nids * sizeof(uint64_t));
+		pos += a->nids * sizeof(uint64_t);
+		r->nattrs++;
+	}
+	return pos;
+
+truncated:
+	fprintf(stderr, "%s: truncated header\n", path);
+	return 0;
+}
+
+/*
+ * Map a file and find its blocks, so they can be handed out to threads.
+ * A block cut short, by a writer that was killed, ends the file.
+ */
+int
+perf_pack_reader_open(struct perf_pack_reader_s *r, const char *path)
+{
+	struct stat st;
+	size_t pos, max = 0;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	r->len = st.st_size;
+	r->map = r->len ? mmap(NULL, r->len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		fprintf(stderr, "cannot map %s: %s\n", path, strerror(errno));
+		r->map = NULL;
+		return -1;
+	}
+	if ((pos = read_header(r, path)) == 0) {
+		perf_pack_reader_close(r);
+		return -1;
+	}
+
+	while (pos + BLOCK_HEADER <= r->len) {
+		const unsigned char *b = (const unsigned char *) r->map + pos;
+		uint32_t magic, samples, len, entries;
+
+		memcpy(&magic, b, 4);
+		memcpy(&samples, b + 4, 4);
+		memcpy(&len, b + 8, 4);
+		memcpy(&entries, b + 12, 4);
+		if (magic != PERF_PACK_MAGIC || samples > MAX_BLOCK) {
+			fprintf(stderr, "%s: bad block at %zu\n", path, pos);
+			r->errors++;
+			break;
+		}
+		if (len > r->len - pos - BLOCK_HEADER)
+			break;
+
+		if (r->nblocks == max) {
+			uint64_t *blocks;
+
+			max = max ? 2 * max : 1024;
+			blocks = realloc(r->blocks, max * sizeof(uint64_t));
+			if (blocks == NULL) {
+				perf_pack_reader_close(r);
+				return -1;
+			}
+			r->blocks = blocks;
+		}
+		r->blocks[r->nblocks++] = pos;
+		r->samples += samples;
+		if (samples > r->max_samples)
+			r->max_samples = samples;
+		if (entries > r->max_ips)
+			r->max_ips = entries;
+		pos += BLOCK_HEADER + len;
+	}
+	return 0;
+}
+
+/* the buffers of a thread decoding blocks */
+struct decoder_s {
+	pthread_t	 thread;
+	struct perf_pack_reader_s *r;
+	perf_pack_cb_t	 cb;
+	void		*arg;
+	size_t		*next;		/* block to take */
+	uint64_t	*col[PERF_PACK_CALLCHAIN];
+	uint32_t	*nr;
+	uint64_t	*ips;
+};
+
+static const unsigned char *
+get_dict(const unsigned char *p, const unsigned char *end, uint64_t *v, size_t n)
+{
+	uint64_t values[PERF_PACK_DICT], nvalues;
+	int64_t d;
+
+	if (p >= end)
+		return NULL;
+	if (*p++ == 1) {
+		uint64_t prev = 0;
+
+		for (size_t i = 0; i < n; prev = v[i++]) {
+			if ((p = perf_get_varint(p, end, &d)) == NULL)
+				return NULL;
+			v[i] = prev + d;
+		}
+		return p;
+	}
+
+	if ((p = perf_get_uvarint(p, end, &nvalues)) == NULL ||
+	    nvalues == 0 || nvalues > PERF_PACK_DICT)
+		return NULL;
+	for (uint64_t i = 0; i < nvalues; i++) {
+		if ((p = perf_get_uvarint(p, end, &values[i])) == NULL)
+			return NULL;
+	}
+	if (nvalues == 1) {
+		for (size_t i = 0; i < n; i++)
+			v[i] = values[0];
+		return p;
+	}
+	if ((size_t) (end - p) < n)
+		return NULL;
+	for (size_t i = 0; i < n; i++) {
+		if (p[i] >= nvalues)
+			return NULL;
+		v[i] = values[p[i]];
+	}
+	return p + n;
+}
+
+static const unsigned char *
+get_deltas(const unsigned char *p, const unsigned char *end, uint64_t *v, size_t n,
+	   uint64_t prev)
+{
+	int64_t d;
+
+	for (size_t i = 0; i < n; prev = v[i++]) {
+		if ((p = perf_get_varint(p, end, &d)) == NULL)
+			return NULL;
+		v[i] = prev + d;
+	}
+	return p;
+}
+
+static const unsigned char *
+get_callchains(struct decoder_s *d, const unsigned char *p, const unsigned char *end,
+	       size_t n, uint32_t entries)
+{
+	size_t off[CHAIN_SLOTS] = { 0 }, pos = 0;
+	uint32_t len[CHAIN_SLOTS] = { 0 };
+	uint64_t nr, same;
+	int64_t delta;
+
+	for (size_t i = 0; i < n; i++) {
+		unsigned int slot = d->r->columns & (1u << PERF_PACK_TID) ?
+			chain_slot(d->col[PERF_PACK_TID][i]) : 0;
+		uint64_t *ips = d->ips + pos, prev = 0;
+
+		if ((p = perf_get_uvarint(p, end, &nr)) == NULL ||
+		    (p = perf_get_uvarint(p, end, &same)) == NULL ||
+		    nr > entries - pos || same > nr || same > len[slot])
+			return NULL;
+		for (uint64_t j = 0; j < nr - same; prev = ips[j++]) {
+			if ((p = perf_get_varint(p, end, &delta)) == NULL)
+				return NULL;
+			ips[j] = prev + delta;
+		}
+		memcpy(ips + nr - same, d->ips + off[slot] + len[slot] - same,
+		       same * sizeof(uint64_t));
+
+		d->nr[i]  = nr;
+		off[slot] = pos;
+		len[slot] = nr;
+		pos += nr;
+	}
+	return pos == entries ? p : NULL;
+}
+
+static int
+decode_block(struct decoder_s *d, size_t offset)
+{
+	const unsigned char *p = (const unsigned char *) d->r->map + offset, *end;
+	uint32_t columns = d->r->columns, samples, len, entries;
+	struct perf_pack_sample_s s;
+	uint64_t first;
+	size_t pos = 0;
+
+	memcpy(&samples, p + 4, 4);
+	memcpy(&len, p + 8, 4);
+	memcpy(&entries, p + 12, 4);
+	memcpy(&first, p + 16, 8);
+	end = p + BLOCK_HEADER + len;
+	p  += BLOCK_HEADER;
+
+	for (int c = PERF_PACK_ID; c <= PERF_PACK_PERIOD && p; c++) {
+		if (columns & (1u << c))
+			p = get_dict(p, end, d->col[c], samples);
+		else
+			memset(d->col[c], 0, samples * sizeof(uint64_t));
+	}
+	if (p && (columns & (1u << PERF_PACK_TIME)))
+		p = get_deltas(p, end, d->col[PERF_PACK_TIME], samples, first);
+	if (p && (columns & (1u << PERF_PACK_IP)))
+		p = get_deltas(p, end, d->col[PERF_PACK_IP], samples, 0);
+	if (p && (columns & (1u << PERF_PACK_ADDR)))
+		p = get_deltas(p, end, d->col[PERF_PACK_ADDR], samples, 0);
+	if (p && (columns & (1u << PERF_PACK_CALLCHAIN)))
+		p = get_callchains(d, p, end, samples, entries);
+	if (p == NULL)
+		return -1;
+
+	memset(&s, 0, sizeof(s));
+	for (uint32_t i = 0; i < samples; i++) {
+		uint64_t tid = d->col[PERF_PACK_TID][i];
+
+		s.id	 = d->col[PERF_PACK_ID][i];
+		s.pid	 = (uint32_t) tid;
+		s.tid	 = tid >> 32;
+		s.cpu	 = (uint32_t) d->col[PERF_PACK_CPU][i];
+		s.period = d->col[PERF_PACK_PERIOD][i];
+		s.time	 = columns & (1u << PERF_PACK_TIME) ? d->col[PERF_PACK_TIME][i] : 0;
+		s.ip	 = columns & (1u << PERF_PACK_IP) ? d->col[PERF_PACK_IP][i] : 0;
+		s.addr	 = columns & (1u << PERF_PACK_ADDR) ? d->col[PERF_PACK_ADDR][i] : 0;
+		if (columns & (1u << PERF_PACK_CALLCHAIN)) {
+			s.nr_ips = d->nr[i];
+			s.ips	 = d->ips + pos;
+			pos	+= d->nr[i];
+		}
+		d->cb(&s, d->arg);
+	}
+	return 0;
+}
+
+static void *
+read_thread(void *arg)
+{
+	struct decoder_s *d = arg;
+	size_t b;
+
+	while ((b = __atomic_fetch_add(d->next, 1, __ATOMIC_RELAXED)) < d->r->nblocks) {
+		if (decode_block(d, d->r->blocks[b]))
+			__atomic_add_fetch(&d->r->errors, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void
+free_decoder(struct decoder_s *d)
+{
+	for (int c = 0; c < PERF_PACK_CALLCHAIN; c++)
+		free(d->col[c]);
+	free(d->nr);
+	free(d->ips);
+}
+
+/*
+ * Decode every block with nthreads threads, each taking the next block
+ * not taken. cb() is called on the thread that decoded the sample, with
+ * args[thread] (NULL without args): the samples of a block come in
+ * order, the blocks in any. Returns -1 if a thread could not start, the
+ * corrupt blocks are skipped and counted in errors.
+ */
+int
+perf_pack_read(struct perf_pack_reader_s *r, int nthreads, perf_pack_cb_t cb, void **args)
+{
+	struct decoder_s *d;
+	size_t next = 0;
+	int started = 0, ret = 0;
+
+	if (nthreads <= 0)
+		nthreads = 1;
+	d = calloc(nthreads, sizeof(*d));
+	if (d == NULL)
+		return -1;
+
+	for (int i = 0; i < nthreads; i++) {
+		d[i].r	  = r;
+		d[i].cb	  = cb;
+		d[i].arg  = args ? args[i] : NULL;
+		d[i].next = &next;
+		for (int c = 0; c < PERF_PACK_CALLCHAIN; c++)
+			d[i].col[c] = malloc((r->max_samples ? r->max_samples : 1) * sizeof(uint64_t));
+		d[i].nr	 = malloc((r->max_samples ? r->max_samples : 1) * sizeof(uint32_t));
+		d[i].ips = malloc((r->max_ips ? r->max_ips : 1) * sizeof(uint64_t));
+		for (int c = 0; c < PERF_PACK_CALLCHAIN; c++) {
+			if (d[i].col[c] == NULL || d[i].nr == NULL || d[i].ips == NULL) {
+				fprintf(stderr, "perf_pack: cannot allocate %u samples\n",
+					r->max_samples);
+				ret = -1;
+				goto out;
+			}
+		}
+	}
+
+	for (started = 0; started < nthreads; started++) {
+		if (pthread_create(&d[started].thread, NULL, read_thread, &d[started])) {
+			fprintf(stderr, "perf_pack: cannot start thread %d\n", started);
+			ret = -1;
+			break;
+		}
+	}
+	for (int i = 0; i < started; i++)
+		pthread_join(d[i].thread, NULL);
+
+out:
+	for (int i = 0; i < nthreads; i++)
+		free_decoder(&d[i]);
+	free(d);
+	return ret;
+}
@@ -0,0 +1,152 @@
+/*
+ * Packed sample files: PERF_RECORD_SAMPLEs stored column by column in
+ * blocks that decode on their own, several times smaller than the
+ * records, and read back by as many threads as there are cores.
+ *
+ *   perf_pack_open(&p, "samples.pack", 0);
+ *   perf_pack_add_attr(&p, &attr, &id, 1);          every event, first
+ *   perf_ring_drain(&ring, perf_pack_cb, &p);       or perf_pack_record()
+ *   perf_pack_close(&p);
+ *
+ *   perf_pack_reader_open(&r, "samples.pack");
+ *   perf_pack_read(&r, nthreads, count_sample, args);  args[i] for thread i
+ *   perf_pack_reader_close(&r);
+ *
+ * The writer encodes and writes a block once it has block_samples, in
+ * the calling thread: feed it from a collector thread or offline, not
+ * from a signal handler. The events must share their sample_type; the
+ * IDENTIFIER (or ID), IP, TID, TIME, ADDR, CPU, PERIOD and CALLCHAIN of
+ * the samples are kept, the rest of the record is not.
+ *
+ * The file, in the byte order of the host:
+ *
+ *   "PERFPAK1", u64 sample_type, u32 attr size, u32 number of attrs,
+ *   then for every attr: the perf_event_attr, u32 number of ids, the ids
+ *
+ *   block: u32 PERF_PACK_MAGIC, u32 samples, u32 bytes of columns,
+ *   u32 callchain entries, u64 time of the first sample, then one column
+ *   per field of the sample_type, in the order of enum perf_pack_column
+ *
+ * Numbers are varints, signed ones zigzag encoded. The id, tid, cpu and
+ * period columns are dictionaries: a u8 0, the number of values and the
+ * values, then, unless there is only one, the u8 index of every sample;
+ * or, past PERF_PACK_DICT values in the block, a u8 1 and the values as
+ * the time column. The tid and cpu are the u64 of the record, the pid
+ * and the cpu in its low half. The time, ip and addr columns hold the
+ * difference with the previous sample, the first time with the one of
+ * the block. A callchain is its number of entries, how many of its
+ * outermost entries are the same as the last callchain of the same
+ * thread in the block, and the others, innermost first, each as the
+ * difference with the entry before it. Nothing refers to another block.
+ */
+
+#ifndef PERF_PACK_H
+#define PERF_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/perf_event.h>
+
+#include "perf_ring.h"
+
+#define PERF_PACK_MAGIC		0x31424b50	/* "PKB1" */
+#define PERF_PACK_BLOCK		4096		/* samples, by default */
+#define PERF_PACK_DICT		256		/* values of a dictionary */
+#define PERF_PACK_MAX_ATTRS	64
+
+enum perf_pack_column {
+	PERF_PACK_ID,
+	PERF_PACK_TID,
+	PERF_PACK_CPU,
+	PERF_PACK_PERIOD,
+	PERF_PACK_TIME,
+	PERF_PACK_IP,
+	PERF_PACK_ADDR,
+	PERF_PACK_CALLCHAIN,
+	PERF_PACK_NR
+};
+
+/* a decoded sample, the fields not in the sample_type are 0 */
+struct perf_pack_sample_s {
+	uint64_t	 id;
+	uint32_t	 pid;
+	uint32_t	 tid;
+	uint32_t	 cpu;
+	uint64_t	 period;
+	uint64_t	 time;
+	uint64_t	 ip;
+	uint64_t	 addr;
+	uint64_t	 nr_ips;
+	const uint64_t	*ips;
+};
+
+struct perf_pack_attr_s {
+	struct perf_event_attr attr;
+	uint64_t	*ids;
+	uint32_t	 nids;
+};
+
+struct perf_pack_s {
+	int		 fd;
+	size_t		 block_samples;
+	uint64_t	 sample_type;
+	uint32_t	 columns;	/* 1 << enum perf_pack_column */
+	struct perf_sample_layout_s layout;
+
+	struct perf_pack_attr_s attrs[PERF_PACK_MAX_ATTRS];
+	int		 nattrs;
+	int		 started;	/* the header is written */
+
+	/* the samples of the block, by column */
+	size_t		 n;
+	uint64_t	*col[PERF_PACK_CALLCHAIN];
+	uint32_t	*nr;		/* callchain entries of each sample */
+	uint64_t	*ips;		/* all of them */
+	size_t		 nips;
+	size_t		 max_ips;
+	unsigned char	*buf;		/* the encoded block */
+	size_t		 bufsize;
+
+	uint64_t	 samples;
+	uint64_t	 blocks;
+	uint64_t	 bytes;		/* of the file */
+	uint64_t	 record_bytes;	/* of the samples it got */
+	uint64_t	 skipped;	/* records other than samples, or unparsable */
+	int		 error;		/* errno of the first failed write */
+};
+
+typedef void (*perf_pack_cb_t)(const struct perf_pack_sample_s *s, void *arg);
+
+struct perf_pack_reader_s {
+	void		*map;
+	size_t		 len;
+
+	uint64_t	 sample_type;
+	uint32_t	 columns;
+	struct perf_pack_attr_s attrs[PERF_PACK_MAX_ATTRS];
+	int		 nattrs;
+
+	uint64_t	*blocks;	/* offsets */
+	size_t		 nblocks;
+	uint64_t	 samples;
+	uint32_t	 max_samples;	/* of a block */
+	uint32_t	 max_ips;
+
+	uint64_t	 errors;	/* corrupt blocks */
+};
+
+int	perf_pack_open(struct perf_pack_s *p, const char *path, size_t block_samples);
+int	perf_pack_add_attr(struct perf_pack_s *p, const struct perf_event_attr *attr,
+			   const uint64_t *ids, uint32_t nids);
+int	perf_pack_record(struct perf_pack_s *p, const struct perf_event_header *hdr);
+void	perf_pack_cb(const struct perf_event_header *hdr, void *arg);
+int	perf_pack_close(struct perf_pack_s *p);
+void	perf_pack_sample(struct perf_pack_sample_s *s, const struct perf_sample_s *in,
+			 uint64_t sample_type);
+
+int	perf_pack_reader_open(struct perf_pack_reader_s *r, const char *path);
+int	perf_pack_read(struct perf_pack_reader_s *r, int nthreads, perf_pack_cb_t cb, void **args);
+void	perf_pack_reader_close(struct perf_pack_reader_s *r);
+
+#endif
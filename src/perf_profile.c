@@ -0,0 +1,366 @@
+/*
+ * Callchain profile.
+ * See perf_profile.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+
+#include "perf_hash.h"
+#include "perf_profile.h"
+
+/* deeper chains are cut, the kernel default is 127 */
+#define MAX_DEPTH	256
+
+/* frames printed per callchain */
+#define PRINT_DEPTH	8
+
+int
+perf_profile_init(struct perf_profile_s *p, size_t max_chains, size_t max_ips)
+{
+	memset(p, 0, sizeof(*p));
+
+	if (max_chains & (max_chains - 1)) {
+		fprintf(stderr, "profile chains must be a power of 2: %zu\n", max_chains);
+		return -1;
+	}
+
+	/* mapped up front, only the pages used get faulted in */
+	p->chains = mmap(NULL, max_chains * sizeof(struct perf_chain_s), PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	p->ips	  = mmap(NULL, max_ips * sizeof(uint64_t), PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (p->chains == MAP_FAILED || p->ips == MAP_FAILED) {
+		fprintf(stderr, "cannot map the profile: %s\n", strerror(errno));
+		if (p->chains != MAP_FAILED)
+			munmap(p->chains, max_chains * sizeof(struct perf_chain_s));
+		if (p->ips != MAP_FAILED)
+			munmap(p->ips, max_ips * sizeof(uint64_t));
+		memset(p, 0, sizeof(*p));
+		return -1;
+	}
+	p->max_chains = max_chains;
+	p->max_ips    = max_ips;
+	return 0;
+}
+
+void
+perf_profile_fini(struct perf_profile_s *p)
+{
+	if (p->chains)
+		munmap(p->chains, p->max_chains * sizeof(struct perf_chain_s));
+	if (p->ips)
+		munmap(p->ips, p->max_ips * sizeof(uint64_t));
+	memset(p, 0, sizeof(*p));
+}
+
+static uint64_t
+hash_ips(const uint64_t *ips, size_t n)
+{
+	uint64_t h = 0xcbf29ce484222325ull;	/* FNV-1a */
+
+	for (size_t i = 0; i < n; i++) {
+		h ^= ips[i];
+		h *= 0x100000001b3ull;
+	}
+	return h ? h : 1;
+}
+
+struct chain_key_s {
+	struct perf_profile_s	*p;
+	const uint64_t		*ips;
+	size_t			 n;
+};
+
+/* the chains whose hashes collide */
+static int
+chain_match(const void *entry, const void *arg)
+{
+	const struct perf_chain_s *c = entry;
+	const struct chain_key_s *k = arg;
+
+	return c->nr == k->n && memcmp(&k->p->ips[c->off], k->ips, k->n * sizeof(uint64_t)) == 0;
+}
+
+/*
+ * Account a sample to its chain, leaf first as the kernel writes it.
+ * The PERF_CONTEXT_* markers are left out. Async-signal-safe.
+ * Returns the chain, NULL if the profile is full.
+ */
+struct perf_chain_s *
+perf_profile_add_chain(struct perf_profile_s *p, const uint64_t *ips, uint64_t nr,
+		       uint64_t period)
+{
+	uint64_t buf[MAX_DEPTH];
+	size_t n = 0;
+
+	for (uint64_t i = 0; i < nr && n < MAX_DEPTH; i++) {
+		if (ips[i] < PERF_CONTEXT_MAX)
+			buf[n++] = ips[i];
+	}
+
+	p->samples++;
+	p->period += period;
+
+	/* at most half full, the chains are looked up for every sample */
+	struct chain_key_s key = { p, buf, n };
+	uint64_t hash = hash_ips(buf, n);
+	int fresh, room = 2 * (p->nchains + 1) <= p->max_chains && p->nips + n <= p->max_ips;
+	struct perf_chain_s *c = perf_hash_get(p->chains, sizeof(*c), p->max_chains, &p->nchains,
+					       hash, hash, room, chain_match, &key, &fresh);
+
+	if (c == NULL) {
+		p->dropped++;
+		return NULL;
+	}
+	if (fresh) {
+		memcpy(&p->ips[p->nips], buf, n * sizeof(uint64_t));
+		c->nr  = n;
+		c->off = p->nips;
+		p->nips += n;
+	}
+	c->samples++;
+	c->period += period;
+	return c;
+}
+
+int
+perf_profile_add(struct perf_profile_s *p, const uint64_t *ips, uint64_t nr, uint64_t period)
+{
+	return perf_profile_add_chain(p, ips, nr, period) ? 0 : -1;
+}
+
+struct func_s {
+	uint64_t	 key;
+	int		 used;
+	char		*label;
+	uint64_t	 self;
+	uint64_t	 total;
+	uint64_t	 samples;	/* as the leaf */
+	size_t		 last;		/* last chain counted in total, plus one */
+};
+
+struct path_s {
+	uint64_t	 hash;
+	size_t		 chain;		/* a raw chain with this symbolized path */
+	uint64_t	 samples;
+	uint64_t	 period;
+};
+
+static const char *
+basename_of(const char *path)
+{
+	const char *s = strrchr(path, '/');
+	return s ? s + 1 : path;
+}
+
+static char *
+make_label(const struct perf_frame_s *f)
+{
+	char *label;
+	int ret;
+
+	if (f->sym)
+		ret = asprintf(&label, "%s (%s)", f->sym, basename_of(f->dso));
+	else if (f->dso)
+		ret = asprintf(&label, "[%s+0x%"PRIx64"]", basename_of(f->dso), f->off);
+	else
+		ret = asprintf(&label, "[unknown 0x%"PRIx64"]", f->ip);
+	return ret < 0 ? NULL : label;
+}
+
+static const struct perf_profile_s *sort_profile;
+
+static uint64_t
+weight(uint64_t samples, uint64_t period)
+{
+	return sort_profile->period ? period : samples;
+}
+
+static int
+cmp_func(const void *a, const void *b)
+{
+	const struct func_s *x = *(struct func_s * const *)a, *y = *(struct func_s * const *)b;
+
+	if (x->self != y->self)
+		return x->self < y->self ? 1 : -1;
+	return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+static int
+cmp_path(const void *a, const void *b)
+{
+	const struct path_s *x = a, *y = b;
+	uint64_t wx = weight(x->samples, x->period), wy = weight(y->samples, y->period);
+
+	return wx < wy ? 1 : wx > wy ? -1 : 0;
+}
+
+static size_t
+next_pow2(size_t n)
+{
+	size_t s = 1;
+
+	while (s < n)
+		s <<= 1;
+	return s;
+}
+
+/*
+ * Resolve every distinct IP, then print the functions by self samples
+ * (the leaf of the chain) with their total (anywhere in the chain), and
+ * the callchains merged by function, heaviest first.
+ */
+void
+perf_profile_report(struct perf_profile_s *p, struct perf_symtab_s *st, FILE *out, int top)
+{
+	struct timespec t0, t1;
+	size_t nfuncs = 0, npaths = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	sort_profile = p;
+
+	/* ip -> function */
+	size_t fsize = next_pow2(2 * p->nips + 2);
+	struct func_s *funcs = calloc(fsize, sizeof(struct func_s));
+	uint32_t *fid = malloc((p->nips + 1) * sizeof(uint32_t));
+
+	for (size_t i = 0; i < p->nips; i++) {
+		const struct perf_frame_s *f = perf_symtab_resolve(st, p->ips[i]);
+		uint64_t key = f->id ? (uintptr_t) f->id : f->ip;
+		size_t h = (key * 0x9e3779b97f4a7c15ull) >> 20;
+
+		for (;; h++) {
+			struct func_s *fn = &funcs[h & (fsize - 1)];
+
+			if (!fn->used) {
+				fn->used  = 1;
+				fn->key	  = key;
+				fn->label = make_label(f);
+				nfuncs++;
+				break;
+			}
+			if (fn->key == key)
+				break;
+		}
+		fid[i] = h & (fsize - 1);
+	}
+
+	/* chains -> functions, and chains merged by function */
+	size_t psize = next_pow2(2 * p->nchains + 2);
+	struct path_s *paths = calloc(psize, sizeof(struct path_s));
+
+	for (size_t c = 0, seen = 0; c < p->max_chains && seen < p->nchains; c++) {
+		const struct perf_chain_s *chain = &p->chains[c];
+
+		if (chain->hash == 0)
+			continue;
+		seen++;
+
+		uint64_t w = weight(chain->samples, chain->period);
+		if (chain->nr) {
+			funcs[fid[chain->off]].self    += w;
+			funcs[fid[chain->off]].samples += chain->samples;
+		}
+
+		uint64_t h = 0xcbf29ce484222325ull;
+		for (uint32_t i = 0; i < chain->nr; i++) {
+			struct func_s *fn = &funcs[fid[chain->off + i]];
+
+			if (fn->last != c + 1) {
+				fn->total += w;
+				fn->last   = c + 1;
+			}
+			h ^= fid[chain->off + i];
+			h *= 0x100000001b3ull;
+		}
+
+		for (size_t j = h;; j++) {
+			struct path_s *path = &paths[j & (psize - 1)];
+
+			if (path->samples == 0) {
+				path->hash  = h;
+				path->chain = c;
+				npaths++;
+			} else {
+				const struct perf_chain_s *o = &p->chains[path->chain];
+				int same = path->hash == h && o->nr == chain->nr;
+
+				for (uint32_t i = 0; same && i < chain->nr; i++)
+					same = fid[o->off + i] == fid[chain->off + i];
+				if (!same)
+					continue;
+			}
+			path->samples += chain->samples;
+			path->period  += chain->period;
+			break;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	uint64_t total = p->period ? p->period : p->samples;
+	if (total == 0)
+		total = 1;
+
+	fprintf(out, "\n%"PRIu64" samples, %zu callchains, %zu distinct ips, %zu functions\n",
+		p->samples, p->nchains, (size_t) st->misses, nfuncs);
+	fprintf(out, "resolved in %.3f ms (%"PRIu64" cache hits)\n",
+		(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) * 1e-6, st->hits);
+	if (p->dropped)
+		fprintf(out, "%"PRIu64" samples dropped, profile full\n", p->dropped);
+
+	/* functions */
+	struct func_s **sorted = malloc((nfuncs + 1) * sizeof(struct func_s *));
+	size_t n = 0;
+	for (size_t i = 0; i < fsize; i++) {
+		if (funcs[i].used)
+			sorted[n++] = &funcs[i];
+	}
+	qsort(sorted, n, sizeof(struct func_s *), cmp_func);
+
+	fprintf(out, "\n  self%%  total%%   samples  function\n");
+	for (size_t i = 0; i < n && (int) i < top; i++) {
+		fprintf(out, "%6.2f%% %6.2f%% %9"PRIu64"  %s\n",
+			100.0 * sorted[i]->self / total, 100.0 * sorted[i]->total / total,
+			sorted[i]->samples, sorted[i]->label ? sorted[i]->label : "?");
+	}
+
+	/* callchains */
+	struct path_s *plist = malloc((npaths + 1) * sizeof(struct path_s));
+	n = 0;
+	for (size_t i = 0; i < psize; i++) {
+		if (paths[i].samples)
+			plist[n++] = paths[i];
+	}
+	qsort(plist, n, sizeof(struct path_s), cmp_path);
+
+	fprintf(out, "\n     %%   samples  callchain\n");
+	for (size_t i = 0; i < n && (int) i < top; i++) {
+		const struct perf_chain_s *chain = &p->chains[plist[i].chain];
+
+		fprintf(out, "%6.2f%% %9"PRIu64"  ",
+			100.0 * weight(plist[i].samples, plist[i].period) / total, plist[i].samples);
+		for (uint32_t j = 0; j < chain->nr && j < PRINT_DEPTH; j++) {
+			const char *label = funcs[fid[chain->off + j]].label;
+			fprintf(out, "%s%s", j ? " <- " : "", label ? label : "?");
+		}
+		fprintf(out, "%s\n", chain->nr > PRINT_DEPTH ? " <- ..." : "");
+	}
+
+	for (size_t i = 0; i < fsize; i++)
+		free(funcs[i].label);
+	free(plist);
+	free(sorted);
+	free(paths);
+	free(funcs);
+	free(fid);
+}
@@ -0,0 +1,59 @@
+/*
+ * Callchain profile: sample totals per distinct callchain, reported per
+ * function and per symbolized callchain.
+ *
+ * perf_profile_add() only stores the raw IPs. It works on memory mapped
+ * by perf_profile_init() and never allocates, so it can be called from
+ * the signal handler that drains the ring (one thread at a time). All
+ * the symbol work is left to perf_profile_report(), which resolves each
+ * distinct IP once through a perf_symtab_s:
+ *
+ *   perf_profile_init(&p, 1 << 16, 1 << 20);
+ *   ... in the handler, for every sample:
+ *   perf_profile_add(&p, sample.ips, sample.nr_ips, sample.v[PERF_SF_PERIOD]);
+ *   ... at the end of the run:
+ *   perf_symtab_init(&st, 0);
+ *   perf_profile_report(&p, &st, stdout, 20);
+ */
+
+#ifndef PERF_PROFILE_H
+#define PERF_PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "perf_symtab.h"
+
+struct perf_chain_s {
+	uint64_t	hash;		/* 0: free slot */
+	uint64_t	samples;
+	uint64_t	period;
+	uint32_t	nr;
+	uint32_t	off;		/* first IP in ips[] */
+};
+
+struct perf_profile_s {
+	struct perf_chain_s *chains;	/* open addressing */
+	size_t		 max_chains;	/* power of 2 */
+	size_t		 nchains;
+
+	uint64_t	*ips;		/* the IPs of every chain, leaf first */
+	size_t		 max_ips;
+	size_t		 nips;
+
+	uint64_t	 samples;
+	uint64_t	 period;
+	uint64_t	 dropped;	/* no room left for a new chain */
+};
+
+int	perf_profile_init(struct perf_profile_s *p, size_t max_chains, size_t max_ips);
+void	perf_profile_fini(struct perf_profile_s *p);
+
+int	perf_profile_add(struct perf_profile_s *p, const uint64_t *ips, uint64_t nr,
+			 uint64_t period);
+struct perf_chain_s *perf_profile_add_chain(struct perf_profile_s *p, const uint64_t *ips,
+					    uint64_t nr, uint64_t period);
+void	perf_profile_report(struct perf_profile_s *p, struct perf_symtab_s *st,
+			    FILE *out, int top);
+
+#endif
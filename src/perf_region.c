@@ -0,0 +1,405 @@
+/*
+ * Region counting with userspace counter reads.
+ * See perf_region.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "perf_region.h"
+
+#define barrier()	asm volatile("" ::: "memory")
+
+struct event_name_s {
+	const char	*name;
+	uint32_t	 type;
+	uint64_t	 config;
+};
+
+static const struct event_name_s event_names[] = {
+	{ "cycles",			PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions",		PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache-references",		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+	{ "cache-misses",		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "branches",			PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	{ "branch-misses",		PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ "bus-cycles",			PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES },
+	{ "stalled-cycles-frontend",	PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+	{ "stalled-cycles-backend",	PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+	{ "ref-cycles",			PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES },
+	{ "cpu-clock",			PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK },
+	{ "task-clock",			PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "page-faults",		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ "minor-faults",		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN },
+	{ "major-faults",		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+	{ "context-switches",		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu-migrations",		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+};
+
+static __thread struct perf_region_thread_s *self;
+
+/* the totals of the threads closed so far */
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct perf_region_s totals[PERF_REGION_MAX];
+static char *region_names[PERF_REGION_MAX];
+static char *event_list[PERF_REGION_MAX_EVENTS];
+static int num_events;
+static uint64_t total_reads, total_fallbacks;
+
+static inline
+int sys_perf_event_open(struct perf_event_attr *attr, pid_t pid,
+			int cpu, int group_fd, unsigned long flags)
+{
+	attr->size = sizeof(*attr);
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+/*
+ * Fill the type and config of attr from a generic name or rNNNN, so the
+ * counting tools take the same names as perf_region_open().
+ */
+int
+perf_region_event(const char *name, struct perf_event_attr *attr)
+{
+	for (size_t i = 0; i < sizeof(event_names) / sizeof(event_names[0]); i++) {
+		if (strcmp(name, event_names[i].name) == 0) {
+			attr->type   = event_names[i].type;
+			attr->config = event_names[i].config;
+			return 0;
+		}
+	}
+
+	if (name[0] == 'r' && name[1]) {
+		char *end;
+		attr->type   = PERF_TYPE_RAW;
+		attr->config = strtoull(name + 1, &end, 16);
+		if (*end == '\0')
+			return 0;
+	}
+
+	fprintf(stderr, "unknown event %s\n", name);
+	return -1;
+}
+
+/*
+ * The other way around, for the tools reading attrs back from a file:
+ * the generic name, rNNNN, or type:config. Returns buf.
+ */
+const char *
+perf_region_event_name(const struct perf_event_attr *attr, char *buf, size_t len)
+{
+	for (size_t i = 0; i < sizeof(event_names) / sizeof(event_names[0]); i++) {
+		if (attr->type == event_names[i].type && attr->config == event_names[i].config) {
+			snprintf(buf, len, "%s", event_names[i].name);
+			return buf;
+		}
+	}
+
+	if (attr->type == PERF_TYPE_RAW)
+		snprintf(buf, len, "r%llx", (unsigned long long) attr->config);
+	else
+		snprintf(buf, len, "%u:%#llx", attr->type, (unsigned long long) attr->config);
+	return buf;
+}
+
+static void
+close_thread(struct perf_region_thread_s *t)
+{
+	for (int i = 0; i < t->nevents; i++) {
+		if (t->pc[i])
+			munmap(t->pc[i], getpagesize());
+		if (t->fd[i] >= 0)
+			close(t->fd[i]);
+	}
+	free(t);
+}
+
+/*
+ * Open the group on the calling thread, events is a comma separated
+ * list of names. Every thread should use the same list.
+ */
+int
+perf_region_open(const char *events, int flags)
+{
+	struct perf_region_thread_s *t;
+	char *list, *name, *save;
+
+	if (self) {
+		fprintf(stderr, "perf_region: already open on this thread\n");
+		return -1;
+	}
+
+	t = calloc(1, sizeof(*t));
+	list = strdup(events);
+	if (t == NULL || list == NULL) {
+		free(t);
+		free(list);
+		return -1;
+	}
+	for (int i = 0; i < PERF_REGION_MAX_EVENTS; i++)
+		t->fd[i] = -1;
+
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		struct perf_event_attr attr;
+		int i = t->nevents;
+
+		if (i == PERF_REGION_MAX_EVENTS) {
+			fprintf(stderr, "perf_region: at most %d events\n", PERF_REGION_MAX_EVENTS);
+			goto fail;
+		}
+
+		memset(&attr, 0, sizeof(attr));
+		if (perf_region_event(name, &attr))
+			goto fail;
+		attr.disabled	 = (i == 0);	/* the leader starts them all */
+		attr.exclude_hv	 = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+
+		t->fd[i] = sys_perf_event_open(&attr, 0, -1, i ? t->fd[0] : -1, 0);
+		if (t->fd[i] < 0 && errno == EACCES) {
+			/* perf_event_paranoid only lets us count userspace */
+			attr.exclude_kernel = 1;
+			t->fd[i] = sys_perf_event_open(&attr, 0, -1, i ? t->fd[0] : -1, 0);
+		}
+		if (t->fd[i] < 0) {
+			fprintf(stderr, "perf_region: cannot open %s: %s\n", name, strerror(errno));
+			goto fail;
+		}
+		t->nevents++;
+
+		t->pc[i] = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, t->fd[i], 0);
+		if (t->pc[i] == MAP_FAILED) {
+			t->pc[i] = NULL;
+			fprintf(stderr, "perf_region: cannot mmap %s: %s\n", name, strerror(errno));
+			goto fail;
+		}
+
+		pthread_mutex_lock(&totals_lock);
+		if (num_events == i) {
+			event_list[i] = strdup(name);
+			num_events++;
+		}
+		pthread_mutex_unlock(&totals_lock);
+	}
+	free(list);
+
+	if (t->nevents == 0) {
+		free(t);
+		return -1;
+	}
+
+	if (ioctl(t->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)) {
+		fprintf(stderr, "perf_region: cannot enable: %s\n", strerror(errno));
+		close_thread(t);
+		return -1;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	t->rdpmc = !(flags & PERF_REGION_NO_RDPMC);
+	for (int i = 0; i < t->nevents; i++) {
+		if (!t->pc[i]->cap_user_rdpmc)
+			t->rdpmc = 0;
+	}
+#endif
+
+	self = t;
+	return 0;
+
+fail:
+	free(list);
+	close_thread(t);
+	return -1;
+}
+
+/* the leader and all its members, in one syscall */
+static void
+read_group(struct perf_region_thread_s *t, uint64_t *v)
+{
+	uint64_t buf[1 + PERF_REGION_MAX_EVENTS];
+
+	t->fallbacks++;
+	if (read(t->fd[0], buf, sizeof(buf)) < (ssize_t) sizeof(uint64_t)) {
+		memset(v, 0, t->nevents * sizeof(uint64_t));
+		return;
+	}
+	memcpy(v, &buf[1], t->nevents * sizeof(uint64_t));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t
+rdpmc(uint32_t counter)
+{
+	uint32_t lo, hi;
+
+	asm volatile("rdpmc" : "=a" (lo), "=d" (hi) : "c" (counter));
+	return lo | ((uint64_t) hi << 32);
+}
+
+/*
+ * The self-monitoring read documented in linux/perf_event.h, retried
+ * while pc->lock moves. Fails when the counter is not on the pmu right
+ * now, or when it counts another thread.
+ */
+int
+perf_region_read_user(struct perf_event_mmap_page *pc, uint64_t *value)
+{
+	uint32_t seq, idx;
+	int64_t count;
+	uint16_t width;
+
+	do {
+		seq = pc->lock;
+		barrier();
+
+		idx = pc->index;
+		if (idx == 0)
+			return -1;
+
+		width  = pc->pmc_width;
+		count  = rdpmc(idx - 1);
+		count <<= 64 - width;
+		count >>= 64 - width;	/* sign extend */
+		count += pc->offset;
+
+		barrier();
+	} while (pc->lock != seq);
+
+	*value = count;
+	return 0;
+}
+#else
+int
+perf_region_read_user(struct perf_event_mmap_page *pc, uint64_t *value)
+{
+	return -1;
+}
+#endif
+
+static inline void
+read_counters(struct perf_region_thread_s *t, uint64_t *v)
+{
+	t->reads++;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (t->rdpmc) {
+		int i;
+
+		for (i = 0; i < t->nevents; i++) {
+			if (perf_region_read_user(t->pc[i], &v[i]))
+				break;
+		}
+		if (i == t->nevents)
+			return;
+	}
+#endif
+	read_group(t, v);
+}
+
+void
+perf_region_begin(int region)
+{
+	struct perf_region_thread_s *t = self;
+
+	if (t == NULL || region < 0 || region >= PERF_REGION_MAX)
+		return;
+	read_counters(t, t->regions[region].start);
+}
+
+void
+perf_region_end(int region)
+{
+	struct perf_region_thread_s *t = self;
+	uint64_t v[PERF_REGION_MAX_EVENTS];
+
+	if (t == NULL || region < 0 || region >= PERF_REGION_MAX)
+		return;
+	read_counters(t, v);
+
+	struct perf_region_s *r = &t->regions[region];
+	for (int i = 0; i < t->nevents; i++)
+		r->count[i] += v[i] - r->start[i];
+	r->calls++;
+}
+
+struct perf_region_thread_s *
+perf_region_self(void)
+{
+	return self;
+}
+
+/* Close the group of the calling thread and add its counts to the totals */
+void
+perf_region_close(void)
+{
+	struct perf_region_thread_s *t = self;
+
+	if (t == NULL)
+		return;
+
+	pthread_mutex_lock(&totals_lock);
+	for (int r = 0; r < PERF_REGION_MAX; r++) {
+		totals[r].calls += t->regions[r].calls;
+		for (int i = 0; i < t->nevents; i++)
+			totals[r].count[i] += t->regions[r].count[i];
+	}
+	total_reads	+= t->reads;
+	total_fallbacks += t->fallbacks;
+	pthread_mutex_unlock(&totals_lock);
+
+	self = NULL;
+	close_thread(t);
+}
+
+void
+perf_region_name(int region, const char *name)
+{
+	if (region < 0 || region >= PERF_REGION_MAX)
+		return;
+
+	pthread_mutex_lock(&totals_lock);
+	free(region_names[region]);
+	region_names[region] = strdup(name);
+	pthread_mutex_unlock(&totals_lock);
+}
+
+/* The totals of the threads closed so far, per region and per call */
+void
+perf_region_report(FILE *out)
+{
+	pthread_mutex_lock(&totals_lock);
+
+	fprintf(out, "%-16s %10s", "region", "calls");
+	for (int i = 0; i < num_events; i++)
+		fprintf(out, " %20s", event_list[i]);
+	fprintf(out, "\n");
+
+	for (int r = 0; r < PERF_REGION_MAX; r++) {
+		if (totals[r].calls == 0)
+			continue;
+
+		if (region_names[r])
+			fprintf(out, "%-16s", region_names[r]);
+		else
+			fprintf(out, "region %-9d", r);
+		fprintf(out, " %10"PRIu64, totals[r].calls);
+		for (int i = 0; i < num_events; i++)
+			fprintf(out, " %20"PRIu64, totals[r].count[i]);
+		fprintf(out, "\n%-16s %10s", "", "per call");
+		for (int i = 0; i < num_events; i++)
+			fprintf(out, " %20.1f", (double) totals[r].count[i] / totals[r].calls);
+		fprintf(out, "\n");
+	}
+	fprintf(out, "%"PRIu64" reads, %"PRIu64" with read()\n", total_reads, total_fallbacks);
+
+	pthread_mutex_unlock(&totals_lock);
+}
@@ -0,0 +1,78 @@
+/*
+ * Region counting with userspace counter reads.
+ *
+ * Generalizes perf_events_example2.c: every thread opens its own group
+ * of counting events from a list of names and brackets the code to
+ * measure with perf_region_begin() / perf_region_end(). The counts of
+ * each region accumulate in a thread-local table, so instrumenting a
+ * hot loop costs no lock and no syscall:
+ *
+ *   perf_region_name(0, "inner");
+ *   perf_region_open("cycles,instructions,cache-misses", 0);  per thread
+ *   for (...) {
+ *       perf_region_begin(0);
+ *       ...
+ *       perf_region_end(0);
+ *   }
+ *   perf_region_close();	folds the thread table into the totals
+ *   perf_region_report(stdout);
+ *
+ * The members are read with rdpmc under the seqlock of their mmap page
+ * when the kernel allows it for all of them (cap_user_rdpmc), and with
+ * a single PERF_FORMAT_GROUP read() of the leader otherwise, e.g. for
+ * software events, when /sys/bus/event_source/devices/cpu/rdpmc is 0,
+ * or while the group is multiplexed out.
+ *
+ * Event names are the generic ones of perf (cycles, instructions,
+ * cache-misses, branch-misses, task-clock, page-faults, ...) or rNNNN
+ * for a raw PMU config.
+ */
+
+#ifndef PERF_REGION_H
+#define PERF_REGION_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <linux/perf_event.h>
+
+#define PERF_REGION_MAX_EVENTS	8
+#define PERF_REGION_MAX		64
+
+/* perf_region_open() flags */
+#define PERF_REGION_NO_RDPMC	0x1	/* always read() */
+
+struct perf_region_s {
+	uint64_t	calls;
+	uint64_t	count[PERF_REGION_MAX_EVENTS];
+	uint64_t	start[PERF_REGION_MAX_EVENTS];
+};
+
+/* the state of a thread */
+struct perf_region_thread_s {
+	int		nevents;
+	int		fd[PERF_REGION_MAX_EVENTS];
+	struct perf_event_mmap_page *pc[PERF_REGION_MAX_EVENTS];
+	int		rdpmc;		/* every member can be read in userspace */
+
+	uint64_t	reads;
+	uint64_t	fallbacks;	/* read() instead of rdpmc */
+
+	struct perf_region_s regions[PERF_REGION_MAX];
+};
+
+int	perf_region_event(const char *name, struct perf_event_attr *attr);
+const char *perf_region_event_name(const struct perf_event_attr *attr, char *buf, size_t len);
+int	perf_region_read_user(struct perf_event_mmap_page *pc, uint64_t *value);
+
+int	perf_region_open(const char *events, int flags);
+void	perf_region_close(void);
+
+void	perf_region_name(int region, const char *name);
+void	perf_region_begin(int region);
+void	perf_region_end(int region);
+
+struct perf_region_thread_s *perf_region_self(void);
+void	perf_region_report(FILE *out);
+
+#endif
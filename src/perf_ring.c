@@ -0,0 +1,596 @@
+/*
+ * Zero-copy reader for the perf_event mmap ring buffer.
+ * See perf_ring.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+
+#include "perf_ring.h"
+
+static size_t pagesize;
+
+size_t
+perf_ring_pagesize(void)
+{
+	if (pagesize == 0)
+		pagesize = sysconf(_SC_PAGESIZE);
+	return pagesize;
+}
+
+/*
+ * map one control page plus data_pages of payload.
+ * data_pages must be a power of 2.
+ */
+void *
+perf_ring_mmap(int fd, size_t data_pages)
+{
+	if (data_pages == 0 || (data_pages & (data_pages - 1))) {
+		fprintf(stderr, "buffer pages must be a power of 2: %zu\n", data_pages);
+		return NULL;
+	}
+
+	void *buf = mmap(NULL, (data_pages + 1) * perf_ring_pagesize(),
+			 PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED) {
+		fprintf(stderr, "Can't mmap buffer\n");
+		return NULL;
+	}
+	return buf;
+}
+
+int
+perf_ring_init(struct perf_ring_s *ring, void *base, size_t data_pages)
+{
+	memset(ring, 0, sizeof(*ring));
+	if (base == NULL)
+		return -1;
+
+	/*
+	 * The bounce buffer is allocated here and not on demand, since
+	 * the ring is usually drained from a signal handler.
+	 */
+	ring->bounce = malloc(PERF_RING_MAX_RECORD);
+	if (ring->bounce == NULL)
+		return -1;
+
+	ring->hdr  = base;
+	ring->data = (unsigned char *)base + perf_ring_pagesize();
+	ring->size = data_pages * perf_ring_pagesize();
+	ring->mask = ring->size - 1;
+	ring->tail = ring->hdr->data_tail;
+	ring->head = ring->tail;
+
+	return 0;
+}
+
+int
+perf_ring_open(struct perf_ring_s *ring, int fd, size_t data_pages)
+{
+	void *base = perf_ring_mmap(fd, data_pages);
+	if (base == NULL)
+		return -1;
+
+	if (perf_ring_init(ring, base, data_pages)) {
+		munmap(base, (data_pages + 1) * perf_ring_pagesize());
+		return -1;
+	}
+	return 0;
+}
+
+void
+perf_ring_close(struct perf_ring_s *ring)
+{
+	if (ring->hdr)
+		munmap(ring->hdr, ring->size + perf_ring_pagesize());
+	free(ring->bounce);
+	memset(ring, 0, sizeof(*ring));
+}
+
+/*
+ * Snapshot the kernel's write position. Returns the number of bytes
+ * that are ready to be consumed.
+ */
+size_t
+perf_ring_begin(struct perf_ring_s *ring)
+{
+	ring->head = __atomic_load_n(&ring->hdr->data_head, __ATOMIC_ACQUIRE);
+	ring->tail = ring->hdr->data_tail;
+
+	return ring->head - ring->tail;
+}
+
+/*
+ * Records that tell the data is incomplete. The payload of
+ * PERF_RECORD_LOST is { id, lost }, the one of LOST_SAMPLES { lost }.
+ */
+static void
+account(struct perf_ring_s *ring, const struct perf_event_header *hdr)
+{
+	const uint64_t *p = (const uint64_t *)(hdr + 1);
+
+	switch (hdr->type) {
+	case PERF_RECORD_LOST:
+		if (hdr->size >= sizeof(*hdr) + 2 * sizeof(uint64_t))
+			ring->stats.lost += p[1];
+		ring->stats.lost_records++;
+		break;
+	case PERF_RECORD_LOST_SAMPLES:
+		if (hdr->size >= sizeof(*hdr) + sizeof(uint64_t))
+			ring->stats.lost += p[0];
+		ring->stats.lost_records++;
+		break;
+	case PERF_RECORD_THROTTLE:
+		ring->stats.throttled++;
+		break;
+	case PERF_RECORD_UNTHROTTLE:
+		ring->stats.unthrottled++;
+		break;
+	}
+}
+
+/*
+ * Return the next record, or NULL when everything up to the snapshot
+ * taken by perf_ring_begin() has been consumed.
+ *
+ * Records are 8-byte aligned, so the header itself never wraps; only
+ * the payload may straddle the end of the buffer.
+ */
+const struct perf_event_header *
+perf_ring_next(struct perf_ring_s *ring)
+{
+	struct perf_event_header *hdr;
+	size_t avail, off, room;
+
+	avail = ring->head - ring->tail;
+	if (avail < sizeof(*hdr))
+		return NULL;
+
+	off  = ring->tail & ring->mask;
+	hdr  = (struct perf_event_header *)(ring->data + off);
+
+	if (hdr->size < sizeof(*hdr) || hdr->size > avail) {
+		/* corrupted or partially written record: drop the rest */
+		ring->tail = ring->head;
+		return NULL;
+	}
+	ring->tail += hdr->size;
+
+	room = ring->size - off;
+	if (hdr->size > room) {
+		memcpy(ring->bounce, hdr, room);
+		memcpy(ring->bounce + room, ring->data, hdr->size - room);
+		hdr = (struct perf_event_header *)ring->bounce;
+	}
+
+	if (hdr->type != PERF_RECORD_SAMPLE)
+		account(ring, hdr);
+	return hdr;
+}
+
+/*
+ * Tell the kernel that everything returned so far can be overwritten.
+ */
+void
+perf_ring_end(struct perf_ring_s *ring)
+{
+	__atomic_store_n(&ring->hdr->data_tail, ring->tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Ask for a wakeup when the ring is half full instead of on every
+ * sample. The other half leaves the kernel room to keep writing while
+ * we drain.
+ */
+void
+perf_ring_watermark(struct perf_event_attr *attr, size_t data_pages)
+{
+	attr->watermark	       = 1;
+	attr->wakeup_watermark = data_pages * perf_ring_pagesize() / 2;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Consume every record available right now, calling cb on each of
+ * them, and account the batch in ring->stats. Safe to call from a
+ * signal handler: clock_gettime() is async-signal-safe.
+ */
+size_t
+perf_ring_drain(struct perf_ring_s *ring, perf_record_cb cb, void *arg)
+{
+	const struct perf_event_header *hdr;
+	uint64_t start = now_ns();
+	size_t n = 0;
+
+	if (perf_ring_begin(ring) == 0)
+		return 0;
+
+	while ((hdr = perf_ring_next(ring)) != NULL) {
+		if (hdr->type == PERF_RECORD_SAMPLE)
+			ring->stats.samples++;
+		if (cb)
+			cb(hdr, arg);
+		n++;
+	}
+	perf_ring_end(ring);
+
+	ring->stats.wakeups++;
+	ring->stats.records  += n;
+	ring->stats.drain_ns += now_ns() - start;
+
+	return n;
+}
+
+void
+perf_ring_stats_add(struct perf_ring_stats_s *sum, const struct perf_ring_stats_s *stats)
+{
+	sum->wakeups	 += stats->wakeups;
+	sum->records	 += stats->records;
+	sum->samples	 += stats->samples;
+	sum->drain_ns	 += stats->drain_ns;
+	sum->lost	 += stats->lost;
+	sum->lost_records += stats->lost_records;
+	sum->throttled	 += stats->throttled;
+	sum->unthrottled += stats->unthrottled;
+}
+
+/*
+ * One line per ring, or per tool with the stats of its rings summed by
+ * perf_ring_stats_add(). The samples are only known in the drain mode.
+ * The lost samples are a fraction of what was recorded, so a reader
+ * can scale the totals, or at least know not to trust them.
+ */
+void
+perf_ring_report(FILE *out, const char *name, const struct perf_ring_stats_s *stats)
+{
+	fprintf(out, "%s: ", name);
+	if (stats->samples)
+		fprintf(out, "%"PRIu64" samples, ", stats->samples);
+	fprintf(out, "%"PRIu64" lost in %"PRIu64" records", stats->lost, stats->lost_records);
+	if (stats->samples && stats->lost)
+		fprintf(out, " (%.2f%%)", 100.0 * stats->lost / (stats->samples + stats->lost));
+	fprintf(out, ", %"PRIu64" throttled, %"PRIu64" unthrottled\n",
+		stats->throttled, stats->unthrottled);
+}
+
+
+/*
+ * The leading fields of PERF_RECORD_SAMPLE, in record order.
+ * That order is different from the enum perf_event_sample_format.
+ */
+static const struct {
+	uint64_t bit;
+	uint8_t  field;
+} prefix_fields[] = {
+	{ PERF_SAMPLE_IDENTIFIER,	PERF_SF_IDENTIFIER },
+	{ PERF_SAMPLE_IP,		PERF_SF_IP },
+	{ PERF_SAMPLE_TID,		PERF_SF_TID },
+	{ PERF_SAMPLE_TIME,		PERF_SF_TIME },
+	{ PERF_SAMPLE_ADDR,		PERF_SF_ADDR },
+	{ PERF_SAMPLE_ID,		PERF_SF_ID },
+	{ PERF_SAMPLE_STREAM_ID,	PERF_SF_STREAM_ID },
+	{ PERF_SAMPLE_CPU,		PERF_SF_CPU },
+	{ PERF_SAMPLE_PERIOD,		PERF_SF_PERIOD },
+};
+
+/* Everything after PERIOD */
+static const struct {
+	uint64_t bit;
+	uint8_t  op;
+	uint8_t  field;
+} tail_fields[] = {
+	{ PERF_SAMPLE_READ,		PERF_SOP_READ,		0 },
+	{ PERF_SAMPLE_CALLCHAIN,	PERF_SOP_CALLCHAIN,	0 },
+	{ PERF_SAMPLE_RAW,		PERF_SOP_RAW,		0 },
+	{ PERF_SAMPLE_BRANCH_STACK,	PERF_SOP_BRANCH_STACK,	0 },
+	{ PERF_SAMPLE_REGS_USER,	PERF_SOP_REGS_USER,	0 },
+	{ PERF_SAMPLE_STACK_USER,	PERF_SOP_STACK_USER,	0 },
+	{ PERF_SAMPLE_WEIGHT | PERF_SAMPLE_WEIGHT_STRUCT,
+					PERF_SOP_WORD,		PERF_SF_WEIGHT },
+	{ PERF_SAMPLE_DATA_SRC,		PERF_SOP_WORD,		PERF_SF_DATA_SRC },
+	{ PERF_SAMPLE_TRANSACTION,	PERF_SOP_WORD,		PERF_SF_TRANSACTION },
+	{ PERF_SAMPLE_REGS_INTR,	PERF_SOP_REGS_INTR,	0 },
+	{ PERF_SAMPLE_PHYS_ADDR,	PERF_SOP_WORD,		PERF_SF_PHYS_ADDR },
+	{ PERF_SAMPLE_CGROUP,		PERF_SOP_WORD,		PERF_SF_CGROUP },
+	{ PERF_SAMPLE_DATA_PAGE_SIZE,	PERF_SOP_WORD,		PERF_SF_DATA_PAGE_SIZE },
+	{ PERF_SAMPLE_CODE_PAGE_SIZE,	PERF_SOP_WORD,		PERF_SF_CODE_PAGE_SIZE },
+};
+
+/* The sample_id trailer of non-sample records, in record order */
+static const struct {
+	uint64_t bit;
+	uint8_t  field;
+} id_fields[] = {
+	{ PERF_SAMPLE_TID,		PERF_SF_TID },
+	{ PERF_SAMPLE_TIME,		PERF_SF_TIME },
+	{ PERF_SAMPLE_ID,		PERF_SF_ID },
+	{ PERF_SAMPLE_STREAM_ID,	PERF_SF_STREAM_ID },
+	{ PERF_SAMPLE_CPU,		PERF_SF_CPU },
+	{ PERF_SAMPLE_IDENTIFIER,	PERF_SF_IDENTIFIER },
+};
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+int
+perf_sample_layout_init(struct perf_sample_layout_s *layout,
+			const struct perf_event_attr *attr)
+{
+	uint64_t type = attr->sample_type;
+	uint64_t fmt  = attr->read_format;
+	int i;
+
+	memset(layout, 0, sizeof(*layout));
+	layout->sample_type	   = type;
+	layout->read_format	   = fmt;
+	layout->branch_sample_type = attr->branch_sample_type;
+
+	if (type & PERF_SAMPLE_AUX) {
+		fprintf(stderr, "PERF_SAMPLE_AUX is not supported\n");
+		return -1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(prefix_fields); i++) {
+		if (type & prefix_fields[i].bit)
+			layout->prefix[layout->nprefix++] = prefix_fields[i].field;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(tail_fields); i++) {
+		if (type & tail_fields[i].bit) {
+			layout->op[layout->nops]       = tail_fields[i].op;
+			layout->op_field[layout->nops] = tail_fields[i].field;
+			layout->nops++;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(id_fields); i++) {
+		if (type & id_fields[i].bit)
+			layout->id[layout->nid++] = id_fields[i].field;
+	}
+
+	/* struct read_format, see perf_event.h */
+	size_t header = 0, entry = sizeof(uint64_t);
+	if (fmt & PERF_FORMAT_TOTAL_TIME_ENABLED) header += sizeof(uint64_t);
+	if (fmt & PERF_FORMAT_TOTAL_TIME_RUNNING) header += sizeof(uint64_t);
+	if (fmt & PERF_FORMAT_ID)		  entry  += sizeof(uint64_t);
+	if (fmt & PERF_FORMAT_LOST)		  entry  += sizeof(uint64_t);
+
+	layout->read_entry = entry;
+	layout->read_size  = (fmt & PERF_FORMAT_GROUP) ? 0 : header + entry;
+
+	layout->nregs_user = __builtin_popcountll(attr->sample_regs_user);
+	layout->nregs_intr = __builtin_popcountll(attr->sample_regs_intr);
+
+	return 0;
+}
+
+/*
+ * Decode a PERF_RECORD_SAMPLE in place. Only the fields that are part
+ * of the layout's sample_type are set.
+ */
+int
+perf_sample_parse(const struct perf_sample_layout_s *layout,
+		  const struct perf_event_header *hdr,
+		  struct perf_sample_s *sample)
+{
+	const uint64_t *p   = (const uint64_t *)(hdr + 1);
+	const uint64_t *end = (const uint64_t *)((const char *)hdr + hdr->size);
+	uint64_t n;
+	int i;
+
+	if (p + layout->nprefix > end)
+		return -1;
+
+	sample->hdr = hdr;
+
+	for (i = 0; i < layout->nprefix; i++)
+		sample->v[layout->prefix[i]] = p[i];
+	p += layout->nprefix;
+
+	for (i = 0; i < layout->nops; i++) {
+		if (p >= end)
+			return -1;
+
+		switch (layout->op[i]) {
+		case PERF_SOP_WORD:
+			sample->v[layout->op_field[i]] = *p++;
+			break;
+
+		case PERF_SOP_READ:
+			n = layout->read_size;
+			if (n == 0) {
+				/* { nr, [enabled], [running], cntr[nr] } */
+				n = sizeof(uint64_t) + p[0] * layout->read_entry;
+				if (layout->read_format & PERF_FORMAT_TOTAL_TIME_ENABLED)
+					n += sizeof(uint64_t);
+				if (layout->read_format & PERF_FORMAT_TOTAL_TIME_RUNNING)
+					n += sizeof(uint64_t);
+			}
+			sample->read	  = p;
+			sample->read_size = n;
+			p += n / sizeof(uint64_t);
+			break;
+
+		case PERF_SOP_CALLCHAIN:
+			sample->nr_ips = p[0];
+			sample->ips    = p + 1;
+			p += 1 + sample->nr_ips;
+			break;
+
+		case PERF_SOP_RAW:
+			sample->raw_size = *(const uint32_t *)p;
+			sample->raw	 = (const uint32_t *)p + 1;
+			/* u32 size + data is padded to a multiple of 8 */
+			p = (const uint64_t *)((const char *)p +
+				((sizeof(uint32_t) + sample->raw_size + 7) & ~7ul));
+			break;
+
+		case PERF_SOP_BRANCH_STACK:
+			sample->nr_branches = *p++;
+			if (layout->branch_sample_type & PERF_SAMPLE_BRANCH_HW_INDEX)
+				p++;
+			sample->branches = (const struct perf_branch_entry *)p;
+			p += sample->nr_branches * 3;
+			break;
+
+		case PERF_SOP_REGS_USER:
+			sample->regs_user_abi = *p++;
+			sample->regs_user     = p;
+			if (sample->regs_user_abi != PERF_SAMPLE_REGS_ABI_NONE)
+				p += layout->nregs_user;
+			break;
+
+		case PERF_SOP_STACK_USER:
+			sample->stack_user_size = *p++;
+			sample->stack_user	= p;
+			if (sample->stack_user_size) {
+				p += sample->stack_user_size / sizeof(uint64_t);
+				sample->stack_user_size = *p++;	/* dyn_size */
+			}
+			break;
+
+		case PERF_SOP_REGS_INTR:
+			sample->regs_intr_abi = *p++;
+			sample->regs_intr     = p;
+			if (sample->regs_intr_abi != PERF_SAMPLE_REGS_ABI_NONE)
+				p += layout->nregs_intr;
+			break;
+		}
+	}
+
+	return p <= end ? 0 : -1;
+}
+
+/*
+ * Decode the sample_id trailer of a non-sample record (MMAP, COMM,
+ * SWITCH, ...). Needs sample_id_all to be set in the attribute.
+ */
+int
+perf_sample_parse_id(const struct perf_sample_layout_s *layout,
+		     const struct perf_event_header *hdr,
+		     struct perf_sample_s *sample)
+{
+	const uint64_t *end = (const uint64_t *)((const char *)hdr + hdr->size);
+	const uint64_t *p   = end - layout->nid;
+	int i;
+
+	if (p < (const uint64_t *)(hdr + 1))
+		return -1;
+
+	sample->hdr = hdr;
+	for (i = 0; i < layout->nid; i++)
+		sample->v[layout->id[i]] = p[i];
+
+	return 0;
+}
+
+/*
+ * Decode a struct read_format, from PERF_SAMPLE_READ or read() on the
+ * event. With PERF_FORMAT_GROUP it has one entry per member, leader
+ * first, without it a single one.
+ */
+int
+perf_read_parse(uint64_t read_format, const uint64_t *p, size_t size,
+		struct perf_read_s *r)
+{
+	const uint64_t *end;
+
+	memset(r, 0, sizeof(*r));
+	if (p == NULL)
+		return -1;
+	end = p + size / sizeof(uint64_t);
+
+	if (!(read_format & PERF_FORMAT_GROUP)) {
+		/* { value, [enabled], [running], [id], [lost] } */
+		if (p >= end)
+			return -1;
+		r->nr = 1;
+		r->cntr[0].value = *p++;
+	} else {
+		/* { nr, [enabled], [running], { value, [id], [lost] }[nr] } */
+		if (p >= end)
+			return -1;
+		r->nr = *p++;
+		if (r->nr > PERF_READ_MAX)
+			return -1;
+	}
+
+	if (read_format & PERF_FORMAT_TOTAL_TIME_ENABLED)
+		r->time_enabled = p < end ? *p++ : 0;
+	if (read_format & PERF_FORMAT_TOTAL_TIME_RUNNING)
+		r->time_running = p < end ? *p++ : 0;
+
+	if (!(read_format & PERF_FORMAT_GROUP)) {
+		if (read_format & PERF_FORMAT_ID)
+			r->cntr[0].id = p < end ? *p++ : 0;
+		if (read_format & PERF_FORMAT_LOST)
+			r->cntr[0].lost = p < end ? *p++ : 0;
+		return 0;
+	}
+
+	size_t words = 1 + !!(read_format & PERF_FORMAT_ID) + !!(read_format & PERF_FORMAT_LOST);
+	if (p + r->nr * words > end)
+		return -1;
+
+	for (uint64_t i = 0; i < r->nr; i++) {
+		r->cntr[i].value = *p++;
+		if (read_format & PERF_FORMAT_ID)
+			r->cntr[i].id = *p++;
+		if (read_format & PERF_FORMAT_LOST)
+			r->cntr[i].lost = *p++;
+	}
+	return 0;
+}
+
+void
+perf_sample_fprint(FILE *out, const struct perf_sample_layout_s *layout,
+		   const struct perf_sample_s *sample)
+{
+	uint64_t type = layout->sample_type;
+
+	/* non-sample records only carry the sample_id trailer */
+	if (sample->hdr->type != PERF_RECORD_SAMPLE)
+		type &= PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ID |
+			PERF_SAMPLE_STREAM_ID | PERF_SAMPLE_CPU |
+			PERF_SAMPLE_IDENTIFIER;
+
+	fprintf(out, "  ");
+	if (type & PERF_SAMPLE_IDENTIFIER)
+		fprintf(out, "ID :%"PRIu64" ", sample->v[PERF_SF_IDENTIFIER]);
+	if (type & PERF_SAMPLE_IP)
+		fprintf(out, "IIP:%#016"PRIx64"  ", sample->v[PERF_SF_IP]);
+	if (type & PERF_SAMPLE_TID)
+		fprintf(out, "PID:%d  TID:%d  ", perf_sample_pid(sample),
+			perf_sample_tid(sample));
+	if (type & PERF_SAMPLE_TIME)
+		fprintf(out, "TIME:%'"PRIu64"  ", sample->v[PERF_SF_TIME]);
+	if (type & PERF_SAMPLE_ADDR)
+		fprintf(out, "ADDR:%#016"PRIx64"  ", sample->v[PERF_SF_ADDR]);
+	if (type & PERF_SAMPLE_CPU)
+		fprintf(out, "CPU:%u  ", perf_sample_cpu(sample));
+	if (type & PERF_SAMPLE_PERIOD)
+		fprintf(out, "PERIOD:%'"PRIu64"  ", sample->v[PERF_SF_PERIOD]);
+
+	if (type & PERF_SAMPLE_CALLCHAIN) {
+		fprintf(out, "\n  CALLCHAIN :\n");
+		for (uint64_t i = 0; i < sample->nr_ips; i++)
+			fprintf(out, "\t0x%"PRIx64"\n", sample->ips[i]);
+	}
+	fprintf(out, "\n");
+}
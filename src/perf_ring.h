@@ -0,0 +1,236 @@
+/*
+ * Zero-copy reader for the perf_event mmap ring buffer.
+ *
+ * The tools in this directory used to carry their own copy of
+ * read_from_perf_buffer()/parse_perf_sample(), which memcpy'ed every
+ * field out of the ring 8 bytes at a time and called sysconf() on each
+ * read. This library walks the records in place instead:
+ *
+ *   perf_ring_begin()  snapshot data_head once
+ *   perf_ring_next()   return a pointer to the next record. Records that
+ *                      do not wrap are returned straight from the ring,
+ *                      only the ones straddling the end are copied into
+ *                      a bounce buffer.
+ *   perf_ring_end()    publish data_tail once for the whole batch
+ *
+ * PERF_RECORD_SAMPLE records are decoded with a perf_sample_layout_s,
+ * a field-offset table precomputed from the event's sample_type, so the
+ * per-record work is a table walk rather than a chain of
+ * "if (type & PERF_SAMPLE_xxx)" tests.
+ *
+ * Pointers handed out by perf_ring_next() and perf_sample_parse() are
+ * valid until the next call to perf_ring_end().
+ *
+ * perf_ring_drain() wraps the three calls for the batched mode: the
+ * event is opened with perf_ring_watermark(), left free-running, and
+ * every wakeup drains whatever accumulated since the last one instead of
+ * re-arming the counter with PERF_EVENT_IOC_REFRESH after each sample.
+ *
+ * Whatever the reading mode, perf_ring_next() counts the records that
+ * say the data is incomplete: PERF_RECORD_LOST (the ring was full),
+ * PERF_RECORD_LOST_SAMPLES (the PMU dropped them) and the
+ * PERF_RECORD_THROTTLE/UNTHROTTLE pairs of an event that went over
+ * kernel.perf_event_max_sample_rate. perf_ring_report() prints them.
+ */
+
+#ifndef PERF_RING_H
+#define PERF_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/perf_event.h>
+
+/* perf_event_header.size is a u16, no record can be larger than this */
+#define PERF_RING_MAX_RECORD	65536
+
+struct perf_ring_stats_s {
+	uint64_t	wakeups;	/* drains that found data */
+	uint64_t	records;
+	uint64_t	samples;	/* PERF_RECORD_SAMPLE only */
+	uint64_t	drain_ns;	/* time spent in perf_ring_drain() */
+
+	/* counted by perf_ring_next(), whichever way the ring is read */
+	uint64_t	lost;		/* samples dropped by the kernel */
+	uint64_t	lost_records;	/* PERF_RECORD_LOST and LOST_SAMPLES */
+	uint64_t	throttled;	/* PERF_RECORD_THROTTLE */
+	uint64_t	unthrottled;	/* PERF_RECORD_UNTHROTTLE */
+};
+
+struct perf_ring_s {
+	struct perf_event_mmap_page *hdr;	/* control page */
+	unsigned char	*data;			/* beginning of the payload */
+	size_t		 size;			/* payload size, power of 2 */
+	size_t		 mask;
+	uint64_t	 head;			/* data_head snapshot */
+	uint64_t	 tail;			/* private read position */
+	unsigned char	*bounce;		/* copy of a wrapped record */
+	struct perf_ring_stats_s stats;
+};
+
+typedef void (*perf_record_cb)(const struct perf_event_header *hdr, void *arg);
+
+/*
+ * Fixed-size fields of a PERF_RECORD_SAMPLE. Every one of them takes
+ * exactly one u64 in the record, TID and CPU included.
+ */
+enum perf_sample_field {
+	PERF_SF_IDENTIFIER = 0,
+	PERF_SF_IP,
+	PERF_SF_TID,		/* u32 pid, tid */
+	PERF_SF_TIME,
+	PERF_SF_ADDR,
+	PERF_SF_ID,
+	PERF_SF_STREAM_ID,
+	PERF_SF_CPU,		/* u32 cpu, res */
+	PERF_SF_PERIOD,
+	PERF_SF_WEIGHT,
+	PERF_SF_DATA_SRC,
+	PERF_SF_TRANSACTION,
+	PERF_SF_PHYS_ADDR,
+	PERF_SF_CGROUP,
+	PERF_SF_DATA_PAGE_SIZE,
+	PERF_SF_CODE_PAGE_SIZE,
+	PERF_SF_NR
+};
+
+/* Variable length sections, in the order the kernel writes them */
+enum perf_sample_op {
+	PERF_SOP_WORD = 0,	/* one u64, see perf_sample_layout_s.op_field */
+	PERF_SOP_READ,
+	PERF_SOP_CALLCHAIN,
+	PERF_SOP_RAW,
+	PERF_SOP_BRANCH_STACK,
+	PERF_SOP_REGS_USER,
+	PERF_SOP_STACK_USER,
+	PERF_SOP_REGS_INTR,
+};
+
+#define PERF_SAMPLE_MAX_OPS	24
+
+struct perf_sample_layout_s {
+	uint64_t	sample_type;
+	uint64_t	read_format;
+	uint64_t	branch_sample_type;
+
+	/* leading run of u64 fields, word i holds field prefix[i] */
+	uint8_t		nprefix;
+	uint8_t		prefix[PERF_SF_NR];
+
+	/* everything after the prefix, walked one op at a time */
+	uint8_t		nops;
+	uint8_t		op[PERF_SAMPLE_MAX_OPS];
+	uint8_t		op_field[PERF_SAMPLE_MAX_OPS];
+
+	/* sample_id trailer of the non-sample records (sample_id_all) */
+	uint8_t		nid;
+	uint8_t		id[6];
+
+	uint16_t	read_size;	/* 0 if PERF_FORMAT_GROUP */
+	uint16_t	read_entry;	/* bytes per group member */
+	uint8_t		nregs_user;
+	uint8_t		nregs_intr;
+};
+
+struct perf_sample_s {
+	const struct perf_event_header *hdr;
+
+	uint64_t	 v[PERF_SF_NR];
+
+	const uint64_t	*read;		/* raw struct read_format */
+	size_t		 read_size;
+
+	uint64_t	 nr_ips;
+	const uint64_t	*ips;
+
+	uint32_t	 raw_size;
+	const void	*raw;
+
+	uint64_t	 nr_branches;
+	const struct perf_branch_entry *branches;
+
+	uint64_t	 regs_user_abi;
+	const uint64_t	*regs_user;
+	uint64_t	 stack_user_size;
+	const void	*stack_user;
+	uint64_t	 regs_intr_abi;
+	const uint64_t	*regs_intr;
+};
+
+/* members of a PERF_FORMAT_GROUP read decoded by perf_read_parse() */
+#define PERF_READ_MAX		16
+
+struct perf_read_s {
+	uint64_t	nr;
+	uint64_t	time_enabled;
+	uint64_t	time_running;
+	struct {
+		uint64_t	value;
+		uint64_t	id;
+		uint64_t	lost;
+	} cntr[PERF_READ_MAX];
+};
+
+/*
+ * Ring buffer
+ */
+size_t	perf_ring_pagesize(void);
+void *	perf_ring_mmap(int fd, size_t data_pages);
+int	perf_ring_init(struct perf_ring_s *ring, void *base, size_t data_pages);
+int	perf_ring_open(struct perf_ring_s *ring, int fd, size_t data_pages);
+void	perf_ring_close(struct perf_ring_s *ring);
+
+size_t	perf_ring_begin(struct perf_ring_s *ring);
+const struct perf_event_header *perf_ring_next(struct perf_ring_s *ring);
+void	perf_ring_end(struct perf_ring_s *ring);
+
+void	perf_ring_watermark(struct perf_event_attr *attr, size_t data_pages);
+size_t	perf_ring_drain(struct perf_ring_s *ring, perf_record_cb cb, void *arg);
+void	perf_ring_stats_add(struct perf_ring_stats_s *sum,
+			    const struct perf_ring_stats_s *stats);
+void	perf_ring_report(FILE *out, const char *name,
+			 const struct perf_ring_stats_s *stats);
+
+/*
+ * Sample decoding
+ */
+int	perf_sample_layout_init(struct perf_sample_layout_s *layout,
+				const struct perf_event_attr *attr);
+int	perf_sample_parse(const struct perf_sample_layout_s *layout,
+			  const struct perf_event_header *hdr,
+			  struct perf_sample_s *sample);
+int	perf_sample_parse_id(const struct perf_sample_layout_s *layout,
+			     const struct perf_event_header *hdr,
+			     struct perf_sample_s *sample);
+void	perf_sample_fprint(FILE *out, const struct perf_sample_layout_s *layout,
+			   const struct perf_sample_s *sample);
+int	perf_read_parse(uint64_t read_format, const uint64_t *p, size_t size,
+			struct perf_read_s *r);
+
+static inline uint32_t
+perf_sample_pid(const struct perf_sample_s *sample)
+{
+	uint32_t w[2];
+	memcpy(w, &sample->v[PERF_SF_TID], sizeof(w));
+	return w[0];
+}
+
+static inline uint32_t
+perf_sample_tid(const struct perf_sample_s *sample)
+{
+	uint32_t w[2];
+	memcpy(w, &sample->v[PERF_SF_TID], sizeof(w));
+	return w[1];
+}
+
+static inline uint32_t
+perf_sample_cpu(const struct perf_sample_s *sample)
+{
+	uint32_t w[2];
+	memcpy(w, &sample->v[PERF_SF_CPU], sizeof(w));
+	return w[0];
+}
+
+#endif
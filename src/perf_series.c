@@ -0,0 +1,632 @@
+/*
+ * Counting mode time series.
+ * See perf_series.h for the usage and the file format.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "perf_region.h"
+#include "perf_series.h"
+#include "perf_varint.h"
+
+#define HEADER_MAGIC	"PSERIES1"
+#define BLOCK_HEADER	20		/* magic, rows, time, bytes */
+#define COLUMNS(n)	(3 + (n))	/* time, enabled, running, events */
+#define QUEUE_SIZE	(1 << 17)
+
+/* a row handed over by the signal handler */
+struct row_record_s {
+	struct perf_event_header hdr;
+	struct perf_series_row_s row;
+};
+
+static struct perf_series_s *signal_series;
+
+static inline int
+sys_perf_event_open(struct perf_event_attr *attr, pid_t pid,
+		    int cpu, int group_fd, unsigned long flags)
+{
+	attr->size = sizeof(*attr);
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Open the group, disabled, on pid: 0 for the calling thread, or a
+ * forked child that has not exec'd yet.
+ */
+int
+perf_series_open(struct perf_series_s *s, const char *events, pid_t pid,
+		 unsigned int interval_ms, int flags)
+{
+	char *list, *name, *save;
+
+	memset(s, 0, sizeof(*s));
+	for (int i = 0; i < PERF_SERIES_MAX_EVENTS; i++)
+		s->fd[i] = -1;
+	s->out = -1;
+
+	if (interval_ms == 0) {
+		fprintf(stderr, "perf_series: the interval must be positive\n");
+		return -1;
+	}
+	if ((flags & PERF_SERIES_RDPMC) && pid != 0) {
+		fprintf(stderr, "perf_series: rdpmc only reads the calling thread\n");
+		return -1;
+	}
+
+	list = strdup(events);
+	if (list == NULL)
+		return -1;
+
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		struct perf_event_attr attr;
+		int i = s->nevents;
+
+		if (i == PERF_SERIES_MAX_EVENTS) {
+			fprintf(stderr, "perf_series: at most %d events\n", PERF_SERIES_MAX_EVENTS);
+			goto fail;
+		}
+		if (strlen(name) > 255) {
+			fprintf(stderr, "perf_series: event name too long: %s\n", name);
+			goto fail;
+		}
+
+		memset(&attr, 0, sizeof(attr));
+		if (perf_region_event(name, &attr))
+			goto fail;
+		attr.disabled	 = (i == 0);	/* the leader starts them all */
+		attr.exclude_hv	 = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+		if (pid) {
+			attr.inherit	    = 1;
+			attr.enable_on_exec = (i == 0);
+		}
+
+		s->fd[i] = sys_perf_event_open(&attr, pid, -1, i ? s->fd[0] : -1, 0);
+		if (s->fd[i] < 0 && errno == EACCES) {
+			/* perf_event_paranoid only lets us count userspace */
+			attr.exclude_kernel = 1;
+			s->fd[i] = sys_perf_event_open(&attr, pid, -1, i ? s->fd[0] : -1, 0);
+		}
+		if (s->fd[i] < 0) {
+			fprintf(stderr, "perf_series: cannot open %s: %s\n", name, strerror(errno));
+			goto fail;
+		}
+		s->names[i] = strdup(name);
+		s->nevents++;
+
+		if (flags & PERF_SERIES_RDPMC) {
+			s->pc[i] = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, s->fd[i], 0);
+			if (s->pc[i] == MAP_FAILED) {
+				s->pc[i] = NULL;
+				fprintf(stderr, "perf_series: cannot mmap %s: %s\n", name,
+					strerror(errno));
+				goto fail;
+			}
+		}
+	}
+	free(list);
+
+	if (s->nevents == 0) {
+		fprintf(stderr, "perf_series: no events\n");
+		return -1;
+	}
+	s->interval_ms = interval_ms;
+	s->flags       = flags;
+	s->pid	       = pid;
+	return 0;
+
+fail:
+	free(list);
+	perf_series_close(s);
+	return -1;
+}
+
+int
+perf_series_create(struct perf_series_s *s, const char *path)
+{
+	s->out = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (s->out < 0) {
+		fprintf(stderr, "perf_series: cannot create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+write_all(struct perf_series_s *s, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = write(s->out, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			s->errors++;
+			return -1;
+		}
+		p	 += n;
+		len	 -= n;
+		s->bytes += n;
+	}
+	return 0;
+}
+
+static int
+write_header(struct perf_series_s *s)
+{
+	unsigned char buf[32 + PERF_SERIES_MAX_EVENTS * 256], *p = buf;
+	uint32_t n = s->nevents, us = s->interval_ms * 1000;
+	uint64_t realtime = clock_ns(CLOCK_REALTIME);
+
+	memcpy(p, HEADER_MAGIC, 8);
+	memcpy(p + 8, &n, 4);
+	memcpy(p + 12, &us, 4);
+	memcpy(p + 16, &realtime, 8);
+	memcpy(p + 24, &s->start_ns, 8);
+	p += 32;
+	for (int i = 0; i < s->nevents; i++) {
+		size_t len = strlen(s->names[i]);
+
+		*p++ = len;
+		memcpy(p, s->names[i], len);
+		p += len;
+	}
+	return write_all(s, buf, p - buf);
+}
+
+/*
+ * The values of the group. With rdpmc the times are the clock's, with
+ * read() the kernel's.
+ */
+static int
+read_row(struct perf_series_s *s, struct perf_series_row_s *row)
+{
+	uint64_t buf[3 + PERF_SERIES_MAX_EVENTS];
+	int i;
+
+	row->time = clock_ns(CLOCK_MONOTONIC);
+
+	if (s->rdpmc) {
+		for (i = 0; i < s->nevents; i++) {
+			if (perf_region_read_user(s->pc[i], &row->v[i]))
+				break;
+		}
+		row->enabled = row->running = row->time - s->start_ns;
+		if (i == s->nevents) {
+			s->user_reads++;
+			return 0;
+		}
+	}
+
+	if (read(s->fd[0], buf, sizeof(buf)) < (ssize_t) ((3 + s->nevents) * sizeof(uint64_t)))
+		return -1;
+	if (!s->rdpmc) {
+		row->enabled = buf[1];
+		row->running = buf[2];
+	}
+	memcpy(row->v, &buf[3], s->nevents * sizeof(uint64_t));
+	return 0;
+}
+
+static void
+series_signal(int sig, siginfo_t *info, void *uc)
+{
+	struct perf_series_s *s = signal_series;
+	struct row_record_s rec;
+	int saved = errno;
+
+	if (s == NULL || info->si_code != SI_TIMER)
+		return;
+
+	rec.hdr.type = 0;
+	rec.hdr.misc = 0;
+	rec.hdr.size = sizeof(rec);
+	s->reads++;
+	if (read_row(s, &rec.row) == 0)
+		perf_spsc_push(&s->queue, &rec.hdr);
+	else
+		s->lost++;
+	s->handler_ns += clock_ns(CLOCK_MONOTONIC) - rec.row.time;
+	errno = saved;
+}
+
+/* the rows of the block, column by column, then the block in one write() */
+static void
+flush_block(struct perf_series_s *s)
+{
+	const struct perf_series_row_s *prev;
+	unsigned char *p = s->buf + BLOCK_HEADER;
+	uint64_t interval_ns = s->interval_ms * 1000000ull;
+	uint32_t magic = PERF_SERIES_MAGIC, rows = s->nrows, len;
+
+	if (s->nrows == 0)
+		return;
+
+	prev = &s->last;
+	for (int r = 0; r < s->nrows; prev = &s->rows[r++])
+		p = perf_put_varint(p, s->rows[r].time - prev->time - interval_ns);
+	prev = &s->last;
+	for (int r = 0; r < s->nrows; prev = &s->rows[r++])
+		p = perf_put_varint(p, (s->rows[r].enabled - prev->enabled) -
+				       (s->rows[r].time - prev->time));
+	prev = &s->last;
+	for (int r = 0; r < s->nrows; prev = &s->rows[r++])
+		p = perf_put_varint(p, (s->rows[r].running - prev->running) -
+				       (s->rows[r].enabled - prev->enabled));
+	for (int i = 0; i < s->nevents; i++) {
+		uint64_t last_delta = 0;
+
+		prev = &s->last;
+		for (int r = 0; r < s->nrows; prev = &s->rows[r++]) {
+			uint64_t delta = s->rows[r].v[i] - prev->v[i];
+
+			p = perf_put_varint(p, delta - last_delta);
+			last_delta = delta;
+		}
+	}
+
+	len = p - s->buf - BLOCK_HEADER;
+	memcpy(s->buf, &magic, 4);
+	memcpy(s->buf + 4, &rows, 4);
+	memcpy(s->buf + 8, &s->last.time, 8);
+	memcpy(s->buf + 16, &len, 4);
+	if (write_all(s, s->buf, p - s->buf) == 0) {
+		s->blocks++;
+		s->intervals += s->nrows;
+	}
+
+	s->last	 = s->rows[s->nrows - 1];
+	s->nrows = 0;
+}
+
+static void
+add_row(struct perf_series_s *s, const struct perf_series_row_s *row)
+{
+	s->rows[s->nrows++] = *row;
+	if (s->nrows == PERF_SERIES_BLOCK)
+		flush_block(s);
+}
+
+static void
+queued_row(const struct perf_event_header *hdr, void *arg)
+{
+	add_row(arg, &((const struct row_record_s *) hdr)->row);
+}
+
+/*
+ * Every interval: read the group, or take the rows of the handler,
+ * a few times per block.
+ */
+static void *
+series_thread(void *arg)
+{
+	struct perf_series_s *s = arg;
+	uint64_t step = s->interval_ms * 1000000ull;
+	uint64_t next = s->start_ns;
+	struct perf_series_row_s row;
+
+	if (s->flags & PERF_SERIES_RDPMC)
+		step *= PERF_SERIES_BLOCK / 4;
+
+	while (s->running) {
+		next += step;
+		struct timespec ts = { next / 1000000000ull, next % 1000000000ull };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+
+		if (s->flags & PERF_SERIES_RDPMC) {
+			perf_spsc_drain(&s->queue, queued_row, s);
+			continue;
+		}
+		s->reads++;
+		if (read_row(s, &row) == 0)
+			add_row(s, &row);
+		else
+			s->lost++;
+	}
+
+	if (s->flags & PERF_SERIES_RDPMC)
+		perf_spsc_drain(&s->queue, queued_row, s);
+	flush_block(s);
+	s->thread_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	return NULL;
+}
+
+/*
+ * Write the header and start reading. With PERF_SERIES_RDPMC, call it
+ * from the thread that opened the group.
+ */
+int
+perf_series_start(struct perf_series_s *s)
+{
+	sigset_t mask, old;
+
+	s->buf = malloc(BLOCK_HEADER + PERF_SERIES_BLOCK * COLUMNS(s->nevents) * PERF_VARINT_MAX);
+	if (s->buf == NULL || s->out < 0) {
+		fprintf(stderr, "perf_series: no file to write\n");
+		return -1;
+	}
+
+	/* with a pid, enable_on_exec starts the group */
+	if (s->pid == 0 && ioctl(s->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)) {
+		fprintf(stderr, "perf_series: cannot enable: %s\n", strerror(errno));
+		return -1;
+	}
+
+	s->start_ns = clock_ns(CLOCK_MONOTONIC);
+	if (write_header(s))
+		return -1;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (s->flags & PERF_SERIES_RDPMC) {
+		s->rdpmc = 1;
+		for (int i = 0; i < s->nevents; i++) {
+			if (!s->pc[i]->cap_user_rdpmc)
+				s->rdpmc = 0;
+		}
+	}
+#endif
+	if (read_row(s, &s->last)) {
+		fprintf(stderr, "perf_series: cannot read the group: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (s->flags & PERF_SERIES_RDPMC) {
+		struct sigaction act;
+		struct sigevent sev;
+		struct itimerspec its;
+
+		if (signal_series) {
+			fprintf(stderr, "perf_series: one rdpmc series per process\n");
+			return -1;
+		}
+		if (perf_spsc_init(&s->queue, QUEUE_SIZE, NULL))
+			return -1;
+		signal_series = s;
+
+		memset(&act, 0, sizeof(act));
+		act.sa_sigaction = series_signal;
+		act.sa_flags	 = SA_SIGINFO | SA_RESTART;
+		sigaction(PERF_SERIES_SIGNAL, &act, NULL);
+
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify	  = SIGEV_THREAD_ID;
+		sev.sigev_signo		  = PERF_SERIES_SIGNAL;
+		sev._sigev_un._tid	  = syscall(SYS_gettid);
+		if (timer_create(CLOCK_MONOTONIC, &sev, &s->timer)) {
+			fprintf(stderr, "perf_series: cannot create the timer: %s\n", strerror(errno));
+			signal_series = NULL;
+			return -1;
+		}
+		s->have_timer = 1;
+
+		its.it_interval.tv_sec	= s->interval_ms / 1000;
+		its.it_interval.tv_nsec = (s->interval_ms % 1000) * 1000000L;
+		its.it_value		= its.it_interval;
+		timer_settime(s->timer, 0, &its, NULL);
+	}
+
+	/* the thread leaves the signal to the thread it reads */
+	sigemptyset(&mask);
+	sigaddset(&mask, PERF_SERIES_SIGNAL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	s->running = 1;
+	int ret = pthread_create(&s->thread, NULL, series_thread, s);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		fprintf(stderr, "perf_series: cannot start the thread: %s\n", strerror(ret));
+		s->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Stop reading and flush the last block */
+void
+perf_series_stop(struct perf_series_s *s)
+{
+	if (s->have_timer) {
+		timer_delete(s->timer);
+		s->have_timer = 0;
+	}
+	if (!s->running)
+		return;
+	s->running = 0;
+	pthread_join(s->thread, NULL);
+	if (signal_series == s)
+		signal_series = NULL;
+	s->stop_ns = clock_ns(CLOCK_MONOTONIC);
+	s->lost += s->queue.dropped;
+}
+
+void
+perf_series_report(struct perf_series_s *s, FILE *out)
+{
+	double elapsed = (s->stop_ns - s->start_ns) * 1e-9;
+	uint64_t cost = s->thread_ns + s->handler_ns;
+
+	fprintf(out, "series: %"PRIu64" intervals of %u ms in %"PRIu64" blocks, %"PRIu64" bytes "
+		"(%.1f bytes per interval)\n", s->intervals, s->interval_ms, s->blocks, s->bytes,
+		s->intervals ? (double) s->bytes / s->intervals : 0.0);
+	fprintf(out, "  %"PRIu64" reads, %"PRIu64" with rdpmc, %"PRIu64" lost", s->reads,
+		s->user_reads, s->lost);
+	if (s->errors)
+		fprintf(out, ", %"PRIu64" write errors", s->errors);
+	fprintf(out, "\n  thread %.3f ms, handler %.3f ms of cpu time: %.4f%% overhead\n",
+		s->thread_ns * 1e-6, s->handler_ns * 1e-6,
+		elapsed > 0 ? cost * 1e-7 / elapsed : 0.0);
+}
+
+void
+perf_series_close(struct perf_series_s *s)
+{
+	perf_series_stop(s);
+	for (int i = 0; i < PERF_SERIES_MAX_EVENTS; i++) {
+		if (s->pc[i])
+			munmap(s->pc[i], getpagesize());
+		if (s->fd[i] >= 0)
+			close(s->fd[i]);
+		free(s->names[i]);
+		s->pc[i]    = NULL;
+		s->fd[i]    = -1;
+		s->names[i] = NULL;
+	}
+	if (s->queue.buf)
+		perf_spsc_fini(&s->queue);
+	if (s->out >= 0)
+		close(s->out);
+	s->out = -1;
+	free(s->buf);
+	s->buf = NULL;
+}
+
+int
+perf_series_file_open(struct perf_series_file_s *f, const char *path)
+{
+	const unsigned char *p;
+	struct stat st;
+	uint32_t n;
+	int fd;
+
+	memset(f, 0, sizeof(*f));
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	f->len = st.st_size;
+	f->map = f->len >= 32 ? mmap(NULL, f->len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (f->map == MAP_FAILED) {
+		fprintf(stderr, "cannot map %s\n", path);
+		f->map = NULL;
+		return -1;
+	}
+
+	p = f->map;
+	memcpy(&n, p + 8, 4);
+	if (memcmp(p, HEADER_MAGIC, 8) || n == 0 || n > PERF_SERIES_MAX_EVENTS) {
+		fprintf(stderr, "%s: not a series file\n", path);
+		perf_series_file_close(f);
+		return -1;
+	}
+	f->nevents = n;
+	memcpy(&f->interval_us, p + 12, 4);
+	memcpy(&f->realtime, p + 16, 8);
+	memcpy(&f->monotonic, p + 24, 8);
+
+	f->pos = 32;
+	for (int i = 0; i < f->nevents; i++) {
+		size_t len = f->pos < f->len ? p[f->pos] : 0;
+
+		if (f->pos + 1 + len > f->len) {
+			fprintf(stderr, "%s: truncated header\n", path);
+			perf_series_file_close(f);
+			return -1;
+		}
+		memcpy(f->names[i], p + f->pos + 1, len);
+		f->names[i][len] = '\0';
+		f->pos += 1 + len;
+	}
+	return 0;
+}
+
+/*
+ * Decode the next block. Returns 1, 0 at the end of the file, -1 if the
+ * block is corrupt. A block cut short, by a writer that was killed, ends
+ * the file.
+ */
+int
+perf_series_file_next(struct perf_series_file_s *f, struct perf_series_block_s *b)
+{
+	const unsigned char *p = (const unsigned char *) f->map + f->pos, *end;
+	uint64_t interval_ns = f->interval_us * 1000ull, time;
+	uint32_t magic, rows, len;
+	int64_t v;
+
+	if (f->pos + BLOCK_HEADER > f->len)
+		return 0;
+	memcpy(&magic, p, 4);
+	memcpy(&rows, p + 4, 4);
+	memcpy(&time, p + 8, 8);
+	memcpy(&len, p + 16, 4);
+	if (magic != PERF_SERIES_MAGIC || rows == 0 || rows > PERF_SERIES_BLOCK) {
+		fprintf(stderr, "series: bad block at %zu\n", f->pos);
+		return -1;
+	}
+	if (f->pos + BLOCK_HEADER + len > f->len)
+		return 0;
+
+	p  += BLOCK_HEADER;
+	end = p + len;
+	b->nrows = rows;
+
+	for (uint32_t r = 0; r < rows; r++) {
+		if ((p = perf_get_varint(p, end, &v)) == NULL)
+			goto corrupt;
+		b->time[r] = time += interval_ns + v;
+		b->enabled[r] = v + interval_ns;	/* the time between the reads, for now */
+	}
+	for (uint32_t r = 0; r < rows; r++) {
+		if ((p = perf_get_varint(p, end, &v)) == NULL)
+			goto corrupt;
+		b->enabled[r] += v;
+	}
+	for (uint32_t r = 0; r < rows; r++) {
+		if ((p = perf_get_varint(p, end, &v)) == NULL)
+			goto corrupt;
+		b->running[r] = b->enabled[r] + v;
+	}
+	for (int i = 0; i < f->nevents; i++) {
+		uint64_t delta = 0;
+
+		for (uint32_t r = 0; r < rows; r++) {
+			if ((p = perf_get_varint(p, end, &v)) == NULL)
+				goto corrupt;
+			b->v[i][r] = delta += v;
+		}
+	}
+
+	f->pos += BLOCK_HEADER + len;
+	return 1;
+
+corrupt:
+	fprintf(stderr, "series: corrupt block at %zu\n", f->pos);
+	return -1;
+}
+
+void
+perf_series_file_close(struct perf_series_file_s *f)
+{
+	if (f->map)
+		munmap(f->map, f->len);
+	f->map = NULL;
+}
@@ -0,0 +1,159 @@
+/*
+ * Counting mode time series: a group of counting events read every
+ * interval_ms, for hours, into a compact columnar file.
+ *
+ * The group is read by a thread of its own, with one PERF_FORMAT_GROUP
+ * read() of the leader per interval. With PERF_SERIES_RDPMC the group
+ * counts the calling thread and is read on that thread instead: a POSIX
+ * timer sends it PERF_SERIES_SIGNAL every interval and the handler reads
+ * the members with rdpmc, without a syscall, when the kernel allows it
+ * for all of them (hardware events only, see perf_region.h), and with
+ * read() otherwise. The handler hands the values over through a
+ * perf_spsc queue, the thread does the rest:
+ *
+ *   perf_series_open(&s, "cycles,instructions,cache-misses", pid, 10, 0);
+ *   perf_series_create(&s, "series.data");
+ *   perf_series_start(&s);
+ *   ... hours later:
+ *   perf_series_stop(&s);
+ *   perf_series_report(&s, stdout);
+ *   perf_series_close(&s);
+ *
+ * With a pid the group is opened with inherit, disabled, and
+ * enable_on_exec: open it on a forked child before its exec, the
+ * threads and processes it creates are counted with it.
+ *
+ * The file is a header then blocks of up to PERF_SERIES_BLOCK rows, a
+ * row being one interval, all in the byte order of the host:
+ *
+ *   "PSERIES1", u32 number of events, u32 interval in us,
+ *   u64 CLOCK_REALTIME and u64 CLOCK_MONOTONIC of the start, in ns,
+ *   then for every event a u8 length and its name
+ *
+ *   block: u32 PERF_SERIES_MAGIC, u32 rows, u64 CLOCK_MONOTONIC of the
+ *   read before the first row, u32 bytes of columns, then the columns:
+ *   the time of the rows, their time enabled, their time running, and
+ *   one per event
+ *
+ * A column holds one value per row: the time is the time between two
+ * reads minus the interval, the time enabled is the one of the group
+ * minus that time, the time running the time on the pmu minus the time
+ * enabled, zero unless multiplexed, and an event the difference between
+ * its count in the interval and in the interval before. Every value is
+ * zigzag encoded as a signed varint, from 0 at the start of a block so
+ * the blocks decode on their own: about a byte for the times, two or
+ * three for the counts. A block is written with one write() once full,
+ * the thread flushes the last one at perf_series_stop().
+ *
+ * With PERF_SERIES_RDPMC the times enabled and running are the time of
+ * the clock: the group is on the pmu of the thread whenever it runs, and
+ * a read() of a group multiplexed out is not scaled.
+ *
+ * perf_series_file_open() maps a file and perf_series_file_next()
+ * decodes its blocks one by one into counts per interval. pe_series
+ * records and prints them.
+ */
+
+#ifndef PERF_SERIES_H
+#define PERF_SERIES_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <linux/perf_event.h>
+
+#include "perf_spsc.h"
+
+#define PERF_SERIES_MAX_EVENTS	8
+#define PERF_SERIES_BLOCK	256		/* rows */
+#define PERF_SERIES_MAGIC	0x31425350	/* "PSB1" */
+#define PERF_SERIES_SIGNAL	(SIGRTMIN + 3)
+
+/* perf_series_open() flags */
+#define PERF_SERIES_RDPMC	0x1	/* read on the calling thread, with rdpmc */
+
+/* the counts of one interval */
+struct perf_series_row_s {
+	uint64_t	time;		/* CLOCK_MONOTONIC */
+	uint64_t	enabled;
+	uint64_t	running;
+	uint64_t	v[PERF_SERIES_MAX_EVENTS];
+};
+
+struct perf_series_s {
+	int		 nevents;
+	char		*names[PERF_SERIES_MAX_EVENTS];
+	int		 fd[PERF_SERIES_MAX_EVENTS];
+	struct perf_event_mmap_page *pc[PERF_SERIES_MAX_EVENTS];
+	unsigned int	 interval_ms;
+	int		 flags;
+	pid_t		 pid;
+	int		 rdpmc;		/* every member can be read in userspace */
+
+	/* PERF_SERIES_RDPMC */
+	timer_t		 timer;
+	int		 have_timer;
+	struct perf_spsc_s queue;	/* rows of the handler */
+	uint64_t	 handler_ns;
+
+	int		 out;		/* the file */
+	pthread_t	 thread;
+	volatile int	 running;
+
+	/* the block being filled, rows as read */
+	struct perf_series_row_s last;	/* read before the block */
+	struct perf_series_row_s rows[PERF_SERIES_BLOCK];
+	int		 nrows;
+	unsigned char	*buf;		/* the encoded block */
+
+	uint64_t	 reads;
+	uint64_t	 user_reads;	/* with rdpmc */
+	uint64_t	 lost;		/* reads that failed, or rows the queue dropped */
+	uint64_t	 intervals;	/* rows written */
+	uint64_t	 blocks;
+	uint64_t	 bytes;		/* of the file */
+	uint64_t	 thread_ns;	/* cpu time of the thread */
+	uint64_t	 start_ns;
+	uint64_t	 stop_ns;
+	uint64_t	 errors;
+};
+
+/* a file, mapped */
+struct perf_series_file_s {
+	void		*map;
+	size_t		 len;
+	size_t		 pos;
+
+	int		 nevents;
+	char		 names[PERF_SERIES_MAX_EVENTS][256];
+	uint32_t	 interval_us;
+	uint64_t	 realtime;	/* of the start */
+	uint64_t	 monotonic;
+};
+
+/* a block, decoded: the deltas of every row */
+struct perf_series_block_s {
+	int		 nrows;
+	uint64_t	 time[PERF_SERIES_BLOCK];	/* CLOCK_MONOTONIC at the end of the row */
+	uint64_t	 enabled[PERF_SERIES_BLOCK];
+	uint64_t	 running[PERF_SERIES_BLOCK];
+	uint64_t	 v[PERF_SERIES_MAX_EVENTS][PERF_SERIES_BLOCK];
+};
+
+int	perf_series_open(struct perf_series_s *s, const char *events, pid_t pid,
+			 unsigned int interval_ms, int flags);
+int	perf_series_create(struct perf_series_s *s, const char *path);
+int	perf_series_start(struct perf_series_s *s);
+void	perf_series_stop(struct perf_series_s *s);
+void	perf_series_report(struct perf_series_s *s, FILE *out);
+void	perf_series_close(struct perf_series_s *s);
+
+int	perf_series_file_open(struct perf_series_file_s *f, const char *path);
+int	perf_series_file_next(struct perf_series_file_s *f, struct perf_series_block_s *b);
+void	perf_series_file_close(struct perf_series_file_s *f);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Lock-free single-producer/single-consumer record queue.
+ * See perf_spsc.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "perf_spsc.h"
+
+/*
+ * A record never wraps in the queue. When it does not fit before the
+ * end, the producer leaves a pad header there and starts over at the
+ * beginning; header.size is too small for the gap so the consumer skips
+ * to the end of the buffer on its own.
+ */
+#define PERF_SPSC_PAD	0
+
+int
+perf_spsc_init(struct perf_spsc_s *q, size_t size, struct perf_spsc_notify_s *notify)
+{
+	memset(q, 0, sizeof(*q));
+
+	if (size < 2 * PERF_RING_MAX_RECORD || (size & (size - 1))) {
+		fprintf(stderr, "spsc size must be a power of 2 >= %d: %zu\n",
+			2 * PERF_RING_MAX_RECORD, size);
+		return -1;
+	}
+
+	if (posix_memalign((void **)&q->buf, PERF_SPSC_CACHELINE, size)) {
+		fprintf(stderr, "cannot allocate %zu bytes\n", size);
+		return -1;
+	}
+
+	/* fault it in now rather than in the signal handler */
+	memset(q->buf, 0, size);
+	mlock(q->buf, size);
+
+	q->size	  = size;
+	q->mask	  = size - 1;
+	q->notify = notify;
+	return 0;
+}
+
+void
+perf_spsc_fini(struct perf_spsc_s *q)
+{
+	if (q->buf) {
+		munlock(q->buf, q->size);
+		free(q->buf);
+	}
+	q->buf = NULL;
+}
+
+int
+perf_spsc_push(struct perf_spsc_s *q, const struct perf_event_header *hdr)
+{
+	uint64_t head = q->head;
+	uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	size_t size   = hdr->size;
+	size_t off    = head & q->mask;
+	size_t gap    = 0;
+
+	/* records are 8-byte aligned, so is the pad header */
+	if (off + size > q->size)
+		gap = q->size - off;
+
+	if (head + gap + size - tail > q->size) {
+		q->dropped++;
+		return -1;
+	}
+
+	if (gap) {
+		struct perf_event_header *pad = (void *)(q->buf + off);
+		pad->type = PERF_SPSC_PAD;
+		pad->misc = 0;
+		pad->size = 0;
+		head += gap;
+		off   = 0;
+	}
+
+	memcpy(q->buf + off, hdr, size);
+	q->pushed++;
+
+	__atomic_store_n(&q->head, head + size, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Move everything out of a perf ring. Returns the number of records
+ * queued.
+ */
+size_t
+perf_spsc_push_ring(struct perf_spsc_s *q, struct perf_ring_s *ring)
+{
+	const struct perf_event_header *hdr;
+	size_t n = 0;
+
+	perf_ring_begin(ring);
+	while ((hdr = perf_ring_next(ring)) != NULL) {
+		if (perf_spsc_push(q, hdr) == 0)
+			n++;
+	}
+	perf_ring_end(ring);
+
+	/*
+	 * A wakeup costs a syscall, and on a busy cpu the consumer may
+	 * preempt us right away. Only ask for one once the queue is a
+	 * quarter full, below that the consumer's timeout picks it up.
+	 */
+	if (n && q->notify) {
+		/* order the head stores before the sleeping load, see perf_spsc_wait() */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&q->notify->sleeping, __ATOMIC_RELAXED) &&
+		    q->head - __atomic_load_n(&q->tail, __ATOMIC_RELAXED) >= q->size / 4)
+			perf_spsc_wake(q->notify);
+	}
+
+	return n;
+}
+
+size_t
+perf_spsc_drain(struct perf_spsc_s *q, perf_record_cb cb, void *arg)
+{
+	uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = q->tail;
+	size_t n = 0;
+
+	while (tail < head) {
+		size_t off = tail & q->mask;
+		const struct perf_event_header *hdr = (void *)(q->buf + off);
+
+		if (hdr->type == PERF_SPSC_PAD && hdr->size == 0) {
+			tail += q->size - off;
+			continue;
+		}
+
+		cb(hdr, arg);
+		tail += hdr->size;
+		n++;
+	}
+
+	__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+	return n;
+}
+
+int
+perf_spsc_notify_init(struct perf_spsc_notify_s *n)
+{
+	memset(n, 0, sizeof(*n));
+	n->fd = eventfd(0, EFD_CLOEXEC);
+	if (n->fd < 0) {
+		fprintf(stderr, "eventfd: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void
+perf_spsc_notify_fini(struct perf_spsc_notify_s *n)
+{
+	if (n->fd >= 0)
+		close(n->fd);
+	n->fd = -1;
+}
+
+/* async-signal-safe */
+void
+perf_spsc_wake(struct perf_spsc_notify_s *n)
+{
+	uint64_t one = 1;
+
+	if (write(n->fd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/*
+ * Sleep until a queue fills past the wakeup threshold, perf_spsc_wake()
+ * is called, or timeout_ms elapsed. sleeping is raised before the queues
+ * are checked one last time, so a producer either sees it or pushed
+ * early enough for the check to find its records.
+ */
+void
+perf_spsc_wait(struct perf_spsc_notify_s *n, struct perf_spsc_s **q, int nq,
+	       int timeout_ms)
+{
+	struct pollfd pfd = { .fd = n->fd, .events = POLLIN };
+	uint64_t v;
+
+	__atomic_store_n(&n->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	for (int i = 0; i < nq; i++) {
+		uint64_t used = __atomic_load_n(&q[i]->head, __ATOMIC_SEQ_CST) - q[i]->tail;
+		if (used >= q[i]->size / 4)
+			goto out;
+	}
+
+	if (poll(&pfd, 1, timeout_ms) > 0 && read(n->fd, &v, sizeof(v)) < 0)
+		;
+out:
+	__atomic_store_n(&n->sleeping, 0, __ATOMIC_RELAXED);
+}
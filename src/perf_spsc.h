@@ -0,0 +1,75 @@
+/*
+ * Lock-free single-producer/single-consumer record queue.
+ *
+ * For the tools that keep signal driven sampling, e.g. self profiling
+ * with the signal routed to the sampled thread: the handler does nothing
+ * but copy the raw records out of the perf ring into a preallocated
+ * queue, and a separate thread decodes and aggregates them. The handler
+ * cost is then a memcpy per record, with no fprintf() and no lookups.
+ *
+ * perf_spsc_push() and perf_spsc_push_ring() are async-signal-safe.
+ * They never block: a record that does not fit is dropped and counted.
+ *
+ * The producer and consumer indexes live on their own cachelines so the
+ * two sides only share the lines of the records themselves.
+ *
+ * The consumer sleeps on a perf_spsc_notify_s, which can be shared by
+ * several queues, with a timeout. The producers only write to its
+ * eventfd when the consumer is asleep and a queue is a quarter full, so
+ * in the steady state the handler makes no syscall at all.
+ *
+ *   producer (signal handler)       consumer thread
+ *   perf_spsc_push_ring(q, ring)    for (;;) {
+ *                                       n = perf_spsc_drain(q, decode, arg);
+ *                                       if (!n) perf_spsc_wait(&notify, &q, 1, 1);
+ *                                   }
+ */
+
+#ifndef PERF_SPSC_H
+#define PERF_SPSC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "perf_ring.h"
+
+#define PERF_SPSC_CACHELINE	64
+
+struct perf_spsc_notify_s {
+	int		fd;		/* eventfd */
+	int		sleeping __attribute__((aligned(PERF_SPSC_CACHELINE)));
+};
+
+struct perf_spsc_s {
+	/* written by the producer only */
+	uint64_t	head __attribute__((aligned(PERF_SPSC_CACHELINE)));
+	uint64_t	pushed;
+	uint64_t	dropped;
+
+	/* written by the consumer only */
+	uint64_t	tail __attribute__((aligned(PERF_SPSC_CACHELINE)));
+
+	/* read only once initialized */
+	unsigned char	*buf __attribute__((aligned(PERF_SPSC_CACHELINE)));
+	size_t		 size;		/* power of 2 */
+	size_t		 mask;
+	struct perf_spsc_notify_s *notify;
+};
+
+int	perf_spsc_init(struct perf_spsc_s *q, size_t size, struct perf_spsc_notify_s *notify);
+void	perf_spsc_fini(struct perf_spsc_s *q);
+
+/* producer */
+int	perf_spsc_push(struct perf_spsc_s *q, const struct perf_event_header *hdr);
+size_t	perf_spsc_push_ring(struct perf_spsc_s *q, struct perf_ring_s *ring);
+
+/* consumer */
+size_t	perf_spsc_drain(struct perf_spsc_s *q, perf_record_cb cb, void *arg);
+
+int	perf_spsc_notify_init(struct perf_spsc_notify_s *n);
+void	perf_spsc_notify_fini(struct perf_spsc_notify_s *n);
+void	perf_spsc_wait(struct perf_spsc_notify_s *n, struct perf_spsc_s **q, int nq,
+		       int timeout_ms);
+void	perf_spsc_wake(struct perf_spsc_notify_s *n);
+
+#endif
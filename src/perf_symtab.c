@@ -0,0 +1,502 @@
+/*
+ * Address to symbol resolution for the sampled IPs and callchains.
+ * See perf_symtab.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "perf_symtab.h"
+
+#define CACHE_INIT	4096
+
+/*
+ * Start of the kernel half of the address space. The 64 bit ports keep
+ * the kernel in the top half: from 0xffff800000000000 on x86_64, lower
+ * with 5-level paging, from 0xfff0000000000000 at most on arm64, from
+ * 0xc000000000000000 on ppc64. The 32 bit ones default to a 3G/1G split.
+ */
+#if defined(__LP64__)
+#define KERNEL_START	0x8000000000000000ull
+#else
+#define KERNEL_START	0xc0000000ull
+#endif
+
+static int
+cmp_sym(const void *a, const void *b)
+{
+	const struct perf_sym_s *x = a, *y = b;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static int
+cmp_map(const void *a, const void *b)
+{
+	const struct perf_map_s *x = a, *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/*
+ * Sort the symbols, drop the aliases of an address and give the ones
+ * without a size the room up to the next symbol.
+ */
+static void
+index_syms(struct perf_dso_s *dso)
+{
+	size_t n = 0;
+
+	qsort(dso->syms, dso->nsyms, sizeof(struct perf_sym_s), cmp_sym);
+
+	for (size_t i = 0; i < dso->nsyms; i++) {
+		if (n && dso->syms[n - 1].addr == dso->syms[i].addr) {
+			if (dso->syms[n - 1].size == 0)
+				dso->syms[n - 1].size = dso->syms[i].size;
+			continue;
+		}
+		dso->syms[n++] = dso->syms[i];
+	}
+	dso->nsyms = n;
+
+	for (size_t i = 0; i + 1 < n; i++) {
+		if (dso->syms[i].size == 0)
+			dso->syms[i].size = dso->syms[i + 1].addr - dso->syms[i].addr;
+	}
+}
+
+/* the function holding addr */
+static const struct perf_sym_s *
+find_sym(const struct perf_dso_s *dso, uint64_t addr)
+{
+	size_t lo = 0, hi = dso->nsyms;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (dso->syms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+
+	const struct perf_sym_s *sym = &dso->syms[lo - 1];
+	if (sym->size && addr >= sym->addr + sym->size)
+		return NULL;
+	return sym;
+}
+
+static int
+load_elf(struct perf_dso_s *dso)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(dso->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(Elf64_Ehdr)) {
+		close(fd);
+		return -1;
+	}
+
+	dso->image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (dso->image == MAP_FAILED) {
+		dso->image = NULL;
+		return -1;
+	}
+	dso->image_size = st.st_size;
+
+	const unsigned char *base = dso->image;
+	const Elf64_Ehdr *eh = dso->image;
+
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+	    eh->e_phoff + (uint64_t) eh->e_phnum * sizeof(Elf64_Phdr) > dso->image_size ||
+	    eh->e_shoff + (uint64_t) eh->e_shnum * sizeof(Elf64_Shdr) > dso->image_size)
+		return -1;
+
+	const Elf64_Phdr *ph = (const void *)(base + eh->e_phoff);
+	dso->segments = calloc(eh->e_phnum, sizeof(struct perf_segment_s));
+	for (int i = 0; i < eh->e_phnum; i++) {
+		if (ph[i].p_type != PT_LOAD)
+			continue;
+		dso->segments[dso->nsegments].offset = ph[i].p_offset;
+		dso->segments[dso->nsegments].filesz = ph[i].p_filesz;
+		dso->segments[dso->nsegments].vaddr  = ph[i].p_vaddr;
+		dso->nsegments++;
+	}
+
+	/* .symtab has everything, .dynsym is what is left when stripped */
+	const Elf64_Shdr *sh = (const void *)(base + eh->e_shoff);
+	const Elf64_Shdr *symtab = NULL;
+	for (int i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type == SHT_SYMTAB)
+			symtab = &sh[i];
+		else if (sh[i].sh_type == SHT_DYNSYM && symtab == NULL)
+			symtab = &sh[i];
+	}
+	if (symtab == NULL || symtab->sh_link >= eh->e_shnum ||
+	    symtab->sh_offset + symtab->sh_size > dso->image_size)
+		return 0;
+
+	const Elf64_Shdr *strtab = &sh[symtab->sh_link];
+	if (strtab->sh_offset + strtab->sh_size > dso->image_size)
+		return 0;
+
+	const Elf64_Sym *sym = (const void *)(base + symtab->sh_offset);
+	const char *str = (const char *)(base + strtab->sh_offset);
+	size_t n = symtab->sh_size / sizeof(Elf64_Sym);
+
+	dso->syms = malloc(n * sizeof(struct perf_sym_s));
+	for (size_t i = 0; i < n; i++) {
+		int type = ELF64_ST_TYPE(sym[i].st_info);
+
+		if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+		    sym[i].st_shndx == SHN_UNDEF || sym[i].st_value == 0 ||
+		    sym[i].st_name >= strtab->sh_size)
+			continue;
+
+		dso->syms[dso->nsyms].addr = sym[i].st_value;
+		dso->syms[dso->nsyms].size = sym[i].st_size;
+		dso->syms[dso->nsyms].name = str + sym[i].st_name;
+		dso->nsyms++;
+	}
+	index_syms(dso);
+	return 0;
+}
+
+/* only when readable, kptr_restrict shows every address as 0 */
+static void
+load_kallsyms(struct perf_dso_s *dso)
+{
+	FILE *f = fopen("/proc/kallsyms", "r");
+	size_t max = 0;
+	char line[512];
+
+	dso->path = strdup("[kernel.kallsyms]");
+	if (f == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long addr;
+		char type, name[256];
+
+		if (sscanf(line, "%llx %c %255s", &addr, &type, name) != 3 || addr == 0)
+			continue;
+		if (type != 't' && type != 'T' && type != 'w' && type != 'W')
+			continue;
+
+		if (dso->nsyms == max) {
+			max = max ? 2 * max : 65536;
+			dso->syms = realloc(dso->syms, max * sizeof(struct perf_sym_s));
+		}
+		dso->syms[dso->nsyms].addr = addr;
+		dso->syms[dso->nsyms].size = 0;
+		dso->syms[dso->nsyms].name = strdup(name);
+		dso->nsyms++;
+	}
+	fclose(f);
+	index_syms(dso);
+}
+
+static struct perf_dso_s *
+get_dso(struct perf_symtab_s *st, const char *path)
+{
+	for (int i = 0; i < st->ndsos; i++) {
+		if (strcmp(st->dsos[i]->path, path) == 0)
+			return st->dsos[i];
+	}
+
+	struct perf_dso_s *dso = calloc(1, sizeof(*dso));
+	dso->path = strdup(path);
+	if (path[0] == '/')
+		load_elf(dso);		/* without symbols if it fails */
+
+	st->dsos = realloc(st->dsos, (st->ndsos + 1) * sizeof(*st->dsos));
+	st->dsos[st->ndsos++] = dso;
+	return dso;
+}
+
+static int
+load_maps(struct perf_symtab_s *st)
+{
+	char path[64], line[4096];
+	int max = 0;
+	FILE *f;
+
+	if (st->pid)
+		snprintf(path, sizeof(path), "/proc/%d/maps", st->pid);
+	else
+		snprintf(path, sizeof(path), "/proc/self/maps");
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long start, end, pgoff;
+		char perm[8];
+		int pos = 0;
+
+		if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perm, &pgoff, &pos) < 4 ||
+		    pos == 0 || perm[2] != 'x')
+			continue;
+
+		char *name = line + pos;
+		name[strcspn(name, "\n")] = '\0';
+		if (*name == '\0')
+			continue;	/* anonymous, e.g. JIT code */
+
+		if (st->nmaps == max) {
+			max = max ? 2 * max : 64;
+			st->maps = realloc(st->maps, max * sizeof(struct perf_map_s));
+		}
+		st->maps[st->nmaps].start = start;
+		st->maps[st->nmaps].end	  = end;
+		st->maps[st->nmaps].pgoff = pgoff;
+		st->maps[st->nmaps].dso	  = get_dso(st, name);
+		st->nmaps++;
+	}
+	fclose(f);
+
+	qsort(st->maps, st->nmaps, sizeof(struct perf_map_s), cmp_map);
+	return 0;
+}
+
+/*
+ * Add a mapping of path, as seen in a PERF_RECORD_MMAP2, replacing the
+ * ones it overlaps.
+ */
+int
+perf_symtab_add_map(struct perf_symtab_s *st, uint64_t start, uint64_t end,
+		    uint64_t pgoff, const char *path)
+{
+	int n = 0;
+
+	for (int i = 0; i < st->nmaps; i++) {
+		if (st->maps[i].end <= start || st->maps[i].start >= end)
+			st->maps[n++] = st->maps[i];
+	}
+	st->nmaps = n;
+
+	if (st->nmaps == st->max_maps) {
+		int max = st->max_maps ? 2 * st->max_maps : 64;
+		struct perf_map_s *maps = realloc(st->maps, max * sizeof(struct perf_map_s));
+
+		if (maps == NULL)
+			return -1;
+		st->maps     = maps;
+		st->max_maps = max;
+	}
+
+	/* keep them sorted, the records come in address order most of the time */
+	int i = st->nmaps++;
+	while (i > 0 && st->maps[i - 1].start > start) {
+		st->maps[i] = st->maps[i - 1];
+		i--;
+	}
+	st->maps[i].start = start;
+	st->maps[i].end	  = end;
+	st->maps[i].pgoff = pgoff;
+	st->maps[i].dso	  = get_dso(st, path);
+
+	/* what was resolved may be somewhere else now */
+	if (st->cache_used) {
+		memset(st->cache, 0, st->cache_size * sizeof(struct perf_frame_s));
+		st->cache_used = 0;
+	}
+	return 0;
+}
+
+/*
+ * kallsyms is the same for every symtab, it is read once and kept while
+ * one of them uses it.
+ */
+static struct perf_dso_s kernel_dso;
+static int kernel_refs;
+
+int
+perf_symtab_init(struct perf_symtab_s *st, pid_t pid)
+{
+	memset(st, 0, sizeof(*st));
+	st->pid = pid;
+
+	if (pid >= 0 && load_maps(st))
+		return -1;
+	st->max_maps = st->nmaps;
+
+	if (kernel_refs++ == 0)
+		load_kallsyms(&kernel_dso);
+	st->kernel = &kernel_dso;
+
+	st->cache_size = CACHE_INIT;
+	st->cache = calloc(st->cache_size, sizeof(struct perf_frame_s));
+	return 0;
+}
+
+static void
+free_dso(struct perf_dso_s *dso, int own_names)
+{
+	if (own_names) {
+		for (size_t i = 0; i < dso->nsyms; i++)
+			free((char *) dso->syms[i].name);
+	}
+	if (dso->image)
+		munmap(dso->image, dso->image_size);
+	free(dso->syms);
+	free(dso->segments);
+	free(dso->path);
+}
+
+void
+perf_symtab_fini(struct perf_symtab_s *st)
+{
+	for (int i = 0; i < st->ndsos; i++) {
+		free_dso(st->dsos[i], 0);
+		free(st->dsos[i]);
+	}
+	if (st->kernel && --kernel_refs == 0) {
+		free_dso(&kernel_dso, 1);
+		memset(&kernel_dso, 0, sizeof(kernel_dso));
+	}
+	free(st->dsos);
+	free(st->maps);
+	free(st->cache);
+	memset(st, 0, sizeof(*st));
+}
+
+static const struct perf_map_s *
+find_map(const struct perf_symtab_s *st, uint64_t ip)
+{
+	int lo = 0, hi = st->nmaps;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (st->maps[mid].start <= ip)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || ip >= st->maps[lo - 1].end)
+		return NULL;
+	return &st->maps[lo - 1];
+}
+
+static void
+lookup(struct perf_symtab_s *st, uint64_t ip, struct perf_frame_s *frame)
+{
+	const struct perf_map_s *map;
+	const struct perf_sym_s *sym;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->ip  = ip;
+	frame->off = ip;
+
+	if (ip >= KERNEL_START) {
+		frame->dso = st->kernel->path;
+		if ((sym = find_sym(st->kernel, ip)) != NULL) {
+			frame->sym = sym->name;
+			frame->off = ip - sym->addr;
+			frame->id  = sym;
+		}
+		return;
+	}
+
+	if ((map = find_map(st, ip)) == NULL)
+		return;
+
+	struct perf_dso_s *dso = map->dso;
+	uint64_t fileoff = ip - map->start + map->pgoff;
+
+	frame->dso = dso->path;
+	frame->off = fileoff;
+
+	/* file offset to link time address, through the segment holding it */
+	for (int i = 0; i < dso->nsegments; i++) {
+		const struct perf_segment_s *seg = &dso->segments[i];
+
+		if (fileoff < seg->offset || fileoff >= seg->offset + seg->filesz)
+			continue;
+
+		uint64_t addr = fileoff - seg->offset + seg->vaddr;
+		if ((sym = find_sym(dso, addr)) != NULL) {
+			frame->sym = sym->name;
+			frame->off = addr - sym->addr;
+			frame->id  = sym;
+		}
+		break;
+	}
+}
+
+static void
+cache_grow(struct perf_symtab_s *st)
+{
+	struct perf_frame_s *old = st->cache;
+	size_t size = st->cache_size;
+
+	st->cache_size = 2 * size;
+	st->cache = calloc(st->cache_size, sizeof(struct perf_frame_s));
+
+	for (size_t i = 0; i < size; i++) {
+		if (old[i].ip == 0)
+			continue;
+
+		size_t h = (old[i].ip * 0x9e3779b97f4a7c15ull) >> 20;
+		while (st->cache[h & (st->cache_size - 1)].ip)
+			h++;
+		st->cache[h & (st->cache_size - 1)] = old[i];
+	}
+	free(old);
+}
+
+/*
+ * The frame holding ip. The pointer is good until the next call, copy
+ * what is needed from it.
+ */
+const struct perf_frame_s *
+perf_symtab_resolve(struct perf_symtab_s *st, uint64_t ip)
+{
+	static struct perf_frame_s null_frame;
+
+	if (ip == 0)
+		return &null_frame;
+
+	size_t h = (ip * 0x9e3779b97f4a7c15ull) >> 20;
+	for (;; h++) {
+		struct perf_frame_s *f = &st->cache[h & (st->cache_size - 1)];
+
+		if (f->ip == ip) {
+			st->hits++;
+			return f;
+		}
+		if (f->ip == 0)
+			break;
+	}
+
+	st->misses++;
+	if (2 * (st->cache_used + 1) > st->cache_size) {
+		cache_grow(st);
+		h = (ip * 0x9e3779b97f4a7c15ull) >> 20;
+		while (st->cache[h & (st->cache_size - 1)].ip)
+			h++;
+	}
+
+	struct perf_frame_s *f = &st->cache[h & (st->cache_size - 1)];
+	lookup(st, ip, f);
+	st->cache_used++;
+	return f;
+}
@@ -0,0 +1,98 @@
+/*
+ * Address to symbol resolution for the sampled IPs and callchains.
+ *
+ * perf_symtab_init() reads /proc/<pid>/maps once, loads the .symtab (or
+ * .dynsym when stripped) of every mapped ELF object and /proc/kallsyms,
+ * and sorts the function symbols of each into an address index. Every
+ * resolved address is then kept in a hash cache, so a profile with
+ * millions of callchains pays for one binary search per distinct IP.
+ *
+ * The maps are read when called, so call it once the profiled process
+ * has loaded what it is going to load, typically at the end of the run
+ * for self profiling, or while the target is still alive otherwise.
+ *
+ *   perf_symtab_init(&st, 0);
+ *   const struct perf_frame_s *f = perf_symtab_resolve(&st, ip);
+ *   printf("%s+0x%lx (%s)\n", f->sym, f->off, f->dso);
+ *   perf_symtab_fini(&st);
+ *
+ * With a negative pid nothing is read: the maps are added one by one
+ * with perf_symtab_add_map(), e.g. from the PERF_RECORD_MMAP2 of a
+ * process that may be gone by the time its samples are resolved.
+ */
+
+#ifndef PERF_SYMTAB_H
+#define PERF_SYMTAB_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct perf_sym_s {
+	uint64_t	 addr;		/* link time address */
+	uint64_t	 size;
+	const char	*name;
+};
+
+struct perf_segment_s {
+	uint64_t	 offset;	/* PT_LOAD p_offset */
+	uint64_t	 filesz;
+	uint64_t	 vaddr;
+};
+
+struct perf_dso_s {
+	char		*path;
+	void		*image;		/* the mapped file, the names point into it */
+	size_t		 image_size;
+
+	struct perf_segment_s *segments;
+	int		 nsegments;
+
+	struct perf_sym_s *syms;	/* sorted by addr */
+	size_t		 nsyms;
+};
+
+struct perf_map_s {
+	uint64_t	 start;
+	uint64_t	 end;
+	uint64_t	 pgoff;
+	struct perf_dso_s *dso;
+};
+
+/* what perf_symtab_resolve() returns */
+struct perf_frame_s {
+	uint64_t	 ip;
+	const char	*sym;		/* NULL if unknown */
+	const char	*dso;		/* NULL if unmapped */
+	uint64_t	 off;		/* from sym, or from the dso start if unknown */
+	const struct perf_sym_s *id;	/* unique per function, NULL if unknown */
+};
+
+struct perf_symtab_s {
+	pid_t		 pid;
+
+	struct perf_map_s *maps;	/* sorted by start */
+	int		 nmaps;
+	int		 max_maps;
+
+	struct perf_dso_s **dsos;
+	int		 ndsos;
+
+	struct perf_dso_s *kernel;	/* kallsyms, addresses as they are, shared */
+
+	/* ip -> frame, open addressing */
+	struct perf_frame_s *cache;
+	size_t		 cache_size;	/* power of 2 */
+	size_t		 cache_used;
+
+	uint64_t	 hits;
+	uint64_t	 misses;
+};
+
+int	perf_symtab_init(struct perf_symtab_s *st, pid_t pid);
+int	perf_symtab_add_map(struct perf_symtab_s *st, uint64_t start, uint64_t end,
+			    uint64_t pgoff, const char *path);
+void	perf_symtab_fini(struct perf_symtab_s *st);
+
+const struct perf_frame_s *perf_symtab_resolve(struct perf_symtab_s *st, uint64_t ip);
+
+#endif
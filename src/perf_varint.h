@@ -0,0 +1,60 @@
+/*
+ * Varints of the series and pack formats.
+ *
+ * 7 bits per byte, least significant first, the high bit set on all
+ * but the last byte. Signed numbers are zigzag encoded first, so that
+ * the small deltas of either sign take a byte or two. A varint takes
+ * at most PERF_VARINT_MAX bytes.
+ */
+
+#ifndef PERF_VARINT_H
+#define PERF_VARINT_H
+
+#include <stdint.h>
+
+#define PERF_VARINT_MAX		10
+
+static inline unsigned char *
+perf_put_uvarint(unsigned char *p, uint64_t z)
+{
+	while (z >= 0x80) {
+		*p++ = z | 0x80;
+		z >>= 7;
+	}
+	*p++ = z;
+	return p;
+}
+
+static inline unsigned char *
+perf_put_varint(unsigned char *p, int64_t v)
+{
+	return perf_put_uvarint(p, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+/* the end of the varint at p, NULL if it runs past end or 64 bits */
+static inline const unsigned char *
+perf_get_uvarint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+	uint64_t z = 0;
+
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		z |= (uint64_t) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*v = z;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static inline const unsigned char *
+perf_get_varint(const unsigned char *p, const unsigned char *end, int64_t *v)
+{
+	uint64_t z;
+
+	if ((p = perf_get_uvarint(p, end, &z)) != NULL)
+		*v = (int64_t) (z >> 1) ^ -(int64_t) (z & 1);
+	return p;
+}
+
+#endif
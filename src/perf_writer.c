@@ -0,0 +1,419 @@
+/*
+ * Streaming perf.data writer.
+ * See perf_writer.h for the usage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "perf_writer.h"
+
+/* data starts on its own page, after the header */
+#define PERF_DATA_OFFSET	4096
+
+/* PERF_RECORD_LOST: header, id, lost, then the sample_id trailer */
+#define LOST_SIZE(w)		(sizeof(struct perf_event_header) + 2 * sizeof(uint64_t) + (w)->id_size)
+#define LOST_MAX_SIZE		(sizeof(struct perf_event_header) + (2 + PERF_SF_NR) * sizeof(uint64_t))
+
+static int
+pwrite_all(int fd, const void *buf, size_t len, off_t offset)
+{
+	const unsigned char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p      += n;
+		len    -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+static void *
+writer_thread(void *arg)
+{
+	struct perf_writer_s *w = arg;
+	int next = 0;		/* buffers are written in the order they were filled */
+	uint64_t v;
+
+	for (;;) {
+		if (read(w->wakefd, &v, sizeof(v)) < 0 && errno != EINTR)
+			break;
+
+		/* stop is set after the last handoff, so load it first */
+		int stop = __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE);
+
+		while (__atomic_load_n(&w->full[next], __ATOMIC_ACQUIRE)) {
+			if (w->error == 0 &&
+			    pwrite_all(w->fd, w->buf[next], w->len[next],
+				       w->data_offset + w->data_size))
+				w->error = errno;
+			else
+				w->data_size += w->len[next];
+
+			w->len[next] = 0;
+			__atomic_store_n(&w->full[next], 0, __ATOMIC_RELEASE);
+			next ^= 1;
+		}
+
+		if (stop)
+			break;
+	}
+	return NULL;
+}
+
+int
+perf_writer_open(struct perf_writer_s *w, const char *path, size_t bufsize)
+{
+	sigset_t all, old;
+	int ret;
+
+	memset(w, 0, sizeof(*w));
+	w->fd	  = -1;
+	w->wakefd = -1;
+
+	if (bufsize == 0)
+		bufsize = PERF_WRITER_BUFSIZE;
+	if (bufsize < PERF_RING_MAX_RECORD + LOST_MAX_SIZE)
+		bufsize = PERF_RING_MAX_RECORD + LOST_MAX_SIZE;
+	w->bufsize     = bufsize;
+	w->data_offset = PERF_DATA_OFFSET;
+
+	for (int i = 0; i < 2; i++) {
+		if (posix_memalign((void **)&w->buf[i], 4096, bufsize)) {
+			fprintf(stderr, "cannot allocate %zu bytes\n", bufsize);
+			goto fail;
+		}
+	}
+
+	w->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (w->fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	w->wakefd = eventfd(0, EFD_CLOEXEC);
+	if (w->wakefd < 0) {
+		fprintf(stderr, "eventfd: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	/* keep the signals for the sampled threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&w->thread, NULL, writer_thread, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		goto fail;
+	}
+	return 0;
+
+fail:
+	if (w->wakefd >= 0)
+		close(w->wakefd);
+	if (w->fd >= 0)
+		close(w->fd);
+	free(w->buf[0]);
+	free(w->buf[1]);
+	memset(w, 0, sizeof(*w));
+	w->fd = w->wakefd = -1;
+	return -1;
+}
+
+int
+perf_writer_add_attr(struct perf_writer_s *w, const struct perf_event_attr *attr,
+		     const uint64_t *ids, int nids)
+{
+	struct perf_writer_attr_s *a;
+
+	a = realloc(w->attrs, (w->nattrs + 1) * sizeof(*a));
+	if (a == NULL)
+		return -1;
+	w->attrs = a;
+
+	/* the events share their sample_type, the first one sizes the trailer */
+	if (w->nattrs == 0) {
+		struct perf_sample_layout_s layout;
+
+		if (attr->sample_id_all && perf_sample_layout_init(&layout, attr) == 0)
+			w->id_size = layout.nid * sizeof(uint64_t);
+		if (nids > 0)
+			w->lost_id = ids[0];
+	}
+
+	a = &w->attrs[w->nattrs];
+	a->attr	     = *attr;
+	a->attr.size = sizeof(struct perf_event_attr);
+	a->nids	     = nids;
+	a->ids	     = NULL;
+	if (nids > 0) {
+		a->ids = malloc(nids * sizeof(uint64_t));
+		if (a->ids == NULL)
+			return -1;
+		memcpy(a->ids, ids, nids * sizeof(uint64_t));
+	}
+	w->nattrs++;
+	return 0;
+}
+
+static void
+handoff(struct perf_writer_s *w)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&w->full[w->cur], 1, __ATOMIC_RELEASE);
+	if (write(w->wakefd, &one, sizeof(one)) < 0)
+		w->error = errno;
+	w->cur ^= 1;
+}
+
+/*
+ * Account the records dropped since the last one in a PERF_RECORD_LOST,
+ * the caller has made room for it. The sample_id trailer is left zeroed,
+ * as in the synthesized records.
+ */
+static void
+put_lost(struct perf_writer_s *w)
+{
+	unsigned char *p = w->buf[w->cur] + w->len[w->cur];
+	struct perf_event_header hdr = {
+		.type = PERF_RECORD_LOST,
+		.misc = 0,
+		.size = LOST_SIZE(w),
+	};
+	uint64_t body[2] = { w->lost_id, w->lost_pending };
+
+	memcpy(p, &hdr, sizeof(hdr));
+	memcpy(p + sizeof(hdr), body, sizeof(body));
+	memset(p + sizeof(hdr) + sizeof(body), 0, w->id_size);
+	w->len[w->cur] += hdr.size;
+	w->lost_pending = 0;
+	w->records++;
+}
+
+int
+perf_writer_record(struct perf_writer_s *w, const struct perf_event_header *hdr)
+{
+	size_t size = hdr->size;
+
+	if (w->lost_pending)
+		size += LOST_SIZE(w);
+
+	/* the writer thread still owns the buffer we would fill */
+	if (__atomic_load_n(&w->full[w->cur], __ATOMIC_ACQUIRE))
+		goto drop;
+
+	if (w->len[w->cur] + size > w->bufsize) {
+		handoff(w);
+		if (__atomic_load_n(&w->full[w->cur], __ATOMIC_ACQUIRE))
+			goto drop;
+	}
+
+	if (w->lost_pending)
+		put_lost(w);
+	memcpy(w->buf[w->cur] + w->len[w->cur], hdr, hdr->size);
+	w->len[w->cur] += hdr->size;
+	w->records++;
+	return 0;
+
+drop:
+	w->lost++;
+	w->lost_pending++;
+	return -1;
+}
+
+/* perf_record_cb for perf_ring_drain() */
+void
+perf_writer_cb(const struct perf_event_header *hdr, void *arg)
+{
+	perf_writer_record(arg, hdr);
+}
+
+/*
+ * Append the COMM and executable MMAP records of pid, the way perf
+ * record synthesizes them for a task that is already running, so the
+ * sampled ips resolve to symbols. With attr->mmap_data the data
+ * mappings go too, flagged PERF_RECORD_MISC_MMAP_DATA as the kernel
+ * does, so the sampled addresses resolve to them. The sample_id trailer,
+ * if the events have one, is left zeroed.
+ */
+int
+perf_writer_synthesize(struct perf_writer_s *w, pid_t pid,
+		       const struct perf_event_attr *attr)
+{
+	struct perf_sample_layout_s layout;
+	size_t id_size = 0;
+	union {
+		struct perf_event_header hdr;
+		unsigned char bytes[PERF_RING_MAX_RECORD];
+	} rec;
+	char path[PATH_MAX], line[PATH_MAX + 128];
+	struct {
+		uint32_t pid, tid;
+	} *ids;
+	size_t len;
+	FILE *f;
+
+	if (attr->sample_id_all && perf_sample_layout_init(&layout, attr) == 0)
+		id_size = layout.nid * sizeof(uint64_t);
+
+	/* COMM */
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	memset(&rec, 0, sizeof(rec));
+	ids = (void *)(&rec.hdr + 1);
+	ids->pid = ids->tid = pid;
+	char *comm = (char *)(ids + 1);
+	if (fgets(comm, 16, f) == NULL)
+		comm[0] = '\0';
+	fclose(f);
+	comm[strcspn(comm, "\n")] = '\0';
+
+	len = sizeof(rec.hdr) + sizeof(*ids) + strlen(comm) + 1;
+	len = (len + 7) & ~7UL;
+	rec.hdr.type = PERF_RECORD_COMM;
+	rec.hdr.misc = PERF_RECORD_MISC_USER;
+	rec.hdr.size = len + id_size;
+	perf_writer_record(w, &rec.hdr);
+
+	/* MMAP */
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long start, end, pgoff;
+		char perm[8], file[PATH_MAX];
+		struct {
+			uint32_t pid, tid;
+			uint64_t addr, len, pgoff;
+		} *mmap;
+
+		file[0] = '\0';
+		if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %4095s",
+			   &start, &end, perm, &pgoff, file) < 4)
+			continue;
+		if (perm[2] != 'x' && !attr->mmap_data)
+			continue;
+		if (file[0] == '\0')
+			strcpy(file, "//anon");
+
+		memset(&rec, 0, sizeof(rec));
+		mmap = (void *)(&rec.hdr + 1);
+		mmap->pid   = mmap->tid = pid;
+		mmap->addr  = start;
+		mmap->len   = end - start;
+		mmap->pgoff = pgoff;
+		strcpy((char *)(mmap + 1), file);
+
+		len = sizeof(rec.hdr) + sizeof(*mmap) + strlen(file) + 1;
+		len = (len + 7) & ~7UL;
+		rec.hdr.type = PERF_RECORD_MMAP;
+		rec.hdr.misc = PERF_RECORD_MISC_USER;
+		if (perm[2] != 'x')
+			rec.hdr.misc |= PERF_RECORD_MISC_MMAP_DATA;
+		rec.hdr.size = len + id_size;
+		perf_writer_record(w, &rec.hdr);
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Flush, stop the writer thread, then write the attrs after the data and
+ * finally the header, so a file cut short by a crash is recognizable as
+ * such.
+ */
+int
+perf_writer_close(struct perf_writer_s *w)
+{
+	struct perf_file_header header;
+	uint64_t one = 1;
+	uint64_t offset;
+	int ret = 0;
+
+	if (w->fd < 0)
+		return -1;
+
+	/* the drops since the last record, if there is still room for them */
+	if (w->lost_pending && !__atomic_load_n(&w->full[w->cur], __ATOMIC_ACQUIRE) &&
+	    w->len[w->cur] + LOST_SIZE(w) <= w->bufsize)
+		put_lost(w);
+
+	if (w->len[w->cur] > 0 && !__atomic_load_n(&w->full[w->cur], __ATOMIC_ACQUIRE))
+		handoff(w);
+
+	__atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+	if (write(w->wakefd, &one, sizeof(one)) < 0)
+		w->error = errno;
+	pthread_join(w->thread, NULL);
+
+	/* the ids of every attr, then the attrs pointing at them */
+	offset = w->data_offset + w->data_size;
+	struct perf_file_attr *fattrs = calloc(w->nattrs ? w->nattrs : 1, sizeof(*fattrs));
+
+	for (int i = 0; i < w->nattrs; i++) {
+		size_t size = w->attrs[i].nids * sizeof(uint64_t);
+
+		fattrs[i].attr	      = w->attrs[i].attr;
+		fattrs[i].ids.offset  = offset;
+		fattrs[i].ids.size    = size;
+		if (size && pwrite_all(w->fd, w->attrs[i].ids, size, offset))
+			w->error = errno;
+		offset += size;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic	    = PERF_MAGIC;
+	header.size	    = sizeof(header);
+	header.attr_size    = sizeof(struct perf_file_attr);
+	header.attrs.offset = offset;
+	header.attrs.size   = w->nattrs * sizeof(struct perf_file_attr);
+	header.data.offset  = w->data_offset;
+	header.data.size    = w->data_size;
+
+	if (w->nattrs && pwrite_all(w->fd, fattrs, header.attrs.size, offset))
+		w->error = errno;
+	if (pwrite_all(w->fd, &header, sizeof(header), 0))
+		w->error = errno;
+
+	if (w->error) {
+		fprintf(stderr, "perf_writer: %s\n", strerror(w->error));
+		ret = -1;
+	}
+
+	free(fattrs);
+	for (int i = 0; i < w->nattrs; i++)
+		free(w->attrs[i].ids);
+	free(w->attrs);
+	free(w->buf[0]);
+	free(w->buf[1]);
+	close(w->wakefd);
+	if (close(w->fd))
+		ret = -1;
+
+	w->fd = w->wakefd = -1;
+	w->attrs  = NULL;
+	w->nattrs = 0;
+	w->buf[0] = w->buf[1] = NULL;
+	return ret;
+}
@@ -0,0 +1,113 @@
+/*
+ * Streaming perf.data writer.
+ *
+ * Records are copied verbatim out of the mmap ring into one of two large
+ * page aligned buffers. When a buffer is full it is handed to a writer
+ * thread, which appends it to the file while the other buffer fills up,
+ * so the caller never waits on the disk. Nothing is decoded on the
+ * sampling side; the file is analyzed offline with perf report/script or
+ * with the readers in this directory.
+ *
+ * perf_writer_record() only uses memcpy, atomics and write() on an
+ * eventfd, so it may be called from the tools' signal handlers, as long
+ * as a writer is fed from one context at a time. If the writer thread
+ * falls behind by a whole buffer the record is dropped and counted in
+ * lost, the sampled thread is never blocked. The next record that fits
+ * is preceded by a PERF_RECORD_LOST with the count dropped since the
+ * last one, so perf report shows the gap where it happened.
+ *
+ *   perf_writer_open(&w, "perf.data", 0);
+ *   perf_writer_synthesize(&w, getpid(), &attr);     mmaps for symbols
+ *   ... open the events ...
+ *   perf_writer_add_attr(&w, &attr, &id, 1);
+ *   perf_ring_drain(&ring, perf_writer_cb, &w);      as often as needed
+ *   perf_writer_close(&w);                           header and attrs
+ *
+ * With more than one attr the events need PERF_SAMPLE_IDENTIFIER (or
+ * PERF_SAMPLE_ID) so perf can tell the records apart, and mmap, comm
+ * and sample_id_all for it to resolve the symbols; mmap_data too for
+ * the data addresses.
+ */
+
+#ifndef PERF_WRITER_H
+#define PERF_WRITER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "perf_ring.h"
+
+#define PERF_WRITER_BUFSIZE	(1 << 20)
+
+/*
+ * The file, as perf reads it, for the tools that read it back: the
+ * header, the data section of records, and the attrs pointing at their
+ * ids.
+ */
+
+/* "PERFILE2", tools/perf/util/header.c */
+#define PERF_MAGIC		0x32454c4946524550ULL
+
+struct perf_file_section {
+	uint64_t	offset;
+	uint64_t	size;
+};
+
+struct perf_file_header {
+	uint64_t	magic;
+	uint64_t	size;
+	uint64_t	attr_size;
+	struct perf_file_section attrs;
+	struct perf_file_section data;
+	struct perf_file_section event_types;	/* unused */
+	uint64_t	adds_features[4];	/* none */
+};
+
+struct perf_file_attr {
+	struct perf_event_attr	 attr;
+	struct perf_file_section ids;
+};
+
+struct perf_writer_attr_s {
+	struct perf_event_attr	 attr;
+	uint64_t		*ids;
+	int			 nids;
+};
+
+struct perf_writer_s {
+	int		 fd;
+	int		 wakefd;	/* eventfd, a buffer is ready or stop */
+	pthread_t	 thread;
+
+	size_t		 bufsize;
+	unsigned char	*buf[2];
+	size_t		 len[2];
+	int		 full[2];	/* owned by the writer thread while set */
+	int		 cur;		/* buffer being filled */
+	int		 stop;
+	int		 error;		/* errno of the first failed write */
+
+	uint64_t	 data_offset;
+	uint64_t	 data_size;	/* bytes appended so far */
+
+	uint64_t	 records;
+	uint64_t	 lost;		/* records dropped, both buffers busy */
+	uint64_t	 lost_pending;	/* dropped since the last PERF_RECORD_LOST */
+	uint64_t	 lost_id;	/* id of the first attr, for the LOST records */
+	size_t		 id_size;	/* sample_id trailer of the non-sample records */
+
+	struct perf_writer_attr_s *attrs;
+	int		 nattrs;
+};
+
+int	perf_writer_open(struct perf_writer_s *w, const char *path, size_t bufsize);
+int	perf_writer_add_attr(struct perf_writer_s *w, const struct perf_event_attr *attr,
+			     const uint64_t *ids, int nids);
+int	perf_writer_synthesize(struct perf_writer_s *w, pid_t pid,
+			       const struct perf_event_attr *attr);
+int	perf_writer_record(struct perf_writer_s *w, const struct perf_event_header *hdr);
+void	perf_writer_cb(const struct perf_event_header *hdr, void *arg);
+int	perf_writer_close(struct perf_writer_s *w);
+
+#endif